@@ -0,0 +1,146 @@
+module Main where
+
+import           Criterion.Main
+import qualified Data.ByteString.Char8         as BC
+import           Data.List                     (foldl')
+import qualified Data.Vector.Storable          as VS
+import           Language.Dash.API
+import           Language.Dash.Asm.Assembler   (assemble)
+import           Language.Dash.CodeGen.CodeGen (compile)
+import           Language.Dash.IR.Ast
+import           Language.Dash.IR.Opcode       (cfOpcodes)
+import           Language.Dash.Normalization.Normalization (normalize)
+import           Language.Dash.Parser.Lexer
+import           Language.Dash.Parser.Parser
+import           Language.Dash.VM.Types
+import           Language.Dash.VM.VM           (createVM, destroyVM, loadVMProgram)
+import           Prelude                       hiding (lex)
+
+-- Criterion writes machine-readable results with `--csv` or `--json`, e.g.
+--   cabal bench --benchmark-options='--csv bench.csv'
+-- The benchmarks of the vm itself are in vm/bench (`make bench`).
+
+main :: IO ()
+main = defaultMain $ map frontEnd [1000, 10000, 100000]
+                     ++ [ bgroup "phases" $ map phases programs
+                        , bgroup "run" $ map (runProgram defaultCompileOptions) programs
+                        , bgroup "run -O" $ map (runProgram optimized) programs
+                        ]
+  where
+    optimized = defaultCompileOptions { optimizeCode = True }
+
+
+-- Compile times for generated programs, which look like the large configuration
+-- files that are generated for Dash. Every line is a binding.
+
+frontEnd :: Int -> Benchmark
+frontEnd numLines =
+  env (return $ generateSource numLines) $ \ source ->
+    bgroup (show numLines ++ " lines")
+      [ bench "lex" $ whnf (orFail tokenWeight . lexBytes) source
+      , bench "parse" $ whnf (orFail exprSize . parseSource) source
+      , bench "compile" $ whnf (orFail programLength . (\ s -> parseSource s >>= assembleExpr)) source
+      ]
+  where
+    parseSource s = lexBytes s >>= parse
+    programLength (prog, _, _) = VS.length prog
+
+
+-- Dash programs from bench/programs (cabal runs benchmarks in the package directory)
+programs :: [String]
+programs = ["fib", "quicksort", "statemonad", "strings", "dicts"]
+
+programPath :: String -> FilePath
+programPath name = "bench/programs/" ++ name ++ ".ds"
+
+-- The compile time of every phase. Programs get the preamble, just like in dash, so
+-- most of the code after parsing is from the preamble.
+phases :: String -> Benchmark
+phases name =
+  env (BC.readFile $ programPath name) $ \ source ->
+    let tokens = orFail id (lexBytes source)
+        expr = orFail (`appendExpr` preambleExpr) (parse tokens)
+        normalized = orFail id (normalize expr)
+        compiled = orFail id (compileNormalized normalized)
+    in
+    bgroup name
+      [ bench "lex" $ whnf (orFail tokenWeight . lexBytes) source
+      , bench "parse" $ whnf (orFail exprSize . parse) tokens
+      , bench "normalize" $ whnf (orFail normalizedSize . normalize) expr
+      , bench "codegen" $ whnf (orFail compiledSize . compileNormalized) normalized
+      , bench "assemble" $ whnf (orFail assembledLength . assembleCompiled) compiled
+      ]
+  where
+    compileNormalized (nst, ctable, symNames) = compile nst ctable symNames
+    assembleCompiled (funcs, ctable, _) = assemble funcs ctable
+    -- The normalizer threads its state through the whole program, so the constant
+    -- table is only complete at the end
+    normalizedSize (_, ctable, symNames) = length ctable + length symNames
+    compiledSize (funcs, ctable, _) = sum (map (length . cfOpcodes) funcs) + length ctable
+    assembledLength (prog, _) = VS.length prog
+
+-- Runs a compiled program in a new vm instance, without compiling it again
+runProgram :: CompileOptions -> String -> Benchmark
+runProgram options name =
+  env compileProgram $ \ ~(prog, ctable) ->
+    bench name $ whnfIO (runVM prog ctable)
+  where
+    compileProgram = do
+      parsed <- parseFileWithPreamble (programPath name)
+      let (prog, ctable, _) = orFail id (parsed >>= assembleExprWith options)
+      return (prog, ctable)
+
+runVM :: VMProgram -> VMConstTable -> IO VMWord
+runVM prog ctable = do
+  vm <- createVM
+  value <- loadVMProgram vm prog ctable
+  destroyVM vm
+  return value
+
+orFail :: Show e => (a -> b) -> Either e a -> b
+orFail = either (error . show)
+
+generateSource :: Int -> BC.ByteString
+generateSource numLines =
+  BC.pack $ unlines $ map line [0 .. numLines - 1] ++ ["config_0"]
+  where
+    line i =
+      case i `mod` 4 of
+        0 -> "config_" ++ show i ++ " = { name = \"service " ++ show i ++ "\", port = "
+             ++ show (8000 + i) ++ ", enabled = :true, tags = [:web, :internal] }"
+        1 -> "port_" ++ show i ++ " x = x + " ++ show i
+        2 -> "mode_" ++ show i ++ " = :mode<" ++ show i ++ ", :fast>"
+        _ -> "check_" ++ show i ++ " s = match s with :on -> 1; :off -> 0; _ -> " ++ show i ++ "; end"
+
+
+-- The lexer and the parser produce their results lazily, so we have to walk them
+-- to make sure everything has been done
+
+tokenWeight :: [Token] -> Int
+tokenWeight = foldl' (\ n t -> n + weight t) 0
+  where
+    weight t = case t of
+      TId s        -> length s
+      TSymbol s    -> length s
+      TString s    -> length s
+      TOperator s  -> length s
+      TNamespace s -> length s
+      TInt i       -> i `seq` 1
+      _            -> 1
+
+exprSize :: Expr -> Int
+exprSize expr =
+  case expr of
+    LitNumber n                      -> n `seq` 1
+    LitString s                      -> length s
+    LitSymbol s es                   -> length s + sum (map exprSize es)
+    Wildcard                         -> 1
+    Var s                            -> length s
+    Qualified s e                    -> length s + exprSize e
+    Lambda es e                      -> sum (map exprSize es) + exprSize e
+    MatchBranch ss e                 -> sum (map length ss) + exprSize e
+    FunAp e es                       -> exprSize e + sum (map exprSize es)
+    LocalBinding (Binding s e) body  -> length s + exprSize e + exprSize body
+    DestructuringBind p e body       -> exprSize p + exprSize e + exprSize body
+    Module bs                        -> sum (map (\ (Binding s e) -> length s + exprSize e) bs)
+    Match e branches                 -> exprSize e + sum (map (\ (p, b) -> exprSize p + exprSize b) branches)
@@ -1,5 +1,6 @@
 import           Control.Monad
 import           Control.Monad.IO.Class
+import           Data.List                                 (isSuffixOf)
 import           System.Environment
 import           System.IO
 import           Language.Dash.BuiltIn.BuiltInDefinitions  (preamble)
@@ -7,19 +8,54 @@ import           Language.Dash.BuiltIn.BuiltInDefinitions  (preamble)
 import           Language.Dash.API
 
 main = do
-  args <- getArgs
+  allArgs <- getArgs
+  -- -O can be given anywhere after the script path
+  let options = defaultCompileOptions { optimizeCode = "-O" `elem` allArgs }
+  let args = filter (/= "-O") allArgs
   when ( (length args) == 0) $ error "Expected script path"
   let scriptPath = args !! 0
-  fileContent <- readFile scriptPath
 
   case (length args, if length args > 1 then args !! 1 else "") of
-       (1, _) -> runWithPreamble fileContent >>= showResult
-       (2, "--toAsm") -> putStrLn $ showCompiledProgram (preamble ++ fileContent)
-       (2, "--toNorm") -> putStrLn $ showNormalizedProgram (preamble ++ fileContent)
+       (1, _) -> do isImage <- isImageFile scriptPath
+                    if isImage
+                      then runImage scriptPath >>= showResult
+                      else parseFileWithPreamble scriptPath >>= runParsed options >>= showResult
+       (2, "--compile") -> compile options scriptPath (imagePath scriptPath)
+       (3, "--compile") -> compile options scriptPath (args !! 2)
+       (2, "--toAsm") -> readFile scriptPath >>= \ fileContent -> putStrLn $ showCompiledProgramWith options (preamble ++ fileContent)
+       (2, "--toNorm") -> readFile scriptPath >>= \ fileContent -> putStrLn $ showNormalizedProgramWith options (preamble ++ fileContent)
+       (2, "--profile") -> profile options scriptPath
        (_, _) -> print "Unexpected command line argument"
 
 
 
+runParsed options parsed =
+  case parsed of
+    Left err -> return (Left err)
+    Right expr -> runExprWith options expr
+
+compile options scriptPath outPath = do
+  parsed <- parseFileWithPreamble scriptPath
+  result <- either (return . Left) (compileImageWith options outPath) parsed
+  case result of
+    Left err -> print err
+    Right () -> return ()
+
+-- The profile of script.ds is written to script.ds.profile, and its sampled call
+-- stacks to script.ds.folded (for flamegraph.pl)
+profile options scriptPath = do
+  let reportPath = scriptPath ++ ".profile"
+  let foldedPath = scriptPath ++ ".folded"
+  parsed <- parseFileWithPreamble scriptPath
+  result <- either (return . Left) (runExprWithProfile options reportPath foldedPath) parsed
+  showResult result
+  hPutStrLn stderr $ "Profile written to " ++ reportPath ++ " and " ++ foldedPath
+
+-- script.ds is compiled to script.dsc
+imagePath scriptPath =
+  if ".ds" `isSuffixOf` scriptPath
+    then scriptPath ++ "c"
+    else scriptPath ++ ".dsc"
 
 
 showResult result =
@@ -2,7 +2,7 @@ import           Control.Monad.Trans                      (liftIO)
 import           Language.Dash.API
 import           Language.Dash.BuiltIn.BuiltInDefinitions (errorSymbolName, runtimeErrorSymbolName)
 import           Language.Dash.Error.Error
-import           Language.Dash.IR.Ast                     (Expr (..))
+import           Language.Dash.IR.Ast                     (Expr)
 import           Language.Dash.IR.Data                    (SymbolNameList)
 import           Language.Dash.IR.Opcode                  (EncodedFunction(..))
 import           Language.Dash.VM.Types
@@ -18,8 +18,7 @@ data ReplState = ReplState {
 
 main = do
   putStrLn "Welcome to the dash repl\nType \".quit\" to quit\nUse \"...\" to toggle multi line input"
-  let prog0 = either (error . show) id $ parseWithPreamble ":true" -- obtain preamble
-  -- let prog0 = either (error . show) id $ parseProgram ":true"
+  let prog0 = preambleExpr
   runInputT (setComplete noCompletion defaultSettings) $ loop $ ReplState prog0 False ""
 
 
@@ -99,11 +98,3 @@ showSymbolNames :: SymbolNameList -> String
 showSymbolNames symNames =
   snd $ foldl (\(index, acc) s -> (index + 1, acc ++ "\n" ++ show index ++ ": " ++ s)) (0, "") symNames
 
-appendExpr :: Expr -> Expr -> Expr
-appendExpr newExpr existingExpr =
-  case existingExpr of
-    LocalBinding b e -> LocalBinding b $ appendExpr newExpr e
-    DestructuringBind pat boundExpr e -> DestructuringBind pat boundExpr $ appendExpr newExpr e
-    _ -> newExpr
-
-
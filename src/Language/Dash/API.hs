@@ -1,40 +1,80 @@
 module Language.Dash.API
 ( run
 , runExpr
+, runExprWith
+, runExprWithProfile
 , runWithPreamble
+, compileImage
+, compileImageWith
+, runImage
+, isImageFile
+, LoadedProgram
+, loadProgram
+, loadProgramWithPreamble
+, programValue
+, callProgram
+, unloadProgram
 , normalizeProgram
+, normalizeProgramWith
 , parseProgram
 , assembleProgram
+, assembleExpr
+, assembleExprWith
 , compileExpr
+, compileExprWith
+, CompileOptions (..)
+, defaultCompileOptions
 , parseWithPreamble
+, parseFileWithPreamble
+, preambleExpr
+, appendExpr
 , showNormalizedProgram
+, showNormalizedProgramWith
 , showCompiledProgram
+, showCompiledProgramWith
 ) where
 
+import           Control.Monad                             (unless)
+import qualified Data.ByteString                           as BS
+import           Data.List                                 (elemIndex)
 import           Language.Dash.Asm.Assembler
 import           Language.Dash.BuiltIn.BuiltInDefinitions  (preamble)
 import           Language.Dash.CodeGen.CodeGen
 import           Language.Dash.Error.Error                 (CompilationError (..))
-import           Language.Dash.IR.Ast                      (Expr)
+import           Language.Dash.IR.Ast                      (Expr (..))
 import           Language.Dash.IR.Data
 import           Language.Dash.IR.Opcode
 import           Language.Dash.IR.Nst                      (NstExpr)
 import           Language.Dash.Normalization.Normalization
+import           Language.Dash.Optimization.Optimization
 import           Language.Dash.Parser.Lexer
 import           Language.Dash.Parser.Parser
 import           Language.Dash.VM.DataEncoding
+import           Language.Dash.VM.Image
 import           Language.Dash.VM.Types
 import           Language.Dash.VM.VM
 import           Prelude                                   hiding (lex)
+import           System.IO                                 (hPutStrLn, stderr)
 
 
 -- TODO Add license header everywhere!
 
 
+data CompileOptions = CompileOptions
+  { optimizeCode :: Bool -- run the optimizer between normalization and code generation
+  }
+
+-- The optimizer is opt-in for now (`dash -O`)
+defaultCompileOptions :: CompileOptions
+defaultCompileOptions = CompileOptions { optimizeCode = False }
+
+
 runWithPreamble :: String -> IO (Either CompilationError VMValue)
 runWithPreamble prog =
-  let prog' = preamble ++ prog in
-  run prog'
+  case parseWithPreamble prog of
+    Left err -> return $ Left err
+    Right expr ->
+      runExpr expr
 
 run :: String -> IO (Either CompilationError VMValue)
 run prog = do
@@ -45,43 +85,183 @@ run prog = do
       runExpr expr
 
 runExpr :: Expr -> IO (Either CompilationError VMValue)
-runExpr expr = do
-  let compiledOrError = assembleExpr expr
+runExpr = runExprWith defaultCompileOptions
+
+runExprWith :: CompileOptions -> Expr -> IO (Either CompilationError VMValue)
+runExprWith options expr = do
+  let compiledOrError = assembleExprWith options expr
   case compiledOrError of
     Left err -> return (Left err)
     Right (encodedProgram, encodedConstTable, symNames) -> do
-            (value, constTable, symNames') <- execute encodedProgram encodedConstTable symNames
-            decoded <- decode value constTable symNames'
+            -- every run gets its own instance, so programs can run in parallel
+            vm <- createVM
+            value <- loadVMProgram vm encodedProgram encodedConstTable
+            decoded <- decodeFromInstance vm value encodedConstTable symNames
+            destroyVM vm
+            return $ Right decoded
+
+
+-- Runs the program like runExprWith, and writes a report of where the time was spent
+-- and the sampled call stacks in the folded format of flamegraph.pl
+runExprWithProfile :: CompileOptions -> FilePath -> FilePath -> Expr -> IO (Either CompilationError VMValue)
+runExprWithProfile options reportPath foldedPath expr = do
+  let compiledOrError = do
+        (opcodes, constTable', symNames') <- compileExprWith options expr
+        (encodedProgram, encodedConstTable, funNames) <- assembleWithFunctionNames opcodes constTable'
+        return (encodedProgram, encodedConstTable, symNames', funNames)
+  case compiledOrError of
+    Left err -> return (Left err)
+    Right (encodedProgram, encodedConstTable, symNames, funNames) -> do
+            vm <- createVM
+            enableProfiling vm
+            value <- loadVMProgram vm encodedProgram encodedConstTable
+            mapM_ (uncurry $ nameProfiledFunction vm) funNames
+            isWritten <- writeProfile vm reportPath foldedPath
+            unless isWritten $ hPutStrLn stderr ("Can't write the profile to " ++ reportPath)
+            decoded <- decodeFromInstance vm value encodedConstTable symNames
+            destroyVM vm
             return $ Right decoded
 
 
-assembleProgram :: String -> Either CompilationError ([VMWord], [VMWord], SymbolNameList)
+-- A program that stays loaded in its own vm instance, so that its value (usually a
+-- function) can be called many times without compiling and loading it again.
+data LoadedProgram = LoadedProgram VMInstance VMConstTable SymbolNameList
+
+loadProgramWithPreamble :: String -> IO (Either CompilationError LoadedProgram)
+loadProgramWithPreamble prog =
+  loadExpr (parseWithPreamble prog)
+
+loadProgram :: String -> IO (Either CompilationError LoadedProgram)
+loadProgram prog =
+  loadExpr (parseProgram prog)
+
+loadExpr :: Either CompilationError Expr -> IO (Either CompilationError LoadedProgram)
+loadExpr parsed =
+  case parsed >>= assembleExpr of
+    Left err -> return (Left err)
+    Right (encodedProgram, encodedConstTable, symNames) -> do
+            vm <- createVM
+            _ <- loadVMProgram vm encodedProgram encodedConstTable
+            return $ Right (LoadedProgram vm encodedConstTable symNames)
+
+-- The value of the program's top-level code
+programValue :: LoadedProgram -> IO VMValue
+programValue (LoadedProgram vm constTable symNames) = do
+  value <- vmProgramResult vm
+  decodeFromInstance vm value constTable symNames
+
+-- Calls the value of the program with the given arguments. Only numbers and plain
+-- symbols can be passed as arguments for now.
+callProgram :: LoadedProgram -> [VMValue] -> IO (Either String VMValue)
+callProgram (LoadedProgram vm constTable symNames) args =
+  case mapM encodeArgument args of
+    Left err -> return (Left err)
+    Right encodedArgs -> do
+      fun <- vmProgramResult vm
+      value <- callVMFunction vm fun encodedArgs
+      decoded <- decodeFromInstance vm value constTable symNames
+      return $ Right decoded
+  where
+    encodeArgument (VMNumber n) = Right (encodeNumber n)
+    encodeArgument (VMSymbol name []) =
+      case elemIndex name symNames of
+        Just symId -> Right (encodePlainSymbol $ mkSymId symId)
+        Nothing -> Left $ "Unknown symbol: " ++ name
+    encodeArgument v = Left $ "Unsupported argument: " ++ show v
+
+unloadProgram :: LoadedProgram -> IO ()
+unloadProgram (LoadedProgram vm _ _) = destroyVM vm
+
+
+-- Compiles a program to an image, which can be run without compiling it again
+compileImage :: FilePath -> Expr -> IO (Either CompilationError ())
+compileImage = compileImageWith defaultCompileOptions
+
+compileImageWith :: CompileOptions -> FilePath -> Expr -> IO (Either CompilationError ())
+compileImageWith options path expr =
+  case assembleExprWith options expr of
+    Left err -> return (Left err)
+    Right (encodedProgram, encodedConstTable, symNames) ->
+      Right <$> writeImage path encodedProgram encodedConstTable symNames
+
+runImage :: FilePath -> IO (Either String VMValue)
+runImage path = do
+  vm <- createVM
+  loaded <- loadVMImage vm path
+  result <- case loaded of
+    Nothing -> return $ Left ("Can't load image " ++ path)
+    Just (value, constTable, symNames) ->
+      Right <$> decodeFromInstance vm value constTable symNames
+  destroyVM vm
+  return result
+
+
+assembleProgram :: String -> Either CompilationError (VMProgram, VMConstTable, SymbolNameList)
 assembleProgram prog = do
   ast <- parseProgram prog
   assembleExpr ast
 
-assembleExpr :: Expr -> Either CompilationError ([VMWord], [VMWord], SymbolNameList)
-assembleExpr ast = do
-  (opcodes, constTable', symNames') <- compileExpr ast
+assembleExpr :: Expr -> Either CompilationError (VMProgram, VMConstTable, SymbolNameList)
+assembleExpr = assembleExprWith defaultCompileOptions
+
+assembleExprWith :: CompileOptions -> Expr -> Either CompilationError (VMProgram, VMConstTable, SymbolNameList)
+assembleExprWith options ast = do
+  (opcodes, constTable', symNames') <- compileExprWith options ast
   (encodedProgram, encodedConstTable) <- assemble opcodes constTable'
   return (encodedProgram, encodedConstTable, symNames')
 
 compileExpr :: Expr -> Either CompilationError ([EncodedFunction], ConstTable, SymbolNameList)
-compileExpr ast = do
-  (normExpr, constTable, symNames) <- normalize ast
+compileExpr = compileExprWith defaultCompileOptions
+
+compileExprWith :: CompileOptions -> Expr -> Either CompilationError ([EncodedFunction], ConstTable, SymbolNameList)
+compileExprWith options ast = do
+  (normExpr, constTable, symNames) <- normalizeWith options ast
   compile normExpr constTable symNames
 
 normalizeProgram :: String -> Either CompilationError (NstExpr, ConstTable, SymbolNameList)
-normalizeProgram prog = do
+normalizeProgram = normalizeProgramWith defaultCompileOptions
+
+normalizeProgramWith :: CompileOptions -> String -> Either CompilationError (NstExpr, ConstTable, SymbolNameList)
+normalizeProgramWith options prog = do
   lexed <- lex prog
   ast <- parse lexed
-  normalize ast
+  normalizeWith options ast
 
+normalizeWith :: CompileOptions -> Expr -> Either CompilationError (NstExpr, ConstTable, SymbolNameList)
+normalizeWith options ast = do
+  (normExpr, constTable, symNames) <- normalize ast
+  let normExpr' = if optimizeCode options then optimize normExpr constTable else normExpr
+  return (normExpr', constTable, symNames)
 
+
+-- The preamble is only parsed once, and every program is appended to it. Compiling
+-- the preamble separately would need a module system.
 parseWithPreamble :: String -> Either CompilationError Expr
-parseWithPreamble prog =
-  let prog' = preamble ++ prog in
-  parseProgram prog'
+parseWithPreamble prog = do
+  ast <- parseProgram prog
+  return $ appendExpr ast preambleExpr
+
+-- Source files are lexed from their bytes, which is a lot faster than reading them
+-- into a String first
+parseFileWithPreamble :: FilePath -> IO (Either CompilationError Expr)
+parseFileWithPreamble path = do
+  source <- BS.readFile path
+  return $ do
+    lexed <- lexBytes source
+    ast <- parse lexed
+    return $ appendExpr ast preambleExpr
+
+preambleExpr :: Expr
+preambleExpr =
+  either (error . show) id $ parseProgram (preamble ++ ":true")
+
+-- Replaces the final expression of a chain of bindings
+appendExpr :: Expr -> Expr -> Expr
+appendExpr newExpr existingExpr =
+  case existingExpr of
+    LocalBinding b e -> LocalBinding b $ appendExpr newExpr e
+    DestructuringBind pat boundExpr e -> DestructuringBind pat boundExpr $ appendExpr newExpr e
+    _ -> newExpr
 
 parseProgram :: String -> Either CompilationError Expr
 parseProgram prog = do
@@ -90,19 +270,25 @@ parseProgram prog = do
 
 -- for testing
 showNormalizedProgram :: String -> String
-showNormalizedProgram prog =
-  let result = normalizeProgram prog in
+showNormalizedProgram = showNormalizedProgramWith defaultCompileOptions
+
+showNormalizedProgramWith :: CompileOptions -> String -> String
+showNormalizedProgramWith options prog =
+  let result = normalizeProgramWith options prog in
   case result of
     Left err -> show err
     Right (nExpr, _, _) -> show nExpr
 
 showCompiledProgram :: String -> String
-showCompiledProgram prog =
+showCompiledProgram = showCompiledProgramWith defaultCompileOptions
+
+showCompiledProgramWith :: CompileOptions -> String -> String
+showCompiledProgramWith options prog =
   let parsed = parseProgram prog in
   case parsed of
     Left err -> show err
     Right p' ->
-      let result = compileExpr p' in
+      let result = compileExprWith options p' in
       case result of
         Left err -> show err
         Right (compiled, _, _) -> show compiled
@@ -1,12 +1,22 @@
 module Language.Dash.Asm.Assembler (
   assemble
+, assembleWithFunctionNames
 , assembleWithEncodedConstTable
+, peephole
 ) where
 
 
 import           Data.Bits
+import           Data.Foldable                   (toList)
+import qualified Data.Map                        as Map
+import           Data.Maybe                      (fromJust, mapMaybe)
 import qualified Data.Sequence                   as Seq
+import qualified Data.Set                        as Set
+import qualified Data.Vector.Storable            as VS
 import           Language.Dash.Asm.DataAssembler
+import           Language.Dash.BuiltIn.BuiltInDefinitions (builtInSymbols,
+                                                          falseSymbolName,
+                                                          trueSymbolName)
 import           Language.Dash.Limits
 import           Language.Dash.Error.Error
 import           Language.Dash.IR.Data
@@ -27,15 +37,29 @@ The code generator stores each function as a separate list, so the input type fo
 assembler is [[Opcode]]. Function addresses in the input code are indices of the outer
 list. They are turned into real addresses by the assembler.
 
+Before that, a peephole pass replaces common sequences of instructions with
+superinstructions (see below).
+
 -}
 
 
 
 assemble :: [EncodedFunction]
          -> ConstTable
-         -> Either CompilationError ([VMWord], [VMWord])
+         -> Either CompilationError (VMProgram, VMConstTable)
 assemble funcs ctable = do
-  let combined = foldFunctions funcs
+  (prog, consts, _) <- assembleWithFunctionNames funcs ctable
+  return (prog, consts)
+
+-- Also returns the address of every named function in the program, so that the
+-- profiler can show the names (see vm_profile_name_function)
+assembleWithFunctionNames :: [EncodedFunction]
+                          -> ConstTable
+                          -> Either CompilationError (VMProgram, VMConstTable, [(Int, Name)])
+assembleWithFunctionNames funcs ctable = do
+  let optimize func = func { cfOpcodes = peephole (Seq.fromList ctable) (cfOpcodes func) }
+  let funcs' = map optimize funcs
+  let combined = foldFunctions funcs'
   let instructions = fst combined
   let funcAddrs = snd combined
 
@@ -44,17 +68,18 @@ assemble funcs ctable = do
   let addrConvert = snd encodedConsts
 
   let assembleOpcode = assembleTac funcAddrs addrConvert
-  return (map assembleOpcode instructions, consts)
-  where
+  let names = [ (fromIntegral addr, cfName func)
+              | (addr, func) <- zip (toList funcAddrs) funcs', not (null $ cfName func) ]
+  return (VS.fromList $ map assembleOpcode instructions, VS.fromList consts, names)
 
 assembleWithEncodedConstTable :: [EncodedFunction]
-                              -> [VMWord]
+                              -> VMConstTable
                               -> (ConstAddr
                               -> VMWord)
                               -> SymbolNameList
-                              -> Either CompilationError ([VMWord], [VMWord], SymbolNameList)
+                              -> Either CompilationError (VMProgram, VMConstTable, SymbolNameList)
 assembleWithEncodedConstTable funcs encCTable constAddrConverter symnames =
-  return (map assembleOpcode instructions, encCTable, symnames)
+  return (VS.fromList $ map assembleOpcode instructions, encCTable, symnames)
   where
     assembleOpcode = assembleTac funcAddrs constAddrConverter
     instructions = fst combined
@@ -67,17 +92,14 @@ assembleWithEncodedConstTable funcs encCTable constAddrConverter symnames =
 -- just a sequence with the same length as the nested list). The map helps us to find
 -- function references in the Opcode in our generated binary code.
 foldFunctions :: [EncodedFunction] -> ([Opcode], Seq.Seq VMWord)
-foldFunctions =
-  foldl calcFuncAddr ([], Seq.empty)
-  where
-    calcFuncAddr acc compFunc =
-      let allInstrs = fst acc
-          funcAddrs = snd acc
-      in
-      ( allInstrs ++ (cfOpcodes compFunc), funcAddrs Seq.|> fromIntegral (length allInstrs) )
+foldFunctions funcs =
+  let funcOpcodes = map cfOpcodes funcs
+      funcAddrs = scanl (+) 0 $ map length funcOpcodes
+  in
+  (concat funcOpcodes, Seq.fromList $ map fromIntegral $ take (length funcs) funcAddrs)
 
 
-assembleTac :: Seq.Seq VMWord -> (ConstAddr -> VMWord) -> Opcode -> VMWord
+assembleTac :: Seq.Seq VMWord -> (ConstAddr -> VMWord) -> Opcode -> VMInstruction
 assembleTac funcAddrs addrConv opc =
   let r = regToInt
       i = fromIntegral
@@ -88,7 +110,7 @@ assembleTac funcAddrs addrConv opc =
   case opc of
     OpcRet r0              -> instructionRI   0 (r r0) 0
     OpcLoadI r0 n          -> instructionRI   1 (r r0) (bias n)
-    OpcLoadAddr r0 a       -> instructionRI   1 (r r0) (caddr a)
+    OpcLoadAddr r0 a       -> instructionRI   1 (r r0) (bias $ caddr a)
     OpcLoadPS r0 s         -> instructionRI   2 (r r0) (sym s)
     OpcLoadCS r0 a         -> instructionRI   3 (r r0) (caddr a)
     OpcLoadOS r0 a         -> instructionRI   4 (r r0) (caddr a)
@@ -123,19 +145,53 @@ assembleTac funcAddrs addrConv opc =
     OpcNot r0 r1           -> instructionRRR 33 (r r0) (r r1) (r 0)
     OpcGetField r0 m s     -> instructionRRR 34 (r r0) (r m) (r s)
     OpcConvert r0 r1 rt    -> instructionRRR 35 (r r0) (r r1) (r rt)
-    OpcFunHeader arity     -> instructionRI  63 (r 0) (i arity)
+    OpcMatchSwitch r0 r1 r2 -> instructionRRR 36 (r r0) (r r1) (r r2)
+    OpcStrConcat r0 r1 r2  -> instructionRRR 37 (r r0) (r r1) (r r2)
+    OpcSubStr r0 r1 r2     -> instructionRRR 38 (r r0) (r r1) (r r2)
+    OpcStrCmp r0 r1 r2     -> instructionRRR 39 (r r0) (r r1) (r r2)
+    OpcStrFind r0 r1 r2    -> instructionRRR 40 (r r0) (r r1) (r r2)
+    OpcSpill r0 slot       -> instructionRI  41 (r r0) (i slot)
+    OpcReload r0 slot      -> instructionRI  42 (r r0) (i slot)
+    OpcAddI r0 r1 rc n     -> instructionRRRI 43 (r r0) (r r1) (r rc) (smallBias n)
+    OpcSubI r0 r1 rc n     -> instructionRRRI 44 (r r0) (r r1) (r rc) (smallBias n)
+    OpcJmpLT r0 r1 r2 n    -> instructionRRRI 45 (r r0) (r r1) (r r2) (smallBias n)
+    OpcJmpGT r0 r1 r2 n    -> instructionRRRI 46 (r r0) (r r1) (r r2) (smallBias n)
+    OpcJmpEq r0 r1 r2 n    -> instructionRRRI 47 (r r0) (r r1) (r r2) (smallBias n)
+    OpcJmpMatch r0 a       -> instructionRI  48 (r r0) (caddr a)
+    OpcRetI r0 n           -> instructionRI  49 (r r0) (bias n)
+    OpcRetPS r0 s          -> instructionRI  50 (r r0) (sym s)
+    OpcMapNew r0           -> instructionRRR 51 (r r0) (r 0) (r 0)
+    OpcMapGet r0 r1 r2     -> instructionRRR 52 (r r0) (r r1) (r r2)
+    OpcMapPut r0 r1 r2     -> instructionRRR 53 (r r0) (r r1) (r r2)
+    OpcMapDel r0 r1 r2     -> instructionRRR 54 (r r0) (r r1) (r r2)
+    OpcMapSize r0 r1       -> instructionRRR 55 (r r0) (r r1) (r 0)
+    OpcMapEntry r0 r1 r2   -> instructionRRR 56 (r r0) (r r1) (r r2)
+    OpcArrayNew r0 r1      -> instructionRRR 57 (r r0) (r r1) (r 0)
+    OpcArrayGet r0 r1 r2   -> instructionRRR 58 (r r0) (r r1) (r r2)
+    OpcArraySet r0 r1 r2   -> instructionRRR 59 (r r0) (r r1) (r r2)
+    OpcArrayLen r0 r1      -> instructionRRR 60 (r r0) (r r1) (r 0)
+    OpcArraySlice r0 r1 r2 -> instructionRRR 61 (r r0) (r r1) (r r2)
+    -- the vm reads a frame size of 0 as maxRegisters. Spill slots come after all
+    -- registers, and they are counted above the arity.
+    OpcFunHeader arity size
+      | size > maxRegisters -> instructionRI 63 0 (i arity .|. (size - maxRegisters) `shiftL` funArityBits)
+      | otherwise           -> instructionRI 63 (size `mod` maxRegisters) (i arity)
 
 
-instBits, opcBits, regBits :: Int
+instBits, opcBits, regBits, funArityBits :: Int
 instBits = 32
 opcBits = 6
 regBits = 5
+funArityBits = 6
 
 bias :: Int -> Int
 bias n = n + intBias
 
+smallBias :: Int -> Int
+smallBias n = n + smallIntBias
+
 -- an instruction containing a register and a number
-instructionRI :: Int -> Int -> Int -> VMWord
+instructionRI :: Int -> Int -> Int -> VMInstruction
 instructionRI opcId register value =
   fromIntegral $
   (opcId `shiftL` (instBits - opcBits))
@@ -144,7 +200,7 @@ instructionRI opcId register value =
 
 
 -- an instruction containing three registers
-instructionRRR :: Int -> Int -> Int -> Int -> VMWord
+instructionRRR :: Int -> Int -> Int -> Int -> VMInstruction
 instructionRRR opcId r0 r1 r2 =
   fromIntegral $
   (opcId `shiftL` (instBits - opcBits))
@@ -153,5 +209,157 @@ instructionRRR opcId r0 r1 r2 =
   .|. (r2 `shiftL` (instBits - (opcBits + 3 * regBits)))
 
 
+-- an instruction containing three registers and a small number
+instructionRRRI :: Int -> Int -> Int -> Int -> Int -> VMInstruction
+instructionRRRI opcId r0 r1 r2 value =
+  instructionRRR opcId r0 r1 r2 .|. fromIntegral value
+
+
+
+{-
+
+Peephole optimization
+~~~~~~~~~~~~~~~~~~~~~
+
+The code generator emits some sequences of instructions all the time: Constants are
+loaded into a register right before they're added or returned, and an `if` is a
+comparison, followed by a match on its result with a jump table. The peephole pass
+replaces these sequences with superinstructions (see vm/opcodes.h), so that the vm
+dispatches fewer instructions. The superinstructions still write every register
+that the replaced instructions wrote, except for the register with the pattern
+address of a match, which is a temporary register of the match (see compileMatch).
+
+Jump offsets are relative, so they change when instructions are removed. During the
+pass, jumps contain the index of their target in the original code instead, and they
+are turned back into offsets at the end. An instruction that's removed can't be the
+target of a jump. The jump table after a match is addressed by the match instruction
+itself, so it's only ever replaced as a whole.
+
+Removing instructions only makes jumps shorter, so a jump that fits into a
+superinstruction before the pass still fits afterwards.
+
+-}
+
+peephole :: Seq.Seq Constant -> [Opcode] -> [Opcode]
+peephole consts opcodes =
+  let indexed = zip [0..] $ zipWith (\ index -> mapJump (\ n -> index + 1 + n)) [0..] opcodes in
+  let targets = Set.fromList $ mapMaybe (jumpTarget . snd) indexed in
+  let fused = fuse consts targets indexed in
+  let newIndices = Map.fromList $ zip (map fst fused) [0..] in
+  -- jumps to the end of the function have no instruction as their target
+  let newIndex target = maybe (length fused) snd $ Map.lookupGE target newIndices in
+  zipWith (\ index -> mapJump (\ target -> newIndex target - index - 1)) [0..] (map snd fused)
+
+
+fuse :: Seq.Seq Constant -> Set.Set Int -> [(Int, Opcode)] -> [(Int, Opcode)]
+fuse consts targets instrs =
+  case instrs of
+    -- An if with a comparison as its condition is turned into a jump to the true branch,
+    -- followed by the jump to the false branch. The match branches are loaded before
+    -- the comparison.
+    (i, cmp) : rest
+      | Just (cmpRegs@(rResult : _), compareAndJump) <- compareAndBranch cmp
+      , (loads, (j, OpcLoadAddr rAddr addr) : (_, OpcMatchSwitch subj rAddr' _)
+                  : (_, OpcJmp t0) : (_, OpcJmp t1) : rest') <- span (isLoadF . snd) rest
+      , subj == rResult && rAddr == rAddr'
+      , Just trueFirst <- booleanSwitch addr
+      , not $ any isTarget $ map fst loads ++ [j .. j + 3]
+      , not $ any ((`elem` cmpRegs) . loadedReg . snd) loads
+      , let (tTrue, tFalse) = if trueFirst then (t0, t1) else (t1, t0)
+      , fitsSmall (tTrue - i) ->
+        zip (i : map fst loads) (map snd loads ++ [compareAndJump tTrue])
+        ++ (j, OpcJmp tFalse) : fuse' rest'
+    (i, cmp) : (j, OpcJmpTrue rCond t) : rest
+      | Just (rResult : _, compareAndJump) <- compareAndBranch cmp
+      , rResult == rCond && not (isTarget j) && fitsSmall (t - i) ->
+        (i, compareAndJump t) : fuse' rest
+    (i, OpcLoadAddr rAddr addr) : (j, OpcMatchSwitch subj rAddr' rCaptures) : rest
+      | rAddr == rAddr' && rAddr == rCaptures && not (isTarget j) && matchesConstants addr ->
+        (i, OpcJmpMatch subj addr) : fuse' rest
+    (i, OpcLoadI rc n) : (j, OpcAdd r0 r1 r2) : rest
+      | (r1 == rc || r2 == rc) && fitsSmall n && not (isTarget j) ->
+        let rOther = if r2 == rc then r1 else r2 in
+        (i, OpcAddI r0 rOther rc n) : fuse' rest
+    (i, OpcLoadI rc n) : (j, OpcSub r0 r1 r2) : rest
+      | r2 == rc && fitsSmall n && not (isTarget j) ->
+        (i, OpcSubI r0 r1 rc n) : fuse' rest
+    (i, OpcLoadI r n) : (j, OpcRet r') : rest
+      | r == r' && not (isTarget j) ->
+        (i, OpcRetI r n) : fuse' rest
+    (i, OpcLoadPS r s) : (j, OpcRet r') : rest
+      | r == r' && not (isTarget j) ->
+        (i, OpcRetPS r s) : fuse' rest
+    instr : rest ->
+      instr : fuse' rest
+    [] ->
+      []
+  where
+    fuse' = fuse consts targets
+    isTarget index = index `Set.member` targets
+    fitsSmall n = n >= minSmallInteger && n <= maxSmallInteger
+
+    isLoadF opc = case opc of
+      OpcLoadF _ _ -> True
+      _            -> False
+    loadedReg (OpcLoadF r _) = r
+    loadedReg _              = error "Not a function load"
+
+    patterns addr
+      | constAddrToInt addr < Seq.length consts =
+          case consts `Seq.index` constAddrToInt addr of
+            CMatchData pats -> pats
+            _               -> []
+      | otherwise = []
+
+    -- whether the patterns are :true and :false, and if :true comes first
+    booleanSwitch addr = case patterns addr of
+      [CPlainSymbol a, CPlainSymbol b]
+        | a == trueSymbol && b == falseSymbol -> Just True
+        | a == falseSymbol && b == trueSymbol -> Just False
+      _ -> Nothing
+
+    matchesConstants addr =
+      let isConstant pat = case pat of
+            CPlainSymbol _ -> True
+            CNumber _      -> True
+            _              -> False
+      in
+      not (null (patterns addr)) && all isConstant (patterns addr)
+
+
+-- The registers of a comparison (the result first), and the superinstruction that
+-- also jumps if the result is true
+compareAndBranch :: Opcode -> Maybe ([Reg], Int -> Opcode)
+compareAndBranch opc =
+  case opc of
+    OpcLT r0 r1 r2 -> Just ([r0, r1, r2], OpcJmpLT r0 r1 r2)
+    OpcGT r0 r1 r2 -> Just ([r0, r1, r2], OpcJmpGT r0 r1 r2)
+    OpcEq r0 r1 r2 -> Just ([r0, r1, r2], OpcJmpEq r0 r1 r2)
+    _              -> Nothing
+
+
+mapJump :: (Int -> Int) -> Opcode -> Opcode
+mapJump f opc =
+  case opc of
+    OpcJmp n            -> OpcJmp (f n)
+    OpcJmpTrue r0 n     -> OpcJmpTrue r0 (f n)
+    OpcJmpLT r0 r1 r2 n -> OpcJmpLT r0 r1 r2 (f n)
+    OpcJmpGT r0 r1 r2 n -> OpcJmpGT r0 r1 r2 (f n)
+    OpcJmpEq r0 r1 r2 n -> OpcJmpEq r0 r1 r2 (f n)
+    _                   -> opc
+
+
+jumpTarget :: Opcode -> Maybe Int
+jumpTarget opc =
+  case opc of
+    OpcJmp t            -> Just t
+    OpcJmpTrue _ t      -> Just t
+    OpcJmpLT _ _ _ t    -> Just t
+    OpcJmpGT _ _ _ t    -> Just t
+    OpcJmpEq _ _ _ t    -> Just t
+    _                   -> Nothing
 
 
+trueSymbol, falseSymbol :: SymId
+trueSymbol = fromJust $ lookup trueSymbolName builtInSymbols
+falseSymbol = fromJust $ lookup falseSymbolName builtInSymbols
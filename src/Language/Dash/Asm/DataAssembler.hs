@@ -26,6 +26,11 @@ Data Assembler
 
 Encodes data of type Constant for the virtual machine.
 
+Constants are hash-consed: A constant that is equal to one that has already been
+encoded (at the top level or inside of a compound symbol) gets the address of the
+existing one. This makes the constant table smaller, and the vm can compare equal
+constants by their address (see is_equal in vm/vm.c).
+
 
 TODO describe the runtime representation of all data
 TODO rename const table to constant pool?
@@ -120,28 +125,59 @@ atomizeOpaqueSymbol sid owner args = do
 
 atomizeMatchData :: [Constant] -> ConstAtomization ()
 atomizeMatchData args = do
-  setReservedSpace (1 + length args)
+  let table = map ACMatchTableWord $ matchTable args
+  setReservedSpace (1 + length args + length table)
   let matchHeader = ACMatchHeader (fromIntegral $ length args)
   atomizedArgs <- mapM atomizeConstArg args
-  addAtomized $ matchHeader : atomizedArgs
+  addAtomized $ matchHeader : atomizedArgs ++ table
   setReservedSpace 0
 
 
+-- The patterns of match data are followed by a table which lets the vm jump directly
+-- to the first pattern that could match (see OP_MATCH_SWITCH). Patterns are keyed on
+-- the encoded number or symbol or, for compound symbols, on their header (i.e. symbol
+-- id and number of fields). A pattern without a key (a variable or a wildcard) could
+-- match anything.
+--
+-- Layout: number of keys, first pattern without key, then the pairs of key and index
+-- of the first pattern that could match a value with that key, sorted by key.
+matchTable :: [Constant] -> [VMWord]
+matchTable patterns =
+  let numPatterns = length patterns
+      indexedKeys = zip [(0 :: Int) ..] $ map matchKey patterns
+      firstCatchAll = case [ i | (i, Nothing) <- indexedKeys ] of
+                        []    -> numPatterns
+                        (i:_) -> i
+      firstIndices = Map.fromListWith min [ (k, i) | (i, Just k) <- indexedKeys ]
+      entries = Map.toAscList $ Map.map (min firstCatchAll) firstIndices
+  in
+  fromIntegral (length entries)
+    : fromIntegral firstCatchAll
+    : concatMap (\ (k, i) -> [k, fromIntegral i]) entries
+
+
+matchKey :: Constant -> Maybe VMWord
+matchKey c = case c of
+  CNumber n                -> Just $ Enc.encodeNumber n
+  CPlainSymbol sid         -> Just $ Enc.encodePlainSymbol sid
+  CCompoundSymbol sid args -> Just $ Enc.encodeCompoundSymbolHeader sid (length args)
+  _                        -> Nothing
+
+
 atomizeString :: String -> ConstAtomization ()
 atomizeString str = do
-  let numChunks = numStringChunksForString str
   let nullString = str ++ "\0"
   -- fill rest of string with zeroes
   let adjustedString = nullString ++
-        replicate (bytesPerVMWord - (length nullString `rem` bytesPerVMWord)) '\0'
+        replicate ((bytesPerVMWord - (length nullString `rem` bytesPerVMWord)) `rem` bytesPerVMWord) '\0'
   let chunks = chunksOf bytesPerVMWord adjustedString
-  let encChunks = map (\ [c1, c2, c3, c4] -> ACStringChunk c1 c2 c3 c4) chunks
-  let header = ACStringHeader (length str) numChunks
+  let encChunks = map ACStringChunk chunks
+  let header = ACStringHeader (length str) (Enc.hashString str)
   addAtomized $ header : encChunks
 
 
 bytesPerVMWord :: Int
-bytesPerVMWord = 4
+bytesPerVMWord = Enc.charsPerStringChunk
 
 numStringChunksForString :: String -> Int
 numStringChunksForString str =
@@ -158,9 +194,15 @@ atomizeConstArg c = case c of
   CPlainSymbol sid -> return $ ACPlainSymbol sid
   CMatchVar n      -> return $ ACMatchVar n
   ds@(CCompoundSymbol _ _) -> do
-                addr <- nextFreeAddress
-                pushWorkItem ds
-                return $ ACCompoundSymbolRef addr
+                existing <- internedAddress ds
+                case existing of
+                  Just addr ->
+                      return $ ACCompoundSymbolRef $ mkConstAddr $ fromIntegral addr
+                  Nothing -> do
+                    addr <- nextFreeAddress
+                    intern ds (fromIntegral $ constAddrToInt addr)
+                    pushWorkItem ds
+                    return $ ACCompoundSymbolRef addr
   CFunction addr   -> liftM ACFunction $ actualFuncAddr addr
   CCompoundSymbolRef caddr -> do
                    addr <- actualConstAddr caddr
@@ -179,6 +221,7 @@ data ConstAtomizationState = ConstAtomizationState {
   constants         :: [Constant]
 , workQueue         :: [Constant]
 , addrMap           :: Map.Map ConstAddr VMWord
+, interned          :: Map.Map Constant VMWord -- the addresses of all encoded constants
 , atomized          :: [AtomicConstant] -- should be a Sequence
 , reservedSpace     :: Int
 , numAtomizedConsts :: Int
@@ -191,6 +234,7 @@ emptyConstAtomizationState ctable funcMap = ConstAtomizationState {
   constants         = ctable
 , workQueue         = []
 , addrMap           = Map.empty
+, interned          = Map.empty
 , atomized          = []
 , reservedSpace     = 0
 , numAtomizedConsts = 0
@@ -209,13 +253,20 @@ popWorkItem = do
   case (workQueue state, constants state) of
     ([], []) ->
         return Nothing
-    ([], cs) -> do
-        numAtomized <- gets numAtomizedConsts
-        let currentAddr = fromIntegral $ length $ atomized state
-        addAddrMapping (mkConstAddr numAtomized) currentAddr
-        state' <- get
-        put $ state' { numAtomizedConsts = numAtomized + 1, constants = tail cs }
-        return $ Just $ head cs
+    ([], c : cs) -> do
+        let numAtomized = numAtomizedConsts state
+        put $ state { numAtomizedConsts = numAtomized + 1, constants = cs }
+        existing <- internedAddress c
+        case existing of
+          Just addr -> do
+            -- an equal constant has been encoded before, so we don't need this one
+            addAddrMapping (mkConstAddr numAtomized) addr
+            popWorkItem
+          Nothing -> do
+            let currentAddr = fromIntegral $ length $ atomized state
+            addAddrMapping (mkConstAddr numAtomized) currentAddr
+            intern c currentAddr
+            return $ Just c
     (ws, _) -> do
         put (state { workQueue = tail ws })
         return $ Just $ head ws
@@ -228,6 +279,20 @@ addAddrMapping src dest = do
   put $ state { addrMap = newMap }
 
 
+-- Modules are opaque symbols, and every module is kept as its own constant
+internedAddress :: Constant -> ConstAtomization (Maybe VMWord)
+internedAddress c =
+  case c of
+    COpaqueSymbol {} -> return Nothing
+    _                -> gets (Map.lookup c . interned)
+
+
+intern :: Constant -> VMWord -> ConstAtomization ()
+intern c addr = do
+  state <- get
+  put $ state { interned = Map.insertWith (\ _ old -> old) c addr (interned state) }
+
+
 pushWorkItem :: Constant -> ConstAtomization ()
 pushWorkItem c = do
   state <- get
@@ -252,7 +317,7 @@ spaceNeededByConstant c = case c of
   CMatchVar _            -> 1
   CCompoundSymbol _ args -> 1 + length args
   COpaqueSymbol _ _ args -> 2 + length args
-  CMatchData args        -> 1 + length args
+  CMatchData args        -> 1 + length args + length (matchTable args)
   CString str            -> 1 + numStringChunksForString str
   CFunction _            -> 1
   CCompoundSymbolRef _   -> 1
@@ -293,9 +358,10 @@ data AtomicConstant =
   | ACNumber Int
   | ACMatchHeader Int
   | ACMatchVar Int
-  | ACStringHeader Int Int     -- string length, num chunks
-  | ACStringChunk Char Char Char Char -- with ascii chars and VMWord as Word32 this would be 4 chars per string chunk
+  | ACStringHeader Int Int     -- string length, hash
+  | ACStringChunk String -- with ascii chars and VMWord as Word64 this is 8 chars per string chunk
   | ACFunction Int
+  | ACMatchTableWord VMWord
   deriving (Show, Eq)
 
 
@@ -307,8 +373,9 @@ encodeConstant c = case c of
   ACNumber n                   -> Enc.encodeNumber n
   ACMatchHeader n              -> Enc.encodeMatchHeader n
   ACMatchVar n                 -> Enc.encodeMatchVar n
-  ACStringHeader len numChunks -> Enc.encodeStringHeader len numChunks
-  ACStringChunk b1 b2 b3 b4    -> Enc.encodeStringChunk b1 b2 b3 b4
+  ACStringHeader len hash      -> Enc.encodeStringHeader len hash
+  ACStringChunk chars          -> Enc.encodeStringChunk chars
   ACOpaqueSymbolHeader sid n   -> Enc.encodeOpaqueSymbolHeader sid n
   ACFunction addr              -> Enc.encodeFunctionRef addr
+  ACMatchTableWord w           -> w
 
@@ -22,7 +22,7 @@ import           Language.Dash.IR.Data
 import           Language.Dash.IR.Opcode
 
 
-runtimeErrorSymbolName, errorSymbolName, nilSymbolName, tupleSymbolName, recordSymbolName, listConsSymbolName, listEmptySymbolName, trueSymbolName, falseSymbolName, numberTypeSymbolName, stringTypeSymbolName, symbolTypeSymbolName, functionTypeSymbolName :: String
+runtimeErrorSymbolName, errorSymbolName, nilSymbolName, tupleSymbolName, recordSymbolName, listConsSymbolName, listEmptySymbolName, trueSymbolName, falseSymbolName, numberTypeSymbolName, stringTypeSymbolName, symbolTypeSymbolName, functionTypeSymbolName, arrayTypeSymbolName, listTypeSymbolName :: String
 trueSymbolName = "true"
 falseSymbolName = "false"
 nilSymbolName = "nil"
@@ -37,6 +37,8 @@ numberTypeSymbolName = "number"
 stringTypeSymbolName = "string"
 symbolTypeSymbolName = "symbol"
 functionTypeSymbolName = "function"
+arrayTypeSymbolName = "array"
+listTypeSymbolName = "list"
 
 errorSymbolName = "error" 
 runtimeErrorSymbolName = "runtime_error" 
@@ -59,17 +61,24 @@ builtInSymbols = map f d
            , recordSymbolName -- 9
            , nilSymbolName -- 10 -- TODO should probably be 0
            , runtimeErrorSymbolName -- 11
+           -- the vm converts between lists and arrays, so it needs to know the list symbols
+           , listConsSymbolName -- 12
+           , listEmptySymbolName -- 13
+           , arrayTypeSymbolName -- 14
+           , listTypeSymbolName -- 15
            ]
 
 moduleOwner :: SymId
 moduleOwner = mkSymId 0
 
 
-bifStringConcatName, bifListConcatName, bifStringLengthName, bifSubStringName, bifToStringName, bifStringConcatOperator :: String
+bifStringConcatName, bifListConcatName, bifStringLengthName, bifSubStringName, bifStringCompareName, bifStringFindName, bifToStringName, bifStringConcatOperator :: String
 bifStringConcatName = "concatenate_strings"
 bifListConcatName = "concatenate"
 bifStringLengthName = "string_length"
 bifSubStringName = "sub_string"
+bifStringCompareName = "compare_strings"
+bifStringFindName = "find_string"
 bifToStringName = "to_string"
 bifStringConcatOperator = "^+"
 
@@ -80,52 +89,128 @@ bifStringConcatOperator = "^+"
 type Arity = Int
 builtInFunctions :: [(Name, Arity, [Opcode])]
 builtInFunctions = [  (bifStringConcatName, 2, [
-                        OpcStrLen 2 0,
-                        OpcStrLen 3 1,
-                        OpcAdd 4 2 3,
-                        OpcNewStr 5 4,
-                        OpcLoadI 6 0,  -- index
-                        OpcLoadI 7 1,
-                        -- loop1:
-                        OpcLT 8 2 6, -- is index >= length?
-                        OpcJmpTrue 8 4, -- jmp to next
-                        OpcGetChar 9 0 6,
-                        OpcPutChar 9 5 6,
-                        OpcAdd 6 6 7,
-                        OpcJmp (-6), -- jmp to loop1
-                        -- next:
-                        OpcLoadI 6 0,
-                        -- loop2:
-                        OpcLT 8 3 6,
-                        OpcJmpTrue 8 5, -- jmp to done
-                        OpcGetChar 9 1 6,
-                        OpcAdd 10 2 6,
-                        OpcPutChar 9 5 10,
-                        OpcAdd 6 6 7,
-                        OpcJmp (-7), -- jmp to loop2
-                        -- done:
-                        OpcMove 0 5,
+                        OpcStrConcat 0 0 1,
                         OpcRet 0
                       ]),
                       (bifStringLengthName, 1, [
                         OpcStrLen 0 0,
                         OpcRet 0
                       ]),
-                      (bifSubStringName, 3, [ -- TODO truncate length if needed
-                        OpcNewStr 3 1,
-                        OpcLoadI 6 1,
-                        OpcLoadI 7 0, -- counter
-                        -- loop1:
-                        OpcAdd 9 7 6,  -- TODO this is ugly. Fix our off-by-one error properly
-                        OpcLT 4 1 9, -- is index >= length?
-                        OpcJmpTrue 4 5, -- jmp to next
-                        OpcAdd 8 7 0,
-                        OpcGetChar 5 2 8,
-                        OpcPutChar 5 3 7,
-                        OpcAdd 7 7 6,
-                        OpcJmp (-8), -- jmp to loop1
-                        -- next:
-                        OpcMove 0 3,
+                      -- start and length are clamped to the string
+                      (bifSubStringName, 3, [
+                        OpcSubStr 0 2 0,
+                        OpcRet 0
+                      ]),
+                      (bifStringCompareName, 2, [
+                        OpcStrCmp 0 0 1,
+                        OpcRet 0
+                      ]),
+                      (bifStringFindName, 2, [
+                        OpcStrFind 0 0 1,
+                        OpcRet 0
+                      ]),
+                      -- the argument is ignored, it only turns new_dict into a function
+                      ("new_dict", 1, [
+                        OpcMapNew 0,
+                        OpcRet 0
+                      ]),
+                      ("dict_get", 3, [
+                        OpcMapGet 1 2 0,
+                        OpcRet 1
+                      ]),
+                      ("dict_insert", 3, [
+                        OpcMapPut 1 2 0,
+                        OpcRet 1
+                      ]),
+                      ("dict_remove", 2, [
+                        OpcMapDel 0 1 0,
+                        OpcRet 0
+                      ]),
+                      ("dict_size", 1, [
+                        OpcMapSize 0 0,
+                        OpcRet 0
+                      ]),
+                      -- calls f with every key, value and the accumulator, in the order
+                      -- of the entries in the vm
+                      ("dict_fold", 3, [
+                        OpcMapSize 3 2,
+                        OpcLoadI 4 0,
+                        OpcLoadI 5 1,
+                        OpcEq 6 4 3,
+                        OpcJmpTrue 6 6,
+                        OpcMapEntry 7 2 4,
+                        OpcSetArg 0 7 1,
+                        OpcSetArg 2 1 0,
+                        OpcGenAp 1 0 3,
+                        OpcAdd 4 4 5,
+                        OpcJmp (-8),
+                        OpcRet 1
+                      ]),
+                      ("new_array", 2, [
+                        OpcArrayNew 1 0,
+                        OpcRet 1
+                      ]),
+                      ("array_get", 2, [
+                        OpcArrayGet 0 1 0,
+                        OpcRet 0
+                      ]),
+                      ("array_length", 1, [
+                        OpcArrayLen 0 0,
+                        OpcRet 0
+                      ]),
+                      -- start and length are clamped to the array
+                      ("sub_array", 3, [
+                        OpcArraySlice 0 2 0,
+                        OpcRet 0
+                      ]),
+                      -- changes a copy of the array
+                      ("array_set", 3, [
+                        OpcLoadI 3 0,
+                        OpcArrayLen 4 2,
+                        OpcArraySlice 5 2 3,
+                        OpcArraySet 5 0 1,
+                        OpcRet 5
+                      ]),
+                      ("array_map", 2, [
+                        OpcArrayLen 2 1,
+                        OpcLoadI 3 0,
+                        OpcArrayNew 3 2,
+                        OpcLoadI 4 0,
+                        OpcLoadI 5 1,
+                        OpcEq 6 4 2,
+                        OpcJmpTrue 6 6,
+                        OpcArrayGet 7 1 4,
+                        OpcSetArg 0 7 0,
+                        OpcGenAp 7 0 1,
+                        OpcArraySet 3 4 7,
+                        OpcAdd 4 4 5,
+                        OpcJmp (-8),
+                        OpcRet 3
+                      ]),
+                      -- calls f with every element (from the first to the last) and the
+                      -- accumulator
+                      ("array_fold", 3, [
+                        OpcArrayLen 3 2,
+                        OpcLoadI 4 0,
+                        OpcLoadI 5 1,
+                        OpcEq 6 4 3,
+                        OpcJmpTrue 6 6,
+                        OpcArrayGet 7 2 4,
+                        OpcSetArg 0 7 0,
+                        OpcSetArg 1 1 0,
+                        OpcGenAp 1 0 2,
+                        OpcAdd 4 4 5,
+                        OpcJmp (-8),
+                        OpcRet 1
+                      ]),
+                      ("array_from_list", 1, [
+                        OpcLoadPS 1 (fromJust $ lookup arrayTypeSymbolName builtInSymbols),
+                        OpcConvert 0 0 1,
+                        OpcRet 0
+                      ]),
+                      ("array_to_list", 1, [
+                        OpcLoadPS 1 (fromJust $ lookup listTypeSymbolName builtInSymbols),
+                        OpcConvert 0 0 1,
                         OpcRet 0
                       ]),
                       ("<=", 2, [
@@ -160,10 +245,16 @@ builtInFunctions = [  (bifStringConcatName, 2, [
                    ]
 
 
-returnActionId, readLineActionId, printLineActionId :: Int
+returnActionId, readLineActionId, printLineActionId, flushActionId, spawnActionId, awaitActionId, newChannelActionId, sendActionId, receiveActionId :: Int
 returnActionId = 0
 readLineActionId = 1
 printLineActionId = 2
+flushActionId = 3
+spawnActionId = 4
+awaitActionId = 5
+newChannelActionId = 6
+sendActionId = 7
+receiveActionId = 8
 
 preamble :: String
 preamble = "\n\
@@ -186,6 +277,24 @@ preamble = "\n\
 \                                                          \n\
 \    print_line a =                                       \n\
 \      :_internal_io<" ++ show printLineActionId ++ ", (a " ++ bifStringConcatOperator ++ " \"\\n\"), :nil>    \n\
+\                                                          \n\
+\    flush =                                               \n\
+\      :_internal_io<" ++ show flushActionId ++ ", :nil, :nil>       \n\
+\                                                          \n\
+\    spawn f =                                             \n\
+\      :_internal_io<" ++ show spawnActionId ++ ", f, :nil>          \n\
+\                                                          \n\
+\    await thread =                                        \n\
+\      :_internal_io<" ++ show awaitActionId ++ ", thread, :nil>     \n\
+\                                                          \n\
+\    new_channel =                                         \n\
+\      :_internal_io<" ++ show newChannelActionId ++ ", :nil, :nil>  \n\
+\                                                          \n\
+\    send channel message =                                \n\
+\      :_internal_io<" ++ show sendActionId ++ ", (channel, message), :nil>  \n\
+\                                                          \n\
+\    receive channel =                                     \n\
+\      :_internal_io<" ++ show receiveActionId ++ ", channel, :nil>  \n\
 \  end                                                   \n\
 \                                                        \n\
 \  head ls =                                             \n\
@@ -257,4 +366,17 @@ preamble = "\n\
 \                                                        \n\
 \  m_map m action ls =                                   \n\
 \    sequence m (map action ls)                          \n\
+\                                                        \n\
+\  empty_dict = new_dict :nil                            \n\
+\                                                        \n\
+\  dict_from_list ls =                                   \n\
+\    from_list' l d =                                    \n\
+\      match l with                                      \n\
+\        [] -> d                                         \n\
+\        [(k, v) | rest] -> from_list' rest (dict_insert k v d) \n\
+\      end                                               \n\
+\    from_list' ls (new_dict :nil)                      \n\
+\                                                        \n\
+\  dict_to_list d =                                      \n\
+\    dict_fold (k v acc -> [(k, v) | acc]) [] d         \n\
 \\n"
@@ -8,10 +8,11 @@ import           Control.Monad.Except                     (runExceptT,
 import           Control.Monad.Identity                   (runIdentity)
 import           Control.Monad.State.Strict
 import           Data.Foldable
-import           Data.List                                (transpose)
+import           Data.List                                (sortOn, transpose)
 import           Data.Maybe                               (catMaybes)
 import           Language.Dash.BuiltIn.BuiltInDefinitions
 import           Language.Dash.CodeGen.CodeGenState
+import           Language.Dash.CodeGen.Escape             (liftClosureCalls)
 import           Language.Dash.Error.Error                (CompilationError (..))
 import           Language.Dash.IR.Data
 import           Language.Dash.IR.Nst
@@ -21,7 +22,11 @@ import           Language.Dash.Limits
 
 -- TODO explain what the code generator does and how it does it !
 
--- TODO when there is more time, do dataflow analysis to reuse registers
+-- Registers are allocated per binding. The liveness analysis (see Liveness.hs)
+-- tells us when a value isn't needed anymore, so that its register can be reused.
+-- If all registers hold live values, some of them are spilled (see newRegs).
+-- Closures that are called where they are created are called directly (see
+-- Escape.hs).
 
 
 
@@ -30,22 +35,30 @@ compile :: NstExpr
         -> SymbolNameList
         -> Either CompilationError ([EncodedFunction], ConstTable, SymbolNameList)
 compile expr cTable symlist =
-  let resultOrError = runIdentity $ runExceptT $ execStateT (compileCompilationUnit expr)
+  let expr' = liftClosureCalls expr in
+  let resultOrError = runIdentity $ runExceptT $ execStateT (compileCompilationUnit expr')
                                                             (makeCompState cTable symlist)
   in
   extractResults <$> resultOrError
   where
     extractResults result =
-        (map EncodedFunction $ toList (instructions result), constTable result, symbolNames result)
+        ( zipWith EncodedFunction (toList $ functionNames result) (toList $ instructions result)
+        , toList (constTable result)
+        , toList (symbolNames result) )
 
 
 compileCompilationUnit :: NstExpr -> CodeGen ()
 compileCompilationUnit expr = do
   funAddr <- beginFunction [] []
   addBuiltInFunctions
-  funcCode <- compileExpr expr
-  -- Don't add func header for wrapping function
-  endFunction funAddr funcCode
+  funcCode <- compileBody expr
+  -- The wrapping function only needs a header if it spills values, because the vm
+  -- gives it all registers anyway
+  size <- frameSize
+  let funcCode' = if size > maxRegisters
+                    then OpcFunHeader 0 size : funcCode
+                    else funcCode
+  endFunction funAddr "<main>" funcCode'
 
 
 addBuiltInFunctions :: CodeGen ()
@@ -61,8 +74,9 @@ addBuiltInFunction name bifArity code = do
                        zip (replicate bifArity "p") [0..bifArity]
   funAddr <- beginFunction [] params
   let arity = length params
-  let funcCode' = OpcFunHeader arity : code
-  endFunction funAddr funcCode'
+  -- We don't know which registers built-in functions are using, so they get all of them
+  let funcCode' = OpcFunHeader arity maxRegisters : code
+  endFunction funAddr name funcCode'
   addCompileTimeConst name $ CTConstLambda funAddr -- Have to re-add to outer scope
   return ()
 
@@ -73,16 +87,23 @@ compileFunc freeVars params expr name = do
   funAddr <- beginFunction freeVars params
   -- we add the name already here for recursion
   addCompileTimeConst name $ CTConstLambda funAddr
-  funcCode <- compileExpr expr
+  funcCode <- compileBody expr
 
   let arity = length freeVars + length params
-  let funcCode' = OpcFunHeader arity : funcCode
-  endFunction funAddr funcCode'
+  size <- frameSize
+  let funcCode' = OpcFunHeader arity (max arity size) : funcCode
+  endFunction funAddr name funcCode'
 
   addCompileTimeConst name $ CTConstLambda funAddr -- Have to re-add to outer scope
   return funAddr
 
 
+compileBody :: NstExpr -> CodeGen [Opcode]
+compileBody expr = do
+  startBody expr
+  compileExpr expr
+
+
 compileExpr :: NstExpr -> CodeGen [Opcode]
 compileExpr expr =
   case expr of
@@ -91,8 +112,12 @@ compileExpr expr =
     NDestructuringBind matchedVars patternAddr subjVar body ->
       compileDestructuringBind matchedVars patternAddr subjVar body
     NAtom a -> do
+      step <- beginStep
+      -- the result goes to register 0, so it can't be used for anything else
+      holdRegister 0
       code <- compileAtom 0 a "" True
-      return $ code ++ [OpcRet 0]
+      spillCode <- endStep step
+      return $ spillCode ++ code ++ [OpcRet 0]
 
 
 compileAtom :: Reg -> NstAtomicExpr -> Name -> Bool -> CodeGen [Opcode]
@@ -142,11 +167,9 @@ compileAtom reg atom name isResultValue = case atom of
       let partApInst = [OpcPartAp reg rFun numArgs]
       return $ argInstrs ++ partApInst
   NModule fields ->
-      compileModule reg fields
-  NFieldLookup objVar symVar -> do
-      objReg <- getReg objVar
-      symReg <- getReg symVar
-      return [OpcGetField reg objReg symReg]
+      compileModule reg fields name
+  NFieldLookup objVar symVar ->
+      compileFieldLookup reg objVar symVar
   where
     moveVarToReg :: NstVar -> Reg -> CodeGen [Opcode]
     moveVarToReg var dest = do
@@ -164,7 +187,7 @@ compileFunAp reg funVar args isResultValue = do
 compileCallInstr :: Reg -> NstVar -> Int -> Bool -> CodeGen [Opcode]
 compileCallInstr reg funVar numArgs isResultValue = do
   rFun <- getReg funVar
-  direct <- isDirectCallReg rFun
+  direct <- isDirectCallReg rFun numArgs
   -- TODO maybe the normalizer should already resolve what is a call to a known
   -- function and what isn't?
   let instr = case (direct, isResultValue) of
@@ -180,7 +203,7 @@ compileDynamicSymbol reg dynamicFields cAddr = do
   -- We're writing to a temp reg first because otherwise we might overwrite arguments
   -- in register 0 before we can apply them.
   -- TODO find out if this is the only place that can happen!
-  tempReg <- newReg
+  tempReg <- newTempReg
   let loadConstCode = [ OpcLoadCS tempReg cAddr
                       , OpcCopySym tempReg tempReg] -- copy to heap and place new heap address in reg
   modifyCode <- forM dynamicFields $ \ (index, var) -> do
@@ -222,6 +245,7 @@ compileConstantFreeVar reg name = do
     CTConstPlainSymbol symId -> return [OpcLoadPS reg symId]
     -- CConstCompoundSymbol ConstAddr
     CTConstLambda funAddr    -> compileLoadLambda reg funAddr
+    CTConstModule modAddr _  -> return [OpcLoadOS reg modAddr]
     _ -> throwError $ InternalCompilerError "Unexpected compile time constant"
 
 
@@ -238,37 +262,40 @@ compileLet tmpVar atom body =
   where
     compileLet' :: String -> CodeGen [Opcode]
     compileLet' name = do
+      step <- beginStep
       rTmp <- newReg
       bindVar name rTmp
       let callDirect = canBeCalledDirectly atom
-      when callDirect $ addDirectCallReg rTmp
+      when callDirect $ addDirectCallReg rTmp KnownFunction
       comp1 <- compileAtom rTmp atom name False
+      spillCode <- endStep step
       comp2 <- compileExpr body
-      return $ comp1 ++ comp2
+      return $ spillCode ++ comp1 ++ comp2
 
 compileDestructuringBind :: [NstVar] -> ConstAddr -> NstVar -> NstExpr -> CodeGen [Opcode]
 compileDestructuringBind boundVars patternAddr subjectVar body = do
   when (length boundVars == 0) $ throwError (ParsingError "Destructuring bind does not contain any variables")
-  captureRegs <- forM boundVars bindMatchVar
-  let captureStartReg = head captureRegs
+  step <- beginStep
+  -- the match writes the captures to consecutive registers
+  captureStartReg <- newRegs (length boundVars)
+  zipWithM_ bindMatchVar boundVars [regToInt captureStartReg ..]
   subjReg <- getReg subjectVar
   let addrTempReg = captureStartReg -- we can use the first reg of the captured vars temporarily to store the pattern address
 
   -- we don't need a jump table with this OpcMatch, because there's only one branch and
   -- the first branch continues right after the OpcMatch instruction. If the match fails,
   -- it throws an error anyway
+  spillCode <- endStep step
   compBody <- compileExpr body
-  return $ [OpcLoadAddr addrTempReg patternAddr,
+  return $ spillCode ++
+           [OpcLoadAddr addrTempReg patternAddr,
             OpcMatch subjReg addrTempReg captureStartReg] ++
            compBody
 
   where
-    bindMatchVar :: NstVar -> CodeGen Reg
-    bindMatchVar (NVar n NLocalVar) = do
-      r <- newReg
-      bindVar n r
-      return r
-    bindMatchVar _ = throwError $ InternalCompilerError $ "Bound var in destructuring bind was not a local var"
+    bindMatchVar :: NstVar -> Int -> CodeGen ()
+    bindMatchVar (NVar n NLocalVar) r = bindVar n (mkReg r)
+    bindMatchVar _ _ = throwError $ InternalCompilerError $ "Bound var in destructuring bind was not a local var"
 
 
 -- This determines whether we'll use call or gen_ap later
@@ -348,15 +375,14 @@ compileMatch :: Reg
              -> [([Name], [Name], NstVar)]
              -> Bool
              -> CodeGen [Opcode]
-compileMatch resultReg subject _{- maxCaptures -} patternAddr branches isResultValue = do
+compileMatch resultReg subject maxCaptures patternAddr branches isResultValue = do
   -- the variables containing matchbranches to call
   let matchBranchVars = map (\ (_, _, a) -> a) branches
   subjR <- getReg subject
   let handledBranches = [0 .. length matchBranchVars - 1]
   let remainingBranches = reverse handledBranches
-  captureStartReg <- newReg -- TODO return register to pool after we're done with it
-  -- TODO reserve maxCaptures vars (so that we can check that we don't run out of
-  -- registers) and return them to pool afterwards
+  -- the captures are only needed until the match branch is called
+  captureStartReg <- newTempRegs (max 1 maxCaptures)
   compiledBranches <- forM branches $
     \ (freeVars, capturedVars, funVar) -> do
         loadArgInstrs <- compileMatchBranchLoadArg captureStartReg freeVars capturedVars
@@ -412,9 +438,10 @@ compileMatch resultReg subject _{- maxCaptures -} patternAddr branches isResultV
   -- after match has started, we can reuse the reg holding the address for captured vars
   let addrTempReg = captureStartReg
 
-  -- compile match call
+  -- compile match call. The switch jumps directly to the first pattern that could
+  -- match, instead of trying all of them
   let matchCode = [OpcLoadAddr addrTempReg patternAddr,
-                   OpcMatch subjR addrTempReg captureStartReg]
+                   OpcMatchSwitch subjR addrTempReg captureStartReg]
   let body = Prelude.concat completeCompiledBranches
   return $ matchCode ++ jumpInTable ++ body
 
@@ -439,21 +466,59 @@ compileMatchBranchLoadArg captureStartReg freeVars capturedVars = do
 
 
 
-compileModule :: Reg -> [(SymId, String, NstAtomicExpr)] -> CodeGen [Opcode]
-compileModule resultReg fields = do
+-- The fields of a module are sorted by the symbol ids of their names, so that the
+-- vm can use a binary search to find them
+compileModule :: Reg -> [(SymId, String, NstAtomicExpr)] -> Name -> CodeGen [Opcode]
+compileModule resultReg fields name = do
   -- TODO scan through fields for functions. create placeholders for them
   -- then scan for literals and add them as CTConsts.
   -- then add a new scope with bindings for all that. then compile
   -- TODO and obviousl we can only do that in normalization, so that's where we
   -- should create this
-  let (accessSymbols, names, exprs) = unzip3 fields
+  let (accessSymbols, names, exprs) = unzip3 $ sortOn (\ (sid, _, _) -> sid) fields
   let fieldAccessors = map CPlainSymbol accessSymbols
   fieldConsts <- zipWithM encodeConstantLiteral exprs names
   let cFields = Prelude.concat $ transpose [fieldAccessors, fieldConsts]
   modId <- newModuleIdentifier
   modAddr <- encodeOpaqueSymbol modId moduleOwner cFields
+  addCompileTimeConst name $ CTConstModule modAddr (zip accessSymbols fieldConsts)
   return [OpcLoadOS resultReg modAddr]
 
+
+-- If both the module and the field name are known at compile time, we can load
+-- the field's value directly instead of looking it up at runtime. A function loaded
+-- like this can be called directly if the call has the function's arity.
+compileFieldLookup :: Reg -> NstVar -> NstVar -> CodeGen [Opcode]
+compileFieldLookup reg objVar symVar = do
+  knownModule <- compileTimeConstOfVar objVar
+  knownSymbol <- compileTimeConstOfVar symVar
+  case (knownModule, knownSymbol) of
+    (Just (CTConstModule _ fields), Just (CTConstPlainSymbol symId))
+      | Just field <- lookup symId fields
+      , Just code <- loadModuleField field -> do
+          case field of
+            CFunction fAddr -> do
+              arity <- functionArity fAddr
+              mapM_ (addDirectCallReg reg . KnownArity) arity
+            _ -> return ()
+          return code
+    _ -> do
+      objReg <- getReg objVar
+      symReg <- getReg symVar
+      return [OpcGetField reg objReg symReg]
+  where
+    compileTimeConstOfVar var =
+      case var of
+        NVar vname NLocalVar -> lookupLocalCompileTimeConst vname
+        _ -> return Nothing
+    loadModuleField field =
+      case field of
+        CNumber n               -> Just [OpcLoadI reg n]
+        CPlainSymbol sid        -> Just [OpcLoadPS reg sid]
+        CCompoundSymbolRef addr -> Just [OpcLoadCS reg addr]
+        CFunction fAddr         -> Just [OpcLoadF reg fAddr]
+        _                       -> Nothing
+
 encodeConstantLiteral :: NstAtomicExpr -> Name -> CodeGen Constant
 encodeConstantLiteral field name =
   case field of
@@ -11,8 +11,11 @@ import           Control.Monad.Identity
 import           Control.Monad.State.Strict hiding (state)
 import           Data.List
 import qualified Data.Map                   as Map
-import           Data.Maybe                 (fromJust)
+import           Data.Maybe                 (fromMaybe)
+import           Data.Ord                   (comparing)
 import qualified Data.Sequence              as Seq
+import qualified Data.Set                   as Set
+import           Language.Dash.CodeGen.Liveness
 import           Language.Dash.Limits
 import           Language.Dash.Error.Error  (CompilationError (..))
 import           Language.Dash.IR.Data
@@ -27,8 +30,10 @@ type CodeGen a = CodeGenT a Identity
 
 data CompState = CompState
   { instructions    :: Seq.Seq [Opcode]
-  , constTable      :: ConstTable
-  , symbolNames     :: SymbolNameList
+  , functionNames   :: Seq.Seq Name -- empty for anonymous functions
+  , constTable      :: Seq.Seq Constant
+  , symbolNames     :: Seq.Seq String
+  , symbolIds       :: Map.Map String SymId
   , moduleIdCounter :: Int
   , scopes          :: [CompScope]
   }
@@ -37,8 +42,10 @@ data CompState = CompState
 makeCompState :: ConstTable -> SymbolNameList -> CompState
 makeCompState ct sns = CompState
   { instructions = Seq.fromList []
-  , constTable = ct
-  , symbolNames = sns
+  , functionNames = Seq.fromList []
+  , constTable = Seq.fromList ct
+  , symbolNames = Seq.fromList sns
+  , symbolIds = Map.fromList $ zip sns (map mkSymId [0..])
   , moduleIdCounter = 0
   , scopes = []
   }
@@ -51,22 +58,54 @@ data CompScope = CompScope
   -- these are all the registers that hold function values which
   -- can be called directly with Op_call. Everything else is
   -- called with Op_call_cl
-  , directCallRegs       :: [Reg]
+  , directCallRegs       :: Map.Map Reg DirectCall
   , compileTimeConstants :: Map.Map String CompileTimeConstant
-  , nextFreeRegIndex     :: Int
+  -- the number of registers the function has used so far
+  , usedRegisters        :: Int
+  -- registers that are only needed while the current step is compiled (e.g. for
+  -- the captures of a match)
+  , temporaryRegisters   :: [Reg]
+
+  -- Values that don't fit into the registers are spilled to slots behind the
+  -- registers of the frame. This maps them to their slot and to whether they can
+  -- be called directly.
+  , spilledVars          :: Map.Map Name (Int, Maybe DirectCall)
+  , freeSpillSlots       :: [Int]
+  , spillSlotCount       :: Int
+
+  -- the liveness steps of the function that haven't been compiled yet (see Liveness.hs)
+  , remainingSteps       :: [LivenessStep]
+  -- the names used or bound by the current step, which can't be spilled
+  , pinnedVars           :: Set.Set Name
+  -- spill and reload instructions for the current step, in reverse order
+  , pendingCode          :: [Opcode]
   } deriving (Show)
 
 
-makeScope :: Map.Map Name Reg -> CompScope
-makeScope initialBindings = CompScope
+makeScope :: Map.Map Name Reg -> Int -> CompScope
+makeScope initialBindings numRegisters = CompScope
   { bindings = initialBindings
   , selfReferenceSlot = Nothing
-  , directCallRegs = []
+  , directCallRegs = Map.empty
   , compileTimeConstants = Map.empty
-  , nextFreeRegIndex = Map.size initialBindings
+  , usedRegisters = numRegisters
+  , temporaryRegisters = []
+  , spilledVars = Map.empty
+  , freeSpillSlots = []
+  , spillSlotCount = 0
+  , remainingSteps = []
+  , pinnedVars = Set.empty
+  , pendingCode = []
   }
 
 
+-- Which calls of a function in a register can be compiled as direct calls
+data DirectCall =
+    KnownFunction   -- all of them, the normalizer made sure their arity is right
+  | KnownArity Int  -- those with exactly this many arguments
+  deriving (Show)
+
+
 -- This helps us to keep track of constant values in the code. They overlap
 -- with the constants in the ConstTable, but are not the same. CompileTimeConstants
 -- are for example used in determining free variables in closures. Even though a
@@ -80,6 +119,7 @@ data CompileTimeConstant =
   | CTConstPlainSymbol SymId
   | CTConstCompoundSymbol ConstAddr -- only if it only contains other CompileTimeConstants
   | CTConstLambda FuncAddr  -- only if it is not a closure
+  | CTConstModule ConstAddr [(SymId, Constant)] -- the module and its fields
   deriving (Show)
 
 
@@ -89,32 +129,81 @@ beginFunction freeVars params = do
   let paramStart = length freeVars
   let paramBindings = Map.fromList (zipWithReg params paramStart)
   -- The order of arguments for union is important. We prefer params over free vars
-  let newScope = makeScope $ Map.union paramBindings freeVarBindings
+  let newScope = makeScope (Map.union paramBindings freeVarBindings) (paramStart + length params)
   modify $ \ state -> state { scopes = newScope : scopes state }
   checkRegisterLimits
   addr <- addFunctionPlaceholder
   return addr
 
 
-endFunction :: FuncAddr -> [Opcode] -> CodeGen ()
-endFunction funAddr code = do
+-- The name is only used to show where the time is spent when profiling
+endFunction :: FuncAddr -> Name -> [Opcode] -> CodeGen ()
+endFunction funAddr name code = do
   replacePlaceholderWithActualCode funAddr code
+  modify $ \ state -> state { functionNames = Seq.update (funcAddrToInt funAddr) name (functionNames state) }
   modify $ \ state -> state { scopes = tail $ scopes state }
 
 
+-- Runs the liveness analysis for the body of the current function. Free variables
+-- and parameters that the body never uses don't need their registers.
+startBody :: NstExpr -> CodeGen ()
+startBody expr = do
+  let (liveAtStart, steps) = liveness expr
+  scope <- getScope
+  putScope $ scope { remainingSteps = steps }
+  mapM_ releaseVar $ filter (`Set.notMember` liveAtStart) $ Map.keys (bindings scope)
+
+
+-- Every binding (and the final atom) of a function body is one step. The values
+-- that the step uses are reloaded if they have been spilled, and they stay in
+-- registers until the step is done.
+beginStep :: CodeGen LivenessStep
+beginStep = do
+  scope <- getScope
+  step <- case remainingSteps scope of
+            s : _ -> return s
+            [] -> throwError $ InternalCompilerError "No liveness information for expression"
+  putScope $ scope { remainingSteps = tail (remainingSteps scope)
+                   , pinnedVars = stepUses step `Set.union` stepDefs step }
+  let spilled = filter (`Map.member` spilledVars scope) $ Set.toList (stepUses step)
+  mapM_ reloadVar spilled
+  return step
+
+
+-- Frees the registers of all values that die in the step. Returns the spill
+-- and reload code, which has to run before the code of the step.
+endStep :: LivenessStep -> CodeGen [Opcode]
+endStep step = do
+  mapM_ releaseVar $ Set.toList (stepDying step)
+  scope <- getScope
+  putScope $ scope { temporaryRegisters = []
+                   , pinnedVars = Set.empty
+                   , pendingCode = [] }
+  return $ reverse (pendingCode scope)
+
+
+-- Binding a name that is already bound frees its old register, since nothing can
+-- refer to it anymore
 bindVar :: String -> Reg -> CodeGen ()
 bindVar "" _ = throwError $ InternalCompilerError "Binding anonymous var"
 bindVar name reg = do
+  releaseVar name
   scope <- getScope
   let bindings' = Map.insert name reg (bindings scope)
   putScope $ scope { bindings = bindings' }
-  checkRegisterLimits
 
 
-numBindings :: CodeGen Int
-numBindings = do
-  bs <- gets $ bindings.head.scopes
-  return $ Map.size bs
+releaseVar :: Name -> CodeGen ()
+releaseVar name = do
+  scope <- getScope
+  case (Map.lookup name (bindings scope), Map.lookup name (spilledVars scope)) of
+    (Just reg, _) ->
+      putScope $ scope { bindings = Map.delete name (bindings scope)
+                       , directCallRegs = Map.delete reg (directCallRegs scope) }
+    (_, Just (slot, _)) ->
+      putScope $ scope { spilledVars = Map.delete name (spilledVars scope)
+                       , freeSpillSlots = slot : freeSpillSlots scope }
+    _ -> return ()
 
 
 -- a placeholder is needed because we might start to encode other functions while encoding
@@ -127,7 +216,8 @@ addFunctionPlaceholder = do
   instrs <- gets instructions
   let nextFunAddr = Seq.length instrs
   let instrs' = instrs Seq.|> []
-  modify $ \ state -> state { instructions = instrs' }
+  modify $ \ state -> state { instructions = instrs'
+                           , functionNames = functionNames state Seq.|> "" }
   return $ mkFuncAddr nextFunAddr
 
 
@@ -156,32 +246,146 @@ getRegByName name = do
 
 
 newReg :: CodeGen Reg
-newReg = do
+newReg = newRegs 1
+
+
+-- Returns the first of `count` consecutive registers. They are taken from the
+-- unused registers if possible, otherwise the values in them are spilled. Of all
+-- values that could be spilled, we pick the one that is needed last.
+newRegs :: Int -> CodeGen Reg
+newRegs count = do
   scope <- getScope
-  let nextFree = nextFreeRegIndex scope
-  let reg = mkReg nextFree
-  let scope' = scope { nextFreeRegIndex = nextFree + 1 }
-  putScope scope'
-  return reg
+  let owners = Map.fromList $ map (\ (name, r) -> (regToInt r, name)) $ Map.toList (bindings scope)
+  let temps = map regToInt $ temporaryRegisters scope
+  let isFree r = r `Map.notMember` owners && r `notElem` temps
+  let canSpill r = r `notElem` temps &&
+                   maybe True (`Set.notMember` pinnedVars scope) (Map.lookup r owners)
+  let block start = [start .. start + count - 1]
+  let starts = [0 .. maxRegisters - count]
+  start <- case find (all isFree . block) starts of
+    Just freeStart -> return freeStart
+    Nothing -> do
+      let candidates = filter (all canSpill . block) starts
+      when (null candidates) $
+              throwError $ InternalCompilerError "Out of free registers"
+      let cost s = length $ filter (`Map.member` owners) (block s)
+      let spillStart = if count == 1
+                      then maximumBy (comparing $ nextUse scope . (owners Map.!)) candidates
+                      else minimumBy (comparing cost) candidates
+      mapM_ spillVar $ Map.elems $ Map.filterWithKey (\ r _ -> r `elem` block spillStart) owners
+      return spillStart
+  modify $ \ state ->
+        let scope' = head (scopes state) in
+        state { scopes = scope' { usedRegisters = max (usedRegisters scope') (start + count) }
+                         : tail (scopes state) }
+  return $ mkReg start
+  where
+    -- the number of steps until the name is used again
+    nextUse :: CompScope -> Name -> Int
+    nextUse scope name =
+      fromMaybe maxBound $ findIndex (Set.member name . stepUses) (remainingSteps scope)
+
+
+-- Temporary registers are freed at the end of the current step
+newTempRegs :: Int -> CodeGen Reg
+newTempRegs count = do
+  start <- newRegs count
+  scope <- getScope
+  let regs = map mkReg [regToInt start .. regToInt start + count - 1]
+  putScope $ scope { temporaryRegisters = regs ++ temporaryRegisters scope }
+  return start
+
+
+newTempReg :: CodeGen Reg
+newTempReg = newTempRegs 1
+
+
+-- Keeps the register from being used for anything else in the current step. This
+-- is only needed for registers that are written without being allocated.
+holdRegister :: Reg -> CodeGen ()
+holdRegister reg = do
+  scope <- getScope
+  putScope $ scope { temporaryRegisters = reg : temporaryRegisters scope }
+
+
+spillVar :: Name -> CodeGen ()
+spillVar name = do
+  reg <- getRegByName name
+  slot <- newSpillSlot
+  scope <- getScope
+  let direct = Map.lookup reg (directCallRegs scope)
+  putScope $ scope { bindings = Map.delete name (bindings scope)
+                   , directCallRegs = Map.delete reg (directCallRegs scope)
+                   , spilledVars = Map.insert name (slot, direct) (spilledVars scope)
+                   , pendingCode = OpcSpill reg slot : pendingCode scope }
+
+
+reloadVar :: Name -> CodeGen ()
+reloadVar name = do
+  reg <- newReg
+  scope <- getScope
+  let (slot, direct) = spilledVars scope Map.! name
+  putScope $ scope { bindings = Map.insert name reg (bindings scope)
+                   , spilledVars = Map.delete name (spilledVars scope)
+                   , freeSpillSlots = slot : freeSpillSlots scope
+                   , pendingCode = OpcReload reg slot : pendingCode scope }
+  mapM_ (addDirectCallReg reg) direct
+
+
+newSpillSlot :: CodeGen Int
+newSpillSlot = do
+  scope <- getScope
+  case freeSpillSlots scope of
+    slot : slots -> do
+      putScope $ scope { freeSpillSlots = slots }
+      return slot
+    [] -> do
+      let slot = spillSlotCount scope
+      when (slot >= maxSpillSlots) $
+              throwError $ InternalCompilerError "Out of spill slots"
+      putScope $ scope { spillSlotCount = slot + 1 }
+      return slot
+
+
+-- The size of the current function's frame. The vm only gives it a frame of that
+-- size, the registers above belong to the next frame. Register 0 always holds the
+-- result. Spill slots are behind all registers, so a function that spills values
+-- gets all registers.
+frameSize :: CodeGen Int
+frameSize = do
+  scope <- getScope
+  return $ if spillSlotCount scope > 0
+             then maxRegisters + spillSlotCount scope
+             else min maxRegisters $ max 1 (usedRegisters scope)
 
 
 -- TODO rename to isRegWithRefToKnownFunction
-isDirectCallReg :: Reg -> CodeGen Bool
-isDirectCallReg reg = do
+isDirectCallReg :: Reg -> Int -> CodeGen Bool
+isDirectCallReg reg numArgs = do
   scope <- getScope
-  let dCallRegs = directCallRegs scope
-  return $ Prelude.elem reg dCallRegs
+  return $ case Map.lookup reg (directCallRegs scope) of
+             Just KnownFunction    -> True
+             Just (KnownArity ar)  -> ar == numArgs
+             Nothing               -> False
 
 
 -- TODO same here (rename)
-addDirectCallReg :: Reg -> CodeGen ()
-addDirectCallReg reg = do
+addDirectCallReg :: Reg -> DirectCall -> CodeGen ()
+addDirectCallReg reg direct = do
   scope <- getScope
-  let dCallRegs = directCallRegs scope
-  let dCallRegs' = reg : dCallRegs
+  let dCallRegs' = Map.insert reg direct (directCallRegs scope)
   putScope $ scope { directCallRegs = dCallRegs' }
 
 
+-- The arity of a function that has already been compiled
+functionArity :: FuncAddr -> CodeGen (Maybe Int)
+functionArity funAddr = do
+  instrs <- gets instructions
+  return $ case Seq.index instrs (funcAddrToInt funAddr) of
+             OpcFunHeader arity _ : _ -> Just arity
+             _                        -> Nothing
+
+
 getSelfReference :: CodeGen (Maybe Int)
 getSelfReference = liftM selfReferenceSlot getScope
 
@@ -223,7 +427,15 @@ getCompileTimeConstInSurroundingScopes name = do
         Nothing -> getCompConst constName $ tail scps
 
 
--- TODO implement argument spilling to avoid this hard limit
+-- Only looks at the current scope. Used for local names, which are never
+-- visible in other scopes
+lookupLocalCompileTimeConst :: Name -> CodeGen (Maybe CompileTimeConstant)
+lookupLocalCompileTimeConst name = do
+  scope <- getScope
+  return $ Map.lookup name (compileTimeConstants scope)
+
+
+-- Arguments are passed in registers, so they can't be spilled
 checkRegisterLimits :: CodeGen ()
 checkRegisterLimits = do
   bs <- gets $ bindings.head.scopes
@@ -244,9 +456,8 @@ addConstant :: Constant -> CodeGen ConstAddr
 addConstant c = do
   state <- get
   let cTable = constTable state
-  let nextAddr = mkConstAddr $ length cTable
-  let constTable' = cTable ++ [c] -- TODO can we cons + reverse?
-  put $ state { constTable = constTable' }
+  let nextAddr = mkConstAddr $ Seq.length cTable
+  put $ state { constTable = cTable Seq.|> c }
   return nextAddr
 
 newModuleIdentifier :: CodeGen SymId
@@ -266,14 +477,13 @@ newModuleIdentifier = do
 addSymbolName :: String -> CodeGen SymId
 addSymbolName s = do
   state <- get
-  let syms = symbolNames state
-  if s `elem` syms then  -- TODO optimize this with a map
-    return $ mkSymId $ fromJust $ elemIndex s syms
-  else do
-    let nextId = mkSymId $ length syms
-    let syms' = syms ++ [s]
-    put $ state { symbolNames = syms' }
-    return nextId
+  case Map.lookup s (symbolIds state) of
+    Just symId -> return symId
+    Nothing -> do
+      let nextId = mkSymId $ Seq.length (symbolNames state)
+      put $ state { symbolNames = symbolNames state Seq.|> s
+                  , symbolIds = Map.insert s nextId (symbolIds state) }
+      return nextId
 
 
 getScope :: CodeGen CompScope
@@ -0,0 +1,92 @@
+module Language.Dash.CodeGen.Escape (
+  liftClosureCalls
+) where
+
+import qualified Data.Set                       as Set
+import           Language.Dash.CodeGen.Liveness (atomUses)
+import           Language.Dash.IR.Data          (Name)
+import           Language.Dash.IR.Nst
+
+
+-- A closure is compiled as a function that takes its free variables as the first
+-- arguments, plus a partial application of that function to the values of the free
+-- variables (see compileClosure). Calling the closure goes through gen_ap, which has
+-- to unpack the partial application first.
+--
+-- If the closure is called in the function that created it, the free variables are
+-- still in registers there. So we call its function directly (with ap) and pass the
+-- free variables ourselves. The partial application is only created if the closure
+-- escapes, i.e. if it is used as a value and not just called. Closures that never
+-- escape aren't allocated at all.
+
+-- The function of a closure named `c` is bound to `$lifted:c`
+liftedFunctionPrefix :: String
+liftedFunctionPrefix = "$lifted:"
+
+
+liftClosureCalls :: NstExpr -> NstExpr
+liftClosureCalls expr =
+  case expr of
+    -- closures that refer to themselves need their partial application
+    NLet var@(NVar name _) (NLambda freeVars params body) rest
+      | not (null freeVars) && name `notElem` freeVars ->
+        let funVar = NVar (liftedFunctionPrefix ++ name) NLocalVar in
+        let lifted = NLambda [] (freeVars ++ params) (liftClosureCalls body) in
+        let (rest', escapes) = redirectCalls name freeVars (length params) funVar
+                                             (liftClosureCalls rest) in
+        NLet funVar lifted $
+          if escapes
+            then NLet var (NPartAp funVar (map (`NVar` NLocalVar) freeVars)) rest'
+            else rest'
+    NLet var atom rest ->
+      NLet var (liftInAtom atom) (liftClosureCalls rest)
+    NDestructuringBind vars patternAddr subject rest ->
+      NDestructuringBind vars patternAddr subject (liftClosureCalls rest)
+    NAtom atom ->
+      NAtom (liftInAtom atom)
+
+
+liftInAtom :: NstAtomicExpr -> NstAtomicExpr
+liftInAtom atom =
+  case atom of
+    NLambda freeVars params body ->
+      NLambda freeVars params (liftClosureCalls body)
+    NMatchBranch freeVars matchedVars body ->
+      NMatchBranch freeVars matchedVars (liftClosureCalls body)
+    NModule fields ->
+      NModule $ map (\ (sym, name, field) -> (sym, name, liftInAtom field)) fields
+    _ ->
+      atom
+
+
+-- Replaces the calls of the closure in the rest of the function body. Returns whether
+-- the closure is used in any other way. Calls after one of the free variables has been
+-- bound again need the values that the closure has captured, so they aren't replaced.
+redirectCalls :: Name -> [Name] -> Int -> NstVar -> NstExpr -> (NstExpr, Bool)
+redirectCalls name freeVars arity funVar expr =
+  case expr of
+    NLet var@(NVar bound _) atom rest ->
+      let (atom', atomEscapes) = redirectAtom atom in
+      let (rest', restEscapes) = continueWith [bound] rest in
+      (NLet var atom' rest', atomEscapes || restEscapes)
+    NDestructuringBind vars patternAddr subject@(NVar subjName _) rest ->
+      let (rest', restEscapes) = continueWith (map (\ (NVar n _) -> n) vars) rest in
+      (NDestructuringBind vars patternAddr subject rest', subjName == name || restEscapes)
+    NAtom atom ->
+      let (atom', escapes) = redirectAtom atom in
+      (NAtom atom', escapes)
+  where
+    continueWith boundNames rest
+      | name `elem` boundNames = (rest, False) -- later uses refer to the new binding
+      | any (`elem` freeVars) boundNames = (rest, True)
+      | otherwise = redirectCalls name freeVars arity funVar rest
+
+    redirectAtom atom =
+      case atom of
+        NFunAp (NVar f _) args
+          | f == name && length args == arity && not (any isClosure args) ->
+            (NFunAp funVar (map (`NVar` NLocalVar) freeVars ++ args), False)
+        _ ->
+          (atom, name `Set.member` atomUses atom)
+
+    isClosure (NVar n _) = n == name
@@ -0,0 +1,88 @@
+module Language.Dash.CodeGen.Liveness (
+  LivenessStep (..)
+, liveness
+, atomUses
+) where
+
+import qualified Data.Set              as Set
+import           Language.Dash.IR.Data (Name)
+import           Language.Dash.IR.Nst
+
+
+-- The body of a function is a chain of bindings that ends in an atom, so a single
+-- backwards pass over that chain tells us where every value is used for the last
+-- time. Nested functions have their own chain and are analysed when they are
+-- compiled.
+
+-- There is one step for every binding in the chain, and one for the final atom
+data LivenessStep = LivenessStep
+  { stepUses  :: Set.Set Name -- the names used by this step (they have to be in
+                              -- registers while the step is compiled)
+  , stepDefs  :: Set.Set Name -- the names bound by this step
+  , stepDying :: Set.Set Name -- the names that aren't needed after this step
+  } deriving (Show)
+
+
+-- Returns the names that are live when the chain starts, and the steps of the chain
+liveness :: NstExpr -> (Set.Set Name, [LivenessStep])
+liveness expr =
+  foldr addStep (Set.empty, []) (chain expr)
+  where
+    addStep (uses, defs) (liveOut, steps) =
+      let liveIn = (liveOut `Set.difference` defs) `Set.union` uses
+          dying = (uses `Set.union` defs) `Set.difference` liveOut
+      in
+      (liveIn, LivenessStep uses defs dying : steps)
+
+
+-- The uses and definitions of every step of the chain
+chain :: NstExpr -> [(Set.Set Name, Set.Set Name)]
+chain expr =
+  case expr of
+    NLet (NVar name _) atom body ->
+      (atomUses atom, Set.singleton name) : chain body
+    NDestructuringBind vars _ (NVar subject _) body ->
+      (Set.singleton subject, Set.fromList $ map varName vars) : chain body
+    NAtom atom ->
+      [(atomUses atom, Set.empty)]
+
+
+-- All names that the code for an atom reads from registers of the current function
+atomUses :: NstAtomicExpr -> Set.Set Name
+atomUses atom = Set.fromList $
+  case atom of
+    NNumber _              -> []
+    NPlainSymbol _         -> []
+    NCompoundSymbol fields _ -> map (varName . snd) fields
+    NString _              -> []
+    NVarExpr var           -> [varName var]
+    -- the free variables of a closure are copied into it when it is created
+    NLambda freeVars _ _   -> freeVars
+    -- the free variables of a match branch are passed by the match
+    NMatchBranch {}        -> []
+    NPrimOp primOp         -> map varName $ primOpArgs primOp
+    NPartAp funVar args    -> map varName $ funVar : args
+    NFunAp funVar args     -> map varName $ funVar : args
+    NModule _              -> []
+    NFieldLookup obj sym   -> [varName obj, varName sym]
+    NMatch _ subject _ branches ->
+      varName subject : concatMap (\ (freeVars, _, funVar) -> varName funVar : freeVars) branches
+
+
+primOpArgs :: NstPrimOp -> [NstVar]
+primOpArgs primOp =
+  case primOp of
+    NPrimOpAdd a b         -> [a, b]
+    NPrimOpSub a b         -> [a, b]
+    NPrimOpMul a b         -> [a, b]
+    NPrimOpDiv a b         -> [a, b]
+    NPrimOpEq a b          -> [a, b]
+    NPrimOpLessThan a b    -> [a, b]
+    NPrimOpGreaterThan a b -> [a, b]
+    NPrimOpOr a b          -> [a, b]
+    NPrimOpAnd a b         -> [a, b]
+    NPrimOpNot a           -> [a]
+
+
+varName :: NstVar -> Name
+varName (NVar name _) = name
@@ -37,7 +37,7 @@ data Constant =
   | CMatchVar Int -- Can only be used inside CMatchData
   | CFunction FuncAddr
   | CCompoundSymbolRef ConstAddr
-  deriving (Show, Eq)
+  deriving (Show, Eq, Ord)
 
 
 type ConstTable = [Constant] -- TODO move these out of here
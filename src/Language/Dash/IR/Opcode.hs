@@ -7,7 +7,8 @@ import Language.Dash.IR.Data
 
 
 data EncodedFunction = EncodedFunction {
-  cfOpcodes :: [Opcode]
+  cfName    :: Name -- empty for anonymous functions
+, cfOpcodes :: [Opcode]
 }
   deriving Show
 
@@ -41,9 +42,14 @@ data Opcode =
   | OpcPartAp Reg Reg Int    -- result, reg with function address (code), num args
   | OpcJmp Int
   | OpcMatch Reg Reg Reg     -- subj reg, pattern addr reg, start reg for captures
+  | OpcMatchSwitch Reg Reg Reg -- same as OpcMatch, but uses the match table to find
+                               -- the right pattern
   | OpcSetArg Int Reg Int
   | OpcSetClVal Reg Reg Int
-  | OpcFunHeader Int         -- arity
+  | OpcFunHeader Int Int     -- arity, frame size (number of registers used, plus the
+                             -- spill slots)
+  | OpcSpill Reg Int         -- value reg, spill slot
+  | OpcReload Reg Int        -- result reg, spill slot
   | OpcEq Reg Reg Reg
   | OpcCopySym Reg Reg
   | OpcSetSymField Reg Reg Int -- reg with heap symbol, reg of new value, index
@@ -60,5 +66,36 @@ data Opcode =
   | OpcNot Reg Reg
   | OpcGetField Reg Reg Reg
   | OpcConvert Reg Reg Reg   -- result, source, type (symbol)
-  deriving Show
+  | OpcStrConcat Reg Reg Reg -- result reg, string reg, string reg
+  | OpcSubStr Reg Reg Reg    -- result reg, string reg, start index reg (the length
+                             -- is in the register after the start index)
+  | OpcStrCmp Reg Reg Reg    -- result reg (-1, 0 or 1), string reg, string reg
+  | OpcStrFind Reg Reg Reg   -- result reg (index or -1), string reg, reg with string to find
+  | OpcMapNew Reg            -- result reg
+  | OpcMapGet Reg Reg Reg    -- result reg (holds the value for a missing key), map reg, key reg
+  | OpcMapPut Reg Reg Reg    -- result reg (holds the value to insert), map reg, key reg
+  | OpcMapDel Reg Reg Reg    -- result reg, map reg, key reg
+  | OpcMapSize Reg Reg       -- result reg, map reg
+  | OpcMapEntry Reg Reg Reg  -- result reg for the key (the value goes into the register
+                             -- after it), map reg, index reg
+  | OpcArrayNew Reg Reg      -- result reg (holds the value for all elements), length reg
+  | OpcArrayGet Reg Reg Reg  -- result reg, array reg, index reg
+  | OpcArraySet Reg Reg Reg  -- array reg (changed in place, only for new arrays), index reg,
+                             -- value reg
+  | OpcArrayLen Reg Reg      -- result reg, array reg
+  | OpcArraySlice Reg Reg Reg -- result reg, array reg, start reg (the length is in the
+                              -- register after it)
+
+-- Superinstructions. The code generator doesn't use them, they are generated by the
+-- assembler (see peephole in Assembler.hs)
+  | OpcAddI Reg Reg Reg Int  -- result reg, number reg, reg for the constant, constant
+  | OpcSubI Reg Reg Reg Int  -- result reg, number reg, reg for the constant, constant
+  | OpcJmpLT Reg Reg Reg Int -- result reg, number reg, number reg, jump offset if true
+  | OpcJmpGT Reg Reg Reg Int
+  | OpcJmpEq Reg Reg Reg Int
+  | OpcJmpMatch Reg ConstAddr -- subj reg, pattern addr (the patterns can't capture
+                              -- anything)
+  | OpcRetI Reg Int          -- result reg, number
+  | OpcRetPS Reg SymId       -- result reg, plain symbol
+  deriving (Show, Eq)
 
@@ -1,17 +1,35 @@
 module Language.Dash.Limits (
   maxRegisters
+, maxSpillSlots
 , minInteger
 , maxInteger
+, minNumber
+, maxNumber
 , maxSymbols
 , intBias
+, minSmallInteger
+, maxSmallInteger
+, smallIntBias
 ) where
 
-maxRegisters, minInteger, maxInteger, maxSymbols, intBias :: Int
+maxRegisters, maxSpillSlots, minInteger, maxInteger, minNumber, maxNumber, maxSymbols, intBias :: Int
+minSmallInteger, maxSmallInteger, smallIntBias :: Int
 maxRegisters = 32
+-- The spill slots of a function are counted in the 15 bits of its header that are
+-- left next to the arity (see vm/opcodes.h)
+maxSpillSlots = 2 ^ (15 :: Int) - 1
 maxSymbols = maxInteger
 
+-- Integer literals are loaded as biased immediate values (see Assembler.hs), so
+-- they have to fit into the 21 bits of an instruction. Numbers in the vm are 60 bit.
 maxInteger = 0xFFFFF
 minInteger = -0xFFFFF
 intBias = maxInteger
 
+-- Superinstructions with three registers only have 11 bits left for a number
+maxSmallInteger = 0x3FF
+minSmallInteger = -0x3FF
+smallIntBias = maxSmallInteger
 
+maxNumber = 2 ^ (59 :: Int) - 1
+minNumber = -(2 ^ (59 :: Int))
@@ -23,9 +23,11 @@ import           Control.Monad
 import           Control.Monad.Except
 import           Control.Monad.Identity
 import           Control.Monad.State.Strict               hiding (state)
+import           Data.Foldable                            (toList)
 import           Data.Function                            (on)
 import           Data.List
 import qualified Data.Map                                 as Map
+import qualified Data.Sequence                            as Seq
 import           Language.Dash.BuiltIn.BuiltInDefinitions (builtInSymbols)
 import           Language.Dash.Error.Error                (CompilationError (..))
 import           Language.Dash.IR.Data
@@ -38,7 +40,7 @@ type Norm a = NormT a Identity
 
 data NormState = NormState
   { symbolNames    :: Map.Map String SymId
-  , constTable     :: ConstTable -- TODO rename ConstTable to DataTable (or ConstPool)
+  , constants      :: Seq.Seq Constant -- TODO rename ConstTable to DataTable (or ConstPool)
   , contexts       :: [Context] -- head is current context
 
   -- TODO for this we *really* need unique names
@@ -51,7 +53,7 @@ data NormState = NormState
 emptyNormState :: NormState
 emptyNormState = NormState
   { symbolNames = Map.fromList builtInSymbols
-  , constTable = []
+  , constants = Seq.empty
   , contexts = []
   , arities = Map.empty
   , varNameCounter = 0
@@ -251,13 +253,15 @@ getSymbolNames = map fst . sortBy (compare `on` snd) . Map.toList . symbolNames
 --- Constants
 -- TODO Split this into separate module? Together with constTable type ?
 
+constTable :: NormState -> ConstTable
+constTable = toList . constants
+
 addConstant :: Constant -> Norm ConstAddr
 addConstant c = do
   state <- get
-  let cTable = constTable state
-  let nextAddr = mkConstAddr $ length cTable
-  let constTable' = cTable ++ [c] -- TODO can we cons + reverse?
-  put $ state { constTable = constTable' }
+  let cTable = constants state
+  let nextAddr = mkConstAddr $ Seq.length cTable
+  put $ state { constants = cTable Seq.|> c }
   return nextAddr
 
 
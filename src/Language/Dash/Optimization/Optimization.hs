@@ -0,0 +1,457 @@
+module Language.Dash.Optimization.Optimization (
+  optimize
+) where
+
+import           Control.Monad.State.Strict
+import qualified Data.Map                                 as Map
+import           Data.Maybe                               (fromJust, fromMaybe)
+import qualified Data.Set                                 as Set
+import           Language.Dash.BuiltIn.BuiltInDefinitions (builtInFunctions,
+                                                           builtInSymbols,
+                                                           falseSymbolName,
+                                                           trueSymbolName)
+import           Language.Dash.CodeGen.Liveness           (atomUses)
+import           Language.Dash.IR.Data
+import           Language.Dash.IR.Nst
+import           Language.Dash.Limits                     (maxInteger, minInteger)
+
+
+{-
+
+Optimization
+~~~~~~~~~~~~
+
+This module rewrites the normalized form (Nst) before it is compiled. It is only
+used when the optimizer is switched on (`dash -O`). There are two passes:
+
+The first pass goes through the code in order and remembers the values of all
+bindings that are known at compile time (numbers, plain symbols and functions without
+free variables). With these it
+
+  * folds primops over known values, e.g. `5 * 7` becomes `35`
+  * turns a match on a known number or symbol into a call of the selected branch
+  * inlines small, non-recursive functions at call sites where the function is known.
+    These are the same call sites that the code generator compiles as direct calls
+    (see `canBeCalledDirectly` in CodeGen.hs).
+
+The second pass goes through the code backwards and removes all bindings that are
+never used and that don't have any effect. It removes, for example, the branches that
+the first pass made unreachable and all helper functions of the preamble that a
+program doesn't use.
+
+
+Names
+~~~~~
+
+The code generator resolves constants by their names (see
+`getCompileTimeConstInSurroundingScopes`), and names can be bound more than once in a
+program. So we only follow a name across function boundaries if it is bound exactly
+once. The bindings of an inlined body get fresh names.
+
+-}
+
+
+data KnownValue =
+    KnownNumber Int
+  | KnownSymbol SymId
+  | KnownFunction [Name] NstExpr -- Params Body
+
+data Env = Env
+  { knownValues   :: Map.Map Name KnownValue
+  , bindingCounts :: Map.Map Name Int
+  , constTable    :: ConstTable
+  , inlineDepth   :: Int
+  }
+
+-- The state is the number of the next fresh variable
+type Opt a = State Int a
+
+
+-- Functions with more bindings than this are not inlined
+maxInlinedBindings :: Int
+maxInlinedBindings = 8
+
+-- Stops us from inlining mutually recursive functions forever
+maxInlineDepth :: Int
+maxInlineDepth = 4
+
+
+optimize :: NstExpr -> ConstTable -> NstExpr
+optimize expr ctable =
+  let env = Env { knownValues = Map.empty
+                , bindingCounts = countBindings expr
+                , constTable = ctable
+                , inlineDepth = 0
+                } in
+  let optimized = evalState (optimizeExpr env expr) 0 in
+  fst $ eliminateDeadBindings optimized
+
+
+-- Constant folding, match selection and inlining
+
+optimizeExpr :: Env -> NstExpr -> Opt NstExpr
+optimizeExpr env expr =
+  case expr of
+    NLet var@(NVar name _) atom body -> do
+      -- a function that refers to its own name doesn't mean an older binding
+      atom' <- optimizeAtom (forget [name] env) atom
+      inlined <- inlineCall env atom'
+      case inlined of
+        Just inlinedBody ->
+          continueAfter env inlinedBody $ \ env' result -> optimizeLet env' var result body
+        Nothing ->
+          optimizeLet env var atom' body
+    NDestructuringBind vars patternAddr subject body ->
+      NDestructuringBind vars patternAddr subject <$>
+        optimizeExpr (forget (map varName vars) env) body
+    NAtom atom -> do
+      atom' <- optimizeAtom env atom
+      inlined <- inlineCall env atom'
+      case inlined of
+        Just inlinedBody ->
+          continueAfter env inlinedBody $ \ _ result -> return $ NAtom result
+        Nothing ->
+          return $ NAtom atom'
+  where
+    optimizeLet env' var@(NVar name _) atom body =
+      NLet var atom <$> optimizeExpr (learn name atom env') body
+
+
+-- Goes over the (already optimized) bindings of an inlined body and passes the result
+-- of the body on to the code that follows the call
+continueAfter :: Env -> NstExpr -> (Env -> NstAtomicExpr -> Opt NstExpr) -> Opt NstExpr
+continueAfter env expr k =
+  case expr of
+    NLet var@(NVar name _) atom body ->
+      NLet var atom <$> continueAfter (learn name atom env) body k
+    NDestructuringBind vars patternAddr subject body ->
+      NDestructuringBind vars patternAddr subject <$>
+        continueAfter (forget (map varName vars) env) body k
+    NAtom atom ->
+      k env atom
+
+
+optimizeAtom :: Env -> NstAtomicExpr -> Opt NstAtomicExpr
+optimizeAtom env atom =
+  case atom of
+    -- free variables keep the values they have outside of the function
+    NLambda freeVars params body ->
+      NLambda freeVars params <$> optimizeExpr (forget params env) body
+    NMatchBranch freeVars matchedVars body ->
+      NMatchBranch freeVars matchedVars <$> optimizeExpr (forget matchedVars env) body
+    NModule fields ->
+      NModule <$> forM fields (\ (sym, name, field) -> do
+                                  field' <- optimizeAtom (forget [name] env) field
+                                  return (sym, name, field'))
+    NPrimOp primOp ->
+      return $ fromMaybe atom (foldPrimOp env primOp)
+    NMatch _ subject patternAddr branches ->
+      return $ fromMaybe atom (selectBranch env subject patternAddr branches)
+    _ ->
+      return atom
+
+
+inlineCall :: Env -> NstAtomicExpr -> Opt (Maybe NstExpr)
+inlineCall env atom =
+  case atom of
+    NFunAp funVar args | inlineDepth env < maxInlineDepth ->
+      case lookupKnown env funVar of
+        Just (KnownFunction params body) | length params == length args -> do
+          body' <- renameInlinedBody (Map.fromList $ zip params args) body
+          Just <$> optimizeExpr env { inlineDepth = inlineDepth env + 1 } body'
+        _ -> return Nothing
+    _ -> return Nothing
+
+
+-- Replaces the parameters of an inlined body with the arguments of the call, and
+-- gives all bindings in the body fresh names
+renameInlinedBody :: Map.Map Name NstVar -> NstExpr -> Opt NstExpr
+renameInlinedBody renamings expr =
+  case expr of
+    NLet (NVar name varType) atom body -> do
+      index <- get
+      put (index + 1)
+      let var' = NVar ("$inlined" ++ show index) varType
+      body' <- renameInlinedBody (Map.insert name var' renamings) body
+      return $ NLet var' (renameVars atom) body'
+    NAtom atom ->
+      return $ NAtom (renameVars atom)
+    -- not inlined (see canInline)
+    NDestructuringBind {} ->
+      return expr
+  where
+    rename var@(NVar name _) = Map.findWithDefault var name renamings
+    renameVars atom =
+      case atom of
+        NCompoundSymbol fields cAddr -> NCompoundSymbol (map (fmap rename) fields) cAddr
+        NVarExpr var                 -> NVarExpr (rename var)
+        NPrimOp primOp               -> NPrimOp (mapPrimOpArgs rename primOp)
+        NPartAp funVar args          -> NPartAp (rename funVar) (map rename args)
+        NFunAp funVar args           -> NFunAp (rename funVar) (map rename args)
+        NFieldLookup obj sym         -> NFieldLookup (rename obj) (rename sym)
+        _                            -> atom
+
+
+foldPrimOp :: Env -> NstPrimOp -> Maybe NstAtomicExpr
+foldPrimOp env primOp =
+  case primOp of
+    NPrimOpAdd a b -> arithmetic (+) a b
+    NPrimOpSub a b -> arithmetic (-) a b
+    NPrimOpMul a b -> arithmetic (*) a b
+    NPrimOpDiv a b -> do
+      (x, y) <- numbers a b
+      if y == 0 then Nothing else numberAtom (x `quot` y)
+    NPrimOpEq a b -> do
+      x <- lookupKnown env a
+      y <- lookupKnown env b
+      case (x, y) of
+        (KnownNumber m, KnownNumber n) -> Just $ boolAtom (m == n)
+        (KnownSymbol s, KnownSymbol t) -> Just $ boolAtom (s == t)
+        (KnownNumber _, KnownSymbol _) -> Just $ boolAtom False
+        (KnownSymbol _, KnownNumber _) -> Just $ boolAtom False
+        _                              -> Nothing
+    NPrimOpLessThan a b ->
+      (\ (x, y) -> boolAtom (x < y)) <$> numbers a b
+    NPrimOpGreaterThan a b ->
+      (\ (x, y) -> boolAtom (x > y)) <$> numbers a b
+    -- like in the vm, everything that isn't true counts as false
+    NPrimOpAnd a b ->
+      case (truth a, truth b) of
+        (Just x, Just y) -> Just $ boolAtom (x && y)
+        (Just False, _)  -> Just $ boolAtom False
+        (_, Just False)  -> Just $ boolAtom False
+        _                -> Nothing
+    NPrimOpOr a b ->
+      case (truth a, truth b) of
+        (Just x, Just y) -> Just $ boolAtom (x || y)
+        (Just True, _)   -> Just $ boolAtom True
+        (_, Just True)   -> Just $ boolAtom True
+        _                -> Nothing
+    NPrimOpNot a ->
+      (boolAtom . not) <$> truth a
+  where
+    arithmetic op a b = do
+      (x, y) <- numbers a b
+      numberAtom (x `op` y)
+    numbers a b = do
+      x <- knownNumber a
+      y <- knownNumber b
+      return (x, y)
+    knownNumber v =
+      case lookupKnown env v of
+        Just (KnownNumber n) -> Just n
+        _                    -> Nothing
+    truth v =
+      case lookupKnown env v of
+        Just (KnownNumber _)   -> Just False
+        Just (KnownSymbol sid) -> Just (sid == trueSymbol)
+        _                      -> Nothing
+    -- the result has to fit into a literal (and the vm reports overflows at runtime)
+    numberAtom n =
+      if n < minInteger || n > maxInteger then Nothing else Just (NNumber n)
+
+
+-- A match on a known value is replaced by a call to the branch that matches. The call
+-- passes the same arguments as the code for the match would.
+selectBranch :: Env -> NstVar -> ConstAddr -> [([Name], [Name], NstVar)] -> Maybe NstAtomicExpr
+selectBranch env subject patternAddr branches = do
+  value <- lookupKnown env subject
+  patterns <- case constTable env !! constAddrToInt patternAddr of
+                CMatchData pats -> Just pats
+                _               -> Nothing
+  (pat, (freeVars, _, branchVar)) <- firstMatch value (zip patterns branches)
+  let captures = case pat of
+                   CMatchVar _ -> [subject]
+                   _           -> []
+  return $ NFunAp branchVar (map (`NVar` NLocalVar) freeVars ++ captures)
+  where
+    -- gives up if it can't tell whether a pattern matches
+    firstMatch _ [] = Nothing
+    firstMatch value ((pat, branch) : rest) = do
+      matches <- patternMatches value pat
+      if matches then Just (pat, branch) else firstMatch value rest
+    patternMatches value pat =
+      case (pat, value) of
+        (CMatchVar _, _)                     -> Just True
+        (CNumber n, KnownNumber m)           -> Just (n == m)
+        (CNumber _, KnownSymbol _)           -> Just False
+        (CPlainSymbol s, KnownSymbol t)      -> Just (s == t)
+        (CPlainSymbol _, KnownNumber _)      -> Just False
+        (CCompoundSymbol {}, KnownNumber _)  -> Just False
+        (CCompoundSymbol {}, KnownSymbol _)  -> Just False
+        _                                    -> Nothing
+
+
+-- Known values
+
+learn :: Name -> NstAtomicExpr -> Env -> Env
+learn name atom env =
+  case knownValue of
+    Just value -> env { knownValues = Map.insert name value (knownValues env) }
+    Nothing    -> forget [name] env
+  where
+    knownValue =
+      case atom of
+        NNumber n       -> Just (KnownNumber n)
+        NPlainSymbol sid -> Just (KnownSymbol sid)
+        NVarExpr var    -> lookupKnown env var
+        NLambda [] params body | canInline env name body ->
+          Just (KnownFunction params body)
+        -- match branches get their free variables before their captures
+        NMatchBranch freeVars matchedVars body | canInline env name body ->
+          Just (KnownFunction (freeVars ++ matchedVars) body)
+        _ -> Nothing
+
+
+forget :: [Name] -> Env -> Env
+forget names env =
+  env { knownValues = foldr Map.delete (knownValues env) names }
+
+
+-- Local variables and parameters always refer to the latest binding of their name in
+-- this function. Everything else might refer to a binding that we haven't seen yet.
+lookupKnown :: Env -> NstVar -> Maybe KnownValue
+lookupKnown env (NVar name varType) =
+  if isLocal varType || isUnique env name
+    then Map.lookup name (knownValues env)
+    else Nothing
+  where
+    isLocal NLocalVar = True
+    isLocal NFunParam = True
+    isLocal _         = False
+
+
+isUnique :: Env -> Name -> Bool
+isUnique env name =
+  Map.findWithDefault 0 name (bindingCounts env) <= 1
+
+
+-- We only inline plain chains of bindings. An inlined function mustn't create any
+-- functions itself, and all constants it uses must still mean the same at the call site.
+canInline :: Env -> Name -> NstExpr -> Bool
+canInline env name body =
+  case chainAtoms body of
+    Just atoms -> length atoms <= maxInlinedBindings + 1
+                  && all isSimple atoms
+                  && all (name `Set.notMember`) (map atomUses atoms)
+                  && all (isUnique env) (concatMap constantNames atoms)
+    Nothing -> False
+  where
+    isSimple atom =
+      case atom of
+        NLambda {}      -> False
+        NMatchBranch {} -> False
+        NMatch {}       -> False
+        NModule _       -> False
+        _               -> True
+    constantNames atom =
+      case atom of
+        NVarExpr (NVar constName NConstant) -> [constName]
+        _                                   -> []
+
+
+chainAtoms :: NstExpr -> Maybe [NstAtomicExpr]
+chainAtoms expr =
+  case expr of
+    NLet _ atom body         -> (atom :) <$> chainAtoms body
+    NAtom atom               -> Just [atom]
+    NDestructuringBind {}    -> Nothing
+
+
+-- How often every name is bound in the whole program (built-in functions count as
+-- bound once)
+countBindings :: NstExpr -> Map.Map Name Int
+countBindings expr =
+  Map.fromListWith (+) $ map (\ name -> (name, 1)) $ bifNames ++ exprBindings expr
+  where
+    bifNames = map (\ (name, _, _) -> name) builtInFunctions
+    exprBindings e =
+      case e of
+        NLet var atom body                -> varName var : atomBindings atom ++ exprBindings body
+        NDestructuringBind vars _ _ body  -> map varName vars ++ exprBindings body
+        NAtom atom                        -> atomBindings atom
+    atomBindings atom =
+      case atom of
+        NLambda _ params body       -> params ++ exprBindings body
+        NMatchBranch _ params body  -> params ++ exprBindings body
+        NModule fields              -> concatMap (\ (_, name, field) -> name : atomBindings field) fields
+        _                           -> []
+
+
+-- Dead bindings
+
+-- Returns the optimized expression and all names that it uses (including the names
+-- used by nested functions)
+eliminateDeadBindings :: NstExpr -> (NstExpr, Set.Set Name)
+eliminateDeadBindings expr =
+  case expr of
+    NLet var@(NVar name _) atom body ->
+      let (body', usedLater) = eliminateDeadBindings body in
+      if hasNoEffect atom && name `Set.notMember` usedLater
+        then (body', usedLater)
+        else let (atom', used) = eliminateInAtom atom in
+             (NLet var atom' body', used `Set.union` usedLater)
+    NDestructuringBind vars patternAddr subject body ->
+      let (body', usedLater) = eliminateDeadBindings body in
+      (NDestructuringBind vars patternAddr subject body', Set.insert (varName subject) usedLater)
+    NAtom atom ->
+      let (atom', used) = eliminateInAtom atom in
+      (NAtom atom', used)
+
+
+eliminateInAtom :: NstAtomicExpr -> (NstAtomicExpr, Set.Set Name)
+eliminateInAtom atom =
+  case atom of
+    NLambda freeVars params body ->
+      let (body', used) = eliminateDeadBindings body in
+      (NLambda freeVars params body', Set.fromList freeVars `Set.union` used)
+    NMatchBranch freeVars matchedVars body ->
+      let (body', used) = eliminateDeadBindings body in
+      (NMatchBranch freeVars matchedVars body', Set.fromList freeVars `Set.union` used)
+    NModule fields ->
+      let fields' = map (\ (sym, name, field) -> (sym, name, eliminateInAtom field)) fields in
+      ( NModule $ map (\ (sym, name, (field, _)) -> (sym, name, field)) fields'
+      , Set.unions $ map (\ (_, _, (_, used)) -> used) fields')
+    _ ->
+      (atom, atomUses atom)
+
+
+-- Function calls and matches can run any code, and primops and field lookups can
+-- fail at runtime
+hasNoEffect :: NstAtomicExpr -> Bool
+hasNoEffect atom =
+  case atom of
+    NFunAp {}       -> False
+    NMatch {}       -> False
+    NPrimOp _       -> False
+    NFieldLookup {} -> False
+    _               -> True
+
+
+-- Helpers
+
+mapPrimOpArgs :: (NstVar -> NstVar) -> NstPrimOp -> NstPrimOp
+mapPrimOpArgs f primOp =
+  case primOp of
+    NPrimOpAdd a b         -> NPrimOpAdd (f a) (f b)
+    NPrimOpSub a b         -> NPrimOpSub (f a) (f b)
+    NPrimOpMul a b         -> NPrimOpMul (f a) (f b)
+    NPrimOpDiv a b         -> NPrimOpDiv (f a) (f b)
+    NPrimOpEq a b          -> NPrimOpEq (f a) (f b)
+    NPrimOpLessThan a b    -> NPrimOpLessThan (f a) (f b)
+    NPrimOpGreaterThan a b -> NPrimOpGreaterThan (f a) (f b)
+    NPrimOpOr a b          -> NPrimOpOr (f a) (f b)
+    NPrimOpAnd a b         -> NPrimOpAnd (f a) (f b)
+    NPrimOpNot a           -> NPrimOpNot (f a)
+
+
+boolAtom :: Bool -> NstAtomicExpr
+boolAtom b = NPlainSymbol $ if b then trueSymbol else falseSymbol
+
+trueSymbol, falseSymbol :: SymId
+trueSymbol = fromJust $ lookup trueSymbolName builtInSymbols
+falseSymbol = fromJust $ lookup falseSymbolName builtInSymbols
+
+
+varName :: NstVar -> Name
+varName (NVar name _) = name
@@ -1,16 +1,26 @@
 {
 module Language.Dash.Parser.Lexer (
   lex
+, lexBytes
 , Token(..)
 ) where
 
 import Prelude                                   hiding (lex)
+import qualified Data.ByteString                 as BS
+import qualified Data.ByteString.Builder         as BB
+import qualified Data.ByteString.Lazy            as BL
+import Data.Int                                  (Int64)
+import qualified Data.Text.Encoding.Error        as TE
+import qualified Data.Text.Lazy                  as TL
+import qualified Data.Text.Lazy.Encoding         as TLE
 import Language.Dash.BuiltIn.BuiltInDefinitions (bifStringConcatOperator, bifToStringName)
 import Language.Dash.Error.Error (CompilationError(..))
 
 }
 
-%wrapper "monadUserState"
+-- The lexer works on UTF-8 encoded bytes, so that source files don't have to be
+-- turned into a String first
+%wrapper "monadUserState-bytestring"
 
 $newl       = [\n\r]
 $alphanum   = [a-zA-Z0-9'_]
@@ -80,20 +90,30 @@ tokens :-
 
 
 lex :: String -> Either CompilationError [Token]
-lex input = case (runAlex input loop) of
+lex = lexLazyBytes . BB.toLazyByteString . BB.stringUtf8
+
+lexBytes :: BS.ByteString -> Either CompilationError [Token]
+lexBytes = lexLazyBytes . BL.fromStrict
+
+lexLazyBytes :: BL.ByteString -> Either CompilationError [Token]
+lexLazyBytes input = case (runAlex input loop) of
               Right a -> expandRawStrings a
               Left s -> Left $ ParsingError s
 
 
-mkTok :: Token -> AlexInput -> Int -> Alex Token
+mkTok :: Token -> AlexInput -> Int64 -> Alex Token
 mkTok t _ _ = return t
 
-mkTokS :: (String -> Either CompilationError Token) -> AlexInput -> Int -> Alex Token
-mkTokS f (_, _, _, str) len =
-  case f (take len str) of
+-- Only the text of tokens that need it is decoded
+mkTokS :: (String -> Either CompilationError Token) -> AlexInput -> Int64 -> Alex Token
+mkTokS f (_, _, str, _) len =
+  case f (tokenText $ BL.take len str) of
     Left err -> alexError $ show err
     Right token -> return token
 
+tokenText :: BL.ByteString -> String
+tokenText = TL.unpack . TLE.decodeUtf8With TE.lenientDecode
+
 alexEOF :: Alex Token
 alexEOF = return TEOF
 
@@ -105,28 +125,30 @@ convertEscapeSequences s = do
     [InterpString s] -> return $ TString s
     _                -> return $ TRawString parts
   where
+    -- The characters of the current part are collected in reverse order
 
     conv' :: String -> String -> [InterpStringPart] -> Either CompilationError [InterpStringPart]
     conv' (c:rest@(c1:cs)) acc parts =
       case c of
         '\\' -> parseEscapeChar c1 cs acc parts
-        _ -> conv' rest (acc ++ [c]) parts
-    conv' (c:[]) acc parts = let lastStringPart = acc ++ [c] in
+        _ -> conv' rest (c : acc) parts
+    conv' (c:[]) acc parts = let lastStringPart = reverse (c : acc) in
                              return $ parts ++ [InterpString lastStringPart]
-    conv' [] acc parts = return $ parts ++ [InterpString acc]
+    conv' [] acc parts = return $ parts ++ [InterpString (reverse acc)]
 
     parseEscapeChar ec cs acc parts =
       case ec of
-        '\\' -> conv' cs (acc ++ "\\") parts -- "
-        'n' -> conv' cs (acc ++ "\n") parts
-        '"' -> conv' cs (acc ++ "\"") parts
-        't' -> conv' cs (acc ++ "\t") parts
+        '\\' -> conv' cs ('\\' : acc) parts
+        'n' -> conv' cs ('\n' : acc) parts
+        '"' -> conv' cs ('"' : acc) parts
+        't' -> conv' cs ('\t' : acc) parts
         '(' -> do
                   (interpExpr, rest) <- consumeInterpolatedExpression cs
+                  let parts' = parts ++ [InterpString (reverse acc), InterpExpr interpExpr]
                   if null rest
-                    then return $ parts ++ [InterpString acc, InterpExpr interpExpr]
-                    else conv' rest "" $ parts ++ [InterpString acc, InterpExpr interpExpr]
-        other -> conv' cs (acc ++ [other]) parts
+                    then return parts'
+                    else conv' rest "" parts'
+        other -> conv' cs (other : acc) parts
 
     consumeInterpolatedExpression :: String -> Either CompilationError (String, String)
     consumeInterpolatedExpression str =
@@ -135,11 +157,11 @@ convertEscapeSequences s = do
               "" -> Left $ ParsingError ("Malformed string interpolation: " ++ str)  -- TODO add better error handling
               ch:rest ->
                     case ch of
-                      '(' -> consume (acc ++ "(") rest (nparen + 1)
+                      '(' -> consume ('(' : acc) rest (nparen + 1)
                       ')' -> if nparen == 1
-                               then Right $ (acc, rest)
-                               else consume (acc ++ ")") rest (nparen - 1)
-                      _   -> consume (acc ++ [ch]) rest nparen
+                               then Right $ (reverse acc, rest)
+                               else consume (')' : acc) rest (nparen - 1)
+                      _   -> consume (ch : acc) rest nparen
       in
       consume "" str 1
 
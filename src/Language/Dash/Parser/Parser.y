@@ -349,8 +349,9 @@ returnE = return
 failE :: String -> E a
 failE err = Left $ ParsingError err
 
+-- Only the first few of the remaining tokens, which can be a lot in large files
 parseError :: [Token] -> E a
-parseError ts = failE $ (show ts)
+parseError ts = failE $ (show $ take 20 ts)
 
 varName :: Expr -> E String
 varName (Var s) = Right s
@@ -1,6 +1,7 @@
 module Language.Dash.VM.DataEncoding (
   VMValue(..)
 , decode
+, decodeFromInstance
 , encodeNumber
 , encodePlainSymbol
 , encodeCompoundSymbolRef
@@ -13,42 +14,93 @@ module Language.Dash.VM.DataEncoding (
 , encodeStringRef
 , encodeStringHeader
 , encodeStringChunk
+, hashString
+, charsPerStringChunk
 , encodeFunctionRef
 ) where
 
 import           Data.Bits
+import           Data.Int
+import           Data.List.Split         (chunksOf)
+import qualified Data.Vector             as V
+import qualified Data.Vector.Storable    as VS
 import           Data.Word
-import           Foreign.C.String        (castCharToCChar, castCCharToChar)
+import           Foreign.C.String        (castCCharToChar, castCharToCChar)
+import           Foreign.Marshal.Array   (advancePtr, peekArray)
+import           Foreign.Ptr
+import           Foreign.Storable        (peekElemOff)
 import           Language.Dash.Limits
 import           Language.Dash.IR.Data
 import           Language.Dash.VM.Types
-import           Language.Dash.VM.VM     (getVMHeapArray, getVMHeapValue)
-
-
-decode :: VMWord -> [Word32] -> SymbolNameList -> IO VMValue
-decode w ctable symNames =
+import           Language.Dash.VM.VM     (VMInstance, instanceHeapBase, vmHeapBase)
+
+
+-- Decoding reads the heap through a single pointer. Nothing is allocated while we
+-- decode, so heap objects stay where they are.
+data Decoder = Decoder {
+  decHeap       :: Ptr VMWord
+, decConstTable :: VMConstTable
+, decSymNames   :: V.Vector String
+}
+
+-- Decodes a value that was returned by vm_execute
+decode :: VMWord -> VMConstTable -> SymbolNameList -> IO VMValue
+decode w ctable symNames = do
+  heap <- vmHeapBase
+  decodeWith (Decoder heap ctable (V.fromList symNames)) w
+
+-- Decodes a value that lives on the heap of a vm instance
+decodeFromInstance :: VMInstance -> VMWord -> VMConstTable -> SymbolNameList -> IO VMValue
+decodeFromInstance vm w ctable symNames = do
+  heap <- instanceHeapBase vm
+  decodeWith (Decoder heap ctable (V.fromList symNames)) w
+
+decodeWith :: Decoder -> VMWord -> IO VMValue
+decodeWith dec w =
   let tag = getTag w in
   let value = getValue w in
   decode' tag value
-  where decode' t v | t==tagNumber                = return $ VMNumber (fromIntegral v - intBias)
-                    | t==tagPlainSymbol           = return $ VMSymbol (symNames !! fromIntegral v) []
-                    | t==tagCompoundSymbol        = decodeCompoundSymbol v ctable symNames
-                    | t==tagDynamicCompoundSymbol = decodeDynamicCompoundSymbol v ctable symNames
+  where decode' t v | t==tagNumber                = return $ VMNumber (decodeNumber v)
+                    | t==tagPlainSymbol           = return $ VMSymbol (symbolName dec $ fromIntegral v) []
+                    | t==tagCompoundSymbol        = decodeCompoundSymbol dec v
+                    | t==tagDynamicCompoundSymbol = decodeDynamicCompoundSymbol dec v
                     | t==tagClosure               = return VMClosure
                     | t==tagFunction              = return VMFunction
-                    | t==tagString                = decodeConstantString v ctable
-                    | t==tagDynamicString         = decodeDynamicString v
-                    | t==tagOpaqueSymbol          = decodeOpaqueSymbol v ctable symNames
+                    | t==tagString                = decodeConstantString dec v
+                    | t==tagDynamicString         = decodeDynamicString dec v
+                    | t==tagRope                  = decodeRope dec v
+                    | t==tagOpaqueSymbol          = decodeOpaqueSymbol dec v
+                    | t==tagMap                   = decodeMap dec v
+                    | t==tagArray                 = decodeArray dec v
                     | otherwise                   = error $ "Unknown tag " ++ show t
 
+symbolName :: Decoder -> Int -> String
+symbolName dec symId = decSymNames dec V.! symId
+
+constant :: Decoder -> VMWord -> VMWord
+constant dec addr = decConstTable dec VS.! fromIntegral addr
+
+constants :: Decoder -> VMWord -> Int -> [VMWord]
+constants dec addr count = VS.toList $ VS.slice (fromIntegral addr) count (decConstTable dec)
+
+heapValue :: Decoder -> VMWord -> IO VMWord
+heapValue dec addr = peekElemOff (decHeap dec) (fromIntegral addr)
+
+heapValues :: Decoder -> VMWord -> Int -> IO [VMWord]
+heapValues dec addr count = peekArray count (decHeap dec `advancePtr` fromIntegral addr)
+
 
 -- Number
 
+-- Numbers are 60 bit two's complement integers, so negative numbers only need to
+-- be cropped to the value bits
 encodeNumber :: Int -> VMWord
-encodeNumber = makeVMValue tagNumber . ensureNumberRange . bias . fromIntegral
+encodeNumber = makeVMValue tagNumber . fromIntegral . ensureNumberRange
 
-bias :: Int -> VMWord
-bias n = fromIntegral $ n + intBias
+decodeNumber :: VMWord -> Int
+decodeNumber v =
+  let signExtended = (fromIntegral (v `shiftL` tagBits) :: Int64) `shiftR` tagBits in
+  fromIntegral signExtended
 
 
 -- Function
@@ -89,51 +141,62 @@ decodeCompoundSymbolHeader v =
      fromIntegral $ value .&. low14Bits)
 
 
-decodeCompoundSymbol :: VMWord -> [VMWord] -> SymbolNameList -> IO VMValue
-decodeCompoundSymbol addr ctable symNames = do
-  let subCTable = drop (fromIntegral addr) ctable
-  let (symId, nArgs) = decodeCompoundSymbolHeader (head subCTable)
-  decoded <- mapM (\v -> decode v ctable symNames)
-                  (take (fromIntegral nArgs) $ tail subCTable)
-  let symName = symNames !! symIdToInt symId
-  return $ VMSymbol symName decoded
+decodeCompoundSymbol :: Decoder -> VMWord -> IO VMValue
+decodeCompoundSymbol dec addr = do
+  let (symId, nArgs) = decodeCompoundSymbolHeader (constant dec addr)
+  decoded <- mapM (decodeWith dec) (constants dec (addr + 1) nArgs)
+  return $ VMSymbol (symbolName dec $ symIdToInt symId) decoded
 
 
-decodeDynamicCompoundSymbol :: VMWord -> [VMWord] -> SymbolNameList -> IO VMValue
-decodeDynamicCompoundSymbol addr ctable symNames = do
-  symHeader <- getVMHeapValue addr
+decodeDynamicCompoundSymbol :: Decoder -> VMWord -> IO VMValue
+decodeDynamicCompoundSymbol dec addr = do
+  symHeader <- heapValue dec addr
   let (symId, count) = decodeCompoundSymbolHeader symHeader
-  let symName = symNames !! symIdToInt symId
-  values <- getVMHeapArray (addr + compoundSymbolHeaderLength) count
-  decoded <- mapM (\v -> decode v ctable symNames) values
-  return $ VMSymbol symName decoded
+  values <- heapValues dec (addr + compoundSymbolHeaderLength) count
+  decoded <- mapM (decodeWith dec) values
+  return $ VMSymbol (symbolName dec $ symIdToInt symId) decoded
+
 
 encodeOpaqueSymbolHeader :: SymId -> Int -> VMWord
 encodeOpaqueSymbolHeader symId n =
   makeVMValue tagOpaqueSymbol $ fromIntegral $ (symIdToInt symId `shiftL` 14) .|. n
 
-decodeOpaqueSymbol :: VMWord -> [VMWord] -> SymbolNameList -> IO VMValue
-decodeOpaqueSymbol _ _ _ = return VMOpaqueSymbol
-
+decodeOpaqueSymbol :: Decoder -> VMWord -> IO VMValue
+decodeOpaqueSymbol _ _ = return VMOpaqueSymbol
 
 -- Strings
 
-decodeConstantString :: VMWord -> [VMWord] -> IO VMValue
-decodeConstantString addr ctable = do
-  let subCTable = drop (fromIntegral addr) ctable
-  let (_, numChunks) = decodeStringHeader (head subCTable)
-  let decodedChunks = map decodeStringChunk (take numChunks $ tail subCTable)
-  let str = concat decodedChunks
-  return $ VMString str
-
-decodeDynamicString :: VMWord -> IO VMValue
-decodeDynamicString addr = do
-  stringHeader <- getVMHeapValue addr
-  let (_, numChunks) = decodeStringHeader stringHeader
-  stringBody <- getVMHeapArray (addr + stringHeaderLength) numChunks
+decodeConstantString :: Decoder -> VMWord -> IO VMValue
+decodeConstantString dec addr = do
+  let (len, _) = decodeStringHeader (constant dec addr)
+  let decodedChunks = map decodeStringChunk (constants dec (addr + 1) (stringChunkCount len))
+  return $ VMString (concat decodedChunks)
+
+decodeDynamicString :: Decoder -> VMWord -> IO VMValue
+decodeDynamicString dec addr = do
+  stringHeader <- heapValue dec addr
+  let (len, _) = decodeStringHeader stringHeader
+  stringBody <- heapValues dec (addr + stringHeaderLength) (stringChunkCount len)
   let decodedChunks = map decodeStringChunk stringBody
-  let str = concat decodedChunks
-  return $ VMString str
+  return $ VMString (concat decodedChunks)
+
+-- A rope is the concatenation of its left and right part. A rope that has been
+-- flattened by the vm has the flat string as its left part and nil as its right part.
+decodeRope :: Decoder -> VMWord -> IO VMValue
+decodeRope dec addr = do
+  parts <- ropeParts addr []
+  return $ VMString (concat parts)
+  where
+    -- ropes tend to lean to the left, so we collect the parts from right to left
+    ropeParts a rest = do
+      [left, right] <- heapValues dec (a + ropeHeaderLength) 2
+      rest' <- if getTag right == tagPlainSymbol then return rest else part right rest
+      part left rest'
+    part v rest
+      | getTag v == tagRope = ropeParts (getValue v) rest
+      | otherwise = do
+          VMString s <- decodeWith dec v
+          return (s : rest)
 
 
 encodeStringRef :: ConstAddr -> VMWord
@@ -143,10 +206,26 @@ encodeStringRef = makeVMValue tagString
                   . constAddrToInt
 
 
+-- The header holds the length and the hash of the string
 encodeStringHeader :: Int -> Int -> VMWord
-encodeStringHeader len numChunks =
+encodeStringHeader len hash =
   makeVMValue tagString $
-              fromIntegral $ (len `shiftL` 14) .|. numChunks
+              fromIntegral $ (len `shiftL` 30) .|. hash
+
+
+-- FNV-1a, cut down to the 30 bits of the string header (0 means that the vm still has
+-- to compute the hash). Has to give the same result as string_hash_of in vm/vm.c.
+hashString :: String -> Int
+hashString str =
+  let bytes = map (fromIntegral . castCharToCChar) str :: [Word8] in
+  let step h b = (h `xor` fromIntegral b) * 16777619 in
+  let hash = fromIntegral (fromIntegral (foldl step (2166136261 :: Word32) bytes) .&. low30Bits) in
+  if hash == 0 then 1 else hash
+
+
+-- The characters are followed by a '\0'
+stringChunkCount :: Int -> Int
+stringChunkCount len = (len + charsPerStringChunk) `div` charsPerStringChunk
 
 
 decodeStringHeader :: VMWord -> (Int, Int)
@@ -156,30 +235,64 @@ decodeStringHeader v =
     error "Expected string tag in string header"
   else
     let value = getValue v in
-    (fromIntegral $ (value .&. high14Bits) `rotateR` 14,
-                        fromIntegral $ value .&. low14Bits)
+    (fromIntegral $ (value `shiftR` 30) .&. low30Bits,
+                        fromIntegral $ value .&. low30Bits)
 
 
-encodeStringChunk :: Char -> Char -> Char -> Char -> VMWord
-encodeStringChunk c1 c2 c3 c4 =
-  fromIntegral (castCharToCChar c4) `shiftL` (3 * 8)
-  .|. fromIntegral (castCharToCChar c3) `shiftL` (2 * 8)
-  .|. fromIntegral (castCharToCChar c2) `shiftL` (1 * 8)
-  .|. fromIntegral (castCharToCChar c1)
+-- A chunk holds up to charsPerStringChunk characters, the first one in the lowest
+-- byte. Missing characters are filled up with '\0'.
+encodeStringChunk :: String -> VMWord
+encodeStringChunk str =
+  foldr (.|.) 0 $ zipWith encodeChar [0 ..] (take charsPerStringChunk str)
+  where
+    encodeChar i c = (fromIntegral (fromIntegral (castCharToCChar c) :: Word8)) `shiftL` (i * 8)
 
 
 decodeStringChunk :: VMWord -> String
 decodeStringChunk encoded =
-  let c4 = castCCharToChar $ fromIntegral $ (encoded .&. 0xFF000000) `rotateR` (3 * 8)
-      c3 = castCCharToChar $ fromIntegral $ (encoded .&. 0x00FF0000) `rotateR` (2 * 8)
-      c2 = castCCharToChar $ fromIntegral $ (encoded .&. 0x0000FF00) `rotateR` (1 * 8)
-      c1 = castCCharToChar $ fromIntegral (encoded .&. 0x000000FF) 
-      str = [c1, c2, c3, c4]
+  let decodeChar i = castCCharToChar $ fromIntegral $ (encoded `shiftR` (i * 8)) .&. 0xFF
+      str = map decodeChar [0 .. charsPerStringChunk - 1]
   in
   filter (/= '\0') str
 
 
 
+-- Maps
+
+-- A map is a trie of nodes (see vm/map.c). The header of a node has the number of
+-- entries below it and a bitmap of its entries, and the second header word is a bitmap
+-- of its child nodes. A collision node has no bitmaps and a header with only the number
+-- of its entries.
+decodeMap :: Decoder -> VMWord -> IO VMValue
+decodeMap dec addr = VMDict <$> nodeEntries addr
+  where
+    nodeEntries a = do
+      [header, nodemap] <- heapValues dec a mapNodeHeaderLength
+      let isCollision = nodemap .&. mapCollisionBit /= 0
+      let (entryCount, childCount) =
+            if isCollision
+              then (fromIntegral $ getValue header `shiftR` 32, 0)
+              else (popCount $ header .&. low32Bits, popCount $ nodemap .&. low32Bits)
+      body <- heapValues dec (a + fromIntegral mapNodeHeaderLength) (2 * entryCount + childCount)
+      let (entries, children) = splitAt (2 * entryCount) body
+      decodedEntries <- mapM decodeEntry (chunksOf 2 entries)
+      childEntries <- mapM (nodeEntries . getValue) children
+      return $ decodedEntries ++ concat childEntries
+    decodeEntry [k, v] = (,) <$> decodeWith dec k <*> decodeWith dec v
+    decodeEntry _ = error "Incomplete map entry"
+
+
+
+-- Arrays
+
+decodeArray :: Decoder -> VMWord -> IO VMValue
+decodeArray dec addr = do
+  header <- heapValue dec addr
+  elements <- heapValues dec (addr + fromIntegral arrayHeaderLength) (fromIntegral $ getValue header)
+  VMArray <$> mapM (decodeWith dec) elements
+
+
+
 -- Match patterns
 
 data MatchDataType = MatchHeader | MatchVar
@@ -201,7 +314,7 @@ matchData :: MatchDataType -> Int -> VMWord
 matchData mtype n =
   let mtag = matchDataSubTag mtype
       cropped = fromIntegral $ fromIntegral n .&. low27Bits
-      mtagVal = mtag `shiftL` (32 - 5)
+      mtagVal = mtag `shiftL` (vmWordBits - 5)
   in
   makeVMValue tagMatchData (cropped .|. mtagVal)
 
@@ -210,19 +323,19 @@ matchData mtype n =
 
 -- TODO check that data actually fits within the data mask!
 makeVMValue :: VMWord -> VMWord -> VMWord
-makeVMValue tag i = (i .&. low28Bits) .|. (tag `shiftL` (32 - 4))
+makeVMValue tag i = (i .&. low60Bits) .|. (tag `shiftL` (vmWordBits - tagBits))
 
-getTag, getValue :: (Bits a, Num a) => a -> a
-getTag v = (v .&. 0xF0000000) `rotateL` 4
-getValue v = v .&. fromIntegral low28Bits
+getTag, getValue :: VMWord -> VMWord
+getTag v = v `shiftR` (vmWordBits - tagBits)
+getValue v = v .&. low60Bits
 
 
 -- TODO check max number
 ensureRange :: (Ord a, Num a, Show a) => a -> a
 ensureRange v = if v < 0 || v > 0xFFFFF then error ("Value outside of range: " ++ show v) else v
 
-ensureNumberRange :: (Ord a, Num a, Show a) => a -> a
-ensureNumberRange v = if v > fromIntegral (maxInteger + intBias) then error ("Value outside of range: " ++ show v) else v
+ensureNumberRange :: Int -> Int
+ensureNumberRange v = if v < minNumber || v > maxNumber then error ("Value outside of range: " ++ show v) else v
 
 
 
@@ -230,13 +343,20 @@ ensureNumberRange v = if v > fromIntegral (maxInteger + intBias) then error ("Va
 -- Constants, limits
 
 
-low28Bits, low27Bits, low14Bits, high14Bits :: VMWord
-low28Bits = 0x0FFFFFFF
+vmWordBits, tagBits, charsPerStringChunk :: Int
+vmWordBits = finiteBitSize (0 :: VMWord)
+tagBits = 4
+charsPerStringChunk = vmWordBits `div` 8
+
+low60Bits, low32Bits, low30Bits, low27Bits, low14Bits, high14Bits :: VMWord
+low60Bits = 0x0FFFFFFFFFFFFFFF
+low32Bits = 0xFFFFFFFF
+low30Bits = 0x3FFFFFFF
 low27Bits = 0x07FFFFFF
 low14Bits = 0x3FFF
 high14Bits = 0xFFFC000
 
-tagNumber, tagPlainSymbol, tagCompoundSymbol, tagMatchData, tagFunction, tagDynamicCompoundSymbol, tagClosure, tagString, tagDynamicString, tagOpaqueSymbol :: VMWord
+tagNumber, tagPlainSymbol, tagCompoundSymbol, tagMatchData, tagFunction, tagDynamicCompoundSymbol, tagClosure, tagString, tagDynamicString, tagOpaqueSymbol, tagRope, tagMap, tagArray :: VMWord
 tagNumber = 0x0
 tagPlainSymbol = 0x4
 tagCompoundSymbol = 0x5
@@ -246,11 +366,24 @@ tagDynamicCompoundSymbol = 0x8
 tagString = 0x9
 tagDynamicString = 0xA
 tagOpaqueSymbol = 0xB
+tagRope = 0xC
+tagMap = 0xD
+tagArray = 0xE
 tagMatchData = 0xF
 
-compoundSymbolHeaderLength, stringHeaderLength :: VMWord
+compoundSymbolHeaderLength, stringHeaderLength, ropeHeaderLength :: VMWord
 compoundSymbolHeaderLength = 1
 stringHeaderLength = 1
+ropeHeaderLength = 1
+
+mapNodeHeaderLength :: Int
+mapNodeHeaderLength = 2
+
+mapCollisionBit :: VMWord
+mapCollisionBit = bit 32
+
+arrayHeaderLength :: Int
+arrayHeaderLength = 1
 
 
 
@@ -0,0 +1,62 @@
+module Language.Dash.VM.Image (
+  writeImage
+, isImageFile
+, imageVersion
+) where
+
+import           Control.Monad            (when)
+import qualified Data.ByteString          as BS
+import qualified Data.ByteString.Builder  as B
+import qualified Data.ByteString.Char8    as BC
+import qualified Data.ByteString.Lazy     as BL
+import           Data.Monoid              ((<>))
+import qualified Data.Vector.Storable     as VS
+import           Foreign.Storable         (Storable, sizeOf)
+import           Language.Dash.IR.Data    (SymbolNameList)
+import           Language.Dash.VM.Types
+import           System.IO
+
+
+-- An image holds an assembled program, so that it can be run without compiling
+-- it again. The vm maps it into memory directly (see vm/image.c, which also
+-- describes the layout). The version has to match image_version in vm/image.h.
+imageVersion :: Int
+imageVersion = 2
+
+imageMagic :: BS.ByteString
+imageMagic = BC.pack "DASH"
+
+-- The program and the const table are written straight from their buffers, which
+-- works because the vm only runs on little endian machines (see image.c)
+writeImage :: FilePath -> VMProgram -> VMConstTable -> SymbolNameList -> IO ()
+writeImage path prog ctable symNames =
+  withBinaryFile path WriteMode $ \h -> do
+    B.hPutBuilder h header
+    putVector h prog
+    -- the const table starts at a multiple of 8 bytes
+    when (odd $ VS.length prog) $ B.hPutBuilder h (word32 0)
+    putVector h ctable
+    BL.hPut h names
+  where
+    header =  B.byteString imageMagic
+           <> word32 imageVersion
+           <> word32 (VS.length prog)
+           <> word32 (VS.length ctable)
+           <> word32 (fromIntegral $ BL.length names)
+           <> word32 0
+    names = B.toLazyByteString $ mconcat $ map (\ n -> B.stringUtf8 n <> B.word8 0) symNames
+    word32 = B.word32LE . fromIntegral
+
+putVector :: Storable a => Handle -> VS.Vector a -> IO ()
+putVector h v =
+  VS.unsafeWith v $ \ ptr -> hPutBuf h ptr (VS.length v * sizeOf (element v))
+  where
+    -- sizeOf doesn't look at its argument
+    element :: VS.Vector a -> a
+    element _ = undefined
+
+isImageFile :: FilePath -> IO Bool
+isImageFile path =
+  withBinaryFile path ReadMode $ \h -> do
+    magic <- BS.hGet h (BS.length imageMagic)
+    return $ magic == imageMagic
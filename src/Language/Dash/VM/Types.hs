@@ -3,8 +3,17 @@ module Language.Dash.VM.Types where
 import Data.Word
 import Data.List (intercalate)
 import Data.List.Split (chunksOf)
+import qualified Data.Vector.Storable as VS
 
-type VMWord = Word32
+type VMWord = Word64
+
+-- Instructions are 32 bit, while values are a full VMWord
+type VMInstruction = Word32
+
+-- Assembled programs live in pinned buffers, which the vm reads without any
+-- marshalling
+type VMProgram = VS.Vector VMInstruction
+type VMConstTable = VS.Vector VMWord
 
 data VMValue =
     VMNumber Int
@@ -13,6 +22,8 @@ data VMValue =
   | VMClosure -- TODO add meaningful data 
   | VMFunction -- TODO add meaningful data (name, arguments, etc)
   | VMOpaqueSymbol
+  | VMDict [(VMValue, VMValue)] -- in the order of the vm (see vm/map.c)
+  | VMArray [VMValue]
   deriving (Eq)
 
 
@@ -25,6 +36,8 @@ instance Show VMValue where
       VMClosure -> "<closure>"
       VMFunction -> "<function>"
       VMOpaqueSymbol -> "<opaque symbol>"  -- TODO special handling for modules
+      VMDict entries -> "dict_from_list [" ++ intercalate ", " (map showEntry entries) ++ "]"
+      VMArray elements -> "array_from_list [" ++ intercalate ", " (map show elements) ++ "]"
       VMSymbol "$_empty_list" [] -> "[]"
       VMSymbol s [] -> ":" ++ s
       VMSymbol "$_list" fields -> showNestedList fields
@@ -33,6 +46,9 @@ instance Show VMValue where
       VMSymbol s fields ->  ":" ++ s ++ "<" ++ intercalate ", " (map showField fields) ++ ">"
 
 
+showEntry :: (VMValue, VMValue) -> String
+showEntry (k, v) = "(" ++ show k ++ ", " ++ show v ++ ")"
+
 showField :: VMValue -> String
 showField v =
   case v of
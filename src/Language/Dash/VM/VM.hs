@@ -1,43 +1,178 @@
 module Language.Dash.VM.VM (
   execute
-, getVMHeapArray
-, getVMHeapValue
+, VMInstance
+, createVM
+, destroyVM
+, loadVMProgram
+, loadVMImage
+, vmProgramResult
+, callVMFunction
+, enableProfiling
+, nameProfiledFunction
+, writeProfile
+, vmHeapBase
+, instanceHeapBase
 ) where
 
-import           Data.Word
+import           Data.List.Split        (endBy)
+import qualified Data.Vector.Storable   as VS
+import qualified Data.Vector.Storable.Mutable as VSM
 import           Foreign.C
+import           Foreign.Marshal.Utils  (toBool)
 import           Foreign.Storable
+import           Foreign.Marshal.Alloc
 import           Foreign.Marshal.Array
 import           Foreign.Ptr
+import qualified GHC.Foreign            as GHC
+import           System.IO              (utf8)
 import           Language.Dash.IR.Data  (SymbolNameList)
 import           Language.Dash.VM.Types
 
 -- TODO change order in return value! (sym names and const table)
-execute :: [VMWord] -> [VMWord] -> SymbolNameList -> IO (VMWord, [VMWord], SymbolNameList)
+-- The vm reads the program and the const table right out of the vectors (and makes
+-- its own copy), so nothing has to be marshalled. All runs share one global instance,
+-- so execute must not be called from several threads at once (use a VMInstance).
+execute :: VMProgram -> VMConstTable -> SymbolNameList -> IO (VMWord, VMConstTable, SymbolNameList)
 execute prog ctable symNames =
-  withArray (map CUInt prog) (\progPtr ->
-    withArray (map CUInt ctable) (\ctablePtr ->
+  VS.unsafeWith prog (\progPtr ->
+    VS.unsafeWith ctable (\ctablePtr ->
       foreignVMExecute progPtr
-                       (fromIntegral $ length prog)
-                       ctablePtr (fromIntegral $ length ctable)
+                       (fromIntegral $ VS.length prog)
+                       ctablePtr (fromIntegral $ VS.length ctable)
   ))
   >>= \a ->
     return (a, ctable, symNames)
 
-getVMHeapValue :: VMWord -> IO VMWord
-getVMHeapValue addr = do
-  let ptr = foreignVMGetHeapPointer addr
-  peek ptr
 
-getVMHeapArray :: VMWord -> Int -> IO [VMWord]
-getVMHeapArray addr len = do
-  let ptr = foreignVMGetHeapPointer addr
-  peekArray len ptr
+-- A vm instance keeps a loaded program and its heap around, so that functions of
+-- the program can be called many times without loading it again. Instances are
+-- independent of each other, so different Haskell threads can each run their own
+-- instance at the same time (but an instance must not be shared between threads).
+newtype VMInstance = VMInstance (Ptr ())
 
--- This will not call back into Haskell, so we can mark it unsafe
-foreign import ccall unsafe "vm_execute" foreignVMExecute
-    :: Ptr CUInt -> CInt -> Ptr CUInt -> CInt -> IO Word32
+createVM :: IO VMInstance
+createVM = VMInstance <$> foreignVMCreate nullPtr
+
+destroyVM :: VMInstance -> IO ()
+destroyVM (VMInstance vm) = foreignVMDestroy vm
+
+-- Returns the result of the program's top-level code
+loadVMProgram :: VMInstance -> VMProgram -> VMConstTable -> IO VMWord
+loadVMProgram (VMInstance vm) prog ctable =
+  VS.unsafeWith prog (\progPtr ->
+    VS.unsafeWith ctable (\ctablePtr ->
+      foreignVMLoadProgram vm
+                           progPtr (fromIntegral $ VS.length prog)
+                           ctablePtr (fromIntegral $ VS.length ctable)
+  ))
+
+-- Loads a program that has been compiled to an image (see Language.Dash.VM.Image).
+-- Returns the result of the program together with the constant table and the
+-- symbol names of the image, or Nothing if the file isn't a valid image.
+loadVMImage :: VMInstance -> FilePath -> IO (Maybe (VMWord, VMConstTable, SymbolNameList))
+loadVMImage (VMInstance vm) path = do
+  value <- withCString path (foreignVMLoadImage vm)
+  namesOrNull <- alloca $ \ sizePtr -> do
+    namesPtr <- foreignVMImageSymbolNames vm sizePtr
+    if namesPtr == nullPtr
+      then return Nothing
+      else do
+        size <- peek sizePtr
+        Just <$> GHC.peekCStringLen utf8 (namesPtr, fromIntegral size)
+  case namesOrNull of
+    Nothing -> return Nothing
+    Just names -> do
+      ctable <- alloca $ \ lengthPtr -> do
+        ctablePtr <- foreignVMInstanceConstTable vm lengthPtr
+        len <- fromIntegral <$> peek lengthPtr
+        -- the instance frees its const table when it's destroyed, so we need a copy
+        copied <- VSM.new len
+        VSM.unsafeWith copied $ \ dest -> copyArray dest ctablePtr len
+        VS.unsafeFreeze copied
+      return $ Just (value, ctable, endBy "\0" names)
+
+-- Heap values move during garbage collection, so this has to be read again after
+-- every call
+vmProgramResult :: VMInstance -> IO VMWord
+vmProgramResult (VMInstance vm) = foreignVMProgramResult vm
+
+callVMFunction :: VMInstance -> VMWord -> [VMWord] -> IO VMWord
+callVMFunction (VMInstance vm) fun args =
+  withArray args (\argsPtr ->
+    foreignVMCall vm fun argsPtr (fromIntegral $ length args))
+
+
+-- Profiling has to be enabled before the program is loaded. The profile is written
+-- as a report and as sampled call stacks for flamegraph.pl (see profiler.c).
+enableProfiling :: VMInstance -> IO ()
+enableProfiling (VMInstance vm) = foreignVMEnableProfiling vm
+
+-- The address is the one of the function's header in the loaded program
+nameProfiledFunction :: VMInstance -> Int -> String -> IO ()
+nameProfiledFunction (VMInstance vm) addr name =
+  withCString name (foreignVMProfileNameFunction vm (fromIntegral addr))
+
+-- Returns False if the instance isn't profiling or a file can't be written
+writeProfile :: VMInstance -> FilePath -> FilePath -> IO Bool
+writeProfile (VMInstance vm) reportPath foldedPath =
+  withCString reportPath $ \ reportPtr ->
+    withCString foldedPath $ \ foldedPtr ->
+      toBool <$> foreignVMWriteProfile vm reportPtr foldedPtr
+
+
+-- The start of the heap, which heap addresses are offsets into. Every execute
+-- creates a new instance, and the garbage collector moves the heap, so the pointer
+-- is only valid until the vm runs again and has to be fetched after every run.
+-- This one is only for values returned by execute.
+vmHeapBase :: IO (Ptr VMWord)
+vmHeapBase = foreignVMGetHeapPointer 0
+
+instanceHeapBase :: VMInstance -> IO (Ptr VMWord)
+instanceHeapBase (VMInstance vm) = foreignVMInstanceHeapPointer vm 0
+
+-- None of these call back into Haskell. Executing or loading a program and calling
+-- a function run Dash code for an arbitrary amount of time, so these are safe calls,
+-- which don't block the other Haskell threads (and allow several instances to run in
+-- parallel with -threaded). vm_execute and vm_get_heap_pointer use one global
+-- instance though, so execute must not be called from several threads at once.
+foreign import ccall safe "vm_execute" foreignVMExecute
+    :: Ptr VMInstruction -> CInt -> Ptr VMWord -> CInt -> IO VMWord
 
 foreign import ccall unsafe "vm_get_heap_pointer" foreignVMGetHeapPointer
-    :: Word32 -> Ptr VMWord
+    :: VMWord -> IO (Ptr VMWord)
+
+foreign import ccall unsafe "vm_create" foreignVMCreate
+    :: Ptr () -> IO (Ptr ())
+
+foreign import ccall unsafe "vm_destroy" foreignVMDestroy
+    :: Ptr () -> IO ()
+
+foreign import ccall safe "vm_load_program" foreignVMLoadProgram
+    :: Ptr () -> Ptr VMInstruction -> CInt -> Ptr VMWord -> CInt -> IO VMWord
+
+foreign import ccall safe "vm_load_image" foreignVMLoadImage
+    :: Ptr () -> CString -> IO VMWord
+
+foreign import ccall unsafe "vm_image_symbol_names" foreignVMImageSymbolNames
+    :: Ptr () -> Ptr CSize -> IO CString
+
+foreign import ccall unsafe "vm_instance_const_table" foreignVMInstanceConstTable
+    :: Ptr () -> Ptr CInt -> IO (Ptr VMWord)
+
+foreign import ccall unsafe "vm_program_result" foreignVMProgramResult
+    :: Ptr () -> IO VMWord
+
+foreign import ccall safe "vm_call" foreignVMCall
+    :: Ptr () -> VMWord -> Ptr VMWord -> CInt -> IO VMWord
+
+foreign import ccall unsafe "vm_instance_heap_pointer" foreignVMInstanceHeapPointer
+    :: Ptr () -> VMWord -> IO (Ptr VMWord)
+
+foreign import ccall unsafe "vm_enable_profiling" foreignVMEnableProfiling
+    :: Ptr () -> IO ()
+
+foreign import ccall unsafe "vm_profile_name_function" foreignVMProfileNameFunction
+    :: Ptr () -> CInt -> CString -> IO ()
 
+foreign import ccall unsafe "vm_write_profile" foreignVMWriteProfile
+    :: Ptr () -> CString -> CString -> IO CBool
@@ -1,10 +1,14 @@
 module IntegrationSpec where
 
+import           Control.Concurrent
+import           Data.List                                 (intercalate, isInfixOf)
 import           Language.Dash.API
 import           Language.Dash.BuiltIn.BuiltInDefinitions
 import           Language.Dash.Error.Error
 import           Language.Dash.VM.DataEncoding
 import           Numeric
+import           System.Directory                          (removeFile)
+import           System.IO
 import           Test.Hspec
 
 -- This is mainly a test of the code generator. But it is an integration test because
@@ -13,6 +17,12 @@ import           Test.Hspec
 shouldReturnRight :: (Show a, Eq a) => IO (Either CompilationError a) -> a -> Expectation
 shouldReturnRight action val = action `shouldReturn` Right val
 
+runOptimized :: String -> IO (Either CompilationError VMValue)
+runOptimized prog =
+  case parseWithPreamble prog of
+    Left err -> return (Left err)
+    Right expr -> runExprWith defaultCompileOptions { optimizeCode = True } expr
+
 isErrorSymbol :: Either CompilationError VMValue -> Bool
 isErrorSymbol result =
   case result of
@@ -55,6 +65,14 @@ spec =
       let result = run "11 / 3"
       result `shouldReturnRight` VMNumber 3
 
+    it "computes numbers beyond the range of integer literals" $ do
+      let result = run "(1000000 * 1000000) - (4 * 1000000)"
+      result `shouldReturnRight` VMNumber 999996000000
+
+    it "computes negative numbers" $ do
+      let result = run "3 - (1000000 * 1000)"
+      result `shouldReturnRight` VMNumber (-999999997)
+
     it "stores a value in a variable" $ do
       let result = run " a = 4\n\
                        \ a"
@@ -217,6 +235,34 @@ spec =
               let result = run code
               result `shouldReturnRight` VMNumber 1862
 
+            it "calls a closure in the function that created it" $ do
+              let code = " add_all x y = \n\
+                         \   add z = x + y + z \n\
+                         \   add 1 + add 2 \n\
+                         \ add_all 10 20"
+              run code `shouldReturnRight` VMNumber 63
+              -- the closure is never used as a value, so it isn't created at all
+              let compiled = showCompiledProgram code
+              ("OpcPartAp" `isInfixOf` compiled) `shouldBe` False
+              ("OpcGenAp" `isInfixOf` compiled) `shouldBe` False
+
+            it "calls a closure that is also returned" $ do
+              let code = " make x = \n\
+                         \   f y = x * y \n\
+                         \   n = f 2 \n\
+                         \   (f, n) \n\
+                         \ match make 5 with \n\
+                         \   (f, n) -> f n \n\
+                         \ end"
+              run code `shouldReturnRight` VMNumber 50
+
+            it "calls a closure from a match branch" $ do
+              let code = " f x = \n\
+                         \   g y = x + y \n\
+                         \   if x > 0 then g 1 else g 2 \n\
+                         \ f 5"
+              run code `shouldReturnRight` VMNumber 6
+
 
 
     context "when using currying" $ do
@@ -441,6 +487,24 @@ spec =
               result `shouldReturnRight` VMNumber 23
 
 
+            it "matches a value against many different symbols" $ do
+              let code =  " calc e = \n\
+                          \   match e with \n\
+                          \     :num<n>    -> n \n\
+                          \     :neg<a>    -> 0 - (calc a) \n\
+                          \     :add<a, b> -> (calc a) + (calc b) \n\
+                          \     :mul<a, b> -> (calc a) * (calc b) \n\
+                          \     :add<a>    -> 1000 \n\
+                          \     :nil       -> 0 \n\
+                          \     7          -> 7000 \n\
+                          \     x          -> 100 \n\
+                          \     :sub<a, b> -> 2000 \n\
+                          \   end \n\
+                          \ calc (:add<(:mul<(:num<3>), (:num<4>)>), (:neg<(:add<:nil, (:sub<1, 2>)>)>)>)"
+              let result = run code
+              result `shouldReturnRight` VMNumber (-88)
+
+
             it "uses wildcards in a match" $ do
               let code =  " match :test<3, 4> with \n\
                           \ :test<_, 4, _> -> 22 \n\
@@ -539,6 +603,14 @@ spec =
         let result = run code
         result `shouldReturnRight` VMNumber 19
 
+      it "calls a function in a known module directly" $ do
+        let code = " mod = module                  \n\
+                   \   func a b = a * b            \n\
+                   \ end                           \n\
+                   \ mod.func 7 6"
+        run code `shouldReturnRight` VMNumber 42
+        ("OpcGenAp" `isInfixOf` showCompiledProgram code) `shouldBe` False
+
       it "calls a function in a module self-recursively" $ do
         let code = " mod = module                  \n\
                    \   func a =                    \n\
@@ -550,6 +622,19 @@ spec =
         let result = run code
         result `shouldReturnRight` VMNumber 10
 
+      it "looks up fields in a module with many fields" $ do
+        let code = " mod = module                  \n\
+                   \   zz = 1                      \n\
+                   \   yy = 20                     \n\
+                   \   xx = :sym                   \n\
+                   \   add a = a + 300             \n\
+                   \   ww = 4000                   \n\
+                   \ end                           \n\
+                   \ get_ww d = mod.ww             \n\
+                   \ mod.add (mod.zz + mod.yy + (get_ww 0))"
+        let result = run code
+        result `shouldReturnRight` VMNumber 4321
+
 
     it "resolves closed over vars in match-branches" $ do
       let code = " fib n =                       \n\
@@ -669,6 +754,16 @@ spec =
       let result = run code
       result `shouldReturnRight` VMSymbol "true" []
 
+    it "determines equality between a dynamic and a constant string" $ do
+      let code = "(\"te\" ^+ \"st\") == \"test\""
+      let result = run code
+      result `shouldReturnRight` VMSymbol "true" []
+
+    it "determines inequality between strings of the same length" $ do
+      let code = "(\"te\" ^+ \"st\") == (\"te\" ^+ \"xt\")"
+      let result = run code
+      result `shouldReturnRight` VMSymbol "false" []
+
     it "has correct precedence for math operators" $ do
       let code = "12 + 6 / 2 - 3 * 2"
       let result = run code
@@ -811,6 +906,101 @@ spec =
       let result = run code
       result `shouldReturnRight` VMString "cdefg"
 
+    it "truncates a sub-string at the end of the string" $ do
+      let code =  " s1 = \"abcdefghijklmn\" \n\
+                  \ sub_string 10 50 s1"
+      let result = run code
+      result `shouldReturnRight` VMString "klmn"
+
+    it "builds a long string by repeated concatenation" $ do
+      let code =  " repeat n s = \n\
+                  \   match n with \n\
+                  \     0 -> \"\" \n\
+                  \     _ -> s ^+ (repeat (n - 1) s) \n\
+                  \   end \n\
+                  \ long = repeat 500 \"0123456789\" \n\
+                  \ (string_length long, sub_string 4995 3 long)"
+      let result = run code
+      result `shouldReturnRight` VMSymbol tupleSymbolName [VMNumber 5000, VMString "567"]
+
+    it "compares strings" $ do
+      let code =  " s1 = \"abc\" \n\
+                  \ s2 = s1 ^+ \"d\" \n\
+                  \ (compare_strings s1 s2, compare_strings s2 \"abcd\", compare_strings \"b\" s1)"
+      let result = run code
+      result `shouldReturnRight` VMSymbol tupleSymbolName [VMNumber (-1), VMNumber 0, VMNumber 1]
+
+    it "finds a string in a string" $ do
+      let code =  " s = \"log: error in line 3\" \n\
+                  \ (find_string s \"error\", find_string s \"warning\")"
+      let result = run code
+      result `shouldReturnRight` VMSymbol tupleSymbolName [VMNumber 5, VMNumber (-1)]
+
+    it "looks up a value in a dict" $ do
+      let code =  " d = dict_insert 2 20 (dict_insert 1 10 empty_dict) \n\
+                  \ (dict_get 2 0 d, dict_get 3 0 d)"
+      let result = run code
+      result `shouldReturnRight` VMSymbol tupleSymbolName [VMNumber 20, VMNumber 0]
+
+    it "keeps old versions of a dict" $ do
+      let code =  " d1 = dict_from_list [(1, :a), (2, :b), (3, :c)] \n\
+                  \ d2 = dict_remove 2 (dict_insert 1 :z d1) \n\
+                  \ (dict_size d1, dict_get 1 :none d1, dict_size d2, dict_get 1 :none d2)"
+      let result = run code
+      result `shouldReturnRight` VMSymbol tupleSymbolName [ VMNumber 3, VMSymbol "a" []
+                                                          , VMNumber 2, VMSymbol "z" []]
+
+    it "uses strings as keys of a dict" $ do
+      let code =  " key = \"ab\" ^+ \"c\" \n\
+                  \ d = dict_insert key 5 empty_dict \n\
+                  \ dict_get \"abc\" 0 d"
+      let result = run code
+      result `shouldReturnRight` VMNumber 5
+
+    it "folds over a dict" $ do
+      let code =  " d = dict_from_list [(1, 10), (2, 20), (3, 30)] \n\
+                  \ dict_fold (k v acc -> acc + k * v) 0 d"
+      let result = run code
+      result `shouldReturnRight` VMNumber 140
+
+    it "returns a dict" $ do
+      let code =  " dict_insert 1 :one empty_dict"
+      let result = run code
+      result `shouldReturnRight` VMDict [(VMNumber 1, VMSymbol "one" [])]
+
+    it "gets an element of an array" $ do
+      let code =  " a = array_from_list [10, 20, 30] \n\
+                  \ (array_get 1 a, array_length a)"
+      let result = run code
+      result `shouldReturnRight` VMSymbol tupleSymbolName [VMNumber 20, VMNumber 3]
+
+    it "keeps the old array when setting an element" $ do
+      let code =  " a = new_array 3 0 \n\
+                  \ b = array_set 1 :x a \n\
+                  \ (array_get 1 a, array_get 1 b)"
+      let result = run code
+      result `shouldReturnRight` VMSymbol tupleSymbolName [VMNumber 0, VMSymbol "x" []]
+
+    it "maps over an array" $ do
+      let code =  " a = array_map (x -> x * 2) (array_from_list [1, 2, 3]) \n\
+                  \ array_to_list a"
+      let result = run code
+      result `shouldReturnRight` VMSymbol listConsSymbolName [VMNumber 2,
+                                  VMSymbol listConsSymbolName [VMNumber 4,
+                                  VMSymbol listConsSymbolName [VMNumber 6,
+                                  VMSymbol listEmptySymbolName []]]]
+
+    it "folds over an array" $ do
+      let code =  " a = array_from_list [1, 2, 3, 4] \n\
+                  \ array_fold (x acc -> acc * 10 + x) 0 a"
+      let result = run code
+      result `shouldReturnRight` VMNumber 1234
+
+    it "slices an array" $ do
+      let code =  " sub_array 1 2 (array_from_list [:a, :b, :c, :d])"
+      let result = run code
+      result `shouldReturnRight` VMArray [VMSymbol "b" [], VMSymbol "c" []]
+
 
     it "converts a string to a number" $ do
       let code =  " s = \"4815\" \n\
@@ -832,6 +1022,174 @@ spec =
 
 
 
+    context "threads" $ do
+
+      it "spawns a thread and waits for its result" $ do
+        let code = " do io with \n\
+                   \   thread <- io.spawn (x -> 6 * 7) \n\
+                   \   io.await thread \n\
+                   \ end"
+        runWithPreamble code `shouldReturnRight` VMNumber 42
+
+      it "passes messages through a channel" $ do
+        let code = " sender channel n = \n\
+                   \   if n == 0 \n\
+                   \     then io.send channel :done \n\
+                   \     else do io with \n\
+                   \       io.send channel n \n\
+                   \       sender channel (n - 1) \n\
+                   \     end \n\
+                   \ sum_messages channel acc = \n\
+                   \   do io with \n\
+                   \     message <- io.receive channel \n\
+                   \     if message == :done \n\
+                   \       then io.return acc \n\
+                   \       else sum_messages channel (acc + message) \n\
+                   \   end \n\
+                   \ do io with \n\
+                   \   channel <- io.new_channel \n\
+                   \   io.spawn (x -> sender channel 100) \n\
+                   \   sum_messages channel 0 \n\
+                   \ end"
+        runWithPreamble code `shouldReturnRight` VMNumber 5050
+
+      it "runs a thread while another thread doesn't finish" $ do
+        let code = " loop x = loop x \n\
+                   \ do io with \n\
+                   \   io.spawn loop \n\
+                   \   worker <- io.spawn (x -> 1 + 2) \n\
+                   \   io.await worker \n\
+                   \ end"
+        runWithPreamble code `shouldReturnRight` VMNumber 3
+
+      it "returns an error if all threads are waiting" $ do
+        let code = " do io with \n\
+                   \   channel <- io.new_channel \n\
+                   \   io.receive channel \n\
+                   \ end"
+        result <- runWithPreamble code
+        isErrorSymbol result `shouldBe` True
+
+    context "loaded programs" $ do
+
+      it "calls a loaded function many times" $ do
+        Right loaded <- loadProgram " add_one x = x + 1 \n\
+                                    \ add_one"
+        results <- mapM (\n -> callProgram loaded [VMNumber n]) [1 .. 100]
+        unloadProgram loaded
+        results `shouldBe` map (Right . VMNumber) [2 .. 101]
+
+      it "calls a loaded closure" $ do
+        Right loaded <- loadProgram " make_adder y = (x -> x + y) \n\
+                                    \ make_adder 10"
+        firstResult <- callProgram loaded [VMNumber 1]
+        secondResult <- callProgram loaded [VMNumber 5]
+        unloadProgram loaded
+        (firstResult, secondResult) `shouldBe` (Right (VMNumber 11), Right (VMNumber 15))
+
+      it "passes symbols to a loaded function" $ do
+        Right loaded <- loadProgram " check s = \n\
+                                    \   match s with \n\
+                                    \     :yes -> 1 \n\
+                                    \     _ -> 0 \n\
+                                    \   end \n\
+                                    \ check"
+        result <- callProgram loaded [VMSymbol "yes" []]
+        unloadProgram loaded
+        result `shouldBe` Right (VMNumber 1)
+
+      it "runs loaded programs on several threads at the same time" $ do
+        let load n = loadProgram $ " make_adder y = (x -> x + y) \n\
+                                   \ make_adder " ++ show n
+        let callMany loaded = mapM (\n -> callProgram loaded [VMNumber n]) [1 .. 100]
+        loadedPrograms <- mapM (fmap (either (error . show) id) . load) [10, 20, 30, 40 :: Int]
+        resultVars <- mapM (\loaded -> do
+                              var <- newEmptyMVar
+                              _ <- forkIO (callMany loaded >>= putMVar var)
+                              return var)
+                           loadedPrograms
+        results <- mapM takeMVar resultVars
+        mapM_ unloadProgram loadedPrograms
+        results `shouldBe` map (\y -> map (Right . VMNumber . (+ y)) [1 .. 100]) [10, 20, 30, 40]
+
+    context "images" $ do
+
+      it "runs a program from an image" $ do
+        (path, h) <- openTempFile "." "image_spec.dsc"
+        hClose h
+        let Right expr = parseWithPreamble " l = [1, 2, 3] \n\
+                                           \ map (x -> x * 2) l"
+        compiled <- compileImage path expr
+        isImage <- isImageFile path
+        result <- runImage path
+        removeFile path
+        (compiled, isImage) `shouldBe` (Right (), True)
+        result `shouldBe` Right (VMSymbol listConsSymbolName [VMNumber 2,
+                                 VMSymbol listConsSymbolName [VMNumber 4,
+                                 VMSymbol listConsSymbolName [VMNumber 6,
+                                 VMSymbol listEmptySymbolName []]]])
+
+    context "when a function has many values" $ do
+
+      it "reuses the registers of values that aren't needed anymore" $ do
+        let bindings = map (\ i -> "   v" ++ show i ++ " = v" ++ show (i - 1) ++ " + 1") [1 .. 100 :: Int]
+        let code = unlines $ [" count n =", "   v0 = n"] ++ bindings ++ ["   v100", " count 5"]
+        let result = run code
+        result `shouldReturnRight` VMNumber 105
+
+      it "spills values if more of them are live than there are registers" $ do
+        let names = map (\ i -> "v" ++ show i) [1 .. 40 :: Int]
+        let bindings = zipWith (\ name i -> "   " ++ name ++ " = n + " ++ show i) names [1 .. 40 :: Int]
+        let code = unlines $ [" sum_up n ="] ++ bindings ++
+                             ["   m = n * 2", "   m + " ++ intercalate " + " names, " sum_up 2"]
+        let result = run code
+        result `shouldReturnRight` VMNumber 904
+
+    context "when optimizing" $ do
+
+      it "computes known values at compile time" $ do
+        let code = " a = 2 * 3 \n\
+                   \ b = a + 4 \n\
+                   \ if b == 10 then a * b else 0"
+        runOptimized code `shouldReturnRight` VMNumber 60
+
+      it "inlines functions that use their arguments" $ do
+        let code = " add3 a b c = a + b + c \n\
+                   \ apply f = f 1 2 3 \n\
+                   \ apply add3"
+        runOptimized code `shouldReturnRight` VMNumber 6
+
+      it "keeps recursive functions" $ do
+        let code = " sum_to n acc = if n == 0 then acc else sum_to (n - 1) (acc + n) \n\
+                   \ sum_to 100 0"
+        runOptimized code `shouldReturnRight` VMNumber 5050
+
+      it "keeps closures that use inlined values" $ do
+        let code = " inc x = x + 1 \n\
+                   \ make_adder n = \n\
+                   \   m = inc n \n\
+                   \   x -> x + m \n\
+                   \ adder = make_adder 4 \n\
+                   \ adder 10"
+        runOptimized code `shouldReturnRight` VMNumber 15
+
+      it "uses the list functions of the preamble" $ do
+        let code = " double x = x * 2 \n\
+                   \ add a b = a + b \n\
+                   \ foldr add 0 (map double [1, 2, 3, 4])"
+        runOptimized code `shouldReturnRight` VMNumber 20
+
+      it "runs io actions" $ do
+        let code = " do io with \n\
+                   \   thread <- io.spawn (x -> 6 * 7) \n\
+                   \   io.await thread \n\
+                   \ end"
+        runOptimized code `shouldReturnRight` VMNumber 42
+
+      it "reports runtime errors in folded code" $ do
+        result <- runOptimized " 1 / 0"
+        isErrorSymbol result `shouldBe` True
+
     context "regression tests" $ do
 
       it "compiles variable assignment" $ do
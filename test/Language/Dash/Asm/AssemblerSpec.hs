@@ -0,0 +1,100 @@
+module Language.Dash.Asm.AssemblerSpec where
+
+import           Data.Maybe                               (fromJust)
+import qualified Data.Sequence                            as Seq
+import           Language.Dash.Asm.Assembler              (peephole)
+import           Language.Dash.BuiltIn.BuiltInDefinitions (builtInSymbols,
+                                                           falseSymbolName,
+                                                           trueSymbolName)
+import           Language.Dash.IR.Data
+import           Language.Dash.IR.Opcode
+import           Test.Hspec
+
+symbol :: String -> SymId
+symbol name = fromJust $ lookup name builtInSymbols
+
+optimized :: [Constant] -> [Opcode] -> [Opcode]
+optimized consts = peephole (Seq.fromList consts)
+
+spec :: Spec
+spec = do
+  describe "Peephole optimization" $ do
+
+      it "adds a constant directly" $ do
+        let code = [ OpcLoadI 1 1
+                   , OpcAdd 2 1 0
+                   , OpcRet 2 ]
+        optimized [] code `shouldBe` [ OpcAddI 2 0 1 1
+                                     , OpcRet 2 ]
+
+      it "subtracts a constant directly" $ do
+        let code = [ OpcLoadI 1 (-3)
+                   , OpcSub 2 0 1
+                   , OpcRet 2 ]
+        optimized [] code `shouldBe` [ OpcSubI 2 0 1 (-3)
+                                     , OpcRet 2 ]
+
+      it "doesn't fuse constants that don't fit into a superinstruction" $ do
+        let code = [ OpcLoadI 1 5000
+                   , OpcAdd 2 0 1
+                   , OpcRet 2 ]
+        optimized [] code `shouldBe` code
+
+      it "returns a constant directly" $ do
+        let code = [ OpcFunHeader 1 1
+                   , OpcLoadPS 0 (symbol trueSymbolName)
+                   , OpcRet 0 ]
+        optimized [] code `shouldBe` [ OpcFunHeader 1 1
+                                     , OpcRetPS 0 (symbol trueSymbolName) ]
+
+      it "fuses a comparison with a conditional jump" $ do
+        let code = [ OpcLT 2 0 1
+                   , OpcJmpTrue 2 1
+                   , OpcEq 2 0 1
+                   , OpcRet 2 ]
+        optimized [] code `shouldBe` [ OpcJmpLT 2 0 1 1
+                                     , OpcEq 2 0 1
+                                     , OpcRet 2 ]
+
+      it "doesn't remove the target of a jump" $ do
+        let code = [ OpcJmpTrue 0 1
+                   , OpcLoadI 0 5
+                   , OpcRet 0 ]
+        optimized [] code `shouldBe` code
+
+      it "turns an if with a comparison into a single jump" $ do
+        let consts = [ CMatchData [ CPlainSymbol (symbol trueSymbolName)
+                                  , CPlainSymbol (symbol falseSymbolName) ] ]
+        let code = [ OpcLT 3 0 1
+                   , OpcLoadF 4 (mkFuncAddr 1)
+                   , OpcLoadF 5 (mkFuncAddr 2)
+                   , OpcLoadAddr 6 (mkConstAddr 0)
+                   , OpcMatchSwitch 3 6 6
+                   , OpcJmp 1
+                   , OpcJmp 2
+                   , OpcAp 2 4 0
+                   , OpcJmp 1
+                   , OpcAp 2 5 0
+                   , OpcRet 2 ]
+        optimized consts code `shouldBe` [ OpcLoadF 4 (mkFuncAddr 1)
+                                         , OpcLoadF 5 (mkFuncAddr 2)
+                                         , OpcJmpLT 3 0 1 1
+                                         , OpcJmp 2
+                                         , OpcAp 2 4 0
+                                         , OpcJmp 1
+                                         , OpcAp 2 5 0
+                                         , OpcRet 2 ]
+
+      it "matches constants without loading the pattern address" $ do
+        let consts = [ CMatchData [ CNumber 0, CPlainSymbol (symbol trueSymbolName) ] ]
+        let code = [ OpcLoadAddr 1 (mkConstAddr 0)
+                   , OpcMatchSwitch 0 1 1
+                   , OpcJmp 1
+                   , OpcJmp 1
+                   , OpcRet 0
+                   , OpcRet 0 ]
+        optimized consts code `shouldBe` [ OpcJmpMatch 0 (mkConstAddr 0)
+                                         , OpcJmp 1
+                                         , OpcJmp 1
+                                         , OpcRet 0
+                                         , OpcRet 0 ]
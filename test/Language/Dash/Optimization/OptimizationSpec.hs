@@ -0,0 +1,102 @@
+module Language.Dash.Optimization.OptimizationSpec where
+
+import           Data.Maybe                                (fromJust)
+import           Language.Dash.API                         (CompileOptions (..),
+                                                            defaultCompileOptions,
+                                                            normalizeProgramWith)
+import           Language.Dash.BuiltIn.BuiltInDefinitions  (builtInSymbols,
+                                                            trueSymbolName)
+import           Language.Dash.Error.Error
+import           Language.Dash.IR.Data
+import           Language.Dash.IR.Nst
+import           Test.Hspec
+
+optimized :: String -> Either CompilationError NstExpr
+optimized prog =
+  (\ (norm, _, _) -> norm) <$> normalizeProgramWith defaultCompileOptions { optimizeCode = True } prog
+
+shouldBeRight :: (Show a, Eq a) => Either CompilationError a -> a -> Expectation
+shouldBeRight a b = a `shouldBe` Right b
+
+-- the names of all bindings at the top level
+boundNames :: NstExpr -> [Name]
+boundNames expr =
+  case expr of
+    NLet (NVar name _) _ body -> name : boundNames body
+    NDestructuringBind vars _ _ body -> map (\ (NVar name _) -> name) vars ++ boundNames body
+    NAtom _ -> []
+
+resultAtom :: NstExpr -> NstAtomicExpr
+resultAtom expr =
+  case expr of
+    NLet _ _ body -> resultAtom body
+    NDestructuringBind _ _ _ body -> resultAtom body
+    NAtom atom -> atom
+
+trueSymbol :: SymId
+trueSymbol = fromJust $ lookup trueSymbolName builtInSymbols
+
+spec :: Spec
+spec = do
+  describe "Optimization" $ do
+
+      it "folds arithmetic over known numbers" $ do
+        optimized " 2 * 3 + 4" `shouldBeRight` NAtom (NNumber 10)
+
+      it "folds comparisons into symbols" $ do
+        optimized " 3 < 4 && 5 == 5" `shouldBeRight` NAtom (NPlainSymbol trueSymbol)
+
+      it "doesn't fold a division by zero" $ do
+        let norm = optimized " 1 / 0"
+        (isPrimOp . resultAtom <$> norm) `shouldBeRight` True
+
+      it "doesn't fold results that are too large for a literal" $ do
+        let norm = optimized " 1048575 + 1"
+        (isPrimOp . resultAtom <$> norm) `shouldBeRight` True
+
+      it "selects the branch of a match on a known symbol" $ do
+        let code = " match :two with\n\
+                   \   :one -> 1 \n\
+                   \   :two -> 2 \n\
+                   \ end"
+        optimized code `shouldBeRight` NAtom (NNumber 2)
+
+      it "selects the branch of an if with a known condition" $ do
+        let code = " a = 3 \n\
+                   \ if a > 2 then 10 else 20"
+        optimized code `shouldBeRight` NAtom (NNumber 10)
+
+      it "inlines a small function" $ do
+        let code = " inc x = x + 1 \n\
+                   \ inc 41"
+        optimized code `shouldBeRight` NAtom (NNumber 42)
+
+      it "inlines functions that call other small functions" $ do
+        let code = " inc x = x + 1 \n\
+                   \ twice x = inc (inc x) \n\
+                   \ twice 5"
+        optimized code `shouldBeRight` NAtom (NNumber 7)
+
+      it "doesn't inline a recursive function" $ do
+        let code = " loop n = loop n \n\
+                   \ loop 1"
+        (elem "loop" . boundNames <$> optimized code) `shouldBeRight` True
+
+      it "removes bindings that are never used" $ do
+        let code = " a = 5 \n\
+                   \ f x = x * 2 \n\
+                   \ b = f \n\
+                   \ :result"
+        (boundNames <$> optimized code) `shouldBeRight` []
+
+      it "keeps function calls that aren't used" $ do
+        let code = " loop n = loop n \n\
+                   \ y = loop 1 \n\
+                   \ :result"
+        (elem "y" . boundNames <$> optimized code) `shouldBeRight` True
+
+  where
+    isPrimOp atom =
+      case atom of
+        NPrimOp _ -> True
+        _         -> False
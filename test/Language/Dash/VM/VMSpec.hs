@@ -1,26 +1,27 @@
 module Language.Dash.VM.VMSpec where
 
-import           Data.Word
+import qualified Data.Vector.Storable        as VS
 import           Language.Dash.Asm.Assembler
 import           Language.Dash.IR.Opcode
 import           Language.Dash.IR.Data
 import           Language.Dash.VM.DataEncoding
+import           Language.Dash.VM.Types
 import           Language.Dash.VM.VM
 import           Language.Dash.Limits
 import           Test.Hspec
 import           Test.QuickCheck
 
-runProg :: [[Opcode]] -> IO Word32
+runProg :: [[Opcode]] -> IO VMWord
 runProg = runProgTbl []
 
-runProgTbl :: [Word32] -> [[Opcode]] -> IO Word32
+runProgTbl :: [VMWord] -> [[Opcode]] -> IO VMWord
 runProgTbl tbl prog = do
   (value, _, _) <- execute asm tbl' []
   return value
   where
     (asm, tbl', _) =
-      let encProg = map EncodedFunction prog in
-      let resultOrError = assembleWithEncodedConstTable encProg tbl (fromIntegral.constAddrToInt) [] in
+      let encProg = map (EncodedFunction "") prog in
+      let resultOrError = assembleWithEncodedConstTable encProg (VS.fromList tbl) (fromIntegral.constAddrToInt) [] in
       case resultOrError of
         Left err -> error $ show err   -- TODO do this without an error
         Right result -> result
@@ -34,7 +35,7 @@ spec = do
       let prog = [[ OpcLoadI 0 55,
                     OpcRet 0 ]]
       result <- runProg prog
-      decodedResult <- decode result [] []
+      decodedResult <- decode result VS.empty []
       decodedResult `shouldBe` (VMNumber 55)
 
 
@@ -44,7 +45,7 @@ spec = do
                     OpcAdd 0 1 2,
                     OpcRet 0 ]]
       result <- runProg prog
-      decodedResult <- decode result [] []
+      decodedResult <- decode result VS.empty []
       decodedResult `shouldBe` (VMNumber 37)
 
     it "moves a register" $ do
@@ -52,7 +53,7 @@ spec = do
                     OpcMove  0 2,
                     OpcRet 0 ]]
       result <- runProg prog
-      decodedResult <- decode result [] []
+      decodedResult <- decode result VS.empty []
       decodedResult `shouldBe` (VMNumber 37)
 
     it "directly calls a function" $ do
@@ -63,12 +64,12 @@ spec = do
                     OpcSetArg 0 4 0,
                     OpcAp 0 3 1,
                     OpcRet 0 ], [
-                    OpcFunHeader 1,
+                    OpcFunHeader 1 3,
                     OpcLoadI  1 100,
                     OpcAdd  2 0 1,
                     OpcRet 2]]
       result <- runProg prog
-      decodedResult <- decode result [] []
+      decodedResult <- decode result VS.empty []
       decodedResult `shouldBe` (VMNumber 138)
 
     it "calls a closure downwards" $ do
@@ -81,7 +82,7 @@ spec = do
                     OpcAp 0 1 1,
                     OpcRet 0 ], [
                     -- fun1
-                    OpcFunHeader 2,
+                    OpcFunHeader 2 4,
                     OpcLoadI 2 115,
                     OpcLoadI 3 23,
                     OpcAdd 2 2 3,
@@ -90,11 +91,11 @@ spec = do
                     OpcRet 2 ], [
                     -- fun2
                     -- fun_header 1 1, -- (* 1 closed over value, 1 parameter *)
-                    OpcFunHeader 2,
+                    OpcFunHeader 2 3,
                     OpcSub 2 1 0,
                     OpcRet 2 ]]
       result <- runProg prog
-      decodedResult <- decode result [] []
+      decodedResult <- decode result VS.empty []
       decodedResult `shouldBe` (VMNumber 58) -- 115 + 23 - 80
 
     it "calls a closure upwards" $ do
@@ -105,18 +106,18 @@ spec = do
                     OpcGenAp 0 1 1,
                     OpcRet 0 ], [
                     -- fun 1
-                    OpcFunHeader 1,
+                    OpcFunHeader 1 3,
                     OpcLoadF 1 (mkFuncAddr 2),
                     OpcLoadI 2 24,
                     OpcSetArg 0 2 0,
                     OpcPartAp 0 1 1,
                     OpcRet 0 ], [
                     -- fun 2
-                    OpcFunHeader 2,
+                    OpcFunHeader 2 3,
                     OpcSub 2 1 0,
                     OpcRet 2 ]]
       result <- runProg prog
-      decodedResult <- decode result [] []
+      decodedResult <- decode result VS.empty []
       decodedResult `shouldBe` (VMNumber 56) -- 80 - 24
 
     it "modifies a closure" $ do
@@ -127,7 +128,7 @@ spec = do
                     OpcGenAp 0 1 1,
                     OpcRet 0 ], [
                     -- fun 1
-                    OpcFunHeader 1,
+                    OpcFunHeader 1 8,
                     OpcLoadF 1 (mkFuncAddr 2),
                     OpcLoadI 2 77,
                     OpcLoadI 3 55,
@@ -137,11 +138,11 @@ spec = do
                     OpcSetClVal 0 7 1,
                     OpcRet 0 ], [
                     -- fun 2
-                    OpcFunHeader 3,
+                    OpcFunHeader 3 4,
                     OpcSub 3 0 1,
                     OpcRet 3 ]]
       result <- runProg prog
-      decodedResult <- decode result [] []
+      decodedResult <- decode result VS.empty []
       decodedResult `shouldBe` (VMNumber 44) -- 77 - 33
 
 
@@ -186,7 +187,7 @@ spec = do
                     OpcLoadI 0 70,
                     OpcRet 0 ]]
       result <- runProg prog
-      decodedResult <- decode result [] []
+      decodedResult <- decode result VS.empty []
       decodedResult `shouldBe` (VMNumber 70)
 
 
@@ -203,7 +204,7 @@ spec = do
                     OpcMove 0 5,
                     OpcRet 0 ]]
       result <- runProg prog
-      decodedResult <- decode result [] []
+      decodedResult <- decode result VS.empty []
       -- result: 2 + 3 + 4 = 9
       decodedResult `shouldBe` (VMNumber 9)
 
@@ -223,7 +224,7 @@ spec = do
                     OpcLoadI 0 300,
                     OpcRet 0 ]]
       result <- runProgTbl ctable prog
-      decodedResult <- decode result ctable []
+      decodedResult <- decode result (VS.fromList ctable) []
       decodedResult `shouldBe` (VMNumber 300)
 
     it "matches a symbol" $ do
@@ -241,7 +242,7 @@ spec = do
                     OpcLoadI 0 300,
                     OpcRet 0 ]]
       result <- runProgTbl ctable prog
-      decodedResult <- decode result ctable []
+      decodedResult <- decode result (VS.fromList ctable) []
       decodedResult `shouldBe` (VMNumber 300)
 
     it "matches a data symbol" $ do
@@ -268,7 +269,7 @@ spec = do
                     OpcLoadI 0 300,
                     OpcRet 0 ]]
       result <- runProgTbl ctable prog
-      decodedResult <- decode result ctable []
+      decodedResult <- decode result (VS.fromList ctable) []
       decodedResult `shouldBe` (VMNumber 300)
 
     it "binds a value in a match" $ do
@@ -296,7 +297,7 @@ spec = do
                     OpcMove 0 4, -- reg 4 contains match var 1 (see pattern in ctable)
                     OpcRet 0 ]]
       result <- runProgTbl ctable prog
-      decodedResult <- decode result [] []
+      decodedResult <- decode result VS.empty []
       decodedResult `shouldBe` (VMNumber 77)
 
     it "loads a symbol on the heap" $ do
@@ -312,7 +313,7 @@ spec = do
                     OpcRet 0 ]]
       result <- runProgTbl ctable prog
       let symNames = ["X", "A", "Y", "B"]
-      let decodeResult = decode result ctable symNames
+      let decodeResult = decode result (VS.fromList ctable) symNames
       decodeResult `shouldReturn` (VMSymbol "B" [VMNumber 33, VMNumber 44])
 
     it "modifies a heap symbol" $ do
@@ -330,7 +331,7 @@ spec = do
                     OpcRet 0 ]]
       result <- runProgTbl ctable prog
       let symNames = ["X", "A", "Y", "B", "Z", "W", "success"]
-      let decodeResult = decode result ctable symNames
+      let decodeResult = decode result (VS.fromList ctable) symNames
       decodeResult `shouldReturn` (VMSymbol "B" [VMNumber 33, VMSymbol "success" []])
 
 
@@ -340,14 +341,13 @@ spec = do
       (runProg prog) `shouldReturn` (encodeStringRef $ mkConstAddr 55)
 
     it "determines the length of a string" $ do
-      let ctable = [ encodeStringHeader 5 2,
-                     encodeStringChunk 'd' 'a' 's' 'h',
-                     encodeStringChunk '!' '\0' '\0' '\0' ]
+      let ctable = [ encodeStringHeader 5 0,
+                     encodeStringChunk "dash!" ]
       let prog = [[ OpcLoadStr 1 (mkConstAddr 0),
                     OpcStrLen 0 1,
                     OpcRet 0 ]]
       result <- runProgTbl ctable prog
-      decodedResult <- decode result ctable []
+      decodedResult <- decode result (VS.fromList ctable) []
       decodedResult `shouldBe` (VMNumber 5)
 
     it "creates a new string" $ do
@@ -355,15 +355,14 @@ spec = do
                     OpcNewStr 0 1,
                     OpcRet 0 ]]
       result <- runProg  prog
-      decodedResult <- decode result [] []
+      decodedResult <- decode result VS.empty []
       decodedResult `shouldBe` (VMString "")
 
     it "copies a string" $ do
       let loop = (-6);
       let end = 4;
-      let ctable = [ encodeStringHeader 5 2,
-                     encodeStringChunk 'd' 'a' 's' 'h',
-                     encodeStringChunk '!' '\0' '\0' '\0' ]
+      let ctable = [ encodeStringHeader 5 0,
+                     encodeStringChunk "dash!" ]
       let prog = [[ OpcLoadStr 6 (mkConstAddr 0),
                     OpcStrLen 1 6,
                     OpcLoadI 2 0, -- index
@@ -380,9 +379,23 @@ spec = do
                     OpcMove 0 3,
                     OpcRet 0 ]]
       result <- runProgTbl ctable prog
-      decodedResult <- decode result ctable []
+      decodedResult <- decode result (VS.fromList ctable) []
       decodedResult `shouldBe` (VMString "dash!")
 
+    it "concatenates two strings" $ do
+      let ctable = [ encodeStringHeader 4 0,
+                     encodeStringChunk "dash",
+                     encodeStringHeader 9 0,
+                     encodeStringChunk "-lang is",
+                     encodeStringChunk " " ]
+      let prog = [[ OpcLoadStr 1 (mkConstAddr 0),
+                    OpcLoadStr 2 (mkConstAddr 2),
+                    OpcStrConcat 0 1 2,
+                    OpcRet 0 ]]
+      result <- runProgTbl ctable prog
+      decodedResult <- decode result (VS.fromList ctable) []
+      decodedResult `shouldBe` (VMString "dash-lang is ")
+
 
     it "looks up a value in a module" $ do
       let ctable = [ encodeOpaqueSymbolHeader (mkSymId 10) 2
@@ -395,7 +408,7 @@ spec = do
                   , OpcGetField 0 1 2
                   , OpcRet 0 ]]
       result <- runProgTbl ctable prog
-      decodedResult <- decode result ctable []
+      decodedResult <- decode result (VS.fromList ctable) []
       decodedResult `shouldBe` (VMNumber 33)
 
 
@@ -0,0 +1,143 @@
+#include <string.h>
+#include "array.h"
+#include "heap.h"
+#include "defs.h"
+#include "encoding.h"
+
+/*
+
+Arrays
+~~~~~~
+
+An array is a single heap object with its length in the header, followed by its
+elements. Getting an element or the length doesn't depend on the length of the
+array, and the garbage collector copies the whole array at once.
+
+Dash lists are compound symbols ($_list<head, tail>) that end with the plain symbol
+$_empty_list. Both symbols are built-in, so their ids are known to the vm and arrays
+can be converted from and to lists here (see OP_CONVERT).
+
+*/
+
+#define list_cell_size (compound_symbol_header_size + 2)
+#define empty_list make_tagged_val(symbol_id_empty_list, vm_tag_plain_symbol)
+
+
+static vm_value *array_pointer(vm_state *state, vm_value array) {
+  return heap_get_pointer(state, get_val(array));
+}
+
+
+size_t array_size(vm_state *state, vm_value array) {
+  return array_count(*array_pointer(state, array));
+}
+
+
+vm_value array_get(vm_state *state, vm_value array, size_t index) {
+  return array_pointer(state, array)[array_header_size + index];
+}
+
+
+void array_set(vm_state *state, vm_value array, size_t index, vm_value value) {
+  array_pointer(state, array)[array_header_size + index] = value;
+  heap_write_barrier(state, get_val(array), value);
+}
+
+
+// Returns the fields of a list cell, or NULL if the value isn't one
+static vm_value *list_cell_pointer(vm_state *state, vm_value value) {
+  vm_value *pointer;
+  switch(get_tag(value)) {
+    case vm_tag_compound_symbol:
+      pointer = state->const_table + get_val(value);
+      break;
+
+    case vm_tag_dynamic_compound_symbol:
+      pointer = heap_get_pointer(state, get_val(value));
+      break;
+
+    default:
+      return NULL;
+  }
+
+  if(compound_symbol_id(*pointer) != symbol_id_list_cons || compound_symbol_count(*pointer) != 2) {
+    return NULL;
+  }
+  return pointer + compound_symbol_header_size;
+}
+
+
+bool list_length(vm_state *state, vm_value list, size_t *length) {
+  size_t count = 0;
+  vm_value *cell;
+  while((cell = list_cell_pointer(state, list)) != NULL) {
+    ++count;
+    list = cell[1];
+  }
+  *length = count;
+  return list == empty_list;
+}
+
+
+size_t array_alloc_size(size_t length) {
+  return array_header_size + length;
+}
+
+
+size_t list_alloc_size(size_t length) {
+  return length * list_cell_size;
+}
+
+
+static heap_address alloc_array(vm_state *state, size_t length) {
+  heap_address addr = heap_alloc(state, array_alloc_size(length));
+  *heap_get_pointer(state, addr) = array_header(length);
+  return addr;
+}
+
+
+vm_value array_new(vm_state *state, size_t length, vm_value fill) {
+  heap_address addr = alloc_array(state, length);
+  vm_value *elements = heap_get_pointer(state, addr) + array_header_size;
+  for(size_t i = 0; i < length; ++i) {
+    elements[i] = fill;
+  }
+  return make_tagged_val(addr, vm_tag_array);
+}
+
+
+vm_value array_slice(vm_state *state, vm_value array, size_t start, size_t length) {
+  heap_address addr = alloc_array(state, length);
+  memcpy(heap_get_pointer(state, addr) + array_header_size,
+         array_pointer(state, array) + array_header_size + start,
+         length * sizeof(vm_value));
+  return make_tagged_val(addr, vm_tag_array);
+}
+
+
+vm_value array_from_list(vm_state *state, vm_value list, size_t length) {
+  heap_address addr = alloc_array(state, length);
+  vm_value *elements = heap_get_pointer(state, addr) + array_header_size;
+  for(size_t i = 0; i < length; ++i) {
+    vm_value *cell = list_cell_pointer(state, list);
+    elements[i] = cell[0];
+    list = cell[1];
+  }
+  return make_tagged_val(addr, vm_tag_array);
+}
+
+
+// Every cell is allocated on its own, so that the heap remembers each of them if they
+// end up in the old space
+vm_value array_to_list(vm_state *state, vm_value array) {
+  vm_value list = empty_list;
+  for(size_t i = array_size(state, array); i > 0; --i) {
+    heap_address addr = heap_alloc(state, list_cell_size);
+    vm_value *cell = heap_get_pointer(state, addr);
+    cell[0] = compound_symbol_header(symbol_id_list_cons, 2);
+    cell[compound_symbol_header_size] = array_get(state, array, i - 1);
+    cell[compound_symbol_header_size + 1] = list;
+    list = make_tagged_val(addr, vm_tag_dynamic_compound_symbol);
+  }
+  return list;
+}
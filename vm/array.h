@@ -0,0 +1,30 @@
+#ifndef _INCLUDE_ARRAY_H
+#define _INCLUDE_ARRAY_H
+
+#include <stdbool.h>
+#include "vm_internal.h"
+
+// Arrays can't be changed by Dash code. The only exception is array_set, which the
+// built-in functions use to fill an array they have just created.
+
+size_t array_size(vm_state *state, vm_value array);
+vm_value array_get(vm_state *state, vm_value array, size_t index);
+void array_set(vm_state *state, vm_value array, size_t index, vm_value value);
+
+// Returns false if the value isn't a list
+bool list_length(vm_state *state, vm_value list, size_t *length);
+
+// The number of words that the following functions allocate. The caller has to
+// reserve them with heap_reserve, because their arguments are not updated by the
+// garbage collector.
+size_t array_alloc_size(size_t length);
+size_t list_alloc_size(size_t length);
+
+vm_value array_new(vm_state *state, size_t length, vm_value fill);
+// Start and length have to be inside of the array
+vm_value array_slice(vm_state *state, vm_value array, size_t start, size_t length);
+// The length has to be the one from list_length
+vm_value array_from_list(vm_state *state, vm_value list, size_t length);
+vm_value array_to_list(vm_state *state, vm_value array);
+
+#endif
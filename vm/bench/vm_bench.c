@@ -0,0 +1,423 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "../vm_internal.h"
+#include "../opcodes.h"
+#include "../encoding.h"
+#include "../defs.h"
+
+/*
+
+VM benchmarks
+~~~~~~~~~~~~~
+
+Microbenchmarks for the interpreter, written with the op_* macros just like the
+specs. Every benchmark is a small program that runs one kind of instruction many
+times, and it is run a few times (`vm_bench [runs]`, 5 by default) in a fresh
+instance. The result of every run is checked, so that a broken vm doesn't look fast.
+
+The results are printed as CSV on stdout, one line per benchmark:
+  - the time of the fastest and of the median run in seconds
+  - the number of instructions that the program executes, which is counted by
+    running it once more with the profiler (see profiler.c)
+  - the time per instruction of the fastest run in nanoseconds
+
+*/
+
+#define array_length(x) (sizeof(x) / sizeof(x[0]))
+
+#define bias(n) ((n) + int_bias)
+#define small_bias(n) ((n) + small_int_bias)
+
+static int number_of_runs = 5;
+
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int compare_times(const void *a, const void *b) {
+  double l = *(const double *) a;
+  double r = *(const double *) b;
+  return (l > r) - (l < r);
+}
+
+// The profile of the whole program, without any function names, starts with the
+// number of executed instructions
+static long long count_instructions(vm_instruction *program, int program_length, vm_value *const_table, int const_table_length) {
+  char path[] = "/tmp/dash_vm_bench_XXXXXX";
+  FILE *file = fdopen(mkstemp(path), "r");
+  vm_instance *vm = vm_create(NULL);
+  vm_enable_profiling(vm);
+  vm_load_program(vm, program, program_length, const_table, const_table_length);
+  long long count = -1;
+  if(file != NULL && vm_write_profile(vm, path, NULL) && fscanf(file, "Instructions: %lld", &count) != 1) {
+    count = -1;
+  }
+  vm_destroy(vm);
+  if(file != NULL) {
+    fclose(file);
+  }
+  remove(path);
+  return count;
+}
+
+static bool run_benchmark(const char *name, vm_instruction *program, int program_length,
+                          vm_value *const_table, int const_table_length, vm_value expected) {
+  double *times = calloc(number_of_runs, sizeof(double));
+  for(int i = 0; i < number_of_runs; ++i) {
+    vm_instance *vm = vm_create(NULL);
+    double start = now();
+    vm_value result = vm_load_program(vm, program, program_length, const_table, const_table_length);
+    times[i] = now() - start;
+    vm_destroy(vm);
+
+    if(result != expected) {
+      fprintf(stderr, "%s: unexpected result %llx (expected %llx)\n", name,
+              (unsigned long long) result, (unsigned long long) expected);
+      free(times);
+      return false;
+    }
+  }
+
+  qsort(times, number_of_runs, sizeof(double), compare_times);
+  long long instructions = count_instructions(program, program_length, const_table, const_table_length);
+  printf("%s,%i,%.6f,%.6f,%lld,%.3f\n", name, number_of_runs, times[0], times[number_of_runs / 2],
+         instructions, instructions > 0 ? times[0] * 1e9 / instructions : 0.0);
+  fflush(stdout);
+  free(times);
+  return true;
+}
+
+// Writes a constant string to the const table and returns the number of words it takes
+static int const_string(vm_value *table, const char *str) {
+  size_t length = strlen(str);
+  size_t num_chunks = (length + sizeof(vm_value)) / sizeof(vm_value);
+  table[0] = string_header(length, 0);
+  memset(table + string_header_size, 0, num_chunks * sizeof(vm_value));
+  memcpy(table + string_header_size, str, length);
+  return string_header_size + num_chunks;
+}
+
+
+/* Dispatch */
+
+// A loop of plain instructions, without superinstructions
+static bool dispatch(void) {
+  vm_instruction program[] = {
+    op_load_i(1, bias(1000)),
+    op_load_i(2, bias(10000)),
+    op_mul(2, 1, 2), /* 10M iterations */
+    op_load_i(1, bias(0)),
+    op_load_i(3, bias(1)),
+    op_load_i(5, bias(0)),
+    /* loop: */
+    op_add(1, 1, 3),
+    op_add(5, 5, 1),
+    op_lt(4, 1, 2),
+    op_jmp_true(4, bias(-4)),
+    op_ret(5)
+  };
+  int64_t n = 10000000;
+  return run_benchmark("dispatch", program, array_length(program), 0, 0, make_number(n * (n + 1) / 2));
+}
+
+static bool dispatch_superinstructions(void) {
+  vm_instruction program[] = {
+    op_load_i(1, bias(1000)),
+    op_load_i(2, bias(10000)),
+    op_mul(2, 1, 2),
+    op_load_i(1, bias(0)),
+    /* loop: */
+    op_add_i(1, 1, 3, small_bias(1)),
+    op_jmp_lt(4, 1, 2, small_bias(-2)),
+    op_ret(1)
+  };
+  return run_benchmark("dispatch_superinstructions", program, array_length(program), 0, 0, make_number(10000000));
+}
+
+
+/* Calls */
+
+static bool direct_calls(void) {
+  const int fun_address = 9;
+  vm_instruction program[] = {
+    op_load_i(1, bias(1000)),
+    op_load_i(2, bias(1000)),
+    op_mul(2, 1, 2),
+    op_load_i(1, bias(0)),
+    op_load_f(3, fun_address),
+    /* loop: */
+    op_set_arg(0, 1, 0),
+    op_ap(1, 3, 1),
+    op_jmp_lt(4, 1, 2, small_bias(-3)),
+    op_ret(1),
+
+    /* inc x = x + 1 */
+    fun_header_with_frame(1, 2),
+    op_add_i(0, 0, 1, small_bias(1)),
+    op_ret(0)
+  };
+  return run_benchmark("direct_calls", program, array_length(program), 0, 0, make_number(1000000));
+}
+
+static bool tail_calls(void) {
+  const int fun_address = 7;
+  vm_instruction program[] = {
+    op_load_i(1, bias(1000)),
+    op_load_i(2, bias(5000)),
+    op_mul(1, 1, 2),
+    op_load_f(3, fun_address),
+    op_set_arg(0, 1, 0),
+    op_ap(0, 3, 1),
+    op_ret(0),
+
+    /* count_down n = if n == 0 then 0 else count_down (n - 1) */
+    fun_header_with_frame(1, 4),
+    op_load_i(1, bias(0)),
+    op_jmp_eq(2, 0, 1, small_bias(4)),
+    op_sub_i(2, 0, 3, small_bias(1)),
+    op_load_f(3, fun_address),
+    op_set_arg(0, 2, 0),
+    op_tail_ap(3, 1),
+    op_ret(0)
+  };
+  return run_benchmark("tail_calls", program, array_length(program), 0, 0, make_number(0));
+}
+
+// The stack grows to 100000 frames
+static bool deep_recursion(void) {
+  const int fun_address = 7;
+  vm_instruction program[] = {
+    op_load_i(1, bias(100)),
+    op_load_i(2, bias(1000)),
+    op_mul(1, 1, 2),
+    op_load_f(2, fun_address),
+    op_set_arg(0, 1, 0),
+    op_ap(0, 2, 1),
+    op_ret(0),
+
+    /* sum n = if n == 0 then 0 else n + sum (n - 1) */
+    fun_header_with_frame(1, 4),
+    op_load_i(1, bias(0)),
+    op_jmp_eq(2, 0, 1, small_bias(6)),
+    op_sub_i(2, 0, 3, small_bias(1)),
+    op_load_f(3, fun_address),
+    op_set_arg(0, 2, 0),
+    op_ap(1, 3, 1),
+    op_add(1, 0, 1),
+    op_ret(1),
+    op_ret(1)
+  };
+  int64_t n = 100000;
+  return run_benchmark("deep_recursion", program, array_length(program), 0, 0, make_number(n * (n + 1) / 2));
+}
+
+
+/* Generic application (see do_gen_ap in vm.c) */
+
+static bool saturated_pap(void) {
+  const int fun_address = 12;
+  vm_instruction program[] = {
+    op_load_i(1, bias(1000)),
+    op_load_i(2, bias(1000)),
+    op_mul(2, 1, 2),
+    op_load_i(1, bias(1)),
+    op_set_arg(0, 1, 0),
+    op_load_f(3, fun_address),
+    op_part_ap(3, 3, 1), /* add 1 */
+    op_load_i(1, bias(0)),
+    /* loop: */
+    op_set_arg(0, 1, 0),
+    op_gen_ap(1, 3, 1),
+    op_jmp_lt(4, 1, 2, small_bias(-3)),
+    op_ret(1),
+
+    /* add a b = a + b */
+    fun_header(2),
+    op_add(0, 0, 1),
+    op_ret(0)
+  };
+  return run_benchmark("gen_ap_saturated_pap", program, array_length(program), 0, 0, make_number(1000000));
+}
+
+// Every iteration creates a pap and then applies it
+static bool undersaturated_call(void) {
+  const int fun_address = 13;
+  vm_instruction program[] = {
+    op_load_i(1, bias(1000)),
+    op_load_i(2, bias(1000)),
+    op_mul(2, 1, 2),
+    op_load_i(1, bias(0)),
+    op_load_f(3, fun_address),
+    op_load_i(6, bias(1)),
+    op_load_i(7, bias(0)),
+    /* loop: */
+    op_set_arg(0, 1, 0),
+    op_gen_ap(5, 3, 1),
+    op_set_arg(0, 6, 1),
+    op_gen_ap(1, 5, 2),
+    op_jmp_lt(4, 1, 2, small_bias(-5)),
+    op_ret(1),
+
+    /* add3 a b c = a + b + c */
+    fun_header(3),
+    op_add(0, 0, 1),
+    op_add(0, 0, 2),
+    op_ret(0)
+  };
+  return run_benchmark("gen_ap_undersaturated", program, array_length(program), 0, 0, make_number(1000000));
+}
+
+// A function with one parameter that returns a closure is called with two arguments
+static bool oversaturated_call(void) {
+  const int adder_address = 11;
+  const int add_address = 16;
+  vm_instruction program[] = {
+    op_load_i(1, bias(1000)),
+    op_load_i(2, bias(1000)),
+    op_mul(2, 1, 2),
+    op_load_i(1, bias(0)),
+    op_load_f(3, adder_address),
+    op_load_i(6, bias(1)),
+    /* loop: */
+    op_set_arg(0, 1, 0),
+    op_set_arg(1, 6, 0),
+    op_gen_ap(1, 3, 2),
+    op_jmp_lt(4, 1, 2, small_bias(-4)),
+    op_ret(1),
+
+    /* adder a = add a */
+    fun_header(1),
+    op_set_arg(0, 0, 0),
+    op_load_f(1, add_address),
+    op_part_ap(0, 1, 1),
+    op_ret(0),
+
+    /* add a b = a + b */
+    fun_header(2),
+    op_add(0, 0, 1),
+    op_ret(0)
+  };
+  return run_benchmark("gen_ap_oversaturated", program, array_length(program), 0, 0, make_number(1000000));
+}
+
+
+/* Matching */
+
+// Every arm of the match sets the subject for the next iteration to the symbol of
+// the next arm, so that all arms are taken equally often
+static bool match_symbols(const char *name, bool is_switch) {
+  const int number_of_patterns = 8;
+  vm_value const_table[1 + 8 + 2 + 2 * 8];
+  const_table[0] = match_header(number_of_patterns);
+  const_table[1 + number_of_patterns] = number_of_patterns; /* the match table */
+  const_table[2 + number_of_patterns] = number_of_patterns;
+  for(int i = 0; i < number_of_patterns; ++i) {
+    const_table[1 + i] = make_tagged_val(i, vm_tag_plain_symbol);
+    const_table[3 + number_of_patterns + 2 * i] = make_tagged_val(i, vm_tag_plain_symbol);
+    const_table[4 + number_of_patterns + 2 * i] = i;
+  }
+
+  const int loop = 6;
+  const int arms = loop + 1;
+  const int arm_code = arms + number_of_patterns;
+  const int loop_end = arm_code + 2 * number_of_patterns;
+  vm_instruction program[loop_end + 3];
+  program[0] = op_load_i(1, bias(1000));
+  program[1] = op_load_i(2, bias(1000));
+  program[2] = op_mul(2, 1, 2);
+  program[3] = op_load_i(1, bias(0));
+  program[4] = op_load_ps(5, 0);
+  program[5] = op_load_i(6, bias(0)); /* the address of the patterns */
+  program[loop] = is_switch ? op_jmp_match(5, 0) : op_match(5, 6, 0);
+  for(int i = 0; i < number_of_patterns; ++i) {
+    int code = arm_code + 2 * i;
+    program[arms + i] = op_jmp(bias(code - (arms + i + 1)));
+    program[code] = op_load_ps(5, (i + 1) % number_of_patterns);
+    program[code + 1] = op_jmp(bias(loop_end - (code + 2)));
+  }
+  program[loop_end] = op_add_i(1, 1, 3, small_bias(1));
+  program[loop_end + 1] = op_jmp_lt(4, 1, 2, small_bias(loop - (loop_end + 2)));
+  program[loop_end + 2] = op_ret(1);
+  return run_benchmark(name, program, array_length(program), const_table, array_length(const_table), make_number(1000000));
+}
+
+
+/* Strings */
+
+static bool string_concat(void) {
+  vm_value const_table[8] = { 0 };
+  int second = const_string(const_table, "");
+  const_string(const_table + second, "0123456789");
+  vm_instruction program[] = {
+    op_load_str(1, 0),
+    op_load_str(2, second),
+    op_load_i(3, bias(0)),
+    op_load_i(4, bias(100000)),
+    /* loop: */
+    op_str_concat(1, 1, 2),
+    op_add_i(3, 3, 5, small_bias(1)),
+    op_jmp_lt(6, 3, 4, small_bias(-3)),
+    /* taking a sub string flattens the rope */
+    op_load_i(7, bias(999990)),
+    op_load_i(8, bias(3)),
+    op_sub_str(1, 1, 7),
+    op_str_len(0, 1),
+    op_ret(0)
+  };
+  return run_benchmark("string_concat", program, array_length(program), const_table, array_length(const_table), make_number(3));
+}
+
+// Two equal strings that are not the same object, so they are compared character
+// by character
+static bool string_compare(void) {
+  vm_value const_table[16] = { 0 };
+  int second = const_string(const_table, "0123456789012345678901234567890123456789");
+  const_string(const_table + second, "0123456789012345678901234567890123456789");
+  vm_instruction program[] = {
+    op_load_i(1, bias(1000)),
+    op_load_i(2, bias(1000)),
+    op_mul(2, 1, 2),
+    op_load_i(1, bias(0)),
+    op_load_str(5, 0),
+    op_load_str(6, second),
+    /* loop: */
+    op_str_cmp(7, 5, 6),
+    op_add_i(1, 1, 3, small_bias(1)),
+    op_jmp_lt(4, 1, 2, small_bias(-3)),
+    op_ret(1)
+  };
+  return run_benchmark("string_compare", program, array_length(program), const_table, array_length(const_table), make_number(1000000));
+}
+
+
+int main(int argc, char **argv) {
+  if(argc > 1) {
+    number_of_runs = atoi(argv[1]);
+    if(number_of_runs < 1) {
+      fprintf(stderr, "Usage: %s [runs]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  printf("benchmark,runs,min_seconds,median_seconds,instructions,ns_per_instruction\n");
+  bool ok = dispatch()
+            && dispatch_superinstructions()
+            && direct_calls()
+            && tail_calls()
+            && deep_recursion()
+            && saturated_pap()
+            && undersaturated_call()
+            && oversaturated_call()
+            && match_symbols("match", false)
+            && match_symbols("match_switch", true)
+            && string_concat()
+            && string_compare();
+  return ok ? 0 : 1;
+}
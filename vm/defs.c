@@ -6,11 +6,14 @@ const int fun_header_size = 1;
 const int pap_header_size = 2;
 const int compound_symbol_header_size = 1;
 const int string_header_size = 1;
+const int rope_size = 3;
+const int map_node_header_size = 2;
+const int array_header_size = 1;
 
 
-const int max_biased_int = 0x1FFFFF;
-const int min_biased_int = 0;
 const int int_bias = 0xFFFFF;
+// for the 11 bit numbers of superinstructions (see opcodes.h)
+const int small_int_bias = 0x3FF;
 
 
 
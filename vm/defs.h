@@ -14,11 +14,17 @@
 #define vm_tag_string 0x9
 #define vm_tag_dynamic_string 0xA
 #define vm_tag_opaque_symbol 0xB
+// a string that is the concatenation of two other strings (see OP_STR_CONCAT)
+#define vm_tag_rope 0xC
+// a persistent hash map (see map.c)
+#define vm_tag_map 0xD
+// an immutable array of values (see array.c)
+#define vm_tag_array 0xE
 #define vm_tag_match_data 0xF
 
 // match data will never appear on the heap, so we can reuse the tag.
 // (Used by the garbage collector to mark the moved position of data.)
-#define vm_tag_forward_pointer vm_tag_match_data;
+#define vm_tag_forward_pointer vm_tag_match_data
 
 #define symbol_id_false 0
 #define symbol_id_true 1
@@ -33,27 +39,64 @@
 #define symbol_id_record 9
 #define symbol_id_nil 10
 #define symbol_id_runtime_error 11
+#define symbol_id_list_cons 12
+#define symbol_id_empty_list 13
+#define symbol_id_array 14
+#define symbol_id_list 15
 
 
 extern const int action_id_return;
 extern const int action_id_readline;
 extern const int action_id_printline;
+extern const int action_id_flush;
+extern const int action_id_spawn;
+extern const int action_id_await;
+extern const int action_id_new_channel;
+extern const int action_id_send;
+extern const int action_id_receive;
 
 extern const int fun_header_size;
 extern const int pap_header_size;
 extern const int compound_symbol_header_size;
 extern const int string_header_size;
+extern const int rope_size;
+extern const int map_node_header_size;
+extern const int array_header_size;
 
-extern const int max_biased_int;
-extern const int min_biased_int;
 extern const int int_bias;
+extern const int small_int_bias;
 
-#define stack_size 255
 #define num_regs 32
 
+// stack sizes are in frames. The stack starts small and grows up to the maximum
+#define initial_stack_size 256
+#define default_max_stack_size (1 << 18)
+
+// the number of calls after which a function is compiled by the jit
+#define default_jit_threshold 1000
+
+// heap sizes are in words per semispace. Heap addresses have to fit into the
+// 60 bit payload of a tagged value, so by default the heap grows until memory
+// runs out.
+#define default_heap_size 4096
+#define default_nursery_size 2048
+#define heap_address_limit 0x0FFFFFFFFFFFFFFFULL
+
+// concatenating strings of at least this length creates a rope instead of a copy
+#define min_rope_length 64
+
 #define action_id_return 0
 #define action_id_readline 1
 #define action_id_printline 2
+#define action_id_flush 3
+#define action_id_spawn 4
+#define action_id_await 5
+#define action_id_new_channel 6
+#define action_id_send 7
+#define action_id_receive 8
+
+// the number of calls and returns a green thread can do before it's preempted
+#define thread_time_slice 1000
 
 #endif
 
@@ -4,19 +4,33 @@
 #include "vm.h"
 
 #define __tag_bits 4
+#define __value_bits (sizeof(vm_value) * 8 - __tag_bits)
 
 //TODO 14 bits for symbol id's is actually not that much if all module fields
 //are encoded as symbols
 
+#define low_60_bits 0x0FFFFFFFFFFFFFFFULL
+#define low_30_bits 0x3FFFFFFF
 #define low_28_bits 0x0FFFFFFF
 #define low_27_bits 0x07FFFFFF
 #define low_14_bits 0x3FFF
 #define high_14_bits 0xFFFC000
 
-#define __tag_mask(t) ((t & 0xF) << (sizeof(vm_value) * 8 - __tag_bits))
-#define make_tagged_val(x, t) (x | __tag_mask(t))
-#define get_val(v) (v & low_28_bits)
-#define get_tag(x) (x >> (sizeof(vm_value) * 8 - __tag_bits))
+#define __tag_mask(t) (((vm_value) (t) & 0xF) << __value_bits)
+#define make_tagged_val(x, t) ((vm_value) (x) | __tag_mask(t))
+#define get_val(v) ((v) & low_60_bits)
+#define get_tag(x) ((x) >> __value_bits)
+
+// Numbers are 60 bit two's complement integers with tag 0. Shifting a number to the
+// left by __tag_bits gives us a 64 bit integer that is an exact multiple of the
+// number, so the hardware overflow checks for 64 bit integers also work for
+// numbers (see OP_ADD).
+#define max_number ((int64_t) (low_60_bits >> 1))
+#define min_number (-max_number - 1)
+#define make_number(n) ((vm_value) (n) & low_60_bits)
+#define get_number(v) (((int64_t) ((v) << __tag_bits)) >> __tag_bits)
+#define number_to_shifted(v) ((int64_t) ((v) << __tag_bits))
+#define shifted_to_number(n) ((vm_value) (n) >> __tag_bits)
 
 #define pap_header(arity, num_vars) (make_tagged_val(((arity << 14) | num_vars), vm_tag_pap))
 #define pap_arity(header) ((get_val(header) & high_14_bits) >> 14)
@@ -36,28 +50,59 @@
 //owner is always 0, this way we know that it is a module.
 
 
-#define string_header(len, num_chunks) (make_tagged_val(((len << 14) | num_chunks), vm_tag_string))
-#define string_length(header) ((get_val(header) & high_14_bits) >> 14)
-#define string_chunk_count(header) (get_val(header) & low_14_bits)
-
-
-#define number(x) get_val(x, vm_type_number)
-#define plain_symbol(x) get_val(x, vm_type_plain_symbol)
-#define compound_symbol(x) get_val(x, vm_type_compound_symbol)
+//strings can be a lot longer than symbols, so their header fields have 30 bits each. The
+//second field is a hash of the characters (see string_hash_of in vm.c), where 0 means
+//that it hasn't been computed yet. The characters are followed by a '\0'.
+#define max_string_length low_30_bits
+#define string_header(len, hash) (make_tagged_val((((vm_value) (len) << 30) | (hash)), vm_tag_string))
+#define string_length(header) ((get_val(header) >> 30) & low_30_bits)
+#define string_hash(header) (get_val(header) & low_30_bits)
+#define string_chunk_count(header) ((string_length(header) + sizeof(vm_value)) / sizeof(vm_value))
+
+//a rope has a header, its left and its right part. The header has the same layout as a
+//string header, so string_length works for ropes too. When a rope is flattened, the
+//flat string replaces its left part and the right part is set to nil.
+#define rope_header(len) (make_tagged_val(((vm_value) (len) << 30), vm_tag_rope))
+#define rope_is_flat(rope_pointer) (get_tag((rope_pointer)[2]) == vm_tag_plain_symbol)
+
+
+//a map is a trie of nodes (see map.c). The header of a node holds the number of entries
+//in the node and all nodes below it, and a bitmap of its entries. The second header
+//word holds a bitmap of its child nodes. The entries (key and value) follow the header,
+//and the child nodes follow the entries. A collision node holds entries whose keys have
+//the same hash. It has the collision bit in its second header word, and all of its
+//entries are counted in its header.
+#define map_node_header(count, datamap) (make_tagged_val(((vm_value) (count) << 32) | (datamap), vm_tag_map))
+#define map_node_count(header) (get_val(header) >> 32)
+#define map_node_datamap(header) ((uint32_t) (header))
+#define map_collision_bit ((vm_value) 1 << 32)
+#define map_node_is_collision(node_pointer) (((node_pointer)[1] & map_collision_bit) != 0)
+#define map_node_nodemap(node_pointer) ((uint32_t) (node_pointer)[1])
+#define map_node_size(node_pointer) (map_node_is_collision(node_pointer) \
+    ? map_node_header_size + 2 * map_node_count((node_pointer)[0]) \
+    : map_node_header_size + 2 * __builtin_popcount(map_node_datamap((node_pointer)[0])) \
+                           + __builtin_popcount(map_node_nodemap(node_pointer)))
+
+
+//an array has a header with its length, followed by its elements
+#define max_array_length (heap_address_limit / 2)
+#define array_header(len) (make_tagged_val((vm_value) (len), vm_tag_array))
+#define array_count(header) get_val(header)
 
 
 // In addition to the usual tag, match data also uses the bit after the tag (currently the
 // fifth bit from the left) to encode additional information. If the bit is set, the value
 // is a match header. If it isn't set, it is a variable to be captured. The wildcard ("_")
-// has a special value of 0xFFFFFFF (all low 28 bits set).
-#define match_wildcard_value low_28_bits
-#define __single_bit(b, n) (b << (sizeof(vm_value) * 8 - n))
-#define __match_data_mask(t, n) ( __tag_mask(vm_tag_match_data) | __single_bit(t, 5) | (n & low_27_bits) )
+// has a special value of 0x7FFFFFF (all low 27 bits set).
+#define match_wildcard_value low_27_bits
+#define __single_bit(b, n) ((vm_value) (b) << (sizeof(vm_value) * 8 - n))
+#define __match_data_mask(t, n) ( __tag_mask(vm_tag_match_data) | __single_bit(t, 5) | ((n) & low_27_bits) )
 #define match_header(n) __match_data_mask(1, n)
 #define match_wildcard __match_data_mask(0, match_wildcard_value)
 #define match_var(n) __match_data_mask(0, n)
 
-#define from_match_value(v) (v & low_27_bits)
+#define is_match_header(v) (((v) & __single_bit(1, 5)) != 0)
+#define from_match_value(v) ((v) & low_27_bits)
 
 
 #endif
@@ -1,23 +1,247 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include "gc.h"
 #include "vm_internal.h"
+#include "defs.h"
+#include "encoding.h"
 
+/*
 
-stack_frame *stack = 0;
-int *stack_pointer = 0;
+Garbage collector
+~~~~~~~~~~~~~~~~~
 
-void gc_set_stack(stack_frame *stack_arg, int *stack_pointer_arg) {
-  stack = stack_arg;
-  stack_pointer = stack_pointer_arg;
+This is a Cheney-style copying collector. All live objects are copied from the
+old semispace to the new one. The roots are the registers and the spilled arguments
+of all stack frames, and the result of the loaded program (see vm_load_program).
+Every object that has been copied gets a forward pointer as its header, which holds
+the object's new address. After the roots have been copied, the new semispace is
+scanned from left to right and every reference found in a copied object is
+evacuated as well, until the scan pointer catches up with the allocation pointer.
+
+We scan *all* registers that have ever been used, not only those of the frames up
+to the stack pointer. Registers above the current frames still contain references
+from earlier calls, and they are not necessarily overwritten when they are reused.
+If we didn't update them, the next collection could find a stale address in them.
+Registers above the high-water mark are still zero, so they don't need scanning.
+
+Heap objects always start with a header that tells us their size:
+  - PAP:             header, function address, closure values
+  - compound symbol: header, fields
+  - string:          header, chunks (not scanned)
+  - rope:            header, left part, right part
+  - map node:        header, bitmap of child nodes, keys and values, child nodes
+  - array:           header, elements
+
+
+Minor collections
+~~~~~~~~~~~~~~~~~
+
+Most objects die young, so new objects are allocated in a small nursery at the
+beginning of the heap (see heap.c). A minor collection uses the same algorithm, but
+only evacuates objects inside the nursery, and copies them to the end of the old
+space of the same heap. Old objects which have been modified to point into the
+nursery are recorded in the remembered set (by the write barrier) and are scanned
+as additional roots.
+
+*/
+
+// The state of a single collection
+typedef struct {
+  vm_state *roots;
+  vm_value *from_space;
+  vm_value *to_space;
+  heap_address next_free;
+  // Only objects below this address are evacuated
+  heap_address evacuation_limit;
+} collection;
+
+
+static bool is_heap_reference(vm_value value) {
+  vm_value tag = get_tag(value);
+  return tag == vm_tag_pap
+      || tag == vm_tag_dynamic_compound_symbol
+      || tag == vm_tag_dynamic_string
+      || tag == vm_tag_rope
+      || tag == vm_tag_map
+      || tag == vm_tag_array;
+}
+
+
+static size_t object_size(vm_value *object) {
+  vm_value header = *object;
+  switch(get_tag(header)) {
+    case vm_tag_pap:
+      return pap_header_size + pap_var_count(header);
+
+    case vm_tag_compound_symbol:
+      return compound_symbol_header_size + compound_symbol_count(header);
+
+    case vm_tag_string:
+      return string_header_size + string_chunk_count(header);
+
+    case vm_tag_rope:
+      return rope_size;
+
+    case vm_tag_map:
+      return map_node_size(object);
+
+    case vm_tag_array:
+      return array_header_size + array_count(header);
+
+    default:
+      fprintf(stderr, "GC: Unknown object header: %016llx\n", (unsigned long long) header);
+      exit(-1);
+  }
+}
+
+
+// Copies a single object to the new semispace (unless it has been copied already)
+// and returns its new address.
+static heap_address evacuate(collection *c, heap_address addr) {
+  if(addr >= c->evacuation_limit) {
+    return addr;
+  }
+
+  vm_value *object = c->from_space + addr;
+  vm_value header = *object;
+
+  if(get_tag(header) == vm_tag_forward_pointer) {
+    return get_val(header);
+  }
+
+  size_t size = object_size(object);
+  heap_address new_addr = c->next_free;
+  memcpy(c->to_space + new_addr, object, size * sizeof(vm_value));
+  c->next_free += size;
+
+  *object = make_tagged_val(new_addr, vm_tag_forward_pointer);
+  return new_addr;
+}
+
+
+static vm_value forward_value(collection *c, vm_value value) {
+  if(!is_heap_reference(value)) {
+    return value;
+  }
+  heap_address new_addr = evacuate(c, get_val(value));
+  return make_tagged_val(new_addr, get_tag(value));
 }
 
 
-int gc_collect(vm_value *old_heap, vm_value *new_heap, int heap_size) {
-  fprintf(stderr, "TODO: implement garbage collector\n");
-  exit(-1);
-  return 0;
+static void forward_values(collection *c, vm_value *values, size_t count) {
+  for(size_t i = 0; i < count; ++i) {
+    values[i] = forward_value(c, values[i]);
+  }
 }
 
 
+static void scan_stack(collection *c, stack_frame *stack, size_t stack_capacity, vm_value *registers, size_t registers_used) {
+  forward_values(c, registers, registers_used);
+  for(size_t i = 0; i < stack_capacity; ++i) {
+    stack_frame *frame = &stack[i];
+    if(frame->spilled_arguments != 0) {
+      frame->spilled_arguments = evacuate(c, frame->spilled_arguments);
+    }
+  }
+}
+
+
+static void scan_roots(collection *c) {
+  vm_state *state = c->roots;
+  // the stack can grow between collections, so we always read the current buffers
+  scan_stack(c, state->stack, state->stack_capacity, state->registers, state->registers_used);
+  state->result = forward_value(c, state->result);
+
+  // the running thread uses the stack of the state
+  vm_scheduler *s = &state->scheduler;
+  for(int i = 0; i < s->thread_count; ++i) {
+    vm_thread *t = &s->threads[i];
+    if(t->status == thread_finished) {
+      t->result = forward_value(c, t->result);
+    }
+    else if(t->status != thread_running) {
+      scan_stack(c, t->stack, t->stack_capacity, t->registers, t->registers_used);
+    }
+  }
+
+  for(int i = 0; i < s->channel_count; ++i) {
+    vm_channel *channel = &s->channels[i];
+    for(size_t j = 0; j < channel->count; ++j) {
+      vm_value *message = &channel->messages[(channel->first + j) % channel->capacity];
+      *message = forward_value(c, *message);
+    }
+  }
+}
+
+
+// Evacuates everything an object refers to and returns the object's size
+static size_t scan_object(collection *c, vm_value *object) {
+  vm_value header = *object;
+
+  switch(get_tag(header)) {
+    case vm_tag_pap:
+      // the second header field is the (untagged) function address
+      forward_values(c, object + pap_header_size, pap_var_count(header));
+      break;
+
+    case vm_tag_compound_symbol:
+      forward_values(c, object + compound_symbol_header_size, compound_symbol_count(header));
+      break;
+
+    case vm_tag_rope:
+      // the right part of a flattened rope is nil, which forward_value leaves alone
+      forward_values(c, object + 1, rope_size - 1);
+      break;
+
+    case vm_tag_map:
+      // the second header word is the bitmap of the child nodes
+      forward_values(c, object + map_node_header_size, map_node_size(object) - map_node_header_size);
+      break;
+
+    case vm_tag_array:
+      forward_values(c, object + array_header_size, array_count(header));
+      break;
+
+    default:
+      // strings don't contain references
+      break;
+  }
+
+  return object_size(object);
+}
+
+
+static void scan_copied_objects(collection *c, heap_address scan) {
+  while(scan < c->next_free) {
+    scan += scan_object(c, c->to_space + scan);
+  }
+}
+
+
+heap_address gc_collect(vm_state *state, vm_value *old_heap, vm_value *new_heap, heap_address start) {
+  collection c = { state, old_heap, new_heap, start, (heap_address) -1 };
+
+  scan_roots(&c);
+  scan_copied_objects(&c, start);
+  return c.next_free;
+}
+
+
+heap_address gc_collect_young(vm_state *state,
+                              vm_value *heap,
+                              heap_address nursery_end,
+                              heap_address next_free_address,
+                              heap_address *remembered,
+                              size_t num_remembered) {
+  collection c = { state, heap, heap, next_free_address, nursery_end };
+
+  scan_roots(&c);
+  for(size_t i = 0; i < num_remembered; ++i) {
+    scan_object(&c, heap + remembered[i]);
+  }
+  scan_copied_objects(&c, next_free_address);
+  return c.next_free;
+}
+
@@ -3,10 +3,23 @@
 
 #include "vm_internal.h"
 
-void gc_set_stack(stack_frame *stack, int *stack_pointer);
+// The roots are the used registers and the spilled arguments of all stack frames
+// of the given state, and the result of its program
 
-// returns the next free position on the new heap
-int gc_collect(vm_value *old_heap, vm_value *new_heap, int heap_size);
+// Copies all live objects to new_heap, starting at address `start`.
+// Returns the next free position on the new heap
+heap_address gc_collect(vm_state *state, vm_value *old_heap, vm_value *new_heap, heap_address start);
+
+// Moves all live objects from the nursery (everything below nursery_end) to the
+// old space, starting at next_free_address. The remembered objects are old objects
+// that might refer to objects in the nursery.
+// Returns the next free position in the old space
+heap_address gc_collect_young(vm_state *state,
+                              vm_value *heap,
+                              heap_address nursery_end,
+                              heap_address next_free_address,
+                              heap_address *remembered,
+                              size_t num_remembered);
 
 
 #endif
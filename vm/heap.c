@@ -1,59 +1,272 @@
 #include "heap.h"
 #include "gc.h"
+#include "vm_internal.h"
+#include "defs.h"
+#include "encoding.h"
+#include "profiler.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
 
-static vm_value *heap = 0;
-static vm_value *other_heap = 0;
-static size_t heap_size = 4096;
-static heap_address next_free_address = 0;
+/*
 
-static void run_gc();
+The heap consists of two semispaces of equal size. After every major garbage
+collection we check how much of the old space is occupied by live data. If more than
+half of it is used, both semispaces grow (up to max_heap_size). If live data drops
+below an eighth of the old space, they shrink again (but never below the initial
+size). Heap addresses are offsets into the semispace, so resizing doesn't invalidate
+any values.
 
-void heap_init() {
-  if (heap) {
-    free(heap);
+Every semispace starts with the nursery, followed by the old space:
+
+  | 0 | nursery ... | old space ...                 |
+      1             nursery_end                     nursery_end + size
+
+Small objects are allocated in the nursery. When it's full, a minor collection
+moves all surviving nursery objects into the old space of the same semispace, so
+afterwards the nursery is empty again. Only if the old space can't take all of the
+nursery, we do a major collection, which copies both the nursery and the old space
+into the old space of the other semispace (whose nursery becomes the new nursery).
+Since the nursery is always at the same position, a heap address is valid in both
+generations and heap_get_pointer doesn't have to care about generations at all.
+
+Objects that are too large for the nursery are allocated in the old space directly.
+Every old object that might point into the nursery has to be in the remembered set,
+which is what heap_write_barrier is for. Objects which are allocated in the old
+space are remembered right away, because they are initialised after allocation.
+
+A nursery size of 0 disables the nursery and every object is allocated in the old
+space.
+
+Every vm instance has its own heap in its vm_state, so the functions here take the
+state instead of using globals.
+
+*/
+
+#define heap_end(h) ((h)->nursery_end + (h)->size)
+
+static void run_gc(vm_state *state, size_t requested_size);
+static void run_minor_gc(vm_state *state);
+static void remember(vm_heap *h, heap_address addr);
+
+bool heap_init(vm_state *state, size_t initial_size, size_t max_size, size_t nursery_size) {
+  vm_heap *h = &state->heap;
+  memset(h, 0, sizeof(vm_heap));
+
+  if (nursery_size > heap_address_limit / 2) {
+    nursery_size = heap_address_limit / 2;
+  }
+  // a major collection might have to make room for the whole nursery (see run_gc)
+  if (max_size > heap_address_limit - 2 * nursery_size) {
+    max_size = heap_address_limit - 2 * nursery_size;
   }
-  if (other_heap) {
-    free(other_heap);
+  if (initial_size > max_size) {
+    initial_size = max_size;
   }
-  next_free_address = 1; // address 0 is reserved to indicate that no address has been set
-  heap = calloc(heap_size, sizeof(vm_value));
-  other_heap = calloc(heap_size, sizeof(vm_value));
+  if (initial_size < 2) {
+    initial_size = 2;
+  }
+
+  h->size = initial_size;
+  h->min_size = initial_size;
+  h->max_size = max_size;
+
+  // address 0 is reserved to indicate that no address has been set
+  h->nursery_end = 1 + nursery_size;
+  h->max_young_object_size = nursery_size / 2;
+  h->next_young_address = 1;
+  h->next_free_address = h->nursery_end;
+
+  h->space = calloc(heap_end(h), sizeof(vm_value));
+  h->other_space = calloc(heap_end(h), sizeof(vm_value));
+  return h->space != NULL && h->other_space != NULL;
 }
 
-heap_address heap_alloc(size_t size) {
-  heap_address old = next_free_address;
-  next_free_address += size;
-  if(next_free_address >= heap_size) {
+void heap_destroy(vm_state *state) {
+  vm_heap *h = &state->heap;
+  free(h->space);
+  free(h->other_space);
+  free(h->remembered_set);
+  memset(h, 0, sizeof(vm_heap));
+}
 
-    run_gc();
+// Note that any allocation can trigger a garbage collection, which moves objects
+// around. Pointers returned by heap_get_pointer are invalid after calling this,
+// and only values stored in a register are updated by the collector.
+heap_address heap_alloc(vm_state *state, size_t size) {
+  vm_heap *h = &state->heap;
+  heap_address addr;
 
-    if(next_free_address >= heap_size) {
-      printf("Out of memory!\n");
-      exit(-1);
+  if(state->profile != NULL) {
+    profile_allocation(state, size);
+  }
+
+  if(size <= h->max_young_object_size && h->old_space_reservation == 0) {
+    if(h->next_young_address + size > h->nursery_end) {
+      run_minor_gc(state);
+    }
+    addr = h->next_young_address;
+    h->next_young_address += size;
+  }
+  else {
+    if(h->next_free_address + size > heap_end(h)) {
+      run_gc(state, size);
+    }
+    addr = h->next_free_address;
+    h->next_free_address += size;
+    h->old_space_reservation = (h->old_space_reservation > size) ? h->old_space_reservation - size : 0;
+    if(h->nursery_end > 1) {
+      remember(h, addr);
     }
-    //TODO update returned address
   }
-  return old;
+
+  return addr;
+}
+
+// Makes sure that the next allocations of up to `size` words in total will not
+// trigger a garbage collection.
+void heap_reserve(vm_state *state, size_t size) {
+  vm_heap *h = &state->heap;
+  if(size <= h->max_young_object_size) {
+    if(h->next_young_address + size > h->nursery_end) {
+      run_minor_gc(state);
+    }
+  }
+  else {
+    // Would not fit into the nursery, so we allocate everything in the old space
+    h->old_space_reservation = size;
+  }
+
+  if(h->next_free_address + size > heap_end(h)) {
+    run_gc(state, size);
+  }
+}
+
+void heap_write_barrier(vm_state *state, heap_address addr, vm_value new_value) {
+  vm_heap *h = &state->heap;
+  if(addr < h->nursery_end) {
+    return;
+  }
+
+  vm_value tag = get_tag(new_value);
+  bool is_reference = tag == vm_tag_pap
+                   || tag == vm_tag_dynamic_compound_symbol
+                   || tag == vm_tag_dynamic_string
+                   || tag == vm_tag_rope
+                   || tag == vm_tag_map
+                   || tag == vm_tag_array;
+
+  if(is_reference && get_val(new_value) < h->nursery_end) {
+    remember(h, addr);
+  }
 }
 
-vm_value *heap_get_pointer(heap_address addr) {
-  if(addr > heap_size) {
+vm_value *heap_get_pointer(vm_state *state, heap_address addr) {
+  vm_heap *h = &state->heap;
+  if(addr >= heap_end(h)) {
     printf("Illegal memory address: %zu!\n", addr);
     exit(-1);
   }
-  return &heap[addr];
+  return &h->space[addr];
+}
+
+static void remember(vm_heap *h, heap_address addr) {
+  // Objects are often modified several times in a row
+  if(h->remembered_count > 0 && h->remembered_set[h->remembered_count - 1] == addr) {
+    return;
+  }
+
+  if(h->remembered_count == h->remembered_capacity) {
+    size_t capacity = h->remembered_capacity == 0 ? 64 : h->remembered_capacity * 2;
+    heap_address *resized = realloc(h->remembered_set, capacity * sizeof(heap_address));
+    if(resized == NULL) {
+      fprintf(stderr, "Out of memory!\n");
+      exit(-1);
+    }
+    h->remembered_set = resized;
+    h->remembered_capacity = capacity;
+  }
+  h->remembered_set[h->remembered_count++] = addr;
 }
 
 static void swap_pointers(vm_value **p1, vm_value **p2) {
   vm_value *temp = *p1;
-  *p2 = *p1;
-  *p1 = temp;
+  *p1 = *p2;
+  *p2 = temp;
+}
+
+static size_t new_heap_size(vm_heap *h, size_t used) {
+  size_t size = h->size;
+
+  while(used > size / 2 && size < h->max_size) {
+    size = (size > h->max_size / 2) ? h->max_size : size * 2;
+  }
+
+  if(size > h->max_size && used <= h->max_size) {
+    size = h->max_size;
+  }
+
+  while(used < size / 8 && size / 2 >= h->min_size) {
+    size /= 2;
+  }
+
+  return size;
+}
+
+static void resize_heap(vm_heap *h, size_t size) {
+  size_t total_size = h->nursery_end + size;
+  vm_value *resized = realloc(h->space, total_size * sizeof(vm_value));
+  vm_value *resized_other = realloc(h->other_space, total_size * sizeof(vm_value));
+  if(resized == NULL || resized_other == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    exit(-1);
+  }
+  h->space = resized;
+  h->other_space = resized_other;
+  h->size = size;
 }
 
-static void run_gc() {
-  next_free_address = gc_collect(heap, other_heap, heap_size);
-  swap_pointers(&heap, &other_heap);
+static void run_gc(vm_state *state, size_t requested_size) {
+  vm_heap *h = &state->heap;
+  // The old space has to be large enough for everything in the old space *and* the
+  // nursery, so it might temporarily have to exceed max_size
+  size_t worst_case = (h->next_free_address - h->nursery_end) + (h->next_young_address - 1);
+  if(worst_case > h->size) {
+    size_t size = new_heap_size(h, worst_case);
+    resize_heap(h, size < worst_case ? worst_case : size);
+  }
+
+  h->next_free_address = gc_collect(state, h->space, h->other_space, h->nursery_end);
+  swap_pointers(&h->space, &h->other_space);
+  h->next_young_address = 1;
+  h->remembered_count = 0;
+
+  size_t used = (h->next_free_address - h->nursery_end) + requested_size;
+  size_t size = new_heap_size(h, used);
+  if(size != h->size) {
+    resize_heap(h, size);
+  }
+
+  if(h->next_free_address + requested_size > heap_end(h)) {
+    fprintf(stderr, "Out of memory!\n");
+    exit(-1);
+  }
+}
+
+static void run_minor_gc(vm_state *state) {
+  vm_heap *h = &state->heap;
+  size_t nursery_used = h->next_young_address - 1;
+
+  // In the worst case, everything in the nursery survives
+  if(h->next_free_address + nursery_used > heap_end(h)) {
+    run_gc(state, 0);
+    return;
+  }
+
+  h->next_free_address = gc_collect_young(state, h->space, h->nursery_end, h->next_free_address,
+                                          h->remembered_set, h->remembered_count);
+  h->next_young_address = 1;
+  h->remembered_count = 0;
 }
 
@@ -3,12 +3,39 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include "vm.h"
 
 typedef size_t heap_address;
+typedef struct vm_state vm_state;
 
-heap_address heap_alloc(size_t size);
-vm_value *heap_get_pointer(heap_address addr);
-void heap_init(void);
+// Every vm instance has its own heap (see heap.c)
+typedef struct {
+  vm_value *space;
+  vm_value *other_space;
+  size_t size; // size of the old space
+  size_t min_size;
+  size_t max_size;
+  heap_address next_free_address;
+
+  heap_address nursery_end;
+  size_t max_young_object_size;
+  heap_address next_young_address;
+  // The next allocations of this many words will be done in the old space (see heap_reserve)
+  size_t old_space_reservation;
+
+  heap_address *remembered_set;
+  size_t remembered_count;
+  size_t remembered_capacity;
+} vm_heap;
+
+heap_address heap_alloc(vm_state *state, size_t size);
+void heap_reserve(vm_state *state, size_t size);
+vm_value *heap_get_pointer(vm_state *state, heap_address addr);
+// Has to be called whenever a value is stored in an existing heap object
+void heap_write_barrier(vm_state *state, heap_address addr, vm_value new_value);
+// sizes are in words per semispace, a nursery size of 0 disables the nursery
+bool heap_init(vm_state *state, size_t initial_size, size_t max_size, size_t nursery_size);
+void heap_destroy(vm_state *state);
 
 #endif
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+
+/*
+
+Images
+~~~~~~
+
+An image is a compiled program on disk (written by `dash --compile`, see
+Language.Dash.VM.Image). The sections are laid out so that the program and the
+constant table can be used right where they are in the mapped file:
+
+  offset 0:   "DASH"
+          4:  version                  (uint32)
+          8:  program length           (uint32, in instructions)
+          12: constant table length    (uint32, in words)
+          16: size of the symbol names (uint32, in bytes)
+          20: reserved                 (uint32)
+          24: program                  (uint32 per instruction)
+              padding to 8 bytes
+              constant table           (uint64 per word)
+              symbol names             (NUL-terminated)
+
+All numbers are little endian.
+
+*/
+
+static const char image_magic[4] = { 'D', 'A', 'S', 'H' };
+
+
+static uint32_t read_uint32(const unsigned char *bytes) {
+  return (uint32_t) bytes[0]
+       | (uint32_t) bytes[1] << 8
+       | (uint32_t) bytes[2] << 16
+       | (uint32_t) bytes[3] << 24;
+}
+
+
+static bool is_little_endian() {
+  uint32_t one = 1;
+  return *(unsigned char *) &one == 1;
+}
+
+
+static bool check_image(vm_image *image, char *error, size_t error_size) {
+  const unsigned char *bytes = image->mapping;
+  size_t size = image->mapping_size;
+
+  if(size < image_header_size || memcmp(bytes, image_magic, sizeof(image_magic)) != 0) {
+    snprintf(error, error_size, "Not a Dash image");
+    return false;
+  }
+  uint32_t version = read_uint32(bytes + 4);
+  if(version != image_version) {
+    snprintf(error, error_size, "Unsupported image version %u (expected %u)", version, image_version);
+    return false;
+  }
+  if(!is_little_endian()) {
+    snprintf(error, error_size, "Images can only be loaded on little endian machines");
+    return false;
+  }
+
+  // the lengths are 32 bit, so none of this can overflow
+  uint64_t program_length = read_uint32(bytes + 8);
+  uint64_t const_table_length = read_uint32(bytes + 12);
+  uint64_t symbol_names_size = read_uint32(bytes + 16);
+  if(program_length > INT32_MAX || const_table_length > INT32_MAX) {
+    snprintf(error, error_size, "Image is too large");
+    return false;
+  }
+
+  uint64_t program_size = program_length * sizeof(vm_instruction);
+  uint64_t const_table_offset = image_header_size + ((program_size + 7) & ~(uint64_t) 7);
+  uint64_t symbol_names_offset = const_table_offset + const_table_length * sizeof(vm_value);
+  if(symbol_names_offset + symbol_names_size != size) {
+    snprintf(error, error_size, "Image has the wrong size (%zu bytes, expected %llu)",
+             size, (unsigned long long) (symbol_names_offset + symbol_names_size));
+    return false;
+  }
+  if(symbol_names_size > 0 && bytes[size - 1] != '\0') {
+    snprintf(error, error_size, "Symbol names are not terminated");
+    return false;
+  }
+
+  // the mapping is page-aligned, so both sections are correctly aligned
+  image->program = (vm_instruction *) (bytes + image_header_size);
+  image->program_length = (int) program_length;
+  image->const_table = (vm_value *) (bytes + const_table_offset);
+  image->const_table_length = (int) const_table_length;
+  image->symbol_names = (const char *) (bytes + symbol_names_offset);
+  image->symbol_names_size = (size_t) symbol_names_size;
+  return true;
+}
+
+
+bool image_open(vm_image *image, const char *path, char *error, size_t error_size) {
+  memset(image, 0, sizeof(vm_image));
+
+  int fd = open(path, O_RDONLY);
+  if(fd == -1) {
+    snprintf(error, error_size, "Can't open %s", path);
+    return false;
+  }
+  struct stat file_status;
+  if(fstat(fd, &file_status) == -1 || file_status.st_size == 0) {
+    close(fd);
+    snprintf(error, error_size, "Not a Dash image");
+    return false;
+  }
+
+  size_t size = (size_t) file_status.st_size;
+  void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping stays valid after the file is closed
+  close(fd);
+  if(mapping == MAP_FAILED) {
+    snprintf(error, error_size, "Can't map %s", path);
+    return false;
+  }
+
+  image->mapping = mapping;
+  image->mapping_size = size;
+  if(!check_image(image, error, error_size)) {
+    image_close(image);
+    return false;
+  }
+  return true;
+}
+
+
+void image_close(vm_image *image) {
+  if(image->mapping != NULL) {
+    munmap(image->mapping, image->mapping_size);
+  }
+  memset(image, 0, sizeof(vm_image));
+}
@@ -0,0 +1,32 @@
+#ifndef _INCLUDE_IMAGE_H
+#define _INCLUDE_IMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "vm.h"
+
+// Has to be increased whenever the image layout or the instruction encoding changes
+#define image_version 2
+#define image_header_size 24
+
+// A compiled program that is mapped into memory. All pointers point into the
+// mapping, so they are only valid until image_close.
+typedef struct {
+  void *mapping;
+  size_t mapping_size;
+  vm_instruction *program;
+  int program_length;
+  vm_value *const_table;
+  int const_table_length;
+  // Every name is terminated by a NUL character
+  const char *symbol_names;
+  size_t symbol_names_size;
+} vm_image;
+
+// If the file is not a valid image, this returns false and writes a description of
+// the problem to `error`.
+bool image_open(vm_image *image, const char *path, char *error, size_t error_size);
+void image_close(vm_image *image);
+
+#endif
@@ -2,24 +2,104 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <poll.h>
 
 #include "io.h"
 #include "defs.h"
 #include "encoding.h"
 #include "heap.h"
+#include "vm_internal.h"
+#include "scheduler.h"
+
+/*
+
+Buffered IO
+~~~~~~~~~~~
+
+print_ln doesn't write to stdout directly, but appends to an output buffer. The
+buffer is written when it's full, when the program runs io.flush and at the end of
+the program. With vm_flush_line, it is also written after every line, and before
+reading from stdin so that prompts are visible. That's the default if stdout is a
+terminal. Programs that write into a pipe only do one write per buffer.
+
+read_line reuses a single line buffer instead of getting a new one for every line.
+
+Both buffers belong to the vm instance (they are in vm_state.io), so instances on
+different threads don't share any io state. Output of different instances is not
+interleaved within a buffer, but the order of their writes to stdout is arbitrary.
+
+*/
+
+#define output_buffer_size (64 * 1024)
+
+
+static void flush_output(vm_io *io) {
+  if(io->output_length > 0) {
+    fwrite(io->output_buffer, 1, io->output_length, stdout);
+    io->output_length = 0;
+  }
+  fflush(stdout);
+}
+
+
+static void write_output(vm_io *io, const char *chars, size_t length) {
+  if(io->output_length + length > output_buffer_size || io->output_buffer == NULL) {
+    flush_output(io);
+    if(length > output_buffer_size || io->output_buffer == NULL) {
+      fwrite(chars, 1, length, stdout);
+      fflush(stdout);
+      return;
+    }
+  }
+
+  memcpy(io->output_buffer + io->output_length, chars, length);
+  io->output_length += length;
+
+  if(io->flush_lines && memchr(chars, '\n', length) != NULL) {
+    flush_output(io);
+  }
+}
+
+
+void io_start(vm_state *state, vm_flush_policy policy) {
+  vm_io *io = &state->io;
+  if(policy == vm_flush_auto) {
+    policy = isatty(STDOUT_FILENO) ? vm_flush_line : vm_flush_full;
+  }
+  // if there is no memory for the buffer, write_output writes directly to stdout
+  if(io->output_buffer == NULL) {
+    io->output_buffer = malloc(output_buffer_size);
+  }
+  io->flush_lines = (policy == vm_flush_line);
+  io->output_length = 0;
+}
+
+
+void io_finish(vm_state *state) {
+  flush_output(&state->io);
+}
+
+
+void io_destroy(vm_state *state) {
+  vm_io *io = &state->io;
+  free(io->output_buffer);
+  free(io->line_buffer);
+  memset(io, 0, sizeof(vm_io));
+}
 
 
 #define panic_stop_io_processing() { *result = make_tagged_val(symbol_id_error, vm_tag_plain_symbol); return final_io_action; }
 
 
-bool is_io_action(vm_value value) {
+bool is_io_action(vm_state *state, vm_value value) {
 
   if(get_tag(value) != vm_tag_dynamic_compound_symbol) {
     return false;
   }
 
   vm_value addr = get_val(value);
-  vm_value *p = heap_get_pointer(addr);
+  vm_value *p = heap_get_pointer(state, addr);
   vm_value header = p[0];
   if(compound_symbol_id(header) != symbol_id_io) {
     return false;
@@ -28,71 +108,200 @@ bool is_io_action(vm_value value) {
   return true;
 }
 
-io_action_result check_io_action(vm_state *state, vm_value value, vm_instruction *program, vm_value *result, vm_value *next_closure) {
+/*
 
-  // check if this is a valid io action
-  if(!is_io_action(value)) {
-    return no_io_action;
+Effects
+~~~~~~~
+
+Every io action id has an effect in the effect table. An effect gets the register
+that holds the io action, because it might allocate (which moves the action), and
+writes the result of the action, which is passed to the bound function. If the
+action is malformed, it fails. If it can't be run yet (e.g. io.receive on an empty
+channel), it blocks, and the green thread runs the same action again when it's
+woken up (see scheduler.c).
+
+*/
+
+typedef enum {
+  effect_done,
+  effect_failed,
+  effect_blocked
+} effect_result;
+
+typedef effect_result (*io_effect)(vm_state *state, vm_value *action_reg, vm_value *result);
+
+#define action_param(action_reg) (heap_get_pointer(state, get_val(*(action_reg)))[2])
+
+
+static bool is_input_ready() {
+  struct pollfd input = { STDIN_FILENO, POLLIN, 0 };
+  return poll(&input, 1, 0) != 0;
+}
+
+
+static effect_result return_effect(vm_state *state, vm_value *action_reg, vm_value *result) {
+  *result = action_param(action_reg);
+  return effect_done;
+}
+
+
+static effect_result read_line_effect(vm_state *state, vm_value *action_reg, vm_value *result) {
+  vm_io *io = &state->io;
+  if(io->flush_lines) {
+    flush_output(io);
   }
 
-  vm_value addr = get_val(value);
-  vm_value *p = heap_get_pointer(addr);
+  // Other threads can keep running while there's no input. There might be a line in
+  // the buffer of stdin already, but then we only read it a little later.
+  if(scheduler_has_runnable_threads(state) && !is_input_ready()) {
+    scheduler_wait_for_input(state);
+    return effect_blocked;
+  }
 
-  vm_value action_type = p[1] - int_bias;
-  vm_value action_param = p[2];
-  vm_value next_action = p[3];
+  ssize_t length = getline(&io->line_buffer, &io->line_buffer_size, stdin);
+  if(length == -1) {
+    *result = make_tagged_val(symbol_id_eof, vm_tag_plain_symbol);
+    return effect_done;
+  }
+
+  //cut off trailing newline (the last line might not have one)
+  if(length > 0 && io->line_buffer[length - 1] == '\n') {
+    io->line_buffer[length - 1] = '\0';
+  }
 
+  *result = new_heap_string(state, io->line_buffer);
+  return effect_done;
+}
+
+
+static effect_result print_line_effect(vm_state *state, vm_value *action_reg, vm_value *result) {
+  // a rope has to be flattened first, which might move our io action
+  heap_reserve(state, string_flatten_size(state, action_param(action_reg)));
+  vm_value param = action_param(action_reg);
+
+  char *chars = read_string(state, param);
+  if(chars == NULL) {
+    fprintf(stderr, "io.print_ln: Expected a string, got %s\n", value_to_type_string(state, param));
+    return effect_failed;
+  }
+  write_output(&state->io, chars, strlen(chars));
+  *result = make_tagged_val(symbol_id_nil, vm_tag_plain_symbol);
+  return effect_done;
+}
+
+
+static effect_result flush_effect(vm_state *state, vm_value *action_reg, vm_value *result) {
+  flush_output(&state->io);
+  *result = make_tagged_val(symbol_id_nil, vm_tag_plain_symbol);
+  return effect_done;
+}
+
+
+static effect_result spawn_effect(vm_state *state, vm_value *action_reg, vm_value *result) {
+  *result = make_number(scheduler_spawn(state, action_param(action_reg)));
+  return effect_done;
+}
+
+
+static effect_result scheduler_effect(scheduler_result r, const char *name, vm_value value) {
+  if(r == scheduler_invalid) {
+    fprintf(stderr, "%s: Unknown thread or channel: %lld\n", name, (long long) get_number(value));
+    return effect_failed;
+  }
+  return r == scheduler_wait ? effect_blocked : effect_done;
+}
+
+
+static effect_result await_effect(vm_state *state, vm_value *action_reg, vm_value *result) {
+  vm_value thread_id = action_param(action_reg);
+  return scheduler_effect(scheduler_await(state, thread_id, result), "io.await", thread_id);
+}
+
+
+static effect_result new_channel_effect(vm_state *state, vm_value *action_reg, vm_value *result) {
+  *result = make_number(scheduler_new_channel(state));
+  return effect_done;
+}
+
+
+// The parameter is a tuple of the channel and the message
+static effect_result send_effect(vm_state *state, vm_value *action_reg, vm_value *result) {
+  vm_value param = action_param(action_reg);
+  vm_value *fields;
+  if(get_tag(param) == vm_tag_compound_symbol) {
+    fields = &state->const_table[get_val(param)];
+  }
+  else if(get_tag(param) == vm_tag_dynamic_compound_symbol) {
+    fields = heap_get_pointer(state, get_val(param));
+  }
+  else {
+    fprintf(stderr, "io.send: Expected a channel and a message, got %s\n", value_to_type_string(state, param));
+    return effect_failed;
+  }
+  if(compound_symbol_count(fields[0]) != 2) {
+    fprintf(stderr, "io.send: Expected a channel and a message\n");
+    return effect_failed;
+  }
+
+  vm_value channel_id = fields[compound_symbol_header_size];
+  vm_value message = fields[compound_symbol_header_size + 1];
+  *result = make_tagged_val(symbol_id_nil, vm_tag_plain_symbol);
+  return scheduler_effect(scheduler_send(state, channel_id, message), "io.send", channel_id);
+}
+
+
+static effect_result receive_effect(vm_state *state, vm_value *action_reg, vm_value *result) {
+  vm_value channel_id = action_param(action_reg);
+  return scheduler_effect(scheduler_receive(state, channel_id, result), "io.receive", channel_id);
+}
+
+
+static const io_effect effects[] = {
+  [action_id_return] = return_effect,
+  [action_id_readline] = read_line_effect,
+  [action_id_printline] = print_line_effect,
+  [action_id_flush] = flush_effect,
+  [action_id_spawn] = spawn_effect,
+  [action_id_await] = await_effect,
+  [action_id_new_channel] = new_channel_effect,
+  [action_id_send] = send_effect,
+  [action_id_receive] = receive_effect,
+};
+
+#define num_effects ((int64_t) (sizeof(effects) / sizeof(effects[0])))
+
+
+io_action_result check_io_action(vm_state *state, vm_value *action_reg, vm_instruction *program, vm_value *result, vm_value *next_closure) {
+
+  // check if this is a valid io action
+  if(!is_io_action(state, *action_reg)) {
+    return no_io_action;
+  }
+
+  vm_value action_type = heap_get_pointer(state, get_val(*action_reg))[1];
   if(get_tag(action_type) != vm_tag_number) {
-    fprintf(stderr, "Malformed io action: %d\n", action_type);
+    fprintf(stderr, "Malformed io action: %s\n", value_to_type_string(state, action_type));
     panic_stop_io_processing();
   }
 
+  int64_t action_id = get_number(action_type);
+  if(action_id < 0 || action_id >= num_effects || effects[action_id] == NULL) {
+    fprintf(stderr, "malformed io action: %lld\n", (long long) action_id);
+    panic_stop_io_processing();
+  }
 
-  // find out which io action
-  int action_id = get_val(action_type);
-  vm_value next_param = make_tagged_val(symbol_id_false, vm_tag_plain_symbol);
-
-  switch (action_id) {
-
-    case action_id_printline: {
-        char *param = read_string(state, action_param);
-        if(param == NULL) {
-          fprintf(stderr, "io.print_ln: Expected a string, got %s\n", value_to_type_string(action_param));
-          panic_stop_io_processing();
-        }
-        printf("%s", param);
-        fflush(stdout);
-        next_param = make_tagged_val(symbol_id_nil, vm_tag_plain_symbol);
-      }
-      break;
-
-    case action_id_readline: {
-        char *line = NULL;
-        size_t buffer_size = 0;
-        int length = getline(&line, &buffer_size, stdin);
-        if(length == -1) {
-          next_param = make_tagged_val(symbol_id_eof, vm_tag_plain_symbol);
-        }
-        else
-        {
-          //cut off trailing newline
-          length -= 1;
-          line[length] = '\0';
-
-          next_param = new_heap_string(line);
-        }
-      }
-      break;
-
-    case action_id_return:
-      next_param = action_param;
-      break;
-
-    default:
-      fprintf(stderr, "malformed io action: %d\n", action_id);
-      panic_stop_io_processing();
+  vm_value next_param;
+  effect_result effect = effects[action_id](state, action_reg, &next_param);
+  if(effect == effect_failed) {
+    panic_stop_io_processing();
+  }
+  if(effect == effect_blocked) {
+    return blocking_io_action;
   }
 
+  // the effect might have moved our io action
+  vm_value next_action = heap_get_pointer(state, get_val(*action_reg))[3];
+
   if(get_tag(next_action) == vm_tag_function || get_tag(next_action) == vm_tag_pap) {
     // The io action includes a bound lambda. Set up the vm so that it is called
     // with the result from our io action.
@@ -1,16 +1,38 @@
 #ifndef _INCLUDE_IO_H
 #define _INCLUDE_IO_H
 
-#include "vm_internal.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include "vm.h"
+#include "heap.h"
+
+// The io state of a vm instance (see io.c)
+typedef struct {
+  char *output_buffer;
+  size_t output_length;
+  bool flush_lines;
+
+  char *line_buffer;
+  size_t line_buffer_size;
+} vm_io;
 
 typedef enum {
   no_io_action = 0,
   intermediary_io_action = 1,
-  final_io_action = 2
+  final_io_action = 2,
+  // the green thread has to wait, and then run the same action again
+  blocking_io_action = 3
 } io_action_result;
 
-io_action_result check_io_action(vm_state *state, vm_value value, vm_instruction *program, vm_value *result, vm_value *next_action);
-bool is_io_action(vm_value value);
+// Output is buffered, so io_start has to be called before a program runs and
+// io_finish afterwards, which writes any remaining output
+void io_start(vm_state *state, vm_flush_policy policy);
+void io_finish(vm_state *state);
+void io_destroy(vm_state *state);
+
+// action_reg has to point to a register, so that the garbage collector can update it
+io_action_result check_io_action(vm_state *state, vm_value *action_reg, vm_instruction *program, vm_value *result, vm_value *next_action);
+bool is_io_action(vm_state *state, vm_value value);
 
 
 #endif
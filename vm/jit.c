@@ -0,0 +1,796 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jit.h"
+#include "opcodes.h"
+#include "defs.h"
+#include "encoding.h"
+#include "verifier.h"
+
+#ifdef VM_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/*
+
+Jit
+~~~
+
+Functions that are called often are compiled to native code. The interpreter counts
+the calls of every function: the first instruction of each function is replaced by
+OP_COUNT_CALL in the decoded program, and when the count reaches the threshold
+(vm_options.jit_threshold), the function is compiled with jit_compile. Every
+instruction that the jit could compile is then replaced by OP_ENTER_JIT, which runs
+the native code from that instruction on (see interpret in vm.c).
+
+The jit is a template compiler: every instruction is translated on its own into a
+fixed sequence of machine code, and the values stay in the register window of the
+frame. The window is pinned for as long as native code runs, because the register
+file only moves when a frame is pushed or resized, which native code never does.
+
+Native code leaves when it reaches an instruction that it can't do by itself, and
+the interpreter carries on from there. These are:
+  - instructions that allocate, call or return, which need the heap, the stack or
+    the scheduler. Calls and returns go through the interpreter, which enters native
+    code again at the first instruction of the callee or after the call.
+  - instructions whose operands are not what the fast path expects, e.g. an add
+    with a value that isn't a number, an overflow, or an eq on strings. The
+    interpreter runs the original instruction again, which does the full check and
+    reports the error just like it would without a jit.
+
+Only self tail calls stay in native code, where they are a jump back to the start of
+the function. Matches whose patterns are all numbers, plain symbols or variables are
+compiled to a sequence of comparisons.
+
+There is only a backend for x86-64 with the System V calling convention. The entry
+at an address is an ordinary C function (see jit_code), which keeps the register
+window in rdi and the time slice in rsi and only uses rax, rcx and rdx for values,
+so it doesn't have to save any registers.
+
+*/
+
+struct jit_code_block {
+  jit_code_block *next;
+  void *memory;
+  size_t size;
+};
+
+
+bool jit_is_available(void) {
+#ifdef VM_JIT
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+bool jit_init(vm_jit *jit, int program_length, unsigned threshold) {
+  memset(jit, 0, sizeof(vm_jit));
+  jit->threshold = threshold;
+  jit->program_length = program_length;
+  jit->call_counts = calloc(program_length + 1, sizeof(unsigned));
+  jit->entries = calloc(program_length + 1, sizeof(jit_code));
+  if(jit->call_counts == NULL || jit->entries == NULL) {
+    jit_free(jit);
+    return false;
+  }
+  return true;
+}
+
+
+void jit_free(vm_jit *jit) {
+  jit_code_block *block = jit->blocks;
+  while(block != NULL) {
+    jit_code_block *next = block->next;
+#ifdef VM_JIT
+    munmap(block->memory, block->size);
+#endif
+    free(block);
+    block = next;
+  }
+  free(jit->call_counts);
+  free(jit->entries);
+  memset(jit, 0, sizeof(vm_jit));
+}
+
+
+#ifndef VM_JIT
+
+int jit_compile(vm_jit *jit, vm_state *state, const vm_instruction *program, int header_address) {
+  return -1;
+}
+
+#else
+
+/* x86-64 */
+
+#define rax 0
+#define rcx 1
+#define rdx 2
+#define rsi 6
+#define rdi 7
+
+#define rex_w 0x48
+
+// Condition codes for jcc and cmovcc
+#define cc_overflow 0x0
+#define cc_equal 0x4
+#define cc_not_equal 0x5
+#define cc_less 0xC
+#define cc_less_or_equal 0xE
+#define cc_greater 0xF
+#define cc_always (-1)
+
+// The opcode extensions of the shift instructions
+#define shift_left 4
+#define shift_right 5
+#define shift_right_arithmetic 7
+
+// The opcodes of `op r/m64, r64`
+#define alu_add 0x01
+#define alu_or 0x09
+#define alu_and 0x21
+#define alu_sub 0x29
+#define alu_cmp 0x39
+
+#define true_value make_tagged_val(symbol_id_true, vm_tag_plain_symbol)
+#define false_value make_tagged_val(symbol_id_false, vm_tag_plain_symbol)
+
+
+typedef enum {
+  to_label,
+  to_exit
+} jump_kind;
+
+// A rel32 that is patched once all labels are known
+typedef struct {
+  size_t position;
+  jump_kind kind;
+  int target; // an address, or an exit code for to_exit
+} jump_fixup;
+
+typedef struct {
+  uint8_t *code;
+  size_t length;
+  size_t capacity;
+  bool is_out_of_memory;
+
+  vm_state *state;
+  const vm_instruction *program;
+  int program_length;
+  int header_address;
+  // The function's body goes from start to end (exclusive)
+  int start;
+  int end;
+  int frame_size;
+  // The offset of the code of every instruction, indexed by address - start
+  size_t *labels;
+  bool *is_compiled;
+
+  jump_fixup *fixups;
+  size_t fixup_count;
+  size_t fixup_capacity;
+} compiler;
+
+
+static void emit_byte(compiler *c, uint8_t byte) {
+  if(c->length == c->capacity) {
+    size_t capacity = c->capacity > 0 ? c->capacity * 2 : 4096;
+    uint8_t *code = realloc(c->code, capacity);
+    if(code == NULL) {
+      c->is_out_of_memory = true;
+      return;
+    }
+    c->code = code;
+    c->capacity = capacity;
+  }
+  c->code[c->length++] = byte;
+}
+
+static void emit_u32(compiler *c, uint32_t value) {
+  for(int i = 0; i < 4; ++i) {
+    emit_byte(c, (value >> (8 * i)) & 0xFF);
+  }
+}
+
+static void emit_u64(compiler *c, uint64_t value) {
+  for(int i = 0; i < 8; ++i) {
+    emit_byte(c, (value >> (8 * i)) & 0xFF);
+  }
+}
+
+static void emit_modrm_register(compiler *c, int reg, int rm) {
+  emit_byte(c, 0xC0 | (reg << 3) | rm);
+}
+
+// [rdi + 8 * vm_reg], i.e. a register of the vm
+static void emit_modrm_vm_register(compiler *c, int reg, int vm_reg) {
+  emit_byte(c, 0x80 | (reg << 3) | rdi);
+  emit_u32(c, (uint32_t) (vm_reg * sizeof(vm_value)));
+}
+
+// mov reg, [rdi + 8 * vm_reg]
+static void emit_load(compiler *c, int reg, int vm_reg) {
+  emit_byte(c, rex_w);
+  emit_byte(c, 0x8B);
+  emit_modrm_vm_register(c, reg, vm_reg);
+}
+
+// mov [rdi + 8 * vm_reg], reg
+static void emit_store(compiler *c, int vm_reg, int reg) {
+  emit_byte(c, rex_w);
+  emit_byte(c, 0x89);
+  emit_modrm_vm_register(c, reg, vm_reg);
+}
+
+// cmp [rdi + 8 * vm_reg], reg
+static void emit_compare_vm_register(compiler *c, int vm_reg, int reg) {
+  emit_byte(c, rex_w);
+  emit_byte(c, alu_cmp);
+  emit_modrm_vm_register(c, reg, vm_reg);
+}
+
+// mov reg, imm64
+static void emit_move_immediate(compiler *c, int reg, uint64_t value) {
+  emit_byte(c, rex_w);
+  emit_byte(c, 0xB8 + reg);
+  emit_u64(c, value);
+}
+
+// mov dst, src
+static void emit_move(compiler *c, int dst, int src) {
+  emit_byte(c, rex_w);
+  emit_byte(c, 0x89);
+  emit_modrm_register(c, src, dst);
+}
+
+// op dst, src
+static void emit_alu(compiler *c, uint8_t opcode, int dst, int src) {
+  emit_byte(c, rex_w);
+  emit_byte(c, opcode);
+  emit_modrm_register(c, src, dst);
+}
+
+// add/sub reg, imm32
+static void emit_alu_immediate(compiler *c, uint8_t opcode, int reg, int32_t value) {
+  emit_byte(c, rex_w);
+  emit_byte(c, 0x81);
+  emit_modrm_register(c, opcode == alu_sub ? 5 : 0, reg);
+  emit_u32(c, (uint32_t) value);
+}
+
+static void emit_shift(compiler *c, int kind, int reg, uint8_t count) {
+  emit_byte(c, rex_w);
+  emit_byte(c, 0xC1);
+  emit_modrm_register(c, kind, reg);
+  emit_byte(c, count);
+}
+
+// imul dst, src
+static void emit_multiply(compiler *c, int dst, int src) {
+  emit_byte(c, rex_w);
+  emit_byte(c, 0x0F);
+  emit_byte(c, 0xAF);
+  emit_modrm_register(c, dst, src);
+}
+
+// cqo; idiv reg
+static void emit_divide(compiler *c, int reg) {
+  emit_byte(c, rex_w);
+  emit_byte(c, 0x99);
+  emit_byte(c, rex_w);
+  emit_byte(c, 0xF7);
+  emit_modrm_register(c, 7, reg);
+}
+
+// test reg, reg
+static void emit_test(compiler *c, int reg) {
+  emit_byte(c, rex_w);
+  emit_byte(c, 0x85);
+  emit_modrm_register(c, reg, reg);
+}
+
+// cmovcc dst, src
+static void emit_conditional_move(compiler *c, int cc, int dst, int src) {
+  emit_byte(c, rex_w);
+  emit_byte(c, 0x0F);
+  emit_byte(c, 0x40 + cc);
+  emit_modrm_register(c, dst, src);
+}
+
+// mov eax, exit; ret
+static void emit_exit(compiler *c, int exit_code) {
+  emit_byte(c, 0xB8);
+  emit_u32(c, (uint32_t) exit_code);
+  emit_byte(c, 0xC3);
+}
+
+#define exit_to(address) ((address) << 1)
+#define exit_to_original(address) (((address) << 1) | 1)
+
+static void add_fixup(compiler *c, jump_kind kind, int target) {
+  if(c->fixup_count == c->fixup_capacity) {
+    size_t capacity = c->fixup_capacity > 0 ? c->fixup_capacity * 2 : 64;
+    jump_fixup *fixups = realloc(c->fixups, capacity * sizeof(jump_fixup));
+    if(fixups == NULL) {
+      c->is_out_of_memory = true;
+      return;
+    }
+    c->fixups = fixups;
+    c->fixup_capacity = capacity;
+  }
+  jump_fixup *fixup = &c->fixups[c->fixup_count++];
+  fixup->position = c->length;
+  fixup->kind = kind;
+  fixup->target = target;
+  emit_u32(c, 0);
+}
+
+static void emit_jump(compiler *c, int cc, jump_kind kind, int target) {
+  if(cc == cc_always) {
+    emit_byte(c, 0xE9);
+  }
+  else {
+    emit_byte(c, 0x0F);
+    emit_byte(c, 0x80 + cc);
+  }
+  add_fixup(c, kind, target);
+}
+
+// Jumps to the code of another instruction. Jumps out of the function leave native
+// code, and the interpreter continues at the target.
+static void emit_jump_to_address(compiler *c, int cc, int address) {
+  if(address >= c->start && address < c->end) {
+    emit_jump(c, cc, to_label, address);
+  }
+  else {
+    emit_jump(c, cc, to_exit, exit_to(address));
+  }
+}
+
+// Leaves native code if the condition is true, so that the interpreter runs the
+// instruction at pc
+static void emit_guard(compiler *c, int cc, int pc) {
+  emit_jump(c, cc, to_exit, exit_to_original(pc));
+}
+
+
+// rax = vm_reg1, rcx = vm_reg2, both numbers
+static void emit_load_numbers(compiler *c, int pc, int vm_reg1, int vm_reg2) {
+  emit_load(c, rax, vm_reg1);
+  emit_load(c, rcx, vm_reg2);
+  // numbers have the tag 0
+  emit_move(c, rdx, rax);
+  emit_alu(c, alu_or, rdx, rcx);
+  emit_shift(c, shift_right, rdx, __value_bits);
+  emit_guard(c, cc_not_equal, pc);
+}
+
+// Numbers and plain symbols are equal if their bits are equal (see is_equal in vm.c)
+static void emit_check_immediate(compiler *c, int pc, int reg) {
+  emit_move(c, rdx, reg);
+  emit_shift(c, shift_right, rdx, __value_bits);
+  // je over the next two instructions, which take 9 bytes
+  emit_byte(c, 0x74);
+  emit_byte(c, 9);
+  emit_byte(c, 0x83);
+  emit_modrm_register(c, 7, rdx);
+  emit_byte(c, vm_tag_plain_symbol);
+  emit_guard(c, cc_not_equal, pc);
+}
+
+// rax = true or false, depending on the flags
+static void emit_bool(compiler *c, int cc) {
+  emit_move_immediate(c, rax, false_value);
+  emit_move_immediate(c, rdx, true_value);
+  emit_conditional_move(c, cc, rax, rdx);
+}
+
+// Compiles one of add, sub, mul, div, lt, gt or eq, and leaves the flags of the comparison
+static void emit_binary_operation(compiler *c, int pc, int opcode, int r0, int r1, int r2) {
+  switch(opcode) {
+    case OP_ADD:
+    case OP_SUB:
+      // the arithmetic is done on shifted numbers (see shifted_add_overflow in vm.c)
+      emit_load_numbers(c, pc, r1, r2);
+      emit_shift(c, shift_left, rax, __tag_bits);
+      emit_shift(c, shift_left, rcx, __tag_bits);
+      emit_alu(c, opcode == OP_ADD ? alu_add : alu_sub, rax, rcx);
+      emit_guard(c, cc_overflow, pc);
+      emit_shift(c, shift_right, rax, __tag_bits);
+      emit_store(c, r0, rax);
+      break;
+
+    case OP_MUL:
+      emit_load_numbers(c, pc, r1, r2);
+      emit_shift(c, shift_left, rax, __tag_bits);
+      emit_shift(c, shift_left, rcx, __tag_bits);
+      emit_shift(c, shift_right_arithmetic, rcx, __tag_bits);
+      emit_multiply(c, rax, rcx);
+      emit_guard(c, cc_overflow, pc);
+      emit_shift(c, shift_right, rax, __tag_bits);
+      emit_store(c, r0, rax);
+      break;
+
+    case OP_DIV:
+      emit_load_numbers(c, pc, r1, r2);
+      emit_test(c, rcx);
+      emit_guard(c, cc_equal, pc);
+      emit_shift(c, shift_left, rax, __tag_bits);
+      emit_shift(c, shift_right_arithmetic, rax, __tag_bits);
+      emit_shift(c, shift_left, rcx, __tag_bits);
+      emit_shift(c, shift_right_arithmetic, rcx, __tag_bits);
+      emit_divide(c, rcx);
+      // min_number / -1
+      emit_move_immediate(c, rcx, max_number);
+      emit_alu(c, alu_cmp, rax, rcx);
+      emit_guard(c, cc_greater, pc);
+      emit_move_immediate(c, rcx, low_60_bits);
+      emit_alu(c, alu_and, rax, rcx);
+      emit_store(c, r0, rax);
+      break;
+
+    case OP_LT:
+    case OP_GT:
+      emit_load_numbers(c, pc, r1, r2);
+      emit_shift(c, shift_left, rax, __tag_bits);
+      emit_shift(c, shift_left, rcx, __tag_bits);
+      emit_alu(c, alu_cmp, rax, rcx);
+      emit_bool(c, opcode == OP_LT ? cc_less : cc_greater);
+      emit_store(c, r0, rax);
+      break;
+
+    case OP_EQ:
+      emit_load(c, rax, r1);
+      emit_load(c, rcx, r2);
+      emit_check_immediate(c, pc, rax);
+      emit_check_immediate(c, pc, rcx);
+      emit_alu(c, alu_cmp, rax, rcx);
+      emit_bool(c, cc_equal);
+      emit_store(c, r0, rax);
+      break;
+  }
+}
+
+// add_i and sub_i also put their constant into a register
+static void emit_immediate_operation(compiler *c, int pc, int opcode, int r0, int r1, int r2, int64_t constant) {
+  emit_move_immediate(c, rax, make_number(constant));
+  emit_store(c, r2, rax);
+  emit_load(c, rax, r1);
+  emit_move(c, rdx, rax);
+  emit_shift(c, shift_right, rdx, __value_bits);
+  emit_guard(c, cc_not_equal, pc);
+  emit_shift(c, shift_left, rax, __tag_bits);
+  emit_alu_immediate(c, opcode == OP_ADD_i ? alu_add : alu_sub, rax, (int32_t) (constant << __tag_bits));
+  emit_guard(c, cc_overflow, pc);
+  emit_shift(c, shift_right, rax, __tag_bits);
+  emit_store(c, r0, rax);
+}
+
+// Only matches whose patterns are all numbers, plain symbols or variables (including
+// the wildcard) are compiled, because they can be compared without looking at the
+// heap or the constant table
+static bool compile_match(compiler *c, int pc, vm_instruction instr) {
+  vm_state *state = c->state;
+  int opcode = get_opcode(instr);
+  int subject_reg = get_arg_r0(instr);
+  int patterns_reg = -1;
+  int patterns_addr;
+  int capture_reg;
+  if(opcode == OP_JMP_MATCH) {
+    patterns_addr = get_arg_i(instr);
+    capture_reg = 0;
+  }
+  else {
+    // The patterns are in a register, which the code generator loads right before
+    // the match. There's a guard in case we get here with a different address.
+    vm_instruction previous = c->program[pc - 1];
+    patterns_reg = get_arg_r1(instr);
+    if(pc == c->start || get_opcode(previous) != OP_LOAD_i || get_arg_r0(previous) != patterns_reg) {
+      return false;
+    }
+    patterns_addr = (int) get_arg_i(previous) - int_bias;
+    capture_reg = get_arg_r2(instr);
+  }
+
+  if(patterns_addr < 0 || patterns_addr >= state->const_table_length) {
+    return false;
+  }
+  bool is_switch = (opcode != OP_MATCH);
+  if(!(is_switch ? verify_match_table(&state->verifier, patterns_addr) : verify_match_data(&state->verifier, patterns_addr))) {
+    return false;
+  }
+  int number_of_patterns = from_match_value(state->const_table[patterns_addr]);
+  if(pc + 1 + number_of_patterns > c->program_length + 1) {
+    return false;
+  }
+  for(int i = 0; i < number_of_patterns; ++i) {
+    vm_value pattern = state->const_table[patterns_addr + 1 + i];
+    vm_value tag = get_tag(pattern);
+    if(tag != vm_tag_number && tag != vm_tag_plain_symbol
+       && !(tag == vm_tag_match_data && !is_match_header(pattern))) {
+      return false;
+    }
+  }
+
+  if(patterns_reg >= 0) {
+    emit_move_immediate(c, rcx, make_number(patterns_addr));
+    emit_compare_vm_register(c, patterns_reg, rcx);
+    emit_guard(c, cc_not_equal, pc);
+  }
+
+  // The jump table follows the match (see OP_MATCH in vm.c)
+  emit_load(c, rax, subject_reg);
+  for(int i = 0; i < number_of_patterns; ++i) {
+    vm_value pattern = state->const_table[patterns_addr + 1 + i];
+    int arm = pc + 1 + i;
+    if(get_tag(pattern) == vm_tag_match_data) {
+      int relative_reg = from_match_value(pattern);
+      if(relative_reg != match_wildcard_value) {
+        if(capture_reg + relative_reg >= num_regs || capture_reg + relative_reg >= c->frame_size) {
+          // this never matches (see does_value_match)
+          continue;
+        }
+        emit_store(c, capture_reg + relative_reg, rax);
+      }
+      // the patterns after a variable are never reached
+      emit_jump_to_address(c, cc_always, arm);
+      return true;
+    }
+    emit_move_immediate(c, rcx, pattern);
+    emit_alu(c, alu_cmp, rax, rcx);
+    emit_jump_to_address(c, cc_equal, arm);
+  }
+  // the interpreter throws the error
+  emit_exit(c, exit_to_original(pc));
+  return true;
+}
+
+// Returns false if the instruction has to be interpreted
+static bool compile_instruction(compiler *c, int pc) {
+  vm_instruction instr = c->program[pc];
+  int opcode = get_opcode(instr);
+  int r0 = get_arg_r0(instr);
+  int r1 = get_arg_r1(instr);
+  int r2 = get_arg_r2(instr);
+
+  switch(opcode) {
+    case OP_LOAD_i:
+      emit_move_immediate(c, rax, make_number((int64_t) get_arg_i(instr) - int_bias));
+      emit_store(c, r0, rax);
+      return true;
+
+    case OP_LOAD_ps:
+    case OP_LOAD_cs:
+    case OP_LOAD_os:
+    case OP_LOAD_f:
+    case OP_LOAD_str: {
+      vm_value tag = opcode == OP_LOAD_ps ? vm_tag_plain_symbol
+                     : opcode == OP_LOAD_cs ? vm_tag_compound_symbol
+                     : opcode == OP_LOAD_os ? vm_tag_opaque_symbol
+                     : opcode == OP_LOAD_f ? vm_tag_function
+                     : vm_tag_string;
+      emit_move_immediate(c, rax, make_tagged_val(get_arg_i(instr), tag));
+      emit_store(c, r0, rax);
+      return true;
+    }
+
+    case OP_MOVE:
+      emit_load(c, rax, r1);
+      emit_store(c, r0, rax);
+      return true;
+
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_LT:
+    case OP_GT:
+    case OP_EQ:
+      emit_binary_operation(c, pc, opcode, r0, r1, r2);
+      return true;
+
+    case OP_ADD_i:
+    case OP_SUB_i:
+      emit_immediate_operation(c, pc, opcode, r0, r1, r2, (int64_t) get_arg_small_i(instr) - small_int_bias);
+      return true;
+
+    case OP_JMP:
+      emit_jump_to_address(c, cc_always, pc + 1 + ((int) get_arg_i(instr) - int_bias));
+      return true;
+
+    case OP_JMP_TRUE:
+      emit_move_immediate(c, rax, true_value);
+      emit_compare_vm_register(c, r0, rax);
+      emit_jump_to_address(c, cc_equal, pc + 1 + ((int) get_arg_i(instr) - int_bias));
+      return true;
+
+    case OP_JMP_LT:
+    case OP_JMP_GT:
+    case OP_JMP_EQ: {
+      int compare = opcode == OP_JMP_LT ? OP_LT : (opcode == OP_JMP_GT ? OP_GT : OP_EQ);
+      int cc = opcode == OP_JMP_LT ? cc_less : (opcode == OP_JMP_GT ? cc_greater : cc_equal);
+      // moves and stores don't change the flags of the comparison
+      emit_binary_operation(c, pc, compare, r0, r1, r2);
+      emit_jump_to_address(c, cc, pc + 1 + ((int) get_arg_small_i(instr) - small_int_bias));
+      return true;
+    }
+
+    case OP_MATCH:
+    case OP_MATCH_SWITCH:
+    case OP_JMP_MATCH:
+      return compile_match(c, pc, instr);
+
+    // The window of the next frame follows the window of this one
+    case OP_SET_ARG:
+      for(int i = 0; i <= r2; ++i) {
+        emit_load(c, rax, r1 + i);
+        emit_store(c, c->frame_size + r0 + i, rax);
+      }
+      return true;
+
+    case OP_SPILL:
+    case OP_RELOAD: {
+      int slot = num_regs + get_arg_i(instr);
+      if(slot >= c->frame_size) {
+        return false;
+      }
+      emit_load(c, rax, opcode == OP_SPILL ? r0 : slot);
+      emit_store(c, opcode == OP_SPILL ? slot : r0, rax);
+      return true;
+    }
+
+    // A tail call of the function itself only moves the arguments, every other call
+    // is done by the interpreter
+    case OP_TAIL_AP:
+      emit_load(c, rax, r1);
+      emit_move_immediate(c, rcx, make_tagged_val(c->header_address, vm_tag_function));
+      emit_alu(c, alu_cmp, rax, rcx);
+      emit_guard(c, cc_not_equal, pc);
+      // the interpreter lets the scheduler switch threads when the time slice is over
+      // (see count_time_slice in vm.c): cmp dword [rsi], 1; dec dword [rsi]
+      emit_byte(c, 0x83);
+      emit_byte(c, 0x38 | rsi);
+      emit_byte(c, 1);
+      emit_guard(c, cc_less_or_equal, pc);
+      emit_byte(c, 0xFF);
+      emit_byte(c, 0x08 | rsi);
+      for(int i = 0; i < r2; ++i) {
+        emit_load(c, rax, c->frame_size + i);
+        emit_store(c, i, rax);
+      }
+      emit_jump_to_address(c, cc_always, c->start);
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+static int find_function_end(const vm_instruction *program, int program_length, int start) {
+  int end = start;
+  while(end < program_length && get_opcode(program[end]) != FUN_HEADER) {
+    ++end;
+  }
+  return end;
+}
+
+// Copies the code into executable memory, which is never writable at the same time
+static uint8_t *install_code(vm_jit *jit, compiler *c) {
+  size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+  size_t size = (c->length + page_size - 1) / page_size * page_size;
+  jit_code_block *block = malloc(sizeof(jit_code_block));
+  if(block == NULL) {
+    return NULL;
+  }
+  void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(memory == MAP_FAILED) {
+    free(block);
+    return NULL;
+  }
+  memcpy(memory, c->code, c->length);
+  if(mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, size);
+    free(block);
+    return NULL;
+  }
+  block->memory = memory;
+  block->size = size;
+  block->next = jit->blocks;
+  jit->blocks = block;
+  return memory;
+}
+
+// Resolves the jumps, with one exit stub per exit after the function's code
+static bool link_code(compiler *c) {
+  size_t first_stub = c->length;
+  for(size_t i = 0; i < c->fixup_count; ++i) {
+    jump_fixup *fixup = &c->fixups[i];
+    size_t target;
+    if(fixup->kind == to_label) {
+      target = c->labels[fixup->target - c->start];
+    }
+    else {
+      // stubs are 6 bytes, and an exit code takes the 4 bytes after the first one
+      target = c->length;
+      for(size_t stub = first_stub; stub < c->length; stub += 6) {
+        uint32_t exit_code;
+        memcpy(&exit_code, c->code + stub + 1, sizeof(exit_code));
+        if(exit_code == (uint32_t) fixup->target) {
+          target = stub;
+          break;
+        }
+      }
+      if(target == c->length) {
+        emit_exit(c, fixup->target);
+        if(c->is_out_of_memory) {
+          return false;
+        }
+      }
+    }
+    int32_t offset = (int32_t) ((int64_t) target - (int64_t) (fixup->position + 4));
+    memcpy(c->code + fixup->position, &offset, sizeof(offset));
+  }
+  return !c->is_out_of_memory;
+}
+
+int jit_compile(vm_jit *jit, vm_state *state, const vm_instruction *program, int header_address) {
+  compiler compiler_state;
+  compiler *c = &compiler_state;
+  memset(c, 0, sizeof(compiler));
+  c->state = state;
+  c->program = program;
+  c->program_length = jit->program_length;
+  c->header_address = header_address;
+  c->start = header_address + fun_header_size;
+  c->end = find_function_end(program, jit->program_length, c->start);
+  c->frame_size = get_fun_frame_size(program[header_address]);
+  if(c->start >= c->end) {
+    return -1;
+  }
+
+  int length = c->end - c->start;
+  c->labels = calloc(length, sizeof(size_t));
+  c->is_compiled = calloc(length, sizeof(bool));
+  if(c->labels == NULL || c->is_compiled == NULL) {
+    c->is_out_of_memory = true;
+  }
+
+  // Every instruction gets a label, the ones that can't be compiled just leave
+  for(int pc = c->start; pc < c->end && !c->is_out_of_memory; ++pc) {
+    size_t position = c->length;
+    size_t fixup_count = c->fixup_count;
+    c->labels[pc - c->start] = position;
+    if(compile_instruction(c, pc)) {
+      c->is_compiled[pc - c->start] = true;
+    }
+    else {
+      c->length = position;
+      c->fixup_count = fixup_count;
+      emit_exit(c, exit_to(pc));
+    }
+  }
+  emit_exit(c, exit_to(c->end));
+
+  int result = -1;
+  uint8_t *code;
+  if(!c->is_out_of_memory && link_code(c) && (code = install_code(jit, c)) != NULL) {
+    for(int pc = c->start; pc < c->end; ++pc) {
+      if(c->is_compiled[pc - c->start]) {
+        jit->entries[pc] = (jit_code) (code + c->labels[pc - c->start]);
+      }
+    }
+    ++jit->function_count;
+    result = c->end;
+  }
+
+  free(c->code);
+  free(c->labels);
+  free(c->is_compiled);
+  free(c->fixups);
+  return result;
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef _INCLUDE_JIT_H
+#define _INCLUDE_JIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "vm_internal.h"
+
+// There is only an x86-64 backend, everywhere else all code is interpreted. Use
+// `make JIT=off` to turn the jit off completely.
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__)) && !defined(VM_NO_JIT)
+#define VM_JIT
+#endif
+
+// The entry of compiled code at an address of the program. It gets the register
+// window of the current frame and the time slice of the scheduler, and returns where
+// the interpreter continues (see jit_exit_address).
+typedef int (*jit_code)(vm_value *reg, int *time_slice);
+
+#define jit_exit_address(exit_code) ((exit_code) >> 1)
+// The instruction at the exit address has been replaced by an entry of compiled code,
+// so the interpreter has to run the original instruction instead of decoding it again
+#define jit_exit_runs_original(exit_code) ((exit_code) & 1)
+
+typedef struct jit_code_block jit_code_block;
+
+typedef struct {
+  unsigned threshold;
+  int program_length;
+  // The number of calls of each function, at the address of its FUN_HEADER
+  unsigned *call_counts;
+  // The entries of compiled code by address, NULL if the instruction is interpreted
+  jit_code *entries;
+  jit_code_block *blocks;
+  int function_count;
+} vm_jit;
+
+bool jit_is_available(void);
+bool jit_init(vm_jit *jit, int program_length, unsigned threshold);
+void jit_free(vm_jit *jit);
+
+// Returns true when the function passes the threshold
+static inline bool jit_count_call(vm_jit *jit, int header_address) {
+  return ++jit->call_counts[header_address] == jit->threshold;
+}
+
+// Compiles the function with the FUN_HEADER at the given address and sets the entries
+// of all instructions that it could compile. Returns the end address of the function
+// (i.e. the address of the next header, or the end of the program), or -1 if the
+// function couldn't be compiled.
+int jit_compile(vm_jit *jit, vm_state *state, const vm_instruction *program, int header_address);
+
+#endif
@@ -0,0 +1,422 @@
+#include <stdio.h>
+#include <string.h>
+#include "map.h"
+#include "heap.h"
+#include "defs.h"
+#include "encoding.h"
+
+/*
+
+Maps
+~~~~
+
+A map is a hash array mapped trie in the compressed layout of CHAMP (Steindorfer and
+Vinju, "Optimizing Hash-Array Mapped Tries for Fast and Lean Immutable JVM
+Collections"). The 30 bit hash of a key selects one of the 32 slots of a node on
+every level, five bits at a time, starting with the lowest bits. A slot is either
+empty, or holds an entry, or holds a child node with all entries whose hashes start
+with the same bits. Only the used slots take space. The node has one bitmap for the
+slots with entries and one for the slots with child nodes, and the position of a
+slot is the number of used slots before it. Keys whose hashes are completely equal
+end up in a collision node after the last level, which is searched linearly.
+
+Maps are never changed. Inserting or removing a key copies the nodes on the path to
+its slot, and the new map shares everything else with the old one. A child node
+never holds a single entry and nothing else. If removing a key leaves a child like
+that, its entry moves up into the parent. (Only the root can be empty.)
+
+Every node knows the number of entries below it, so the size of a map doesn't have
+to be counted, and the n-th entry can be found without going through the entries
+before it (see map_entry).
+
+*/
+
+#define bits_per_level 5
+#define slot_mask 0x1F
+// There are no hash bits left for this level, so its nodes are collision nodes
+#define collision_level 6
+#define max_node_size (map_node_header_size + 2 * 32)
+
+#define slot_bit(hash, level) ((uint32_t) 1 << (((hash) >> ((level) * bits_per_level)) & slot_mask))
+// The position of a slot among the used slots of a bitmap
+#define slot_index(bitmap, bit) ((size_t) __builtin_popcount((bitmap) & ((bit) - 1)))
+
+#define entry_position(datamap, bit) (map_node_header_size + 2 * slot_index(datamap, bit))
+#define child_position(datamap, nodemap, bit) (map_node_header_size + 2 * __builtin_popcount(datamap) \
+                                                + slot_index(nodemap, bit))
+
+
+static vm_value *node_pointer(vm_state *state, vm_value node) {
+  return heap_get_pointer(state, get_val(node));
+}
+
+// The heap space has to be reserved (see map_update_size), so this never triggers a
+// garbage collection
+static vm_value store_node(vm_state *state, vm_value *words, size_t size) {
+  heap_address addr = heap_alloc(state, size);
+  memcpy(heap_get_pointer(state, addr), words, size * sizeof(vm_value));
+  return make_tagged_val(addr, vm_tag_map);
+}
+
+// Makes room for `count` words at `position` of a node that is being built
+static void open_gap(vm_value *words, size_t size, size_t position, size_t count) {
+  memmove(words + position + count, words + position, (size - position) * sizeof(vm_value));
+}
+
+static void close_gap(vm_value *words, size_t size, size_t position, size_t count) {
+  memmove(words + position, words + position + count, (size - position - count) * sizeof(vm_value));
+}
+
+
+vm_value map_new(vm_state *state) {
+  heap_address addr = heap_alloc(state, map_node_header_size);
+  vm_value *node = heap_get_pointer(state, addr);
+  node[0] = map_node_header(0, 0);
+  node[1] = 0;
+  return make_tagged_val(addr, vm_tag_map);
+}
+
+
+size_t map_size(vm_state *state, vm_value map) {
+  return map_node_count(*node_pointer(state, map));
+}
+
+
+bool map_lookup(vm_state *state, vm_value map, vm_value hash, vm_value key, vm_value *value) {
+  vm_value *node = node_pointer(state, map);
+
+  for(int level = 0; !map_node_is_collision(node); ++level) {
+    uint32_t datamap = map_node_datamap(node[0]);
+    uint32_t nodemap = map_node_nodemap(node);
+    uint32_t bit = slot_bit(hash, level);
+
+    if(datamap & bit) {
+      size_t position = entry_position(datamap, bit);
+      if(!is_equal(state, node[position], key)) {
+        return false;
+      }
+      *value = node[position + 1];
+      return true;
+    }
+    if(!(nodemap & bit)) {
+      return false;
+    }
+    node = node_pointer(state, node[child_position(datamap, nodemap, bit)]);
+  }
+
+  size_t count = map_node_count(node[0]);
+  for(size_t i = 0; i < count; ++i) {
+    size_t position = map_node_header_size + 2 * i;
+    if(is_equal(state, node[position], key)) {
+      *value = node[position + 1];
+      return true;
+    }
+  }
+  return false;
+}
+
+
+size_t map_update_size(vm_state *state, vm_value map, vm_value hash) {
+  vm_value *node = node_pointer(state, map);
+  size_t size = 0;
+
+  for(int level = 0; ; ++level) {
+    // every node on the path is copied, with up to one more entry
+    size += map_node_size(node) + 2;
+    if(map_node_is_collision(node)) {
+      break;
+    }
+
+    uint32_t datamap = map_node_datamap(node[0]);
+    uint32_t nodemap = map_node_nodemap(node);
+    uint32_t bit = slot_bit(hash, level);
+    if(nodemap & bit) {
+      node = node_pointer(state, node[child_position(datamap, nodemap, bit)]);
+      continue;
+    }
+    if(datamap & bit) {
+      // the entry in the slot and the new one might need a new node on every level below
+      size += (collision_level - level) * (map_node_header_size + 4);
+    }
+    break;
+  }
+
+  return size;
+}
+
+
+// Creates the nodes for two entries, starting at the given level
+static vm_value merge_entries(vm_state *state, int level,
+                              vm_value hash1, vm_value key1, vm_value value1,
+                              vm_value hash2, vm_value key2, vm_value value2) {
+  if(level == collision_level) {
+    vm_value words[] = { map_node_header(2, 0), map_collision_bit, key1, value1, key2, value2 };
+    return store_node(state, words, map_node_header_size + 4);
+  }
+
+  uint32_t bit1 = slot_bit(hash1, level);
+  uint32_t bit2 = slot_bit(hash2, level);
+  if(bit1 == bit2) {
+    vm_value child = merge_entries(state, level + 1, hash1, key1, value1, hash2, key2, value2);
+    vm_value words[] = { map_node_header(2, 0), bit1, child };
+    return store_node(state, words, map_node_header_size + 1);
+  }
+
+  // entries are in the order of their slots
+  if(bit1 > bit2) {
+    vm_value words[] = { map_node_header(2, bit1 | bit2), 0, key2, value2, key1, value1 };
+    return store_node(state, words, map_node_header_size + 4);
+  }
+  vm_value words[] = { map_node_header(2, bit1 | bit2), 0, key1, value1, key2, value2 };
+  return store_node(state, words, map_node_header_size + 4);
+}
+
+
+static vm_value insert_into_collision_node(vm_state *state, vm_value node, vm_value key, vm_value value, bool *added) {
+  vm_value *node_p = node_pointer(state, node);
+  size_t count = map_node_count(node_p[0]);
+  size_t index = count;
+  for(size_t i = 0; i < count; ++i) {
+    if(is_equal(state, node_p[map_node_header_size + 2 * i], key)) {
+      index = i;
+      break;
+    }
+  }
+
+  *added = index == count;
+  size_t new_count = *added ? count + 1 : count;
+  heap_address addr = heap_alloc(state, map_node_header_size + 2 * new_count);
+  vm_value *copy = heap_get_pointer(state, addr);
+  memcpy(copy, node_p, (map_node_header_size + 2 * count) * sizeof(vm_value));
+  copy[0] = map_node_header(new_count, 0);
+  copy[map_node_header_size + 2 * index] = key;
+  copy[map_node_header_size + 2 * index + 1] = value;
+  return make_tagged_val(addr, vm_tag_map);
+}
+
+
+static vm_value insert_into(vm_state *state, vm_value node, int level, vm_value hash, vm_value key, vm_value value, bool *added) {
+  vm_value *node_p = node_pointer(state, node);
+  if(map_node_is_collision(node_p)) {
+    return insert_into_collision_node(state, node, key, value, added);
+  }
+
+  vm_value words[max_node_size];
+  size_t size = map_node_size(node_p);
+  memcpy(words, node_p, size * sizeof(vm_value));
+
+  size_t count = map_node_count(words[0]);
+  uint32_t datamap = map_node_datamap(words[0]);
+  uint32_t nodemap = map_node_nodemap(words);
+  uint32_t bit = slot_bit(hash, level);
+
+  if(datamap & bit) {
+    size_t position = entry_position(datamap, bit);
+    vm_value existing_key = words[position];
+    vm_value existing_value = words[position + 1];
+    if(is_equal(state, existing_key, key)) {
+      *added = false;
+      if(existing_value == value) {
+        return node;
+      }
+      words[position + 1] = value;
+      return store_node(state, words, size);
+    }
+
+    // the slot gets a child node with both entries
+    vm_value child = merge_entries(state, level + 1, value_hash(state, existing_key), existing_key, existing_value,
+                                   hash, key, value);
+    close_gap(words, size, position, 2);
+    size -= 2;
+    datamap &= ~bit;
+    nodemap |= bit;
+    size_t child_pos = child_position(datamap, nodemap, bit);
+    open_gap(words, size, child_pos, 1);
+    size += 1;
+    words[child_pos] = child;
+    *added = true;
+  }
+  else if(nodemap & bit) {
+    size_t child_pos = child_position(datamap, nodemap, bit);
+    vm_value child = insert_into(state, words[child_pos], level + 1, hash, key, value, added);
+    if(child == words[child_pos]) {
+      return node;
+    }
+    words[child_pos] = child;
+  }
+  else {
+    datamap |= bit;
+    size_t position = entry_position(datamap, bit);
+    open_gap(words, size, position, 2);
+    size += 2;
+    words[position] = key;
+    words[position + 1] = value;
+    *added = true;
+  }
+
+  words[0] = map_node_header(*added ? count + 1 : count, datamap);
+  words[1] = nodemap;
+  return store_node(state, words, size);
+}
+
+
+vm_value map_insert(vm_state *state, vm_value map, vm_value hash, vm_value key, vm_value value) {
+  bool added;
+  return insert_into(state, map, 0, hash, key, value, &added);
+}
+
+
+typedef enum {
+  removed_nothing,
+  removed_from_node, // `node` is the new node
+  removed_all_but_one // the node would only hold a single entry, which the parent takes
+} removal_result;
+
+typedef struct {
+  removal_result result;
+  vm_value node;
+  vm_value key;
+  vm_value value;
+} removal;
+
+
+static removal remove_from_collision_node(vm_state *state, vm_value node, vm_value key) {
+  vm_value *node_p = node_pointer(state, node);
+  size_t count = map_node_count(node_p[0]);
+  vm_value *entries = node_p + map_node_header_size;
+
+  size_t index = count;
+  for(size_t i = 0; i < count; ++i) {
+    if(is_equal(state, entries[2 * i], key)) {
+      index = i;
+      break;
+    }
+  }
+
+  if(index == count) {
+    return (removal) { removed_nothing, 0, 0, 0 };
+  }
+  if(count == 2) {
+    size_t other = 1 - index;
+    return (removal) { removed_all_but_one, 0, entries[2 * other], entries[2 * other + 1] };
+  }
+
+  heap_address addr = heap_alloc(state, map_node_header_size + 2 * (count - 1));
+  vm_value *copy = heap_get_pointer(state, addr);
+  copy[0] = map_node_header(count - 1, 0);
+  copy[1] = map_collision_bit;
+  memcpy(copy + map_node_header_size, entries, 2 * index * sizeof(vm_value));
+  memcpy(copy + map_node_header_size + 2 * index, entries + 2 * (index + 1),
+         2 * (count - index - 1) * sizeof(vm_value));
+  return (removal) { removed_from_node, make_tagged_val(addr, vm_tag_map), 0, 0 };
+}
+
+
+static removal remove_from(vm_state *state, vm_value node, int level, vm_value hash, vm_value key) {
+  vm_value *node_p = node_pointer(state, node);
+  if(map_node_is_collision(node_p)) {
+    return remove_from_collision_node(state, node, key);
+  }
+
+  size_t count = map_node_count(node_p[0]);
+  uint32_t datamap = map_node_datamap(node_p[0]);
+  uint32_t nodemap = map_node_nodemap(node_p);
+  uint32_t bit = slot_bit(hash, level);
+  int entry_count = __builtin_popcount(datamap);
+  int child_count = __builtin_popcount(nodemap);
+
+  vm_value words[max_node_size];
+  size_t size = map_node_size(node_p);
+
+  if(datamap & bit) {
+    size_t position = entry_position(datamap, bit);
+    if(!is_equal(state, node_p[position], key)) {
+      return (removal) { removed_nothing, 0, 0, 0 };
+    }
+
+    if(level > 0 && entry_count == 2 && child_count == 0) {
+      size_t other = (position == map_node_header_size) ? position + 2 : map_node_header_size;
+      return (removal) { removed_all_but_one, 0, node_p[other], node_p[other + 1] };
+    }
+
+    memcpy(words, node_p, size * sizeof(vm_value));
+    close_gap(words, size, position, 2);
+    size -= 2;
+    datamap &= ~bit;
+  }
+  else if(nodemap & bit) {
+    size_t child_pos = child_position(datamap, nodemap, bit);
+    removal child = remove_from(state, node_p[child_pos], level + 1, hash, key);
+
+    switch(child.result) {
+      case removed_nothing:
+        return child;
+
+      case removed_from_node:
+        memcpy(words, node_p, size * sizeof(vm_value));
+        words[child_pos] = child.node;
+        break;
+
+      case removed_all_but_one: {
+        if(level > 0 && entry_count == 0 && child_count == 1) {
+          return child;
+        }
+        // the entry replaces the child
+        memcpy(words, node_p, size * sizeof(vm_value));
+        close_gap(words, size, child_pos, 1);
+        size -= 1;
+        nodemap &= ~bit;
+        datamap |= bit;
+        size_t position = entry_position(datamap, bit);
+        open_gap(words, size, position, 2);
+        size += 2;
+        words[position] = child.key;
+        words[position + 1] = child.value;
+      }
+      break;
+    }
+  }
+  else {
+    return (removal) { removed_nothing, 0, 0, 0 };
+  }
+
+  words[0] = map_node_header(count - 1, datamap);
+  words[1] = nodemap;
+  return (removal) { removed_from_node, store_node(state, words, size), 0, 0 };
+}
+
+
+vm_value map_remove(vm_state *state, vm_value map, vm_value hash, vm_value key) {
+  // the root is never asked to give up its last entry
+  removal r = remove_from(state, map, 0, hash, key);
+  return r.result == removed_nothing ? map : r.node;
+}
+
+
+void map_entry(vm_state *state, vm_value map, size_t index, vm_value *key, vm_value *value) {
+  vm_value *node = node_pointer(state, map);
+
+  while(!map_node_is_collision(node)) {
+    size_t entry_count = __builtin_popcount(map_node_datamap(node[0]));
+    if(index < entry_count) {
+      break;
+    }
+    index -= entry_count;
+
+    // the entries of the children come after the entries of the node
+    vm_value *children = node + map_node_header_size + 2 * entry_count;
+    size_t child_count = __builtin_popcount(map_node_nodemap(node));
+    for(size_t i = 0; i < child_count; ++i) {
+      vm_value *child = node_pointer(state, children[i]);
+      size_t child_size = map_node_count(child[0]);
+      if(index < child_size) {
+        node = child;
+        break;
+      }
+      index -= child_size;
+    }
+  }
+
+  *key = node[map_node_header_size + 2 * index];
+  *value = node[map_node_header_size + 2 * index + 1];
+}
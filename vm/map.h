@@ -0,0 +1,32 @@
+#ifndef _INCLUDE_MAP_H
+#define _INCLUDE_MAP_H
+
+#include <stdbool.h>
+#include "vm_internal.h"
+
+// Maps are persistent, so inserting and removing returns a new map and leaves the old
+// one alone.
+
+// Keys are compared with is_equal and hashed with value_hash (see vm.c). Equal values
+// have the same hash.
+bool is_equal(vm_state *state, vm_value l, vm_value r);
+vm_value value_hash(vm_state *state, vm_value value);
+
+vm_value map_new(vm_state *state);
+size_t map_size(vm_state *state, vm_value map);
+// Returns false if the key isn't in the map
+bool map_lookup(vm_state *state, vm_value map, vm_value hash, vm_value key, vm_value *value);
+
+// The number of words that inserting or removing a key with the given hash allocates
+// at most. The caller has to reserve them with heap_reserve before calling map_insert
+// or map_remove, because their arguments are not updated by the garbage collector.
+size_t map_update_size(vm_state *state, vm_value map, vm_value hash);
+vm_value map_insert(vm_state *state, vm_value map, vm_value hash, vm_value key, vm_value value);
+// Returns the same map if the key isn't in it
+vm_value map_remove(vm_state *state, vm_value map, vm_value hash, vm_value key);
+
+// The entries are ordered by the hashes of their keys (and keys with the same hash by
+// the order in which they were inserted). The index has to be less than map_size.
+void map_entry(vm_state *state, vm_value map, size_t index, vm_value *key, vm_value *value);
+
+#endif
@@ -45,6 +45,39 @@ typedef enum {
   OP_NOT = 33,
   OP_GET_FIELD = 34,
   OP_CONVERT = 35,
+  OP_MATCH_SWITCH = 36, // like OP_MATCH, but uses the match table to skip patterns
+  OP_STR_CONCAT = 37,
+  OP_SUB_STR = 38,
+  OP_STR_CMP = 39,
+  OP_STR_FIND = 40,
+  OP_SPILL = 41,
+  OP_RELOAD = 42,
+
+  // Superinstructions, which the assembler generates from common sequences of the
+  // instructions above (see peephole in Assembler.hs)
+  OP_ADD_i = 43, // load_i followed by add
+  OP_SUB_i = 44, // load_i followed by sub
+  OP_JMP_LT = 45, // lt followed by jmp_true
+  OP_JMP_GT = 46, // gt followed by jmp_true
+  OP_JMP_EQ = 47, // eq followed by jmp_true
+  OP_JMP_MATCH = 48, // load_i and match_switch, for patterns without captures
+  OP_RET_i = 49, // load_i followed by ret
+  OP_RET_ps = 50, // load_ps followed by ret
+
+  // Persistent hash maps (see map.c)
+  OP_MAP_NEW = 51,
+  OP_MAP_GET = 52,
+  OP_MAP_PUT = 53,
+  OP_MAP_DEL = 54,
+  OP_MAP_SIZE = 55,
+  OP_MAP_ENTRY = 56,
+
+  // Arrays (see array.c)
+  OP_ARRAY_NEW = 57,
+  OP_ARRAY_GET = 58,
+  OP_ARRAY_SET = 59,
+  OP_ARRAY_LEN = 60,
+  OP_ARRAY_SLICE = 61,
 
   FUN_HEADER = 63
 } vm_opcode;
@@ -61,16 +94,20 @@ typedef enum {
 #define get_arg_r1(instr) ((instr & 0x001F0000) >> (instr_size - (__opcb + 2 * __regb)))
 #define get_arg_r2(instr) ((instr & 0x0000F800) >> (instr_size - (__opcb + 3 * __regb)))
 #define get_arg_i(instr)   (instr & 0x001FFFFF) //Obs! This is for opcode + reg0 + number
+#define get_arg_small_i(instr) (instr & 0x000007FF) // for opcode + three registers + number
 
 
-/* Used by tests */
-#define instr_ri(op, reg, i) ((op << (instr_size - __opcb)) + (reg << (instr_size - (__opcb + __regb))) + i)
+/* Used by tests. The opcode is shifted as an unsigned value, because opcodes from 32 on
+   don't fit into an int once they are shifted */
+#define instr_ri(op, reg, i) (((vm_instruction) (op) << (instr_size - __opcb)) + (reg << (instr_size - (__opcb + __regb))) + i)
 
-#define instr_rrr(op, reg0, reg1, reg2) ((op << (instr_size - __opcb)) + \
+#define instr_rrr(op, reg0, reg1, reg2) (((vm_instruction) (op) << (instr_size - __opcb)) + \
                                             (reg0 << (instr_size - (__opcb + __regb))) + \
                                             (reg1 << (instr_size - (__opcb + 2 * __regb))) + \
                                             (reg2 << (instr_size - (__opcb + 3 * __regb))))
 
+#define instr_rrri(op, reg0, reg1, reg2, i) (instr_rrr(op, reg0, reg1, reg2) + i)
+
 // TODO make it clear which opcodes expect a function address and which expect a closure!!
 // TODO describe all arguments!
 #define op_load_i(r0, i) (instr_ri(OP_LOAD_i, r0, i))
@@ -85,6 +122,8 @@ typedef enum {
 #define op_move(r0, r1) (instr_rrr(OP_MOVE, r0, r1, 0))
 #define op_ap(r0, fr, n) (instr_rrr(OP_AP, r0, fr, n)) // result reg, reg with function addr (code), num arguments
 #define op_gen_ap(r0, clr, n) (instr_rrr(OP_GEN_AP, r0, clr, n)) // result reg, reg with closure addr (heap), num arguments
+#define op_tail_ap(fr, n) (instr_rrr(OP_TAIL_AP, 0, fr, n)) // reg with function addr (code), num arguments
+#define op_tail_gen_ap(r0, clr, n) (instr_rrr(OP_TAIL_GEN_AP, r0, clr, n)) // result reg, reg with closure addr (heap), num arguments
 #define op_part_ap(r0, fr, n) (instr_rrr(OP_PART_AP, r0, fr, n)) // result reg, reg with function addr (code), num arguments
 #define op_ret(r0) (instr_ri(OP_RET, r0, 0))
 #define op_jmp(n) (instr_ri(OP_JMP, 0, n))
@@ -105,9 +144,48 @@ typedef enum {
 #define op_jmp_true(b, n) (instr_ri(OP_JMP_TRUE, b, n))
 #define op_or(r0, r1, r2) (instr_rrr(OP_OR, r0, r1, r2))
 #define op_and(r0, r1, r2) (instr_rrr(OP_AND, r0, r1, r2))
-#define op_not(r0, r1) (instr_rrr(OP_NOT, r0, r1))
+#define op_not(r0, r1) (instr_rrr(OP_NOT, r0, r1, 0))
 #define op_get_field(r0, mod_r, sym_r) (instr_rrr(OP_GET_FIELD, r0, mod_r, sym_r))
 #define op_convert(r0, r1, rt) (instr_rrr(OP_CONVERT, r0, r1, rt))
+#define op_match_switch(r1, r2, r3) (instr_rrr(OP_MATCH_SWITCH, r1, r2, r3)) // same arguments as op_match
+#define op_str_concat(r0, r1, r2) (instr_rrr(OP_STR_CONCAT, r0, r1, r2)) // result reg, first string reg, second string reg
+#define op_sub_str(r0, r1, r2) (instr_rrr(OP_SUB_STR, r0, r1, r2)) // result reg, string reg, start index reg (the length is in the register after it)
+#define op_str_cmp(r0, r1, r2) (instr_rrr(OP_STR_CMP, r0, r1, r2)) // result reg (-1, 0 or 1), string reg, string reg
+#define op_str_find(r0, r1, r2) (instr_rrr(OP_STR_FIND, r0, r1, r2)) // result reg (index or -1), string reg, reg with string to find
+#define op_spill(r0, i) (instr_ri(OP_SPILL, r0, i)) // value reg, spill slot
+#define op_reload(r0, i) (instr_ri(OP_RELOAD, r0, i)) // result reg, spill slot
+// The numbers of the following superinstructions are biased with small_int_bias. The
+// register of the replaced load still gets the constant, and the compare-and-branch
+// instructions still write their result, so nothing changes for the code after them.
+#define op_add_i(r0, r1, rc, i) (instr_rrri(OP_ADD_i, r0, r1, rc, i)) // result reg, number reg, reg for the constant, constant
+#define op_sub_i(r0, r1, rc, i) (instr_rrri(OP_SUB_i, r0, r1, rc, i)) // result reg, number reg, reg for the constant, constant
+#define op_jmp_lt(r0, r1, r2, n) (instr_rrri(OP_JMP_LT, r0, r1, r2, n)) // result reg, number reg, number reg, jump offset
+#define op_jmp_gt(r0, r1, r2, n) (instr_rrri(OP_JMP_GT, r0, r1, r2, n)) // result reg, number reg, number reg, jump offset
+#define op_jmp_eq(r0, r1, r2, n) (instr_rrri(OP_JMP_EQ, r0, r1, r2, n)) // result reg, value reg, value reg, jump offset
+#define op_jmp_match(r0, i) (instr_ri(OP_JMP_MATCH, r0, i)) // reg with subject, pattern addr (not biased)
+#define op_ret_i(r0, i) (instr_ri(OP_RET_i, r0, i)) // result reg, number (biased with int_bias)
+#define op_ret_ps(r0, i) (instr_ri(OP_RET_ps, r0, i)) // result reg, symbol id
+#define op_map_new(r0) (instr_rrr(OP_MAP_NEW, r0, 0, 0)) // result reg
+#define op_map_get(r0, r1, r2) (instr_rrr(OP_MAP_GET, r0, r1, r2)) // result reg (holds the value for a missing key), map reg, key reg
+#define op_map_put(r0, r1, r2) (instr_rrr(OP_MAP_PUT, r0, r1, r2)) // result reg (holds the value to insert), map reg, key reg
+#define op_map_del(r0, r1, r2) (instr_rrr(OP_MAP_DEL, r0, r1, r2)) // result reg, map reg, key reg
+#define op_map_size(r0, r1) (instr_rrr(OP_MAP_SIZE, r0, r1, 0)) // result reg, map reg
+#define op_map_entry(r0, r1, r2) (instr_rrr(OP_MAP_ENTRY, r0, r1, r2)) // result reg for the key (the value goes into the register after it), map reg, index reg
+#define op_array_new(r0, r1) (instr_rrr(OP_ARRAY_NEW, r0, r1, 0)) // result reg (holds the value for all elements), length reg
+#define op_array_get(r0, r1, r2) (instr_rrr(OP_ARRAY_GET, r0, r1, r2)) // result reg, array reg, index reg
+#define op_array_set(r0, r1, r2) (instr_rrr(OP_ARRAY_SET, r0, r1, r2)) // array reg (changed in place), index reg, value reg
+#define op_array_len(r0, r1) (instr_rrr(OP_ARRAY_LEN, r0, r1, 0)) // result reg, array reg
+#define op_array_slice(r0, r1, r2) (instr_rrr(OP_ARRAY_SLICE, r0, r1, r2)) // result reg, array reg, start index reg (the length is in the register after it)
 #define fun_header(arity) (instr_ri(FUN_HEADER, 0, arity))
+// Frame size is the number of registers a function uses, where 0 means num_regs
+#define fun_header_with_frame(arity, frame_size) (instr_ri(FUN_HEADER, (frame_size) % num_regs, arity))
+// A function that spills values gets all registers, and its spill slots come right
+// after them. The number of spill slots is stored above the arity.
+#define fun_arity_bits 6
+#define fun_header_with_spill_slots(arity, spill_slots) (instr_ri(FUN_HEADER, 0, ((arity) | ((spill_slots) << fun_arity_bits))))
+#define get_fun_arity(header) (get_arg_i(header) & ((1 << fun_arity_bits) - 1))
+#define get_fun_spill_slots(header) (get_arg_i(header) >> fun_arity_bits)
+#define get_fun_frame_size(header) (get_fun_spill_slots(header) > 0 ? num_regs + get_fun_spill_slots(header) \
+                                    : (get_arg_r0(header) == 0 ? num_regs : get_arg_r0(header)))
 
 #endif
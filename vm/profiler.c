@@ -0,0 +1,518 @@
+#include <stdlib.h>
+#include <string.h>
+#include "profiler.h"
+#include "opcodes.h"
+#include "defs.h"
+
+/*
+
+Profiling
+~~~~~~~~~
+
+A vm instance that profiles (see vm_enable_profiling) runs every instruction through
+profile_instruction first. With computed gotos, this is done by jumping through a
+second dispatch table, so that the interpreter is exactly the same when it isn't
+profiling (see interpret in vm.c).
+
+Time is measured in executed instructions, not in cycles, which makes profiles
+repeatable and independent of the machine. Everything is counted per instruction:
+  - how often it was run, which gives us the counts per opcode, the number of
+    instructions run by each function, and the number of calls of each function
+    (i.e. how often its first instruction was run)
+  - how many words it allocated on the heap
+  - for match instructions, how often each arm was taken. The arms are the jump
+    table after the match instruction, so they are counted like any other
+    instruction.
+
+Functions are identified by their FUN_HEADER. The top-level code starts at address
+0, and the instructions after the program, which the vm uses to call functions
+(vm_call) and start threads, count as the pseudo-function <call>.
+
+Every profile_sample_interval instructions we also take a sample of the call stack.
+The samples are written in the folded format of flamegraph.pl, with every sample
+standing for profile_sample_interval instructions.
+
+*/
+
+// Only the innermost frames of deeper stacks are sampled
+#define max_sample_depth 64
+#define truncated_stack (-1)
+
+static const char *opcode_names[] = {
+  [OP_RET] = "ret",
+  [OP_LOAD_i] = "load_i",
+  [OP_LOAD_ps] = "load_ps",
+  [OP_LOAD_cs] = "load_cs",
+  [OP_LOAD_os] = "load_os",
+  [OP_LOAD_f] = "load_f",
+  [OP_ADD] = "add",
+  [OP_SUB] = "sub",
+  [OP_MUL] = "mul",
+  [OP_DIV] = "div",
+  [OP_MOVE] = "move",
+  [OP_AP] = "ap",
+  [OP_GEN_AP] = "gen_ap",
+  [OP_TAIL_AP] = "tail_ap",
+  [OP_TAIL_GEN_AP] = "tail_gen_ap",
+  [OP_PART_AP] = "part_ap",
+  [OP_JMP] = "jmp",
+  [OP_MATCH] = "match",
+  [OP_SET_ARG] = "set_arg",
+  [OP_SET_CL_VAL] = "set_cl_val",
+  [OP_EQ] = "eq",
+  [OP_COPY_SYM] = "copy_sym",
+  [OP_SET_SYM_FIELD] = "set_sym_field",
+  [OP_LOAD_str] = "load_str",
+  [OP_STR_LEN] = "str_len",
+  [OP_NEW_STR] = "new_str",
+  [OP_GET_CHAR] = "get_char",
+  [OP_PUT_CHAR] = "put_char",
+  [OP_LT] = "lt",
+  [OP_GT] = "gt",
+  [OP_JMP_TRUE] = "jmp_true",
+  [OP_OR] = "or",
+  [OP_AND] = "and",
+  [OP_NOT] = "not",
+  [OP_GET_FIELD] = "get_field",
+  [OP_CONVERT] = "convert",
+  [OP_MATCH_SWITCH] = "match_switch",
+  [OP_STR_CONCAT] = "str_concat",
+  [OP_SUB_STR] = "sub_str",
+  [OP_STR_CMP] = "str_cmp",
+  [OP_STR_FIND] = "str_find",
+  [OP_SPILL] = "spill",
+  [OP_RELOAD] = "reload",
+  [OP_ADD_i] = "add_i",
+  [OP_SUB_i] = "sub_i",
+  [OP_JMP_LT] = "jmp_lt",
+  [OP_JMP_GT] = "jmp_gt",
+  [OP_JMP_EQ] = "jmp_eq",
+  [OP_JMP_MATCH] = "jmp_match",
+  [OP_RET_i] = "ret_i",
+  [OP_RET_ps] = "ret_ps",
+  [OP_MAP_NEW] = "map_new",
+  [OP_MAP_GET] = "map_get",
+  [OP_MAP_PUT] = "map_put",
+  [OP_MAP_DEL] = "map_del",
+  [OP_MAP_SIZE] = "map_size",
+  [OP_MAP_ENTRY] = "map_entry",
+  [OP_ARRAY_NEW] = "array_new",
+  [OP_ARRAY_GET] = "array_get",
+  [OP_ARRAY_SET] = "array_set",
+  [OP_ARRAY_LEN] = "array_len",
+  [OP_ARRAY_SLICE] = "array_slice",
+  [FUN_HEADER] = "fun_header",
+};
+
+#define num_opcode_names ((int) (sizeof(opcode_names) / sizeof(opcode_names[0])))
+
+static const char *opcode_name(int opcode) {
+  if(opcode >= num_opcode_names) {
+    // the end of the decoded program
+    return "halt";
+  }
+  return opcode_names[opcode] != NULL ? opcode_names[opcode] : "unknown";
+}
+
+
+bool profile_init(vm_profile *p, const vm_instruction *program, int program_length, int length) {
+  memset(p, 0, sizeof(vm_profile));
+  p->length = length;
+  p->program_length = program_length;
+  p->opcodes = calloc(length, sizeof(uint8_t));
+  p->function_of = calloc(length, sizeof(int));
+  p->function_names = calloc(length, sizeof(char *));
+  p->instruction_counts = calloc(length, sizeof(uint64_t));
+  p->allocated_words = calloc(length, sizeof(uint64_t));
+  p->match_patterns = calloc(length, sizeof(int));
+  if(p->opcodes == NULL || p->function_of == NULL || p->function_names == NULL
+     || p->instruction_counts == NULL || p->allocated_words == NULL || p->match_patterns == NULL) {
+    profile_free(p);
+    return false;
+  }
+
+  int function = 0;
+  for(int i = 0; i < length; ++i) {
+    if(i < program_length) {
+      p->opcodes[i] = get_opcode(program[i]);
+      if(p->opcodes[i] == FUN_HEADER) {
+        function = i;
+      }
+      p->function_of[i] = function;
+    }
+    else {
+      p->function_of[i] = program_length;
+    }
+  }
+
+  p->instructions_until_sample = profile_sample_interval;
+  return true;
+}
+
+
+void profile_free(vm_profile *p) {
+  if(p->function_names != NULL) {
+    for(int i = 0; i < p->length; ++i) {
+      free(p->function_names[i]);
+    }
+  }
+  for(size_t i = 0; i < p->stack_capacity; ++i) {
+    free(p->stacks[i].functions);
+  }
+  free(p->opcodes);
+  free(p->function_of);
+  free(p->function_names);
+  free(p->instruction_counts);
+  free(p->allocated_words);
+  free(p->match_patterns);
+  free(p->stacks);
+  memset(p, 0, sizeof(vm_profile));
+}
+
+
+void profile_name_function(vm_profile *p, int address, const char *name) {
+  if(address < 0 || address >= p->length) {
+    return;
+  }
+  free(p->function_names[address]);
+  p->function_names[address] = strdup(name);
+}
+
+
+static int function_at(vm_profile *p, int address) {
+  if(address < 0 || address >= p->length) {
+    return p->program_length;
+  }
+  return p->function_of[address];
+}
+
+
+static uint64_t hash_stack(const int *functions, int depth) {
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for(int i = 0; i < depth; ++i) {
+    hash = (hash ^ (uint32_t) functions[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+
+static profile_stack *find_stack(profile_stack *stacks, size_t capacity, uint64_t hash, const int *functions, int depth) {
+  size_t i = hash & (capacity - 1);
+  while(stacks[i].functions != NULL) {
+    profile_stack *s = &stacks[i];
+    if(s->hash == hash && s->depth == depth && memcmp(s->functions, functions, depth * sizeof(int)) == 0) {
+      break;
+    }
+    i = (i + 1) & (capacity - 1);
+  }
+  return &stacks[i];
+}
+
+
+// The table is only half full at most, so that there's always a free slot
+static bool grow_stacks(vm_profile *p) {
+  size_t capacity = p->stack_capacity == 0 ? 256 : p->stack_capacity * 2;
+  profile_stack *stacks = calloc(capacity, sizeof(profile_stack));
+  if(stacks == NULL) {
+    return false;
+  }
+  for(size_t i = 0; i < p->stack_capacity; ++i) {
+    profile_stack *s = &p->stacks[i];
+    if(s->functions != NULL) {
+      *find_stack(stacks, capacity, s->hash, s->functions, s->depth) = *s;
+    }
+  }
+  free(p->stacks);
+  p->stacks = stacks;
+  p->stack_capacity = capacity;
+  return true;
+}
+
+
+void profile_sample(vm_state *state) {
+  vm_profile *p = state->profile;
+  p->instructions_until_sample = profile_sample_interval;
+
+  int functions[max_sample_depth + 1];
+  int depth = 0;
+  int first_frame = 0;
+  if(state->stack_pointer >= max_sample_depth) {
+    first_frame = state->stack_pointer - max_sample_depth + 1;
+    functions[depth++] = truncated_stack;
+  }
+  // The return address of a frame points into the function of the frame below it
+  for(int i = first_frame; i <= state->stack_pointer; ++i) {
+    int address = (i == state->stack_pointer) ? state->program_pointer - 1 : state->stack[i + 1].return_address - 1;
+    functions[depth++] = function_at(p, address);
+  }
+
+  if((p->stack_count + 1) * 2 > p->stack_capacity && !grow_stacks(p)) {
+    // the sample is lost, but the rest of the profile is still fine
+    return;
+  }
+  uint64_t hash = hash_stack(functions, depth);
+  profile_stack *s = find_stack(p->stacks, p->stack_capacity, hash, functions, depth);
+  if(s->functions == NULL) {
+    s->functions = malloc(depth * sizeof(int));
+    if(s->functions == NULL) {
+      return;
+    }
+    memcpy(s->functions, functions, depth * sizeof(int));
+    s->hash = hash;
+    s->depth = depth;
+    ++p->stack_count;
+  }
+  ++s->count;
+}
+
+
+/* Writing the profile */
+
+// Folded stacks use spaces and semicolons as separators, so they can't be part of a
+// name there
+static void write_function_name(FILE *out, vm_profile *p, int function, bool is_folded) {
+  char buffer[32];
+  const char *name;
+  if(function == truncated_stack) {
+    name = "...";
+  }
+  else if(function == p->program_length) {
+    name = "<call>";
+  }
+  else if(p->function_names[function] != NULL) {
+    name = p->function_names[function];
+  }
+  else if(function == 0) {
+    name = "<main>";
+  }
+  else {
+    snprintf(buffer, sizeof(buffer), "fun_%i", function);
+    name = buffer;
+  }
+
+  if(!is_folded) {
+    fputs(name, out);
+    return;
+  }
+  for(const char *c = name; *c != '\0'; ++c) {
+    fputc((*c == ' ' || *c == ';') ? '_' : *c, out);
+  }
+}
+
+
+static void write_site(FILE *out, vm_profile *p, int address) {
+  int function = p->function_of[address];
+  fputs("  ", out);
+  write_function_name(out, p, function, false);
+  fprintf(out, "+%i (%s)", address - function, opcode_name(p->opcodes[address]));
+}
+
+
+static double percent(uint64_t part, uint64_t total) {
+  return total == 0 ? 0.0 : 100.0 * (double) part / (double) total;
+}
+
+
+typedef struct {
+  uint64_t key;
+  int index;
+} sort_entry;
+
+static int compare_entries(const void *a, const void *b) {
+  const sort_entry *l = a;
+  const sort_entry *r = b;
+  if(l->key != r->key) {
+    return l->key < r->key ? 1 : -1;
+  }
+  return l->index - r->index;
+}
+
+// Returns the indices with a non-zero key, sorted by their keys (largest first)
+static int sort_by_key(const uint64_t *keys, int count, sort_entry *entries) {
+  int n = 0;
+  for(int i = 0; i < count; ++i) {
+    if(keys[i] > 0) {
+      entries[n].key = keys[i];
+      entries[n].index = i;
+      ++n;
+    }
+  }
+  qsort(entries, n, sizeof(sort_entry), compare_entries);
+  return n;
+}
+
+
+typedef struct {
+  uint64_t calls;
+  uint64_t instructions;
+  uint64_t sampled_instructions;
+  uint64_t allocated_words;
+} function_totals;
+
+// A function starts with its first instruction, its body starts after the header
+static int function_body(vm_profile *p, int function) {
+  if(function == p->program_length) {
+    // the call of vm_call
+    return function + 1;
+  }
+  return p->opcodes[function] == FUN_HEADER ? function + fun_header_size : function;
+}
+
+
+static void write_functions(FILE *out, vm_profile *p, uint64_t total, sort_entry *entries) {
+  function_totals *totals = calloc(p->length, sizeof(function_totals));
+  uint64_t *keys = calloc(p->length, sizeof(uint64_t));
+  if(totals == NULL || keys == NULL) {
+    free(totals);
+    free(keys);
+    return;
+  }
+
+  for(int i = 0; i < p->length; ++i) {
+    function_totals *t = &totals[p->function_of[i]];
+    t->instructions += p->instruction_counts[i];
+    t->allocated_words += p->allocated_words[i];
+  }
+  for(int i = 0; i < p->length; ++i) {
+    if(p->function_of[i] == i) {
+      int body = function_body(p, i);
+      totals[i].calls = body < p->length ? p->instruction_counts[body] : 0;
+    }
+  }
+
+  // Recursive functions are on the stack more than once, but are only counted once
+  // per sample
+  for(size_t i = 0; i < p->stack_capacity; ++i) {
+    profile_stack *s = &p->stacks[i];
+    for(int j = 0; s->functions != NULL && j < s->depth; ++j) {
+      int function = s->functions[j];
+      bool is_outermost = true;
+      for(int k = 0; k < j; ++k) {
+        is_outermost = is_outermost && s->functions[k] != function;
+      }
+      if(function != truncated_stack && is_outermost) {
+        totals[function].sampled_instructions += s->count * profile_sample_interval;
+      }
+    }
+  }
+
+  for(int i = 0; i < p->length; ++i) {
+    keys[i] = totals[i].instructions;
+  }
+  int n = sort_by_key(keys, p->length, entries);
+  fprintf(out, "Functions\n");
+  fprintf(out, "  %12s %14s %7s %15s %12s  %s\n", "calls", "instructions", "%", "incl. (sampled)", "alloc words", "function");
+  for(int i = 0; i < n; ++i) {
+    int function = entries[i].index;
+    function_totals *t = &totals[function];
+    fprintf(out, "  %12llu %14llu %6.2f%% %15llu %12llu  ",
+            (unsigned long long) t->calls, (unsigned long long) t->instructions, percent(t->instructions, total),
+            (unsigned long long) t->sampled_instructions, (unsigned long long) t->allocated_words);
+    write_function_name(out, p, function, false);
+    fputc('\n', out);
+  }
+  fputc('\n', out);
+
+  free(totals);
+  free(keys);
+}
+
+
+static void write_opcodes(FILE *out, vm_profile *p, uint64_t total, sort_entry *entries) {
+  uint64_t counts[256] = { 0 };
+  for(int i = 0; i < p->length; ++i) {
+    counts[p->opcodes[i]] += p->instruction_counts[i];
+  }
+  int n = sort_by_key(counts, 256, entries);
+  fprintf(out, "Opcodes\n");
+  fprintf(out, "  %14s %7s  %s\n", "instructions", "%", "opcode");
+  for(int i = 0; i < n; ++i) {
+    fprintf(out, "  %14llu %6.2f%%  %s\n", (unsigned long long) entries[i].key,
+            percent(entries[i].key, total), opcode_name(entries[i].index));
+  }
+  fputc('\n', out);
+}
+
+
+static void write_allocations(FILE *out, vm_profile *p, sort_entry *entries) {
+  int n = sort_by_key(p->allocated_words, p->length, entries);
+  fprintf(out, "Allocations\n");
+  fprintf(out, "  %12s  %s\n", "words", "site");
+  for(int i = 0; i < n; ++i) {
+    fprintf(out, "  %12llu", (unsigned long long) entries[i].key);
+    write_site(out, p, entries[i].index);
+    fputc('\n', out);
+  }
+  fputc('\n', out);
+}
+
+
+static void write_match_arms(FILE *out, vm_profile *p) {
+  fprintf(out, "Match arms\n");
+  fprintf(out, "  %12s  %s\n", "matches", "site and hits per arm");
+  for(int i = 0; i < p->length; ++i) {
+    int arms = p->match_patterns[i];
+    if(arms == 0) {
+      continue;
+    }
+    uint64_t matches = p->instruction_counts[i];
+    fprintf(out, "  %12llu", (unsigned long long) matches);
+    write_site(out, p, i);
+    fputc(':', out);
+    for(int j = 0; j < arms && i + 1 + j < p->length; ++j) {
+      uint64_t hits = p->instruction_counts[i + 1 + j];
+      fprintf(out, " %llu (%.1f%%)", (unsigned long long) hits, percent(hits, matches));
+    }
+    fputc('\n', out);
+  }
+}
+
+
+static void write_report(FILE *out, vm_profile *p) {
+  sort_entry *entries = calloc(p->length > 256 ? p->length : 256, sizeof(sort_entry));
+  if(entries == NULL) {
+    return;
+  }
+  uint64_t total = 0;
+  for(int i = 0; i < p->length; ++i) {
+    total += p->instruction_counts[i];
+  }
+  fprintf(out, "Instructions: %llu\n\n", (unsigned long long) total);
+  write_functions(out, p, total, entries);
+  write_opcodes(out, p, total, entries);
+  write_allocations(out, p, entries);
+  write_match_arms(out, p);
+  free(entries);
+}
+
+
+static void write_folded(FILE *out, vm_profile *p) {
+  for(size_t i = 0; i < p->stack_capacity; ++i) {
+    profile_stack *s = &p->stacks[i];
+    if(s->functions == NULL) {
+      continue;
+    }
+    for(int j = 0; j < s->depth; ++j) {
+      if(j > 0) {
+        fputc(';', out);
+      }
+      write_function_name(out, p, s->functions[j], true);
+    }
+    fprintf(out, " %llu\n", (unsigned long long) (s->count * profile_sample_interval));
+  }
+}
+
+
+bool profile_write(vm_profile *p, FILE *report, FILE *folded) {
+  if(p->length == 0) {
+    return false;
+  }
+  if(report != NULL) {
+    write_report(report, p);
+  }
+  if(folded != NULL) {
+    write_folded(folded, p);
+  }
+  return true;
+}
@@ -0,0 +1,68 @@
+#ifndef _INCLUDE_PROFILER_H
+#define _INCLUDE_PROFILER_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "vm_internal.h"
+
+// A call stack that was seen when taking a sample, from the outermost function to
+// the innermost one. Functions are identified by their start addresses.
+typedef struct {
+  uint64_t hash;
+  uint64_t count;
+  int depth;
+  int *functions;
+} profile_stack;
+
+// Everything is counted per instruction (i.e. per address in the program) and only
+// summed up when the report is written
+struct vm_profile {
+  // The program and the instructions that the vm adds after it (see vm_instance)
+  int length;
+  int program_length;
+  uint8_t *opcodes;
+  // The start address of the function that each instruction belongs to
+  int *function_of;
+  char **function_names;
+
+  uint64_t *instruction_counts;
+  uint64_t *allocated_words;
+  // The number of patterns of a match instruction, whose jump table follows it
+  int *match_patterns;
+
+  int instructions_until_sample;
+  profile_stack *stacks;
+  size_t stack_count;
+  size_t stack_capacity;
+};
+
+bool profile_init(vm_profile *p, const vm_instruction *program, int program_length, int length);
+void profile_free(vm_profile *p);
+void profile_name_function(vm_profile *p, int address, const char *name);
+void profile_sample(vm_state *state);
+// Either file can be NULL
+bool profile_write(vm_profile *p, FILE *report, FILE *folded);
+
+// The number of instructions between two samples of the call stack
+#define profile_sample_interval 997
+
+// Called for every instruction before it runs, but only if the vm is profiling
+static inline void profile_instruction(vm_state *state, int address) {
+  vm_profile *p = state->profile;
+  ++p->instruction_counts[address];
+  if(--p->instructions_until_sample == 0) {
+    profile_sample(state);
+  }
+}
+
+// Allocations are counted for the instruction that is running
+static inline void profile_allocation(vm_state *state, size_t size) {
+  vm_profile *p = state->profile;
+  int address = state->program_pointer - 1;
+  if(address >= 0 && address < p->length) {
+    p->allocated_words[address] += size;
+  }
+}
+
+#endif
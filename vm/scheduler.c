@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scheduler.h"
+#include "defs.h"
+#include "encoding.h"
+
+/*
+
+Green threads
+~~~~~~~~~~~~~
+
+A program can spawn threads with io.spawn, wait for their results with io.await
+and pass messages through channels. All threads of a vm instance run on the OS
+thread that runs the instance and share its heap. Thread 0 is the main thread, i.e.
+the program itself (or the function called by vm_call). When it finishes, the
+program is done, and all other threads are dropped.
+
+Every thread has its own stack and register file. The running thread uses the ones
+in vm_state, just like a program without threads, so the interpreter doesn't have
+to know which thread it's running. Switching threads means swapping the stack, the
+registers and the program pointer of vm_state with those of another thread.
+
+Threads are switched in three cases:
+  - The time slice of the running thread is used up. Every call and return counts
+    down the time slice (see count_time_slice in vm.c), and then the thread goes to
+    the end of the run queue. It's enough to count calls and returns, because
+    Dash has no loops.
+  - An io action of the thread can't be run yet (io.await of a thread that isn't
+    done, io.receive on an empty channel, or io.read_line while there's no input
+    and other threads could run). The thread is blocked until it's woken up, and
+    then runs the same io action again. That's why the program pointer of a blocked
+    thread is set to retry_address, where it returns its io action once more.
+  - The thread is done. Its result is kept for io.await.
+
+If all threads are blocked, the program is deadlocked and stops with an error.
+
+*/
+
+static void out_of_memory() {
+  fprintf(stderr, "Out of memory!\n");
+  exit(-1);
+}
+
+
+static void *grow_array(void *array, int *capacity, size_t element_size) {
+  int new_capacity = *capacity == 0 ? 8 : *capacity * 2;
+  void *resized = realloc(array, new_capacity * element_size);
+  if(resized == NULL) {
+    out_of_memory();
+  }
+  *capacity = new_capacity;
+  return resized;
+}
+
+
+static void push_runnable(vm_scheduler *s, int thread_id) {
+  if(s->run_queue_count == s->run_queue_capacity) {
+    // unwrap the ring buffer, so that it can grow at the end
+    int *queue = malloc((s->run_queue_capacity == 0 ? 8 : s->run_queue_capacity * 2) * sizeof(int));
+    if(queue == NULL) {
+      out_of_memory();
+    }
+    for(int i = 0; i < s->run_queue_count; ++i) {
+      queue[i] = s->run_queue[(s->run_queue_first + i) % s->run_queue_capacity];
+    }
+    free(s->run_queue);
+    s->run_queue = queue;
+    s->run_queue_first = 0;
+    s->run_queue_capacity = s->run_queue_capacity == 0 ? 8 : s->run_queue_capacity * 2;
+  }
+  s->run_queue[(s->run_queue_first + s->run_queue_count) % s->run_queue_capacity] = thread_id;
+  ++s->run_queue_count;
+  s->threads[thread_id].status = thread_runnable;
+}
+
+
+static void wake_threads(vm_scheduler *s, wait_reason reason, int id) {
+  for(int i = 0; i < s->thread_count; ++i) {
+    vm_thread *t = &s->threads[i];
+    if(t->status == thread_blocked && t->waiting_for == reason && t->wait_id == id) {
+      push_runnable(s, i);
+    }
+  }
+}
+
+
+// Returns -1 if no thread can run
+static int pop_runnable(vm_scheduler *s) {
+  if(s->run_queue_count == 0) {
+    // threads that wait for input only block if there's something else to do
+    wake_threads(s, wait_for_input, 0);
+    if(s->run_queue_count == 0) {
+      return -1;
+    }
+  }
+  int thread_id = s->run_queue[s->run_queue_first];
+  s->run_queue_first = (s->run_queue_first + 1) % s->run_queue_capacity;
+  --s->run_queue_count;
+  return thread_id;
+}
+
+
+static void save_context(vm_state *state, vm_thread *t, thread_status status) {
+  t->status = status;
+  t->stack = state->stack;
+  t->stack_capacity = state->stack_capacity;
+  t->registers = state->registers;
+  t->registers_capacity = state->registers_capacity;
+  t->registers_used = state->registers_used;
+  t->stack_pointer = state->stack_pointer;
+  t->program_pointer = state->program_pointer;
+}
+
+
+static void load_context(vm_state *state, int thread_id) {
+  vm_scheduler *s = &state->scheduler;
+  vm_thread *t = &s->threads[thread_id];
+  t->status = thread_running;
+  state->stack = t->stack;
+  state->stack_capacity = t->stack_capacity;
+  state->registers = t->registers;
+  state->registers_capacity = t->registers_capacity;
+  state->registers_used = t->registers_used;
+  state->stack_pointer = t->stack_pointer;
+  state->program_pointer = t->program_pointer;
+  // vm_state owns the stack and the registers while the thread is running
+  t->stack = NULL;
+  t->registers = NULL;
+  s->current_thread = thread_id;
+  s->time_slice = thread_time_slice;
+}
+
+
+static void free_context(vm_thread *t) {
+  free(t->stack);
+  free(t->registers);
+  t->stack = NULL;
+  t->registers = NULL;
+  t->registers_capacity = 0;
+  t->registers_used = 0;
+}
+
+
+bool scheduler_init(vm_state *state) {
+  vm_scheduler *s = &state->scheduler;
+  memset(s, 0, sizeof(vm_scheduler));
+  s->threads = calloc(1, sizeof(vm_thread));
+  if(s->threads == NULL) {
+    return false;
+  }
+  s->thread_capacity = 1;
+  s->thread_count = 1;
+  s->threads[0].status = thread_running;
+  s->time_slice = thread_time_slice;
+  return true;
+}
+
+
+void scheduler_reset(vm_state *state) {
+  vm_scheduler *s = &state->scheduler;
+
+  // the program might have stopped in another thread (because of an error)
+  if(s->current_thread != 0) {
+    free(state->stack);
+    free(state->registers);
+    load_context(state, 0);
+  }
+
+  for(int i = 1; i < s->thread_count; ++i) {
+    free_context(&s->threads[i]);
+  }
+  for(int i = 0; i < s->channel_count; ++i) {
+    free(s->channels[i].messages);
+  }
+
+  memset(&s->threads[0], 0, sizeof(vm_thread));
+  s->threads[0].status = thread_running;
+  s->thread_count = 1;
+  s->current_thread = 0;
+  s->run_queue_first = 0;
+  s->run_queue_count = 0;
+  s->channel_count = 0;
+  s->time_slice = thread_time_slice;
+}
+
+
+void scheduler_destroy(vm_state *state) {
+  vm_scheduler *s = &state->scheduler;
+  if(s->threads == NULL) {
+    return;
+  }
+  scheduler_reset(state);
+  free(s->threads);
+  free(s->run_queue);
+  free(s->channels);
+  memset(s, 0, sizeof(vm_scheduler));
+}
+
+
+int scheduler_spawn(vm_state *state, vm_value entry) {
+  vm_scheduler *s = &state->scheduler;
+  if(s->thread_count == s->thread_capacity) {
+    s->threads = grow_array(s->threads, &s->thread_capacity, sizeof(vm_thread));
+  }
+
+  int thread_id = s->thread_count;
+  vm_thread *t = &s->threads[thread_id];
+  memset(t, 0, sizeof(vm_thread));
+
+  // like the stack of the main thread (see init_state in vm.c)
+  t->stack_capacity = initial_stack_size < state->max_stack_size ? initial_stack_size : state->max_stack_size;
+  t->stack = calloc(t->stack_capacity + 1, sizeof(stack_frame));
+  t->registers_capacity = (t->stack_capacity + 1) * num_regs;
+  t->registers = calloc(t->registers_capacity, sizeof(vm_value));
+  if(t->stack == NULL || t->registers == NULL) {
+    out_of_memory();
+  }
+  t->stack[0].reg = t->registers;
+  t->stack[0].frame_size = num_regs;
+  t->stack[1].reg = t->registers + num_regs;
+  t->registers_used = 2 * num_regs;
+
+  t->registers[0] = entry;
+  vm_value tag = get_tag(entry);
+  if(tag == vm_tag_function || tag == vm_tag_pap) {
+    // the argument for the call
+    t->registers[num_regs] = make_tagged_val(symbol_id_nil, vm_tag_plain_symbol);
+    t->program_pointer = s->call_address;
+  }
+  else {
+    t->program_pointer = s->retry_address;
+  }
+
+  ++s->thread_count;
+  push_runnable(s, thread_id);
+  return thread_id;
+}
+
+
+int scheduler_new_channel(vm_state *state) {
+  vm_scheduler *s = &state->scheduler;
+  if(s->channel_count == s->channel_capacity) {
+    s->channels = grow_array(s->channels, &s->channel_capacity, sizeof(vm_channel));
+  }
+  memset(&s->channels[s->channel_count], 0, sizeof(vm_channel));
+  return s->channel_count++;
+}
+
+
+static void wait_for(vm_scheduler *s, wait_reason reason, int id) {
+  vm_thread *t = &s->threads[s->current_thread];
+  t->waiting_for = reason;
+  t->wait_id = id;
+}
+
+
+scheduler_result scheduler_await(vm_state *state, vm_value thread_id, vm_value *result) {
+  vm_scheduler *s = &state->scheduler;
+  if(get_tag(thread_id) != vm_tag_number) {
+    return scheduler_invalid;
+  }
+  int64_t id = get_number(thread_id);
+  // a thread that waits for itself would never wake up again
+  if(id < 0 || id >= s->thread_count || id == s->current_thread) {
+    return scheduler_invalid;
+  }
+
+  if(s->threads[id].status == thread_finished) {
+    *result = s->threads[id].result;
+    return scheduler_done;
+  }
+  wait_for(s, wait_for_thread, (int) id);
+  return scheduler_wait;
+}
+
+
+static vm_channel *get_channel(vm_scheduler *s, vm_value channel_id) {
+  if(get_tag(channel_id) != vm_tag_number) {
+    return NULL;
+  }
+  int64_t id = get_number(channel_id);
+  if(id < 0 || id >= s->channel_count) {
+    return NULL;
+  }
+  return &s->channels[id];
+}
+
+
+scheduler_result scheduler_send(vm_state *state, vm_value channel_id, vm_value message) {
+  vm_scheduler *s = &state->scheduler;
+  vm_channel *c = get_channel(s, channel_id);
+  if(c == NULL) {
+    return scheduler_invalid;
+  }
+
+  if(c->count == c->capacity) {
+    size_t capacity = c->capacity == 0 ? 8 : c->capacity * 2;
+    vm_value *messages = malloc(capacity * sizeof(vm_value));
+    if(messages == NULL) {
+      out_of_memory();
+    }
+    for(size_t i = 0; i < c->count; ++i) {
+      messages[i] = c->messages[(c->first + i) % c->capacity];
+    }
+    free(c->messages);
+    c->messages = messages;
+    c->first = 0;
+    c->capacity = capacity;
+  }
+  c->messages[(c->first + c->count) % c->capacity] = message;
+  ++c->count;
+
+  wake_threads(s, wait_for_channel, (int) get_number(channel_id));
+  return scheduler_done;
+}
+
+
+scheduler_result scheduler_receive(vm_state *state, vm_value channel_id, vm_value *message) {
+  vm_scheduler *s = &state->scheduler;
+  vm_channel *c = get_channel(s, channel_id);
+  if(c == NULL) {
+    return scheduler_invalid;
+  }
+
+  if(c->count == 0) {
+    wait_for(s, wait_for_channel, (int) get_number(channel_id));
+    return scheduler_wait;
+  }
+  *message = c->messages[c->first];
+  c->first = (c->first + 1) % c->capacity;
+  --c->count;
+  return scheduler_done;
+}
+
+
+void scheduler_wait_for_input(vm_state *state) {
+  wait_for(&state->scheduler, wait_for_input, 0);
+}
+
+
+void scheduler_yield(vm_state *state) {
+  vm_scheduler *s = &state->scheduler;
+  s->time_slice = thread_time_slice;
+  if(s->run_queue_count == 0) {
+    return;
+  }
+
+  int current = s->current_thread;
+  int next = pop_runnable(s);
+  save_context(state, &s->threads[current], thread_runnable);
+  push_runnable(s, current);
+  load_context(state, next);
+}
+
+
+bool scheduler_block(vm_state *state) {
+  vm_scheduler *s = &state->scheduler;
+  int next = pop_runnable(s);
+  if(next == -1) {
+    return false;
+  }
+
+  state->program_pointer = s->retry_address;
+  save_context(state, &s->threads[s->current_thread], thread_blocked);
+  load_context(state, next);
+  return true;
+}
+
+
+bool scheduler_finish(vm_state *state, vm_value result) {
+  vm_scheduler *s = &state->scheduler;
+  int current = s->current_thread;
+  vm_thread *t = &s->threads[current];
+  t->result = result;
+  t->status = thread_finished;
+  wake_threads(s, wait_for_thread, current);
+
+  int next = pop_runnable(s);
+  if(next == -1) {
+    t->status = thread_running;
+    return false;
+  }
+
+  free(state->stack);
+  free(state->registers);
+  load_context(state, next);
+  return true;
+}
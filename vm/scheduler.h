@@ -0,0 +1,40 @@
+#ifndef _INCLUDE_SCHEDULER_H
+#define _INCLUDE_SCHEDULER_H
+
+#include <stdbool.h>
+#include "vm_internal.h"
+
+typedef enum {
+  scheduler_done = 0,
+  scheduler_wait = 1,    // the running thread has to block until it's woken up again
+  scheduler_invalid = 2  // there is no such thread or channel
+} scheduler_result;
+
+bool scheduler_init(vm_state *state);
+void scheduler_destroy(vm_state *state);
+// Removes all threads except for the main thread and all channels. The main thread
+// becomes the running thread again.
+void scheduler_reset(vm_state *state);
+
+// Creates a thread that runs `entry`, which is either a function (called with nil)
+// or an io action. Returns the id of the thread.
+int scheduler_spawn(vm_state *state, vm_value entry);
+int scheduler_new_channel(vm_state *state);
+
+scheduler_result scheduler_await(vm_state *state, vm_value thread_id, vm_value *result);
+scheduler_result scheduler_send(vm_state *state, vm_value channel_id, vm_value message);
+scheduler_result scheduler_receive(vm_state *state, vm_value channel_id, vm_value *message);
+// The running thread waits until no other thread can run
+void scheduler_wait_for_input(vm_state *state);
+
+// These switch to another thread. The interpreter continues at the program pointer
+// of that thread. `block` and `finish` return false if there is no other thread that
+// could run, which means that the program is deadlocked.
+void scheduler_yield(vm_state *state);
+bool scheduler_block(vm_state *state);
+bool scheduler_finish(vm_state *state, vm_value result);
+
+#define scheduler_is_main_thread(state) ((state)->scheduler.current_thread == 0)
+#define scheduler_has_runnable_threads(state) ((state)->scheduler.run_queue_count > 0)
+
+#endif
@@ -1,11 +1,23 @@
 #include "tiny_spec/tiny_spec.h"
 #include "vm_spec.h"
 #include "vm_equality_spec.h"
+#include "vm_verifier_spec.h"
+#include "vm_image_spec.h"
+#include "vm_map_spec.h"
+#include "vm_array_spec.h"
+#include "vm_profiler_spec.h"
+#include "vm_jit_spec.h"
 
 
 int main(int argc, char **argv) {
 	verify_spec(vm_spec);
   verify_spec(vm_equality_spec);
+  verify_spec(vm_verifier_spec);
+  verify_spec(vm_image_spec);
+  verify_spec(vm_map_spec);
+  verify_spec(vm_array_spec);
+  verify_spec(vm_profiler_spec);
+  verify_spec(vm_jit_spec);
 
   return 0;
 }
@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include "vm_array_spec.h"
+
+#include "../vm_internal.h"
+#include "../opcodes.h"
+#include "../heap.h"
+#include "../encoding.h"
+#include "../defs.h"
+
+#define array_length(x) (sizeof(x) / sizeof(x[0]))
+
+#define bias(n) ((n) + int_bias)
+
+
+static bool is_error(vm_value value) {
+  if(get_tag(value) != vm_tag_dynamic_compound_symbol) {
+    return false;
+  }
+  vm_value *heap_p = vm_get_heap_pointer(get_val(value));
+  return compound_symbol_id(heap_p[0]) == symbol_id_error;
+}
+
+
+it( creates_an_array ) {
+  vm_instruction program[] = {
+    op_load_i(1, bias(5)),
+    op_load_i(2, bias(7)),
+    op_array_new(2, 1),
+    op_array_len(0, 2),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_number(5));
+}
+
+it( sets_and_gets_an_element ) {
+  vm_instruction program[] = {
+    op_load_i(1, bias(3)),
+    op_load_i(2, bias(7)),
+    op_array_new(2, 1),
+    op_load_i(3, bias(1)),
+    op_load_i(4, bias(9)),
+    op_array_set(2, 3, 4),
+    op_array_get(0, 2, 3),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_number(9));
+}
+
+it( fails_for_an_index_out_of_range ) {
+  vm_instruction program[] = {
+    op_load_i(1, bias(3)),
+    op_load_i(2, bias(7)),
+    op_array_new(2, 1),
+    op_array_get(0, 2, 1),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(is_error(result), true);
+}
+
+it( slices_an_array ) {
+  vm_instruction program[] = {
+    op_load_i(1, bias(4)),
+    op_load_i(2, bias(0)),
+    op_array_new(2, 1),
+    op_load_i(3, bias(2)),
+    op_load_i(4, bias(22)),
+    op_array_set(2, 3, 4),
+    op_load_i(5, bias(1)),
+    op_load_i(6, bias(2)),
+    op_array_slice(7, 2, 5),
+    op_array_get(0, 7, 5),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_number(22));
+}
+
+it( clamps_a_slice_to_the_array ) {
+  vm_instruction program[] = {
+    op_load_i(1, bias(4)),
+    op_load_i(2, bias(0)),
+    op_array_new(2, 1),
+    op_load_i(5, bias(1)),
+    op_load_i(6, bias(10)),
+    op_array_slice(7, 2, 5),
+    op_array_len(0, 7),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_number(3));
+}
+
+it( compares_arrays_by_their_elements ) {
+  vm_instruction program[] = {
+    op_load_i(1, bias(3)),
+    op_load_i(2, bias(5)),
+    op_array_new(2, 1),
+    op_load_i(3, bias(5)),
+    op_array_new(3, 1),
+    op_eq(4, 2, 3),
+    op_jmp_true(4, bias(2)),
+    op_load_i(0, bias(1)),
+    op_ret(0),
+    op_load_i(5, bias(0)),
+    op_array_set(3, 5, 1),
+    op_eq(0, 2, 3),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_tagged_val(symbol_id_false, vm_tag_plain_symbol));
+}
+
+it( converts_a_list_to_an_array ) {
+  vm_value const_table[] = {
+    compound_symbol_header(symbol_id_list_cons, 2),
+    make_number(1),
+    make_tagged_val(3, vm_tag_compound_symbol),
+    compound_symbol_header(symbol_id_list_cons, 2),
+    make_number(2),
+    make_tagged_val(symbol_id_empty_list, vm_tag_plain_symbol)
+  };
+  vm_instruction program[] = {
+    op_load_cs(1, 0),
+    op_load_ps(2, symbol_id_array),
+    op_convert(3, 1, 2),
+    op_load_i(4, bias(1)),
+    op_array_get(0, 3, 4),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(result, make_number(2));
+}
+
+it( converts_an_array_to_a_list ) {
+  vm_value const_table[] = {
+    compound_symbol_header(symbol_id_list_cons, 2),
+    make_number(7),
+    make_tagged_val(3, vm_tag_compound_symbol),
+    compound_symbol_header(symbol_id_list_cons, 2),
+    make_number(7),
+    make_tagged_val(symbol_id_empty_list, vm_tag_plain_symbol)
+  };
+  vm_instruction program[] = {
+    op_load_i(1, bias(2)),
+    op_load_i(2, bias(7)),
+    op_array_new(2, 1),
+    op_load_ps(3, symbol_id_list),
+    op_convert(4, 2, 3),
+    op_load_cs(5, 0),
+    op_eq(0, 4, 5),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(result, make_tagged_val(symbol_id_true, vm_tag_plain_symbol));
+}
+
+// The array is too large for the nursery, so it's in the old space while the strings
+// in it are young, and the garbage collector has to find them through the array
+it( keeps_the_elements_of_an_old_array_alive ) {
+  vm_instruction program[] = {
+    op_load_i(1, bias(2000)),
+    op_load_i(3, bias(0)),
+    op_array_new(3, 1),
+    op_load_i(2, bias(0)), /* counter */
+    op_load_i(4, bias(1)),
+    op_load_ps(5, symbol_id_string),
+    /* loop: */
+    op_convert(6, 2, 5),
+    op_array_set(3, 2, 6),
+    op_add(2, 2, 4),
+    op_eq(7, 2, 1),
+    op_jmp_true(7, bias(1)),
+    op_jmp(bias(-6)),
+    op_load_i(8, bias(777)),
+    op_array_get(9, 3, 8),
+    op_load_ps(10, symbol_id_number),
+    op_convert(0, 9, 10),
+    op_ret(0)
+  };
+  vm_options options = { 1024, 1 << 24, 256, default_max_stack_size };
+  vm_value result = vm_execute_with_options(program, array_length(program), 0, 0, &options);
+  is_equal(result, make_number(777));
+}
+
+
+start_spec(vm_array_spec)
+  example(creates_an_array)
+  example(sets_and_gets_an_element)
+  example(fails_for_an_index_out_of_range)
+  example(slices_an_array)
+  example(clamps_a_slice_to_the_array)
+  example(compares_arrays_by_their_elements)
+  example(converts_a_list_to_an_array)
+  example(converts_an_array_to_a_list)
+  example(keeps_the_elements_of_an_old_array_alive)
+end_spec
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include "vm_equality_spec.h"
 
 #include "../vm_internal.h"
@@ -8,6 +9,28 @@
 
 #define array_length(x) (sizeof(x) / sizeof(x[0]))
 
+// Writes a constant string to the const table and returns the number of words it takes
+static int const_string(vm_value *table, const char *str) {
+  size_t length = strlen(str);
+  size_t num_chunks = (length + sizeof(vm_value)) / sizeof(vm_value);
+  table[0] = string_header(length, 0);
+  memset(table + string_header_size, 0, num_chunks * sizeof(vm_value));
+  memcpy(table + string_header_size, str, length);
+  return string_header_size + num_chunks;
+}
+
+// Writes a chain of compound symbols that are nested `depth` levels deep, with `last`
+// in the innermost one. Returns the number of words it takes
+static int nested_symbols(vm_value *table, int start, int depth, vm_value last) {
+  for(int i = 0; i < depth; i++) {
+    int addr = start + i * 3;
+    table[addr] = compound_symbol_header(11, 2);
+    table[addr + 1] = make_tagged_val(i, vm_tag_number);
+    table[addr + 2] = (i == depth - 1) ? last : make_tagged_val(addr + 3, vm_tag_compound_symbol);
+  }
+  return depth * 3;
+}
+
 
 
 
@@ -353,6 +376,127 @@ it( compares_dynamic_and_static_compound_symbols_with_different_counts ) {
   is_equal(result2, make_tagged_val(0, vm_tag_plain_symbol));
 }
 
+// Strings
+
+it( compares_equal_dynamic_strings ) {
+  vm_value const_table[8] = { 0 };
+  int second = const_string(const_table, "dash");
+  const_string(const_table + second, "-lang");
+  vm_instruction program[] = {
+    op_load_str(1, 0),
+    op_load_str(2, second),
+    op_str_concat(3, 1, 2),
+    op_str_concat(4, 1, 2),
+    op_eq(0, 3, 4),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(result, make_tagged_val(1, vm_tag_plain_symbol));
+}
+
+it( compares_dynamic_strings_of_the_same_length_with_different_characters ) {
+  vm_value const_table[8] = { 0 };
+  int second = const_string(const_table, "dash");
+  int third = second + const_string(const_table + second, "-lang");
+  const_string(const_table + third, "-long");
+  vm_instruction program[] = {
+    op_load_str(1, 0),
+    op_load_str(2, second),
+    op_load_str(3, third),
+    op_str_concat(4, 1, 2),
+    op_str_concat(5, 1, 3),
+    op_eq(0, 4, 5),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(result, make_tagged_val(0, vm_tag_plain_symbol));
+}
+
+it( compares_a_dynamic_string_with_a_constant_string ) {
+  vm_value const_table[8] = { 0 };
+  int second = const_string(const_table, "dash");
+  int third = second + const_string(const_table + second, "-lang");
+  const_string(const_table + third, "dash-lang");
+  vm_instruction program[] = {
+    op_load_str(1, 0),
+    op_load_str(2, second),
+    op_str_concat(3, 1, 2),
+    op_load_str(4, third),
+    op_eq(0, 3, 4),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(result, make_tagged_val(1, vm_tag_plain_symbol));
+}
+
+it( compares_a_rope_with_a_flat_string ) {
+  vm_value const_table[32] = { 0 };
+  int second = const_string(const_table, "0123456789012345678901234567890123456789");
+  int third = second + const_string(const_table + second, "abcdefghijklmnopqrstuvwxyzabcdefghijklmn");
+  const_string(const_table + third, "0123456789012345678901234567890123456789"
+                                    "abcdefghijklmnopqrstuvwxyzabcdefghijklmn");
+  vm_instruction program[] = {
+    op_load_str(1, 0),
+    op_load_str(2, second),
+    op_str_concat(3, 1, 2),
+    op_load_str(4, third),
+    op_eq(0, 3, 4),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(result, make_tagged_val(1, vm_tag_plain_symbol));
+}
+
+it( compares_ropes_that_differ_in_the_last_part ) {
+  vm_value const_table[32] = { 0 };
+  int second = const_string(const_table, "0123456789012345678901234567890123456789");
+  int third = second + const_string(const_table + second, "abcdefghijklmnopqrstuvwxyzabcdefghijklmn");
+  const_string(const_table + third, "abcdefghijklmnopqrstuvwxyzabcdefghijklmX");
+  vm_instruction program[] = {
+    op_load_str(1, 0),
+    op_load_str(2, second),
+    op_load_str(3, third),
+    op_str_concat(4, 1, 2),
+    op_str_concat(5, 1, 3),
+    op_eq(0, 4, 5),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(result, make_tagged_val(0, vm_tag_plain_symbol));
+}
+
+
+// Nested data
+
+#define nesting_depth 20000
+static vm_value nested_table[2 * nesting_depth * 3];
+
+it( compares_deeply_nested_compound_symbols ) {
+  int second = nested_symbols(nested_table, 0, nesting_depth, make_tagged_val(7, vm_tag_number));
+  nested_symbols(nested_table, second, nesting_depth, make_tagged_val(7, vm_tag_number));
+  vm_instruction program[] = {
+    op_load_cs(1, 0),
+    op_load_cs(2, second),
+    op_eq(0, 1, 2),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), nested_table, array_length(nested_table));
+  is_equal(result, make_tagged_val(1, vm_tag_plain_symbol));
+}
+
+it( compares_deeply_nested_compound_symbols_that_differ_at_the_bottom ) {
+  int second = nested_symbols(nested_table, 0, nesting_depth, make_tagged_val(7, vm_tag_number));
+  nested_symbols(nested_table, second, nesting_depth, make_tagged_val(8, vm_tag_number));
+  vm_instruction program[] = {
+    op_load_cs(1, 0),
+    op_load_cs(2, second),
+    op_eq(0, 1, 2),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), nested_table, array_length(nested_table));
+  is_equal(result, make_tagged_val(0, vm_tag_plain_symbol));
+}
+
 
 start_spec(vm_equality_spec)
   example(compares_unequal_objects)
@@ -372,5 +516,12 @@ start_spec(vm_equality_spec)
   example(compares_dynamic_and_static_compound_symbols_with_different_data)
   example(compares_dynamic_and_static_compound_symbols_with_different_sym_ids)
   example(compares_dynamic_and_static_compound_symbols_with_different_counts)
+  example(compares_equal_dynamic_strings)
+  example(compares_dynamic_strings_of_the_same_length_with_different_characters)
+  example(compares_a_dynamic_string_with_a_constant_string)
+  example(compares_a_rope_with_a_flat_string)
+  example(compares_ropes_that_differ_in_the_last_part)
+  example(compares_deeply_nested_compound_symbols)
+  example(compares_deeply_nested_compound_symbols_that_differ_at_the_bottom)
 end_spec
 
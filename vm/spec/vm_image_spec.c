@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "vm_image_spec.h"
+
+#include "../vm_internal.h"
+#include "../opcodes.h"
+#include "../image.h"
+#include "../encoding.h"
+#include "../defs.h"
+
+#define array_length(x) (sizeof(x) / sizeof(x[0]))
+
+#define bias(n) ((n) + int_bias)
+
+
+static void write_uint32(FILE *file, uint32_t n) {
+  unsigned char bytes[] = { n & 0xFF, (n >> 8) & 0xFF, (n >> 16) & 0xFF, (n >> 24) & 0xFF };
+  fwrite(bytes, 1, sizeof(bytes), file);
+}
+
+
+// Writes an image to a temporary file and returns its path, which has to be freed
+static char *write_image(uint32_t version, vm_instruction *program, int program_length,
+                         vm_value *const_table, int const_table_length,
+                         const char *symbol_names, size_t symbol_names_size) {
+  char *path = strdup("/tmp/dash_image_spec_XXXXXX");
+  int fd = mkstemp(path);
+  FILE *file = fdopen(fd, "wb");
+
+  fwrite("DASH", 1, 4, file);
+  write_uint32(file, version);
+  write_uint32(file, program_length);
+  write_uint32(file, const_table_length);
+  write_uint32(file, symbol_names_size);
+  write_uint32(file, 0);
+  fwrite(program, sizeof(vm_instruction), program_length, file);
+  if(program_length % 2 != 0) {
+    write_uint32(file, 0);
+  }
+  if(const_table_length > 0) {
+    fwrite(const_table, sizeof(vm_value), const_table_length, file);
+  }
+  fwrite(symbol_names, 1, symbol_names_size, file);
+
+  fclose(file);
+  return path;
+}
+
+
+static bool is_error(vm_instance *vm, vm_value value) {
+  if(get_tag(value) != vm_tag_dynamic_compound_symbol) {
+    return false;
+  }
+  vm_value *heap_p = vm_instance_heap_pointer(vm, get_val(value));
+  return compound_symbol_id(heap_p[0]) == symbol_id_error;
+}
+
+
+it( loads_a_program_from_an_image ) {
+  vm_value const_table[] = {
+    compound_symbol_header(3, 2),
+    make_number(55),
+    make_number(66),
+  };
+  vm_instruction program[] = {
+    op_load_cs(0, 0),
+    op_ret(0),
+    op_ret(0),
+  };
+  const char symbol_names[] = "false\0true\0" "error\0point\0";
+  char *path = write_image(image_version, program, array_length(program), const_table, array_length(const_table),
+                           symbol_names, sizeof(symbol_names) - 1);
+
+  vm_instance *vm = vm_create(NULL);
+  vm_value result = vm_load_image(vm, path);
+  is_equal(result, make_tagged_val(0, vm_tag_compound_symbol));
+
+  int const_table_length = 0;
+  const vm_value *loaded_const_table = vm_instance_const_table(vm, &const_table_length);
+  is_equal(const_table_length, 3);
+  is_equal(loaded_const_table[1], make_number(55));
+
+  size_t symbol_names_size = 0;
+  const char *loaded_names = vm_image_symbol_names(vm, &symbol_names_size);
+  is_equal(symbol_names_size, sizeof(symbol_names) - 1);
+  is_equal(memcmp(loaded_names, symbol_names, symbol_names_size), 0);
+
+  vm_destroy(vm);
+  unlink(path);
+  free(path);
+}
+
+
+it( rejects_an_image_with_a_different_version ) {
+  vm_instruction program[] = {
+    op_load_i(0, bias(1)),
+    op_ret(0),
+  };
+  char *path = write_image(image_version + 1, program, array_length(program), 0, 0, "", 0);
+
+  vm_instance *vm = vm_create(NULL);
+  vm_value result = vm_load_image(vm, path);
+  is_equal(is_error(vm, result), true);
+  size_t symbol_names_size = 0;
+  is_equal(vm_image_symbol_names(vm, &symbol_names_size) == NULL, true);
+
+  vm_destroy(vm);
+  unlink(path);
+  free(path);
+}
+
+
+it( rejects_a_truncated_image ) {
+  vm_instruction program[] = {
+    op_load_i(0, bias(1)),
+    op_ret(0),
+  };
+  char *path = write_image(image_version, program, array_length(program), 0, 0, "", 0);
+  truncate(path, image_header_size + sizeof(vm_instruction));
+
+  vm_instance *vm = vm_create(NULL);
+  vm_value result = vm_load_image(vm, path);
+  is_equal(is_error(vm, result), true);
+
+  vm_destroy(vm);
+  unlink(path);
+  free(path);
+}
+
+
+it( rejects_a_file_that_is_not_an_image ) {
+  vm_instance *vm = vm_create(NULL);
+  vm_value result = vm_load_image(vm, "/tmp/dash_image_spec_does_not_exist");
+  is_equal(is_error(vm, result), true);
+  vm_destroy(vm);
+}
+
+
+start_spec(vm_image_spec)
+  example(loads_a_program_from_an_image)
+  example(rejects_an_image_with_a_different_version)
+  example(rejects_a_truncated_image)
+  example(rejects_a_file_that_is_not_an_image)
+end_spec
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "vm_jit_spec.h"
+
+#include "../vm_internal.h"
+#include "../opcodes.h"
+#include "../encoding.h"
+#include "../defs.h"
+#include "../jit.h"
+
+#define array_length(x) (sizeof(x) / sizeof(x[0]))
+
+#define bias(n) ((n) + int_bias)
+#define small_bias(n) ((n) + small_int_bias)
+
+#define true_symbol make_tagged_val(symbol_id_true, vm_tag_plain_symbol)
+#define false_symbol make_tagged_val(symbol_id_false, vm_tag_plain_symbol)
+
+
+static vm_instance *create_vm(size_t jit_threshold) {
+  vm_options options = vm_default_options();
+  options.jit_threshold = jit_threshold;
+  return vm_create(&options);
+}
+
+// The number of functions the jit should have compiled
+static int compiled(int count) {
+  return jit_is_available() ? count : 0;
+}
+
+// Runtime errors are `error :runtime_error "message"` (see make_str_error in vm.c)
+static const char *error_message(vm_instance *vm, vm_value error) {
+  if(get_tag(error) != vm_tag_dynamic_compound_symbol) {
+    return "";
+  }
+  vm_value message = vm_instance_heap_pointer(vm, get_val(error))[2];
+  return (const char *) (vm_instance_heap_pointer(vm, get_val(message)) + string_header_size);
+}
+
+
+it( compiles_functions_after_the_threshold ) {
+  const int fun_address = 5;
+  vm_instruction program[] = {
+    op_load_i(1, bias(200)),
+    op_load_f(2, fun_address),
+    op_set_arg(0, 1, 0),
+    op_ap(0, 2, 1),
+    op_ret(0),
+
+    /* sum n = if n == 0 then 0 else n + sum (n - 1) */
+    fun_header_with_frame(1, 4),
+    op_load_i(1, bias(0)),
+    op_jmp_eq(2, 0, 1, small_bias(5)),
+    op_sub_i(2, 0, 3, small_bias(1)),
+    op_load_f(3, fun_address),
+    op_set_arg(0, 2, 0),
+    op_ap(1, 3, 1),
+    op_add(0, 0, 1),
+    op_ret(0)
+  };
+
+  vm_instance *vm = create_vm(10);
+  is_equal(vm_load_program(vm, program, array_length(program), 0, 0), make_number(20100));
+  is_equal(vm_jit_function_count(vm), compiled(1));
+  vm_destroy(vm);
+
+  vm = create_vm(1000);
+  is_equal(vm_load_program(vm, program, array_length(program), 0, 0), make_number(20100));
+  is_equal(vm_jit_function_count(vm), 0);
+  vm_destroy(vm);
+}
+
+
+it( runs_self_tail_calls_in_compiled_code ) {
+  const int fun_address = 6;
+  vm_instruction program[] = {
+    op_load_i(1, bias(100000)),
+    op_load_i(2, bias(0)),
+    op_load_f(3, fun_address),
+    op_set_arg(0, 1, 1),
+    op_ap(0, 3, 2),
+    op_ret(0),
+
+    /* sum n acc = if n == 0 then acc else sum (n - 1) (acc + n) */
+    fun_header_with_frame(2, 6),
+    op_load_i(2, bias(0)),
+    op_jmp_eq(3, 0, 2, small_bias(5)),
+    op_sub_i(4, 0, 3, small_bias(1)),
+    op_add(5, 1, 0),
+    op_load_f(3, fun_address),
+    op_set_arg(0, 4, 1),
+    op_tail_ap(3, 2),
+    op_ret(1)
+  };
+
+  vm_instance *vm = create_vm(1);
+  is_equal(vm_load_program(vm, program, array_length(program), 0, 0), make_number(5000050000));
+  is_equal(vm_jit_function_count(vm), compiled(1));
+  vm_destroy(vm);
+}
+
+
+it( computes_like_the_interpreter ) {
+  const int fun_address = 2;
+  vm_instruction program[] = {
+    op_load_f(0, fun_address),
+    op_ret(0),
+
+    /* f a b = (a * b - a) / b + (if a < b then 1 else 2) + (if a > b then 10 else 20) */
+    fun_header_with_frame(2, 8),
+    op_mul(2, 0, 1),
+    op_sub(2, 2, 0),
+    op_div(2, 2, 1),
+    op_lt(3, 0, 1),
+    op_load_i(4, bias(2)),
+    op_jmp_true(3, bias(1)),
+    op_jmp(bias(1)),
+    op_load_i(4, bias(1)),
+    op_add(2, 2, 4),
+    op_gt(3, 0, 1),
+    op_load_i(4, bias(20)),
+    op_jmp_gt(5, 0, 1, small_bias(1)),
+    op_jmp(bias(1)),
+    op_load_i(4, bias(10)),
+    op_add(2, 2, 4),
+    op_move(0, 2),
+    op_ret(0)
+  };
+
+  vm_instance *interpreter = create_vm(0);
+  vm_instance *jit = create_vm(1);
+  vm_value fun = vm_load_program(interpreter, program, array_length(program), 0, 0);
+  vm_load_program(jit, program, array_length(program), 0, 0);
+
+  int64_t values[] = { -1000003, -7, -1, 1, 2, 3, 12, 99991 };
+  int differences = 0;
+  for(size_t i = 0; i < array_length(values); ++i) {
+    for(size_t j = 0; j < array_length(values); ++j) {
+      vm_value args[] = { make_number(values[i]), make_number(values[j]) };
+      vm_value expected = vm_call(interpreter, fun, args, 2);
+      if(vm_call(jit, fun, args, 2) != expected) {
+        ++differences;
+      }
+    }
+  }
+  is_equal(differences, 0);
+  is_equal(vm_jit_function_count(jit), compiled(1));
+  vm_destroy(interpreter);
+  vm_destroy(jit);
+}
+
+
+it( leaves_compiled_code_for_errors ) {
+  const int fun_address = 2;
+  vm_instruction program[] = {
+    op_load_f(0, fun_address),
+    op_ret(0),
+
+    /* f x = x + 1 */
+    fun_header(1),
+    op_add_i(0, 0, 1, small_bias(1)),
+    op_ret(0)
+  };
+
+  vm_instance *vm = create_vm(1);
+  vm_value fun = vm_load_program(vm, program, array_length(program), 0, 0);
+  vm_value arg = make_number(41);
+  is_equal(vm_call(vm, fun, &arg, 1), make_number(42));
+  is_equal(vm_jit_function_count(vm), compiled(1));
+
+  arg = make_tagged_val(3, vm_tag_plain_symbol);
+  is_equal(strcmp(error_message(vm, vm_call(vm, fun, &arg, 1)), "Expected a number, but got symbol"), 0);
+  arg = make_number(max_number);
+  is_equal(strcmp(error_message(vm, vm_call(vm, fun, &arg, 1)), "Int overflow"), 0);
+  arg = make_number(1);
+  is_equal(vm_call(vm, fun, &arg, 1), make_number(2));
+  vm_destroy(vm);
+}
+
+
+it( compares_numbers_and_symbols_in_compiled_code ) {
+  vm_value const_table[8] = { 0 };
+  const_table[0] = string_header(3, 0);
+  memcpy(&const_table[1], "abc", 4);
+  const_table[2] = string_header(3, 0);
+  memcpy(&const_table[3], "abc", 4);
+
+  const int fun_address = 2;
+  vm_instruction program[] = {
+    op_load_f(0, fun_address),
+    op_ret(0),
+
+    /* f a b = if a == b then (if "abc" == "abc" then 1 else 2) else 3 */
+    fun_header_with_frame(2, 4),
+    op_jmp_eq(2, 0, 1, small_bias(1)),
+    op_ret_i(0, bias(3)),
+    op_load_str(2, 0),
+    op_load_str(3, 2),
+    op_eq(0, 2, 3),
+    op_jmp_true(0, bias(1)),
+    op_ret_i(0, bias(2)),
+    op_ret_i(0, bias(1))
+  };
+
+  vm_instance *vm = create_vm(1);
+  vm_value fun = vm_load_program(vm, program, array_length(program), const_table, array_length(const_table));
+  vm_value numbers[] = { make_number(7), make_number(7) };
+  is_equal(vm_call(vm, fun, numbers, 2), make_number(1));
+  vm_value symbols[] = { true_symbol, false_symbol };
+  is_equal(vm_call(vm, fun, symbols, 2), make_number(3));
+  vm_value mixed[] = { make_number(symbol_id_true), true_symbol };
+  is_equal(vm_call(vm, fun, mixed, 2), make_number(3));
+  // functions are never equal, so this has to be left to the interpreter
+  vm_value functions[] = { fun, fun };
+  is_equal(vm_call(vm, fun, functions, 2), make_number(3));
+  is_equal(vm_jit_function_count(vm), compiled(1));
+  vm_destroy(vm);
+}
+
+
+it( matches_plain_symbols_in_compiled_code ) {
+  vm_value const_table[] = {
+    match_header(3),
+    make_tagged_val(5, vm_tag_plain_symbol),
+    make_number(6),
+    match_var(1),
+  };
+
+  const int fun_address = 2;
+  vm_instruction program[] = {
+    op_load_f(0, fun_address),
+    op_ret(0),
+
+    /* f x = match x with :five -> 50 | 6 -> 60 | y -> y */
+    fun_header_with_frame(1, 4),
+    op_load_i(1, bias(0)),
+    op_match(0, 1, 2),
+    op_jmp(bias(2)),
+    op_jmp(bias(2)),
+    op_jmp(bias(2)),
+    op_ret_i(0, bias(50)),
+    op_ret_i(0, bias(60)),
+    op_ret(3)
+  };
+
+  vm_instance *vm = create_vm(1);
+  vm_value fun = vm_load_program(vm, program, array_length(program), const_table, array_length(const_table));
+  vm_value arg = make_tagged_val(5, vm_tag_plain_symbol);
+  is_equal(vm_call(vm, fun, &arg, 1), make_number(50));
+  arg = make_number(6);
+  is_equal(vm_call(vm, fun, &arg, 1), make_number(60));
+  arg = make_tagged_val(6, vm_tag_plain_symbol);
+  is_equal(vm_call(vm, fun, &arg, 1), make_tagged_val(6, vm_tag_plain_symbol));
+  is_equal(vm_jit_function_count(vm), compiled(1));
+  vm_destroy(vm);
+}
+
+
+it( fails_a_match_without_matching_pattern_like_the_interpreter ) {
+  vm_value const_table[] = {
+    match_header(2),
+    make_number(1),
+    make_number(2),
+    2, /* the match table */
+    2,
+    make_number(1), 0,
+    make_number(2), 1
+  };
+
+  const int fun_address = 2;
+  vm_instruction program[] = {
+    op_load_f(0, fun_address),
+    op_ret(0),
+
+    fun_header_with_frame(1, 2),
+    op_jmp_match(0, 0),
+    op_ret_i(0, bias(10)),
+    op_ret_i(0, bias(20))
+  };
+
+  vm_instance *vm = create_vm(1);
+  vm_value fun = vm_load_program(vm, program, array_length(program), const_table, array_length(const_table));
+  vm_value arg = make_number(2);
+  is_equal(vm_call(vm, fun, &arg, 1), make_number(20));
+  arg = make_number(3);
+  is_equal(strcmp(error_message(vm, vm_call(vm, fun, &arg, 1)), "Pattern match failed!"), 0);
+  is_equal(vm_jit_function_count(vm), compiled(1));
+  vm_destroy(vm);
+}
+
+
+it( does_not_compile_while_profiling ) {
+  const int fun_address = 2;
+  vm_instruction program[] = {
+    op_load_f(0, fun_address),
+    op_ret(0),
+
+    fun_header(1),
+    op_add_i(0, 0, 1, small_bias(1)),
+    op_ret(0)
+  };
+
+  vm_instance *vm = create_vm(1);
+  vm_enable_profiling(vm);
+  vm_value fun = vm_load_program(vm, program, array_length(program), 0, 0);
+  vm_value arg = make_number(1);
+  is_equal(vm_call(vm, fun, &arg, 1), make_number(2));
+  is_equal(vm_jit_function_count(vm), 0);
+  vm_destroy(vm);
+}
+
+
+start_spec(vm_jit_spec)
+  example(compiles_functions_after_the_threshold)
+  example(runs_self_tail_calls_in_compiled_code)
+  example(computes_like_the_interpreter)
+  example(leaves_compiled_code_for_errors)
+  example(compares_numbers_and_symbols_in_compiled_code)
+  example(matches_plain_symbols_in_compiled_code)
+  example(fails_a_match_without_matching_pattern_like_the_interpreter)
+  example(does_not_compile_while_profiling)
+end_spec
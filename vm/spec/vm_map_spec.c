@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <string.h>
+#include "vm_map_spec.h"
+
+#include "../vm_internal.h"
+#include "../opcodes.h"
+#include "../heap.h"
+#include "../encoding.h"
+
+#define array_length(x) (sizeof(x) / sizeof(x[0]))
+
+#define bias(n) ((n) + int_bias)
+
+// Writes a constant string to the const table and returns the number of words it takes
+static int const_string(vm_value *table, const char *str) {
+  size_t length = strlen(str);
+  size_t num_chunks = (length + sizeof(vm_value)) / sizeof(vm_value);
+  table[0] = string_header(length, 0);
+  memset(table + string_header_size, 0, num_chunks * sizeof(vm_value));
+  memcpy(table + string_header_size, str, length);
+  return string_header_size + num_chunks;
+}
+
+
+it( creates_an_empty_map ) {
+  vm_instruction program[] = {
+    op_map_new(1),
+    op_map_size(0, 1),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_number(0));
+}
+
+it( looks_up_an_inserted_value ) {
+  vm_instruction program[] = {
+    op_map_new(1),
+    op_load_i(2, bias(5)),
+    op_load_i(3, bias(55)),
+    op_map_put(3, 1, 2),
+    op_load_i(4, bias(6)),
+    op_load_i(0, bias(66)),
+    op_map_put(0, 3, 4),
+    op_load_i(5, bias(0)),
+    op_map_get(5, 0, 2),
+    op_ret(5)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_number(55));
+}
+
+it( returns_the_default_value_for_a_missing_key ) {
+  vm_instruction program[] = {
+    op_map_new(1),
+    op_load_i(2, bias(5)),
+    op_load_i(3, bias(55)),
+    op_map_put(3, 1, 2),
+    op_load_i(4, bias(6)),
+    op_load_ps(0, 3),
+    op_map_get(0, 3, 4),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_tagged_val(3, vm_tag_plain_symbol));
+}
+
+it( replaces_the_value_of_an_existing_key ) {
+  vm_instruction program[] = {
+    op_map_new(1),
+    op_load_i(2, bias(5)),
+    op_load_i(3, bias(55)),
+    op_map_put(3, 1, 2),
+    op_load_i(4, bias(66)),
+    op_map_put(4, 3, 2),
+    op_map_size(5, 4),
+    op_load_i(6, bias(1)),
+    op_eq(7, 5, 6),
+    op_jmp_true(7, bias(1)),
+    op_ret(5),
+    op_load_i(0, bias(0)),
+    op_map_get(0, 4, 2),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_number(66));
+}
+
+it( keeps_the_old_map_when_inserting ) {
+  vm_instruction program[] = {
+    op_map_new(1),
+    op_load_i(2, bias(5)),
+    op_load_i(3, bias(55)),
+    op_map_put(3, 1, 2),
+    op_load_i(4, bias(66)),
+    op_map_put(4, 3, 2),
+    op_load_i(0, bias(0)),
+    op_map_get(0, 3, 2),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_number(55));
+}
+
+it( removes_a_key ) {
+  vm_instruction program[] = {
+    op_map_new(1),
+    op_load_i(2, bias(5)),
+    op_load_i(3, bias(55)),
+    op_map_put(3, 1, 2),
+    op_load_i(4, bias(6)),
+    op_load_i(5, bias(66)),
+    op_map_put(5, 3, 4),
+    op_map_del(6, 5, 2),
+    op_load_i(0, bias(0)),
+    op_map_get(0, 6, 2),
+    op_map_size(7, 6),
+    op_add(0, 0, 7),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_number(1));
+}
+
+it( finds_a_dynamic_string_key_with_a_constant_string ) {
+  vm_value const_table[8] = { 0 };
+  int second = const_string(const_table, "da");
+  int third = second + const_string(const_table + second, "sh");
+  const_string(const_table + third, "dash");
+  vm_instruction program[] = {
+    op_map_new(1),
+    op_load_str(2, 0),
+    op_load_str(3, second),
+    op_str_concat(4, 2, 3),
+    op_load_i(5, bias(55)),
+    op_map_put(5, 1, 4),
+    op_load_str(6, third),
+    op_load_i(0, bias(0)),
+    op_map_get(0, 5, 6),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(result, make_number(55));
+}
+
+it( finds_a_dynamic_compound_symbol_key_with_a_constant_one ) {
+  vm_value const_table[] = {
+    compound_symbol_header(11, 2),
+    make_tagged_val(55, vm_tag_number),
+    make_tagged_val(66, vm_tag_number),
+  };
+  vm_instruction program[] = {
+    op_map_new(1),
+    op_load_cs(2, 0),
+    op_copy_sym(3, 2),
+    op_load_i(4, bias(77)),
+    op_map_put(4, 1, 3),
+    op_load_i(0, bias(0)),
+    op_map_get(0, 4, 2),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(result, make_number(77));
+}
+
+it( returns_the_entries_of_a_map ) {
+  vm_instruction program[] = {
+    op_map_new(1),
+    op_load_i(2, bias(5)),
+    op_load_i(3, bias(50)),
+    op_map_put(3, 1, 2),
+    op_load_i(4, bias(6)),
+    op_load_i(5, bias(60)),
+    op_map_put(5, 3, 4),
+    // the sum of all keys and values
+    op_load_i(6, bias(0)),
+    op_map_entry(7, 5, 6),
+    op_load_i(6, bias(1)),
+    op_map_entry(9, 5, 6),
+    op_add(0, 7, 8),
+    op_add(0, 0, 9),
+    op_add(0, 0, 10),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_number(121));
+}
+
+// Inserts the numbers from 0 to 19999 (with their negation as the value), which needs
+// several levels of nodes. The heap is small, so the map is moved around by the
+// garbage collector.
+it( inserts_and_removes_many_keys ) {
+  vm_instruction program[] = {
+    op_map_new(1),
+    op_load_i(2, bias(0)), /* counter */
+    op_load_i(3, bias(20000)), /* number of iterations */
+    op_load_i(4, bias(1)),
+    /* insert loop: */
+    op_sub(5, 2, 4),
+    op_sub(5, 5, 2),
+    op_sub(5, 5, 2),
+    op_add(5, 5, 4),
+    op_map_put(5, 1, 2),
+    op_move(1, 5),
+    op_add(2, 2, 4),
+    op_eq(6, 2, 3),
+    op_jmp_true(6, bias(1)),
+    op_jmp(bias(-10)),
+    /* look up one of them */
+    op_load_i(7, bias(12345)),
+    op_load_i(8, bias(0)),
+    op_map_get(8, 1, 7),
+    op_map_size(9, 1),
+    op_add(8, 8, 9),
+    op_load_i(10, bias(7655)), /* 20000 - 12345 */
+    op_eq(11, 8, 10),
+    op_jmp_true(11, bias(1)),
+    op_ret(8),
+    /* remove all keys with a second counter */
+    op_load_i(2, bias(0)),
+    /* remove loop: */
+    op_map_del(1, 1, 2),
+    op_add(2, 2, 4),
+    op_eq(6, 2, 3),
+    op_jmp_true(6, bias(1)),
+    op_jmp(bias(-5)),
+    op_map_size(0, 1),
+    op_ret(0)
+  };
+  vm_options options = { 1024, 1 << 24, 256, default_max_stack_size };
+  vm_value result = vm_execute_with_options(program, array_length(program), 0, 0, &options);
+  is_equal(result, make_number(0));
+}
+
+
+start_spec(vm_map_spec)
+  example(creates_an_empty_map)
+  example(looks_up_an_inserted_value)
+  example(returns_the_default_value_for_a_missing_key)
+  example(replaces_the_value_of_an_existing_key)
+  example(keeps_the_old_map_when_inserting)
+  example(removes_a_key)
+  example(finds_a_dynamic_string_key_with_a_constant_string)
+  example(finds_a_dynamic_compound_symbol_key_with_a_constant_one)
+  example(returns_the_entries_of_a_map)
+  example(inserts_and_removes_many_keys)
+end_spec
@@ -0,0 +1,3 @@
+#include "tiny_spec/tiny_spec.h"
+
+extern spec vm_map_spec;
@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "vm_profiler_spec.h"
+
+#include "../vm_internal.h"
+#include "../opcodes.h"
+#include "../encoding.h"
+#include "../defs.h"
+
+#define array_length(x) (sizeof(x) / sizeof(x[0]))
+
+#define bias(n) ((n) + int_bias)
+
+
+static char *read_file(const char *path) {
+  FILE *file = fopen(path, "r");
+  if(file == NULL) {
+    return strdup("");
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char *content = calloc(size + 1, 1);
+  fread(content, 1, size, file);
+  fclose(file);
+  return content;
+}
+
+typedef struct {
+  char *report;
+  char *folded;
+} profile_files;
+
+static profile_files write_profile(vm_instance *vm) {
+  char report_path[] = "/tmp/dash_profile_spec_XXXXXX";
+  char folded_path[] = "/tmp/dash_profile_spec_XXXXXX";
+  close(mkstemp(report_path));
+  close(mkstemp(folded_path));
+  is_equal(vm_write_profile(vm, report_path, folded_path), true);
+  profile_files files = { read_file(report_path), read_file(folded_path) };
+  unlink(report_path);
+  unlink(folded_path);
+  return files;
+}
+
+static void free_profile(profile_files files) {
+  free(files.report);
+  free(files.folded);
+}
+
+// The line of the report that contains the text
+static bool has_line(const char *report, const char *text, const char *other_text) {
+  const char *line = strstr(report, text);
+  if(line == NULL) {
+    return false;
+  }
+  while(line > report && line[-1] != '\n') {
+    --line;
+  }
+  const char *end = strchr(line, '\n');
+  const char *other = strstr(line, other_text);
+  return other != NULL && (end == NULL || other < end);
+}
+
+
+it( counts_calls_and_instructions_per_function ) {
+  const int fun_address = 5;
+  vm_instruction program[] = {
+    op_load_i(1, bias(200)),
+    op_load_f(2, fun_address),
+    op_set_arg(0, 1, 0),
+    op_ap(0, 2, 1),
+    op_ret(0),
+
+    /* sum n = if n == 0 then 0 else n + sum (n - 1) */
+    fun_header_with_frame(1, 4),
+    op_load_i(1, bias(0)),
+    op_eq(2, 0, 1),
+    op_jmp_true(2, bias(7)),
+    op_load_i(2, bias(1)),
+    op_sub(2, 0, 2),
+    op_load_f(3, fun_address),
+    op_set_arg(0, 2, 0),
+    op_ap(1, 3, 1),
+    op_add(1, 0, 1),
+    op_ret(1),
+    op_ret(1)
+  };
+  vm_instance *vm = vm_create(NULL);
+  vm_enable_profiling(vm);
+  vm_value result = vm_load_program(vm, program, array_length(program), 0, 0);
+  is_equal(result, make_number(20100));
+  vm_profile_name_function(vm, fun_address, "sum");
+
+  profile_files files = write_profile(vm);
+  // 200 recursive calls with 10 instructions and one with 4
+  is_equal(has_line(files.report, "  sum\n", " 201 "), true);
+  is_equal(has_line(files.report, "  sum\n", " 2004 "), true);
+  is_equal(has_line(files.report, "  <main>\n", " 5 "), true);
+  is_equal(has_line(files.report, "  ap\n", " 201 "), true);
+  is_equal(has_line(files.report, "Instructions:", " 2009"), true);
+  free_profile(files);
+  vm_destroy(vm);
+}
+
+
+it( samples_call_stacks_in_the_folded_format ) {
+  const int fun_address = 5;
+  vm_instruction program[] = {
+    op_load_i(1, bias(200)),
+    op_load_f(2, fun_address),
+    op_set_arg(0, 1, 0),
+    op_ap(0, 2, 1),
+    op_ret(0),
+
+    fun_header_with_frame(1, 4),
+    op_load_i(1, bias(0)),
+    op_eq(2, 0, 1),
+    op_jmp_true(2, bias(7)),
+    op_load_i(2, bias(1)),
+    op_sub(2, 0, 2),
+    op_load_f(3, fun_address),
+    op_set_arg(0, 2, 0),
+    op_ap(1, 3, 1),
+    op_add(1, 0, 1),
+    op_ret(1),
+    op_ret(1)
+  };
+  vm_instance *vm = vm_create(NULL);
+  vm_enable_profiling(vm);
+  vm_load_program(vm, program, array_length(program), 0, 0);
+  vm_profile_name_function(vm, fun_address, "my sum");
+
+  profile_files files = write_profile(vm);
+  // The stacks are deeper than what is sampled, and names can't contain spaces
+  is_equal(strncmp(files.folded, "...;my_sum;my_sum;", 18), 0);
+  is_equal(has_line(files.folded, "my_sum", "my_sum 997\n"), true);
+  free_profile(files);
+  vm_destroy(vm);
+}
+
+
+it( counts_the_hits_of_match_arms ) {
+  vm_value const_table[] = {
+    match_header(2),
+    make_number(11),
+    make_number(22),
+  };
+
+  vm_instruction program[] = {
+    op_load_i(0, 600),
+    op_load_i(1, bias(22)),
+    op_load_i(2, bias(0)),
+    op_match(1, 2, 0),
+    op_jmp(bias(1)),
+    op_jmp(bias(2)),
+    op_load_i(0, bias(4)),
+    op_ret(0),
+    op_load_i(0, bias(300)),
+    op_ret(0)
+  };
+  vm_instance *vm = vm_create(NULL);
+  vm_enable_profiling(vm);
+  vm_load_program(vm, program, array_length(program), const_table, array_length(const_table));
+
+  profile_files files = write_profile(vm);
+  is_equal(has_line(files.report, "<main>+3 (match)", ": 0 (0.0%) 1 (100.0%)"), true);
+  free_profile(files);
+  vm_destroy(vm);
+}
+
+
+it( counts_allocations_per_instruction ) {
+  vm_value const_table[] = {
+    compound_symbol_header(11, 2),
+    make_number(55),
+    make_number(66),
+  };
+
+  vm_instruction program[] = {
+    op_load_cs(1, 0),
+    op_copy_sym(0, 1),
+    op_ret(0)
+  };
+  vm_instance *vm = vm_create(NULL);
+  vm_enable_profiling(vm);
+  vm_load_program(vm, program, array_length(program), const_table, array_length(const_table));
+
+  profile_files files = write_profile(vm);
+  is_equal(has_line(files.report, "<main>+1 (copy_sym)", " 3 "), true);
+  free_profile(files);
+  vm_destroy(vm);
+}
+
+
+it( only_writes_a_profile_when_profiling ) {
+  vm_instruction program[] = {
+    op_load_i(0, bias(1)),
+    op_ret(0)
+  };
+  vm_instance *vm = vm_create(NULL);
+  vm_load_program(vm, program, array_length(program), 0, 0);
+  is_equal(vm_write_profile(vm, NULL, NULL), false);
+  vm_destroy(vm);
+}
+
+
+start_spec(vm_profiler_spec)
+  example(counts_calls_and_instructions_per_function)
+  example(samples_call_stacks_in_the_folded_format)
+  example(counts_the_hits_of_match_arms)
+  example(counts_allocations_per_instruction)
+  example(only_writes_a_profile_when_profiling)
+end_spec
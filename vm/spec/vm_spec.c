@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include "vm_spec.h"
 
 #include "../vm_internal.h"
@@ -9,17 +10,32 @@
 
 #define array_length(x) (sizeof(x) / sizeof(x[0]))
 
-#define bias(n) (n + int_bias)
+#define bias(n) ((n) + int_bias)
+#define small_bias(n) ((n) + small_int_bias)
 
 const int heap_start = 1;
 
+// Writes a constant string to the const table and returns the number of words it takes
+static int const_string(vm_value *table, const char *str) {
+  size_t length = strlen(str);
+  size_t num_chunks = (length + sizeof(vm_value)) / sizeof(vm_value);
+  table[0] = string_header(length, 0);
+  memset(table + string_header_size, 0, num_chunks * sizeof(vm_value));
+  memcpy(table + string_header_size, str, length);
+  return string_header_size + num_chunks;
+}
+
+static char *dynamic_string_chars(vm_value str) {
+  return (char *) (vm_get_heap_pointer(get_val(str)) + string_header_size);
+}
+
 it( loads_a_number_into_a_register ) {
   vm_instruction program[] = {
-    op_load_i(0, 55),
+    op_load_i(0, bias(55)),
     op_ret(0)
   };
   vm_value result = vm_execute(program, array_length(program), 0, 0);
-  is_equal(result, make_tagged_val(55, vm_tag_number));
+  is_equal(result, make_number(55));
 }
 
 
@@ -31,7 +47,7 @@ it( adds_two_numbers ) {
     op_ret(0)
   };
   vm_value result = vm_execute(program, array_length(program), 0, 0);
-  is_equal(result, bias(43));
+  is_equal(result, make_number(43));
 }
 
 it( subtracts_two_numbers ) {
@@ -42,7 +58,7 @@ it( subtracts_two_numbers ) {
     op_ret(0)
   };
   vm_value result = vm_execute(program, array_length(program), 0, 0);
-  is_equal(result, bias(21));
+  is_equal(result, make_number(21));
 }
 
 
@@ -54,7 +70,7 @@ it( multiplies_two_numbers ) {
     op_ret(0)
   };
   vm_value result = vm_execute(program, array_length(program), 0, 0);
-  is_equal(result, bias(20));
+  is_equal(result, make_number(20));
 }
 
 it( divides_two_numbers ) {
@@ -65,7 +81,63 @@ it( divides_two_numbers ) {
     op_ret(0)
   };
   vm_value result = vm_execute(program, array_length(program), 0, 0);
-  is_equal(result, bias(3));
+  is_equal(result, make_number(3));
+}
+
+it( subtracts_to_a_negative_number ) {
+  vm_instruction program[] = {
+    op_load_i(1, bias(11)),
+    op_load_i(2, bias(32)),
+    op_sub(0, 1, 2),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(get_tag(result), vm_tag_number);
+  is_equal(get_number(result), -21);
+}
+
+it( computes_numbers_larger_than_an_immediate_value ) {
+  vm_instruction program[] = {
+    op_load_i(1, bias(1000)),
+    op_mul(2, 1, 1),
+    op_mul(2, 2, 1),
+    op_mul(2, 2, 1),
+    op_load_i(3, bias(-7)),
+    op_add(0, 2, 3),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(get_number(result), 999999999993LL);
+}
+
+it( stops_with_an_error_when_a_number_overflows ) {
+  vm_instruction program[] = {
+    op_load_i(1, bias(1 << 19)),
+    op_mul(2, 1, 1),
+    op_mul(2, 2, 1), /* 2^57 */
+    op_add(2, 2, 2),
+    op_add(0, 2, 2), /* 2^59 doesn't fit */
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(get_tag(result), vm_tag_dynamic_compound_symbol);
+  vm_value *heap_p = vm_get_heap_pointer(get_val(result));
+  is_equal(compound_symbol_id(heap_p[0]), symbol_id_error);
+}
+
+it( stops_with_an_error_when_a_product_overflows ) {
+  vm_instruction program[] = {
+    op_load_i(1, bias(1 << 19)),
+    op_mul(2, 1, 1),
+    op_mul(2, 2, 1), /* 2^57 */
+    op_load_i(3, bias(-8)),
+    op_mul(4, 2, 3), /* -2^60 doesn't fit */
+    op_ret(4)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(get_tag(result), vm_tag_dynamic_compound_symbol);
+  vm_value *heap_p = vm_get_heap_pointer(get_val(result));
+  is_equal(compound_symbol_id(heap_p[0]), symbol_id_error);
 }
 
 it( has_a_less_than_opcode ) {
@@ -97,7 +169,7 @@ it( moves_a_register ) {
     op_ret(1)
   };
   vm_value result = vm_execute(program, array_length(program), 0, 0);
-  is_equal(result, bias(37));
+  is_equal(result, make_number(37));
 }
 
 
@@ -118,7 +190,111 @@ it( directly_calls_a_function ) {
     op_ret(2)
   };
   vm_value result = vm_execute(program, array_length(program), 0, 0);
-  is_equal(result, bias(138));
+  is_equal(result, make_number(138));
+}
+
+
+it( calls_a_function_with_a_small_frame_recursively ) {
+  const int fun_address = 5;
+  vm_instruction program[] = {
+    op_load_i(1, bias(200)),
+    op_load_f(2, fun_address),
+    op_set_arg(0, 1, 0),
+    op_ap(0, 2, 1),
+    op_ret(0),
+
+    /* sum n = if n == 0 then 0 else n + sum (n - 1) */
+    fun_header_with_frame(1, 4),
+    op_load_i(1, bias(0)),
+    op_eq(2, 0, 1),
+    op_jmp_true(2, bias(7)),
+    op_load_i(2, bias(1)),
+    op_sub(2, 0, 2),
+    op_load_f(3, fun_address),
+    op_set_arg(0, 2, 0),
+    op_ap(1, 3, 1),
+    op_add(1, 0, 1),
+    op_ret(1),
+    op_ret(1)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_number(20100));
+}
+
+
+it( spills_values_in_a_recursive_function ) {
+  const int fun_address = 5;
+  vm_instruction program[] = {
+    op_load_i(1, bias(2000)),
+    op_load_f(2, fun_address),
+    op_set_arg(0, 1, 0),
+    op_ap(0, 2, 1),
+    op_ret(0),
+
+    /* sum n = if n == 0 then 0 else n + sum (n - 1), but n is kept in a spill slot
+       during the call. The frames are larger than num_regs, so the register file
+       has to grow. */
+    fun_header_with_spill_slots(1, 40),
+    op_load_i(1, bias(0)),
+    op_eq(2, 0, 1),
+    op_jmp_true(2, bias(9)),
+    op_spill(0, 39),
+    op_load_i(2, bias(1)),
+    op_sub(2, 0, 2),
+    op_load_f(3, fun_address),
+    op_set_arg(0, 2, 0),
+    op_ap(1, 3, 1),
+    op_reload(0, 39),
+    op_add(1, 0, 1),
+    op_ret(1),
+    op_ret(1)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_number(2001000));
+}
+
+
+it( spills_values_in_the_top_level_code ) {
+  vm_instruction program[] = {
+    fun_header_with_spill_slots(0, 2),
+    op_load_i(0, bias(5)),
+    op_spill(0, 1),
+    op_load_i(0, bias(7)),
+    op_reload(1, 1),
+    op_sub(0, 0, 1),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_number(2));
+}
+
+
+it( tail_calls_a_function_with_more_arguments_than_the_callers_frame ) {
+  const int fun_address1 = 5;
+  const int fun_address2 = 13;
+  vm_instruction program[] = {
+    op_load_i(1, bias(7)),
+    op_load_f(2, fun_address1),
+    op_set_arg(0, 1, 0),
+    op_ap(0, 2, 1),
+    op_ret(0),
+
+    fun_header_with_frame(1, 2),
+    op_set_arg(2, 0, 0),
+    op_load_i(0, bias(100)),
+    op_set_arg(0, 0, 0),
+    op_load_i(0, bias(30)),
+    op_set_arg(1, 0, 0),
+    op_load_f(1, fun_address2),
+    op_tail_ap(1, 3),
+
+    fun_header_with_frame(3, 4),
+    op_sub(3, 0, 1),
+    op_add(3, 3, 2),
+    op_ret(3)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_number(77));
 }
 
 
@@ -150,7 +326,7 @@ it( calls_a_closure_downwards ) {
     op_ret(2)
   };
   vm_value result = vm_execute(program, array_length(program), 0, 0);
-  is_equal(result, bias(58)); //115 + 23 - 80
+  is_equal(result, make_number(58)); //115 + 23 - 80
 }
 
 
@@ -180,7 +356,7 @@ it( calls_a_closure_upwards ) {
     op_ret(2)
   };
   vm_value result = vm_execute(program, array_length(program), 0, 0);
-  is_equal(result, bias(56)); //80 - 24
+  is_equal(result, make_number(56)); //80 - 24
 }
 
 
@@ -212,7 +388,7 @@ it( modifies_a_closure ) {
     op_ret(3)
   };
   vm_value result = vm_execute(program, array_length(program), 0, 0);
-  is_equal(result, bias(44)); //77 - 33
+  is_equal(result, make_number(44)); //77 - 33
 }
 
 
@@ -243,14 +419,15 @@ it( loads_a_symbol_into_a_register ) {
 
 it( loads_a_compound_symbol ) {
   vm_value const_table[] = {
-    /* this would contain the data symbol */
+    make_number(0),
+    compound_symbol_header(3, 0)
   };
 
   vm_instruction program[] = {
     op_load_cs(0, 1),
     op_ret(0)
   };
-  vm_value result = vm_execute(program, array_length(program), const_table, 0);
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
   is_equal(result, make_tagged_val(1, vm_tag_compound_symbol));
 }
 
@@ -264,7 +441,7 @@ it( jumps_forward ) {
     op_ret(0)
   };
   vm_value result = vm_execute(program, array_length(program), 0, 0);
-  is_equal(result, make_tagged_val(bias(70), vm_tag_number));
+  is_equal(result, make_number(70));
 }
 
 it( jumps_if_condition_is_true ) {
@@ -283,20 +460,20 @@ it( jumps_if_condition_is_true ) {
   };
   vm_value result = vm_execute(program, array_length(program), 0, 0);
   // result: 2 + 3 + 4 = 9
-  is_equal(result, make_tagged_val(bias(9), vm_tag_number));
+  is_equal(result, make_number(9));
 }
 
 it( matches_a_number ) {
   vm_value const_table[] = {
     match_header(2),
-    make_tagged_val(bias(11), vm_tag_number),
-    make_tagged_val(bias(22), vm_tag_number),
+    make_number(11),
+    make_number(22),
   };
 
   vm_instruction program[] = {
     op_load_i(0, 600),
     op_load_i(1, bias(22)), /* value to match */
-    op_load_i(2, 0), /* address of match pattern */
+    op_load_i(2, bias(0)), /* address of match pattern */
     op_match(1, 2, 0),
     op_jmp(bias(1)),
     op_jmp(bias(2)),
@@ -306,7 +483,7 @@ it( matches_a_number ) {
     op_ret(0)
   };
   vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
-  is_equal(result, make_tagged_val(bias(300), vm_tag_number));
+  is_equal(result, make_number(300));
 }
 
 it( matches_a_symbol ) {
@@ -319,7 +496,7 @@ it( matches_a_symbol ) {
   vm_instruction program[] = {
     op_load_i(0, bias(600)),
     op_load_ps(1, bias(22)), /* value to match */
-    op_load_i(2, 0), /* address of match pattern */
+    op_load_i(2, bias(0)), /* address of match pattern */
     op_match(1, 2, 0),
     op_jmp(bias(1)),
     op_jmp(bias(2)),
@@ -329,7 +506,7 @@ it( matches_a_symbol ) {
     op_ret(0)
   };
   vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
-  is_equal(result, make_tagged_val(bias(300), vm_tag_number));
+  is_equal(result, make_number(300));
 }
 
 
@@ -340,20 +517,20 @@ it( matches_a_compound_symbol ) {
     make_tagged_val(3, vm_tag_compound_symbol),
     make_tagged_val(6, vm_tag_compound_symbol),
     compound_symbol_header(1, 2),
-    make_tagged_val(bias(55), vm_tag_number),
-    make_tagged_val(bias(66), vm_tag_number),
+    make_number(55),
+    make_number(66),
     compound_symbol_header(1, 2),
-    make_tagged_val(bias(55), vm_tag_number),
-    make_tagged_val(bias(77), vm_tag_number),
+    make_number(55),
+    make_number(77),
     compound_symbol_header(1, 2), /* the subject */
-    make_tagged_val(bias(55), vm_tag_number),
-    make_tagged_val(bias(77), vm_tag_number),
+    make_number(55),
+    make_number(77),
   };
 
   vm_instruction program[] = {
     op_load_i(0, bias(600)),
     op_load_cs(1, 9), /* value to match */
-    op_load_i(2, 0), /* address of match pattern */
+    op_load_i(2, bias(0)), /* address of match pattern */
     op_match(1, 2, 0),
     op_jmp(bias(1)),
     op_jmp(bias(2)),
@@ -363,7 +540,7 @@ it( matches_a_compound_symbol ) {
     op_ret(0)
   };
   vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
-  is_equal(result, make_tagged_val(bias(300), vm_tag_number));
+  is_equal(result, make_number(300));
 
 }
 
@@ -374,14 +551,14 @@ it( binds_a_value_in_a_match ) {
     make_tagged_val(3, vm_tag_compound_symbol),
     make_tagged_val(6, vm_tag_compound_symbol),
     compound_symbol_header(1, 2),
-    make_tagged_val(bias(55), vm_tag_number),
-    make_tagged_val(bias(66), vm_tag_number),
+    make_number(55),
+    make_number(66),
     compound_symbol_header(1, 2),
-    make_tagged_val(bias(55), vm_tag_number),
+    make_number(55),
     match_var(1), /* store this match in start_reg + 1 */
     compound_symbol_header(1, 2), /* the subject */
-    make_tagged_val(bias(55), vm_tag_number),
-    make_tagged_val(bias(77), vm_tag_number),
+    make_number(55),
+    make_number(77),
   };
 
   vm_instruction program[] = {
@@ -389,7 +566,7 @@ it( binds_a_value_in_a_match ) {
     op_load_i(4, bias(66)), /* initial wrong value */
 
     op_load_cs(1, 9), /* value to match */
-    op_load_i(2, 0), /* address of match pattern */
+    op_load_i(2, bias(0)), /* address of match pattern */
     op_match(1, 2, 3), /* after matching, reg 3 + 1 should contain the matched value (77) */
     op_jmp(bias(1)),
     op_jmp(bias(2)),
@@ -400,7 +577,7 @@ it( binds_a_value_in_a_match ) {
   };
 
   vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
-  is_equal(result, make_tagged_val(bias(77), vm_tag_number));
+  is_equal(result, make_number(77));
 }
 
 
@@ -425,9 +602,9 @@ it( binds_a_value_in_a_nested_symbol ) {
 
     compound_symbol_header(1, 2), /* the subject */ //13
     make_tagged_val(16, vm_tag_compound_symbol),
-    make_tagged_val(bias(55), vm_tag_number),
+    make_number(55),
     compound_symbol_header(2, 1), //16
-    make_tagged_val(bias(66), vm_tag_number),
+    make_number(66),
 
   };
 
@@ -435,7 +612,7 @@ it( binds_a_value_in_a_nested_symbol ) {
     op_load_i(0, bias(600)), /* initial wrong value */
 
     op_load_cs(1, 13), /* value to match */
-    op_load_i(2, 0), /* address of match pattern */
+    op_load_i(2, bias(0)), /* address of match pattern */
     op_match(1, 2, 3), /* after matching, reg 3 + 1 should contain the matched value (77) */
     op_jmp(bias(1)),
     op_jmp(bias(2)),
@@ -446,7 +623,7 @@ it( binds_a_value_in_a_nested_symbol ) {
   };
 
   vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
-  is_equal(result, make_tagged_val(bias(11), vm_tag_number));
+  is_equal(result, make_number(11));
 }
 
 
@@ -458,21 +635,21 @@ it( matches_a_dynamic_compound_symbol ) {
     make_tagged_val(3, vm_tag_compound_symbol),
     make_tagged_val(6, vm_tag_compound_symbol),
     compound_symbol_header(1, 2),
-    make_tagged_val(bias(55), vm_tag_number),
-    make_tagged_val(bias(66), vm_tag_number),
+    make_number(55),
+    make_number(66),
     compound_symbol_header(1, 2),
-    make_tagged_val(bias(55), vm_tag_number),
-    make_tagged_val(bias(77), vm_tag_number),
+    make_number(55),
+    make_number(77),
     compound_symbol_header(1, 2), /* the subject */
-    make_tagged_val(bias(55), vm_tag_number),
-    make_tagged_val(bias(77), vm_tag_number),
+    make_number(55),
+    make_number(77),
   };
 
   vm_instruction program[] = {
     op_load_i(0, bias(600)),
     op_load_cs(1, 9),
     op_copy_sym(5, 1), /* value to match */
-    op_load_i(2, 0), /* address of match pattern */
+    op_load_i(2, bias(0)), /* address of match pattern */
     op_match(5, 2, 0),
     op_jmp(bias(1)),
     op_jmp(bias(2)),
@@ -482,7 +659,7 @@ it( matches_a_dynamic_compound_symbol ) {
     op_ret(0)
   };
   vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
-  is_equal(result, make_tagged_val(bias(300), vm_tag_number));
+  is_equal(result, make_number(300));
 
 }
 
@@ -493,14 +670,14 @@ it( binds_a_value_in_a_dynamic_symbol_match ) {
     make_tagged_val(3, vm_tag_compound_symbol),
     make_tagged_val(6, vm_tag_compound_symbol),
     compound_symbol_header(1, 2),
-    make_tagged_val(bias(55), vm_tag_number),
-    make_tagged_val(bias(66), vm_tag_number),
+    make_number(55),
+    make_number(66),
     compound_symbol_header(1, 2),
-    make_tagged_val(bias(55), vm_tag_number),
+    make_number(55),
     match_var(1), /* store this match in start_reg + 1 */
     compound_symbol_header(1, 2), /* the subject */
-    make_tagged_val(bias(55), vm_tag_number),
-    make_tagged_val(bias(77), vm_tag_number),
+    make_number(55),
+    make_number(77),
   };
 
   vm_instruction program[] = {
@@ -509,7 +686,7 @@ it( binds_a_value_in_a_dynamic_symbol_match ) {
 
     op_load_cs(1, 9),
     op_copy_sym(5, 1), /* value to match */
-    op_load_i(2, 0), /* address of match pattern */
+    op_load_i(2, bias(0)), /* address of match pattern */
     op_match(5, 2, 3), /* after matching, reg 3 + 1 should contain the matched value (77) */
     op_jmp(bias(1)),
     op_jmp(bias(2)),
@@ -520,7 +697,7 @@ it( binds_a_value_in_a_dynamic_symbol_match ) {
   };
 
   vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
-  is_equal(result, make_tagged_val(bias(77), vm_tag_number));
+  is_equal(result, make_number(77));
 }
 
 
@@ -545,9 +722,9 @@ it( binds_a_value_in_a_nested_dynamic_symbol ) {
 
     compound_symbol_header(1, 2), /* the subject */ //13
     make_tagged_val(16, vm_tag_compound_symbol),
-    make_tagged_val(bias(55), vm_tag_number),
+    make_number(55),
     compound_symbol_header(2, 1), //16
-    make_tagged_val(bias(66), vm_tag_number),
+    make_number(66),
 
   };
 
@@ -556,7 +733,7 @@ it( binds_a_value_in_a_nested_dynamic_symbol ) {
 
     op_load_cs(1, 13),
     op_copy_sym(5, 1), /* value to match */
-    op_load_i(2, 0), /* address of match pattern */
+    op_load_i(2, bias(0)), /* address of match pattern */
     op_match(5, 2, 3), /* after matching, reg 3 + 1 should contain the matched value (77) */
     op_jmp(bias(1)),
     op_jmp(bias(2)),
@@ -567,20 +744,20 @@ it( binds_a_value_in_a_nested_dynamic_symbol ) {
   };
 
   vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
-  is_equal(result, make_tagged_val(bias(11), vm_tag_number));
+  is_equal(result, make_number(11));
 }
 
 it( throws_an_error_if_matching_fails ) {
   vm_value const_table[] = {
     match_header(2),
-    make_tagged_val(bias(11), vm_tag_number),
-    make_tagged_val(bias(22), vm_tag_number),
+    make_number(11),
+    make_number(22),
   };
 
   vm_instruction program[] = {
     op_load_i(0, 600),
     op_load_i(1, bias(33)), /* value to match */
-    op_load_i(2, 0), /* address of match pattern */
+    op_load_i(2, bias(0)), /* address of match pattern */
     op_match(1, 2, 0),
     op_jmp(bias(1)),
     op_jmp(bias(2)),
@@ -594,7 +771,7 @@ it( throws_an_error_if_matching_fails ) {
   is_equal(get_tag(result), vm_tag_dynamic_compound_symbol);
 
   if(get_tag(result) == vm_tag_dynamic_compound_symbol) {
-    vm_value *heap_p = heap_get_pointer(get_val(result));
+    vm_value *heap_p = vm_get_heap_pointer(get_val(result));
     vm_value sym_header = *heap_p;
     is_equal(compound_symbol_count(sym_header), 2);
     is_equal(compound_symbol_id(sym_header), symbol_id_error);
@@ -604,6 +781,196 @@ it( throws_an_error_if_matching_fails ) {
 }
 
 
+it( jumps_directly_to_the_matching_pattern_with_a_match_switch ) {
+  vm_value const_table[] = {
+    match_header(4),
+    make_tagged_val(13, vm_tag_compound_symbol),
+    make_tagged_val(15, vm_tag_compound_symbol),
+    make_number(11),
+    match_var(0),
+    /* match table: number of keys, first pattern without key, sorted keys with pattern index */
+    3,
+    3,
+    make_number(11), 2,
+    compound_symbol_header(1, 1), 0,
+    compound_symbol_header(2, 1), 1,
+    /* patterns */
+    compound_symbol_header(1, 1),
+    match_var(0),
+    compound_symbol_header(2, 1),
+    match_var(0),
+    /* subject */
+    compound_symbol_header(2, 1),
+    make_number(44),
+  };
+
+  vm_instruction program[] = {
+    op_load_cs(3, 17),
+    op_copy_sym(1, 3), /* value to match */
+    op_load_i(2, bias(0)), /* address of match pattern */
+    op_match_switch(1, 2, 0),
+    op_jmp(bias(3)),
+    op_jmp(bias(4)),
+    op_jmp(bias(5)),
+    op_jmp(bias(6)),
+    op_load_i(0, bias(100)),
+    op_ret(0),
+    op_ret(0), /* the second pattern has bound the field to r0 */
+    op_ret(0),
+    op_load_i(0, bias(300)),
+    op_ret(0),
+    op_load_i(0, bias(400)),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(result, make_number(44));
+}
+
+
+it( uses_the_first_pattern_without_key_if_nothing_else_matches ) {
+  vm_value const_table[] = {
+    match_header(3),
+    make_number(11),
+    match_var(0),
+    make_number(22),
+    /* match table */
+    2,
+    1,
+    make_number(11), 0,
+    make_number(22), 1, /* the variable comes before this pattern */
+  };
+
+  vm_instruction program[] = {
+    op_load_i(1, bias(33)), /* value to match */
+    op_load_i(2, bias(0)), /* address of match pattern */
+    op_match_switch(1, 2, 3),
+    op_jmp(bias(2)),
+    op_jmp(bias(3)),
+    op_jmp(bias(4)),
+    op_load_i(0, bias(100)),
+    op_ret(0),
+    op_move(0, 3),
+    op_ret(0),
+    op_load_i(0, bias(300)),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(result, make_number(33));
+}
+
+
+it( adds_and_subtracts_small_constants ) {
+  vm_instruction program[] = {
+    op_load_i(1, bias(40)),
+    op_add_i(1, 1, 2, small_bias(5)),
+    op_sub_i(0, 1, 3, small_bias(-3)),
+    op_add(0, 0, 2), /* the constants are in their registers as well */
+    op_add(0, 0, 3),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_number(50));
+}
+
+
+it( adds_a_constant_to_its_own_register ) {
+  vm_instruction program[] = {
+    op_add_i(0, 1, 1, small_bias(21)), /* like load_i(1, 21) followed by add(0, 1, 1) */
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_number(42));
+}
+
+
+it( compares_and_branches_in_a_recursive_function ) {
+  const int fun_address = 5;
+  vm_instruction program[] = {
+    op_load_i(1, bias(200)),
+    op_load_f(2, fun_address),
+    op_set_arg(0, 1, 0),
+    op_ap(0, 2, 1),
+    op_ret(0),
+
+    /* sum n = if n == 0 then 0 else n + sum (n - 1) */
+    fun_header_with_frame(1, 4),
+    op_load_i(1, bias(0)),
+    op_jmp_eq(2, 0, 1, small_bias(6)),
+    op_sub_i(2, 0, 3, small_bias(1)),
+    op_load_f(3, fun_address),
+    op_set_arg(0, 2, 0),
+    op_ap(1, 3, 1),
+    op_add(1, 0, 1),
+    op_ret(1),
+    op_ret(1)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_number(20100));
+}
+
+
+it( writes_the_result_of_a_comparison_before_branching ) {
+  vm_instruction program[] = {
+    op_load_i(1, bias(3)),
+    op_load_i(2, bias(4)),
+    op_jmp_gt(3, 1, 2, small_bias(2)),
+    op_jmp_lt(4, 1, 2, small_bias(1)),
+    op_ret(1),
+    op_and(0, 4, 4), /* false if the first jump was taken */
+    op_not(5, 3),
+    op_and(0, 0, 5),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_tagged_val(symbol_id_true, vm_tag_plain_symbol));
+}
+
+
+it( jumps_to_the_matching_constant ) {
+  vm_value const_table[] = {
+    match_header(3),
+    make_tagged_val(11, vm_tag_plain_symbol),
+    make_number(5),
+    make_tagged_val(22, vm_tag_plain_symbol),
+    /* match table */
+    3,
+    3,
+    make_number(5), 1,
+    make_tagged_val(11, vm_tag_plain_symbol), 0,
+    make_tagged_val(22, vm_tag_plain_symbol), 2,
+  };
+
+  vm_instruction program[] = {
+    op_load_ps(1, 22), /* value to match */
+    op_jmp_match(1, 0),
+    op_jmp(bias(2)),
+    op_jmp(bias(2)),
+    op_jmp(bias(2)),
+    op_ret_i(0, bias(100)),
+    op_ret_i(0, bias(200)),
+    op_ret_i(0, bias(-300))
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(result, make_number(-300));
+}
+
+
+it( returns_a_constant_from_a_function ) {
+  const int fun_address = 4;
+  vm_instruction program[] = {
+    op_load_f(1, fun_address),
+    op_ap(0, 1, 0),
+    op_ret(0),
+    op_ret(0),
+
+    fun_header_with_frame(0, 2),
+    op_ret_ps(1, 22)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_tagged_val(22, vm_tag_plain_symbol));
+}
+
+
 it( creates_an_explicit_partial_application ) {
   const int fun_address = 8;
   vm_instruction program[] = {
@@ -622,7 +989,7 @@ it( creates_an_explicit_partial_application ) {
     op_ret(0)
   };
   vm_value result = vm_execute(program, array_length(program), 0, 0);
-  is_equal(result, make_tagged_val(bias(32), vm_tag_number));
+  is_equal(result, make_number(32));
 }
 
 it( creates_a_partial_application_with_a_generic_application ) {
@@ -648,7 +1015,7 @@ it( creates_a_partial_application_with_a_generic_application ) {
     op_ret(0)
   };
   vm_value result = vm_execute(program, array_length(program), 0, 0);
-  is_equal(result, make_tagged_val(bias(165), vm_tag_number));
+  is_equal(result, make_number(165));
 }
 
 
@@ -668,7 +1035,7 @@ it( does_a_generic_application_of_a_function ) {
     op_ret(0)
   };
   vm_value result = vm_execute(program, array_length(program), 0, 0);
-  is_equal(result, make_tagged_val(bias(12), vm_tag_number));
+  is_equal(result, make_number(12));
 }
 
 
@@ -693,7 +1060,7 @@ it( loads_a_symbol_on_the_heap ) {
   is_equal(get_tag(result), vm_tag_dynamic_compound_symbol);
   is_equal(get_val(result), heap_start);
 
-  vm_value *heap_p = heap_get_pointer(heap_start);
+  vm_value *heap_p = vm_get_heap_pointer(heap_start);
   vm_value sym_header = *heap_p;
   is_equal(compound_symbol_count(sym_header), 2);
   int header_size = 1;
@@ -705,11 +1072,11 @@ it( modifies_a_heap_symbol ) {
 
   vm_value const_table[] = {
     compound_symbol_header(5, 2),
-    make_tagged_val(bias(55), vm_tag_number),
-    make_tagged_val(bias(66), vm_tag_number),
+    make_number(55),
+    make_number(66),
     compound_symbol_header(7, 2),
-    make_tagged_val(bias(33), vm_tag_number),
-    make_tagged_val(bias(44), vm_tag_number),
+    make_number(33),
+    make_number(44),
   };
   vm_instruction program[] = {
     op_load_cs(0, 0),
@@ -724,30 +1091,37 @@ it( modifies_a_heap_symbol ) {
   is_equal(get_tag(result), vm_tag_dynamic_compound_symbol);
   is_equal(get_val(result), heap_start);
 
-  vm_value *heap_p = heap_get_pointer(heap_start);
+  vm_value *heap_p = vm_get_heap_pointer(heap_start);
   vm_value sym_header = *heap_p;
   is_equal(compound_symbol_count(sym_header), 2);
   int header_size = 1;
-  is_equal(heap_p[header_size + 0], bias(33));
+  is_equal(heap_p[header_size + 0], make_number(33));
   is_equal(heap_p[header_size + 1], make_tagged_val(77, vm_tag_plain_symbol));
 }
 
 
 it( loads_a_constant_string_into_a_register ) {
+  vm_value const_table[] = {
+    make_number(0),
+    string_header(0, 0),
+    0
+  };
   vm_instruction program[] = {
-    op_load_str(0, 55),
+    op_load_str(0, 1),
     op_ret(0)
   };
-  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
   is_equal(get_tag(result), vm_tag_string);
-  is_equal(get_val(result), 55);
+  is_equal(get_val(result), 1);
 }
 
 
 it( determines_the_length_of_a_string ) {
   vm_value const_table[] = {
-    string_header(6, 2)
+    string_header(6, 0),
     // we're cheating here and leaving out the actual string content
+    0,
+    0
   };
   vm_instruction program[] = {
     op_load_str(1, 0),
@@ -755,7 +1129,7 @@ it( determines_the_length_of_a_string ) {
     op_ret(0)
   };
   vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
-  is_equal(result, make_tagged_val(bias(6), vm_tag_number));
+  is_equal(result, make_number(6));
 }
 
 
@@ -767,7 +1141,7 @@ it( determines_the_length_of_a_dynamic_string ) {
     op_ret(0)
   };
   vm_value result = vm_execute(program, array_length(program), 0, 0);
-  is_equal(result, make_tagged_val(bias(6), vm_tag_number));
+  is_equal(result, make_number(6));
 }
 
 
@@ -780,6 +1154,141 @@ it( creates_a_new_string ) {
   vm_value result = vm_execute(program, array_length(program), 0, 0);
   is_equal(get_tag(result), vm_tag_dynamic_string);
   is_equal(get_val(result), heap_start);
+  // 8 characters and the trailing '\0'
+  is_equal(string_chunk_count(*vm_get_heap_pointer(heap_start)), 2);
+}
+
+
+it( concatenates_two_strings ) {
+  vm_value const_table[8] = { 0 };
+  int second = const_string(const_table, "dash");
+  const_string(const_table + second, "-lang!");
+  vm_instruction program[] = {
+    op_load_str(1, 0),
+    op_load_str(2, second),
+    op_str_concat(0, 1, 2),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(get_tag(result), vm_tag_dynamic_string);
+  is_equal(string_length(*vm_get_heap_pointer(get_val(result))), 10);
+  is_equal(strcmp(dynamic_string_chars(result), "dash-lang!"), 0);
+}
+
+
+it( creates_a_rope_when_concatenating_long_strings ) {
+  vm_value const_table[16] = { 0 };
+  int second = const_string(const_table, "0123456789012345678901234567890123456789");
+  const_string(const_table + second, "abcdefghijklmnopqrstuvwxyzabcdefghijklmn");
+  vm_instruction program[] = {
+    op_load_str(1, 0),
+    op_load_str(2, second),
+    op_str_concat(0, 1, 2),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(get_tag(result), vm_tag_rope);
+  is_equal(string_length(*vm_get_heap_pointer(get_val(result))), 80);
+}
+
+
+it( reads_a_character_from_a_rope ) {
+  vm_value const_table[16] = { 0 };
+  int second = const_string(const_table, "0123456789012345678901234567890123456789");
+  const_string(const_table + second, "abcdefghijklmnopqrstuvwxyzabcdefghijklmn");
+  vm_instruction program[] = {
+    op_load_str(1, 0),
+    op_load_str(2, second),
+    op_str_concat(3, 1, 2),
+    op_load_i(4, bias(45)),
+    op_get_char(0, 3, 4),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(result, make_number('f'));
+}
+
+
+it( builds_a_long_string_by_appending_in_a_loop ) {
+  vm_value const_table[8] = { 0 };
+  int second = const_string(const_table, "");
+  const_string(const_table + second, "0123456789");
+  vm_instruction program[] = {
+    op_load_str(1, 0),
+    op_load_str(2, second),
+    op_load_i(3, bias(0)), /* counter */
+    op_load_i(4, bias(5000)), /* number of iterations */
+    op_load_i(5, bias(1)),
+    /* loop: */
+    op_str_concat(1, 1, 2),
+    op_add(3, 3, 5),
+    op_eq(6, 3, 4),
+    op_jmp_true(6, bias(1)),
+    op_jmp(bias(-5)),
+    op_load_i(7, bias(49995)),
+    op_load_i(8, bias(3)),
+    op_sub_str(0, 1, 7),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(get_tag(result), vm_tag_dynamic_string);
+  is_equal(strcmp(dynamic_string_chars(result), "567"), 0);
+}
+
+it( takes_a_sub_string_and_truncates_the_length ) {
+  vm_value const_table[4] = { 0 };
+  const_string(const_table, "hello world");
+  vm_instruction program[] = {
+    op_load_str(1, 0),
+    op_load_i(2, bias(6)), // start
+    op_load_i(3, bias(100)), // length
+    op_sub_str(0, 1, 2),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(get_tag(result), vm_tag_dynamic_string);
+  is_equal(strcmp(dynamic_string_chars(result), "world"), 0);
+}
+
+
+it( compares_strings ) {
+  vm_value const_table[8] = { 0 };
+  int second = const_string(const_table, "abc");
+  int third = second + const_string(const_table + second, "abd");
+  const_string(const_table + third, "ab");
+  vm_instruction program[] = {
+    op_load_str(1, 0),
+    op_load_str(2, second),
+    op_load_str(3, third),
+    op_str_cmp(4, 1, 2),
+    op_str_cmp(5, 2, 3),
+    op_str_cmp(6, 1, 1),
+    op_sub(0, 5, 4),
+    op_add(0, 0, 6),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  // "abc" < "abd", "abd" > "ab", "abc" == "abc"
+  is_equal(result, make_number(2));
+}
+
+
+it( finds_a_string_in_a_string ) {
+  vm_value const_table[8] = { 0 };
+  int second = const_string(const_table, "find the needle in here");
+  int third = second + const_string(const_table + second, "needle");
+  const_string(const_table + third, "needles");
+  vm_instruction program[] = {
+    op_load_str(1, 0),
+    op_load_str(2, second),
+    op_load_str(3, third),
+    op_str_find(4, 1, 2),
+    op_str_find(5, 1, 3),
+    op_add(0, 4, 5),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(result, make_number(9 - 1));
 }
 
 
@@ -789,7 +1298,7 @@ it( looks_up_a_value_in_a_module ) {
     opaque_symbol_header(10, 2),
     make_tagged_val(0, vm_tag_plain_symbol),
     make_tagged_val(5, vm_tag_plain_symbol),
-    make_tagged_val(bias(33), vm_tag_number),
+    make_number(33),
   };
   vm_instruction program[] = {
     op_load_os(1, 0),
@@ -798,10 +1307,581 @@ it( looks_up_a_value_in_a_module ) {
     op_ret(0)
   };
   vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
-  is_equal(result, make_tagged_val(bias(33), vm_tag_number));
+  is_equal(result, make_number(33));
+}
+
+
+it( looks_up_values_in_a_module_with_many_fields ) {
+
+  vm_value const_table[] = {
+    opaque_symbol_header(10, 8),
+    make_tagged_val(0, vm_tag_plain_symbol),
+    make_tagged_val(2, vm_tag_plain_symbol),
+    make_number(20),
+    make_tagged_val(3, vm_tag_plain_symbol),
+    make_number(30),
+    make_tagged_val(5, vm_tag_plain_symbol),
+    make_number(50),
+    make_tagged_val(8, vm_tag_plain_symbol),
+    make_number(80),
+  };
+  vm_instruction program[] = {
+    op_load_os(1, 0),
+    op_load_ps(2, 2),
+    op_get_field(3, 1, 2),
+    op_load_ps(2, 8),
+    op_get_field(4, 1, 2),
+    op_load_ps(2, 4),
+    op_get_field(5, 1, 2),
+    op_add(0, 3, 4),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(result, make_number(100));
+}
+
+
+it( collects_garbage_while_allocating_in_a_loop ) {
+  vm_value const_table[] = {
+    compound_symbol_header(1, 2),
+    make_number(0),
+    make_number(0),
+  };
+
+  const int fun_address = 18;
+  vm_instruction program[] = {
+    op_load_i(1, bias(0)), /* counter */
+    op_load_i(2, bias(5000)), /* number of iterations */
+    op_load_i(3, bias(1)),
+    op_load_cs(4, 0),
+    op_copy_sym(5, 4), /* this symbol is live during the whole loop */
+    op_set_sym_field(5, 2, 0),
+    op_load_f(8, fun_address),
+    op_set_arg(0, 5, 0),
+    op_part_ap(8, 8, 1), /* so is this closure, which holds a reference to the symbol */
+    /* loop: */
+    op_copy_sym(6, 4), /* garbage */
+    op_set_sym_field(6, 5, 1),
+    op_add(1, 1, 3),
+    op_eq(7, 1, 2),
+    op_jmp_true(7, bias(1)),
+    op_jmp(bias(-6)),
+    op_set_arg(0, 1, 0),
+    op_gen_ap(0, 8, 1),
+    op_ret(0),
+
+    fun_header(2),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+
+  is_equal(get_tag(result), vm_tag_dynamic_compound_symbol);
+
+  vm_value *heap_p = vm_get_heap_pointer(get_val(result));
+  is_equal(compound_symbol_id(heap_p[0]), 1);
+  is_equal(heap_p[1], make_number(5000));
+  is_equal(heap_p[2], make_number(0));
 }
 
 
+it( grows_the_heap_for_large_live_data ) {
+  vm_value const_table[] = {
+    compound_symbol_header(1, 2),
+    make_number(0),
+    make_tagged_val(0, vm_tag_plain_symbol),
+  };
+
+  vm_instruction program[] = {
+    op_load_i(1, bias(0)), /* counter */
+    op_load_i(2, bias(100000)), /* number of list cells */
+    op_load_i(3, bias(1)),
+    op_load_cs(4, 0),
+    op_load_ps(5, 0), /* end of list */
+    /* loop: */
+    op_copy_sym(6, 4),
+    op_set_sym_field(6, 1, 0),
+    op_set_sym_field(6, 5, 1),
+    op_move(5, 6),
+    op_add(1, 1, 3),
+    op_eq(7, 1, 2),
+    op_jmp_true(7, bias(1)),
+    op_jmp(bias(-8)),
+    op_ret(5),
+  };
+
+  vm_options options = { 1024, 1 << 24, 64, default_max_stack_size };
+  vm_value result = vm_execute_with_options(program, array_length(program), const_table, array_length(const_table), &options);
+
+  int length = 0;
+  int expected_value = 100000 - 1;
+  vm_value cell = result;
+  while(get_tag(cell) == vm_tag_dynamic_compound_symbol) {
+    vm_value *heap_p = vm_get_heap_pointer(get_val(cell));
+    if(heap_p[1] != make_number(expected_value)) {
+      break;
+    }
+    --expected_value;
+    ++length;
+    cell = heap_p[2];
+  }
+  is_equal(length, 100000);
+}
+
+
+it( keeps_young_objects_referenced_by_old_objects ) {
+  vm_value const_table[] = {
+    compound_symbol_header(1, 2),
+    make_number(0),
+    make_number(0),
+  };
+
+  vm_instruction program[] = {
+    op_load_i(1, bias(0)), /* counter */
+    op_load_i(2, bias(5000)), /* number of iterations */
+    op_load_i(3, bias(1)),
+    op_load_cs(4, 0),
+    op_copy_sym(5, 4), /* survives the first minor collection and is old afterwards */
+    /* loop: */
+    op_copy_sym(6, 4),
+    op_set_sym_field(6, 1, 0),
+    op_set_sym_field(5, 6, 1), /* the only reference to the new symbol is in an old object */
+    op_load_i(6, bias(0)),
+    op_copy_sym(7, 4), /* garbage, enough to trigger at least one minor collection */
+    op_copy_sym(7, 4),
+    op_copy_sym(7, 4),
+    op_copy_sym(7, 4),
+    op_copy_sym(7, 4),
+    op_copy_sym(7, 4),
+    op_add(1, 1, 3),
+    op_eq(8, 1, 2),
+    op_jmp_true(8, bias(1)),
+    op_jmp(bias(-14)),
+    op_ret(5),
+  };
+
+  vm_options options = { 1024, 1 << 24, 16, default_max_stack_size };
+  vm_value result = vm_execute_with_options(program, array_length(program), const_table, array_length(const_table), &options);
+
+  is_equal(get_tag(result), vm_tag_dynamic_compound_symbol);
+  vm_value *heap_p = vm_get_heap_pointer(get_val(result));
+  vm_value young = heap_p[2];
+  is_equal(get_tag(young), vm_tag_dynamic_compound_symbol);
+
+  heap_p = vm_get_heap_pointer(get_val(young));
+  is_equal(compound_symbol_id(heap_p[0]), 1);
+  is_equal(heap_p[1], make_number(4999));
+}
+
+
+it( grows_the_stack_for_deep_recursion ) {
+  vm_value const_table[] = {
+    compound_symbol_header(1, 2),
+    make_number(0),
+    make_tagged_val(0, vm_tag_plain_symbol),
+  };
+
+  const int fun_address = 5;
+  const int depth = 20000;
+  vm_instruction program[] = {
+    op_load_i(1, bias(depth)),
+    op_load_f(2, fun_address),
+    op_set_arg(0, 1, 0),
+    op_ap(0, 2, 1),
+    op_ret(0),
+
+    /* builds a list, but every cell is allocated before the recursive call and
+       is only referenced by a register while the stack grows */
+    fun_header_with_frame(1, 6),
+    op_load_i(1, bias(0)),
+    op_eq(2, 0, 1),
+    op_jmp_true(2, bias(10)),
+    op_load_cs(1, 0),
+    op_copy_sym(3, 1),
+    op_set_sym_field(3, 0, 0),
+    op_load_i(1, bias(1)),
+    op_sub(1, 0, 1),
+    op_load_f(4, fun_address),
+    op_set_arg(0, 1, 0),
+    op_ap(5, 4, 1),
+    op_set_sym_field(3, 5, 1),
+    op_ret(3),
+    op_load_ps(1, 0),
+    op_ret(1)
+  };
+
+  vm_options options = { 1024, 1 << 24, 64, default_max_stack_size };
+  vm_value result = vm_execute_with_options(program, array_length(program), const_table, array_length(const_table), &options);
+
+  int length = 0;
+  int expected_value = depth;
+  vm_value cell = result;
+  while(get_tag(cell) == vm_tag_dynamic_compound_symbol) {
+    vm_value *heap_p = vm_get_heap_pointer(get_val(cell));
+    if(heap_p[1] != make_number(expected_value)) {
+      break;
+    }
+    --expected_value;
+    ++length;
+    cell = heap_p[2];
+  }
+  is_equal(length, depth);
+}
+
+
+it( stops_with_an_error_when_the_stack_is_full ) {
+  const int fun_address = 4;
+  vm_instruction program[] = {
+    op_load_f(1, fun_address),
+    op_set_arg(0, 1, 0),
+    op_ap(0, 1, 1),
+    op_ret(0),
+
+    /* f x = 1 + (f x) */
+    fun_header_with_frame(1, 3),
+    op_set_arg(0, 0, 0),
+    op_ap(1, 0, 1),
+    op_load_i(2, bias(1)),
+    op_add(1, 1, 2),
+    op_ret(1)
+  };
+
+  vm_options options = vm_default_options();
+  options.max_stack_size = 1000;
+  vm_value result = vm_execute_with_options(program, array_length(program), 0, 0, &options);
+
+  is_equal(get_tag(result), vm_tag_dynamic_compound_symbol);
+  vm_value *heap_p = vm_get_heap_pointer(get_val(result));
+  is_equal(compound_symbol_id(heap_p[0]), symbol_id_error);
+}
+
+
+it( runs_a_flush_action ) {
+  vm_value const_table[] = {
+    compound_symbol_header(symbol_id_io, 3),
+    make_number(action_id_flush),
+    make_tagged_val(symbol_id_nil, vm_tag_plain_symbol),
+    make_tagged_val(symbol_id_nil, vm_tag_plain_symbol)
+  };
+
+  const int fun_address = 5;
+  vm_instruction program[] = {
+    op_load_cs(1, 0),
+    op_copy_sym(0, 1),
+    op_load_f(2, fun_address),
+    op_set_sym_field(0, 2, 2), /* bind the action to fun */
+    op_ret(0),
+
+    fun_header(1),
+    op_load_i(0, bias(42)),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(result, make_number(42));
+}
+
+it( runs_an_io_action_returned_by_a_bound_function ) {
+  vm_value const_table[] = {
+    compound_symbol_header(symbol_id_io, 3),
+    make_number(action_id_flush),
+    make_tagged_val(symbol_id_nil, vm_tag_plain_symbol),
+    make_tagged_val(symbol_id_nil, vm_tag_plain_symbol),
+    compound_symbol_header(symbol_id_io, 3),
+    make_number(action_id_return),
+    make_number(42),
+    make_tagged_val(symbol_id_nil, vm_tag_plain_symbol)
+  };
+
+  const int fun_address = 5;
+  vm_instruction program[] = {
+    op_load_cs(1, 0),
+    op_copy_sym(0, 1),
+    op_load_f(2, fun_address),
+    op_set_sym_field(0, 2, 2),
+    op_ret(0),
+
+    fun_header(1),
+    op_load_cs(1, 4),
+    op_copy_sym(0, 1), /* io.return 42 */
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(result, make_number(42));
+}
+
+
+#define io_action(action_id) \
+  compound_symbol_header(symbol_id_io, 3), \
+  make_number(action_id), \
+  make_tagged_val(symbol_id_nil, vm_tag_plain_symbol), \
+  make_tagged_val(symbol_id_nil, vm_tag_plain_symbol)
+
+it( spawns_a_thread_and_waits_for_its_result ) {
+  vm_value const_table[] = {
+    io_action(action_id_spawn),
+    io_action(action_id_await)
+  };
+
+  const int after_spawn_address = 7;
+  const int worker_address = 12;
+  vm_instruction program[] = {
+    op_load_cs(1, 0),
+    op_copy_sym(0, 1),
+    op_load_f(2, worker_address),
+    op_set_sym_field(0, 2, 1), /* io.spawn worker */
+    op_load_f(2, after_spawn_address),
+    op_set_sym_field(0, 2, 2),
+    op_ret(0),
+
+    /* after_spawn thread = io.await thread */
+    fun_header(1),
+    op_load_cs(1, 4),
+    op_copy_sym(2, 1),
+    op_set_sym_field(2, 0, 1),
+    op_ret(2),
+
+    /* worker _ = 42 */
+    fun_header(1),
+    op_load_i(0, bias(42)),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(result, make_number(42));
+}
+
+
+it( preempts_a_thread_that_never_finishes ) {
+  vm_value const_table[] = {
+    io_action(action_id_new_channel),
+    io_action(action_id_spawn),
+    io_action(action_id_send),
+    io_action(action_id_receive),
+    compound_symbol_header(0, 2), /* (channel, message) */
+    make_tagged_val(symbol_id_nil, vm_tag_plain_symbol),
+    make_tagged_val(symbol_id_nil, vm_tag_plain_symbol)
+  };
+
+  const int spawn_loop_address = 5;
+  const int spawn_sender_address = 15;
+  const int receive_address = 27;
+  const int loop_address = 32;
+  const int sender_address = 36;
+  vm_instruction program[] = {
+    op_load_cs(1, 0),
+    op_copy_sym(0, 1),
+    op_load_f(2, spawn_loop_address),
+    op_set_sym_field(0, 2, 2), /* io.new_channel */
+    op_ret(0),
+
+    /* spawn_loop channel = io.spawn loop, followed by spawn_sender channel */
+    fun_header(1),
+    op_load_cs(1, 4),
+    op_copy_sym(2, 1),
+    op_load_f(3, loop_address),
+    op_set_sym_field(2, 3, 1),
+    op_load_f(4, spawn_sender_address),
+    op_set_arg(0, 0, 0),
+    op_part_ap(4, 4, 1),
+    op_set_sym_field(2, 4, 2),
+    op_ret(2),
+
+    /* spawn_sender channel _ = io.spawn (sender channel), followed by receive channel */
+    fun_header(2),
+    op_load_cs(2, 4),
+    op_copy_sym(3, 2),
+    op_load_f(4, sender_address),
+    op_set_arg(0, 0, 0),
+    op_part_ap(4, 4, 1),
+    op_set_sym_field(3, 4, 1),
+    op_load_f(5, receive_address),
+    op_set_arg(0, 0, 0),
+    op_part_ap(5, 5, 1),
+    op_set_sym_field(3, 5, 2),
+    op_ret(3),
+
+    /* receive channel _ = io.receive channel */
+    fun_header(2),
+    op_load_cs(2, 12),
+    op_copy_sym(3, 2),
+    op_set_sym_field(3, 0, 1),
+    op_ret(3),
+
+    /* loop x = loop x */
+    fun_header(1),
+    op_load_f(1, loop_address),
+    op_set_arg(0, 0, 0),
+    op_tail_ap(1, 1),
+
+    /* sender channel _ = io.send channel 42 */
+    fun_header(2),
+    op_load_cs(2, 16),
+    op_copy_sym(3, 2),
+    op_set_sym_field(3, 0, 0),
+    op_load_i(4, bias(42)),
+    op_set_sym_field(3, 4, 1),
+    op_load_cs(2, 8),
+    op_copy_sym(5, 2),
+    op_set_sym_field(5, 3, 1),
+    op_ret(5)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(result, make_number(42));
+}
+
+
+it( stops_with_an_error_when_all_threads_are_blocked ) {
+  vm_value const_table[] = {
+    io_action(action_id_new_channel),
+    io_action(action_id_receive)
+  };
+
+  const int fun_address = 5;
+  vm_instruction program[] = {
+    op_load_cs(1, 0),
+    op_copy_sym(0, 1),
+    op_load_f(2, fun_address),
+    op_set_sym_field(0, 2, 2), /* io.new_channel */
+    op_ret(0),
+
+    /* f channel = io.receive channel */
+    fun_header(1),
+    op_load_cs(1, 4),
+    op_copy_sym(2, 1),
+    op_set_sym_field(2, 0, 1),
+    op_ret(2)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+
+  is_equal(get_tag(result), vm_tag_dynamic_compound_symbol);
+  vm_value *heap_p = vm_get_heap_pointer(get_val(result));
+  is_equal(compound_symbol_id(heap_p[0]), symbol_id_error);
+}
+
+
+it( calls_a_function_of_a_loaded_program_many_times ) {
+  const int fun_address = 2;
+  vm_instruction program[] = {
+    op_load_f(0, fun_address),
+    op_ret(0),
+
+    /* f x = x + 1 */
+    fun_header(1),
+    op_load_i(1, bias(1)),
+    op_add(0, 0, 1),
+    op_ret(0)
+  };
+
+  vm_instance *vm = vm_create(NULL);
+  vm_value fun = vm_load_program(vm, program, array_length(program), 0, 0);
+  is_equal(get_tag(fun), vm_tag_function);
+
+  int wrong_results = 0;
+  for(int i = 0; i < 1000; ++i) {
+    vm_value arg = make_number(i);
+    if(vm_call(vm, fun, &arg, 1) != make_number(i + 1)) {
+      ++wrong_results;
+    }
+  }
+  is_equal(wrong_results, 0);
+  vm_destroy(vm);
+}
+
+
+it( calls_a_closure_of_a_loaded_program_while_collecting_garbage ) {
+  vm_value const_table[] = {
+    compound_symbol_header(1, 2),
+    make_number(0),
+    make_number(0),
+  };
+
+  const int fun_address = 5;
+  vm_instruction program[] = {
+    op_load_i(1, bias(10)),
+    op_load_f(2, fun_address),
+    op_set_arg(0, 1, 0),
+    op_part_ap(0, 2, 1),
+    op_ret(0),
+
+    /* f c x = c + x, with c = 10 */
+    fun_header(2),
+    op_load_cs(2, 0),
+    op_copy_sym(3, 2), /* garbage */
+    op_add(0, 0, 1),
+    op_ret(0)
+  };
+
+  vm_options options = { 1024, 1 << 24, 16, default_max_stack_size };
+  vm_instance *vm = vm_create(&options);
+  vm_value closure = vm_load_program(vm, program, array_length(program), const_table, array_length(const_table));
+  is_equal(get_tag(closure), vm_tag_pap);
+
+  int wrong_results = 0;
+  for(int i = 0; i < 2000; ++i) {
+    vm_value arg = make_number(i);
+    // the closure moves when it is collected
+    closure = vm_program_result(vm);
+    if(vm_call(vm, closure, &arg, 1) != make_number(i + 10)) {
+      ++wrong_results;
+    }
+  }
+  is_equal(wrong_results, 0);
+  vm_destroy(vm);
+}
+
+
+it( runs_two_instances_with_separate_heaps ) {
+  vm_value const_table[] = {
+    compound_symbol_header(1, 2),
+    make_number(0),
+    make_number(0),
+  };
+
+  const int fun_address = 5;
+  vm_instruction program_a[] = {
+    op_load_i(1, bias(10)),
+    op_load_f(2, fun_address),
+    op_set_arg(0, 1, 0),
+    op_part_ap(0, 2, 1),
+    op_ret(0),
+
+    /* f c x = c + x */
+    fun_header(2),
+    op_load_cs(2, 0),
+    op_copy_sym(3, 2), /* garbage */
+    op_add(0, 0, 1),
+    op_ret(0)
+  };
+  vm_instruction program_b[array_length(program_a)];
+  memcpy(program_b, program_a, sizeof(program_a));
+  program_b[0] = op_load_i(1, bias(20));
+
+  vm_options options = { 1024, 1 << 24, 16, default_max_stack_size };
+  vm_instance *vm_a = vm_create(&options);
+  vm_instance *vm_b = vm_create(&options);
+  vm_load_program(vm_a, program_a, array_length(program_a), const_table, array_length(const_table));
+  vm_load_program(vm_b, program_b, array_length(program_b), const_table, array_length(const_table));
+
+  int wrong_results = 0;
+  for(int i = 0; i < 2000; ++i) {
+    vm_value arg = make_number(i);
+    if(vm_call(vm_a, vm_program_result(vm_a), &arg, 1) != make_number(i + 10)) {
+      ++wrong_results;
+    }
+    if(vm_call(vm_b, vm_program_result(vm_b), &arg, 1) != make_number(i + 20)) {
+      ++wrong_results;
+    }
+  }
+  is_equal(wrong_results, 0);
+
+  // both closures are at the same address, but in different heaps
+  vm_value closure_a = vm_program_result(vm_a);
+  vm_value closure_b = vm_program_result(vm_b);
+  is_equal(get_val(closure_a), get_val(closure_b));
+  is_equal(vm_instance_heap_pointer(vm_a, get_val(closure_a))[2], make_number(10));
+  is_equal(vm_instance_heap_pointer(vm_b, get_val(closure_b))[2], make_number(20));
+
+  vm_destroy(vm_a);
+  vm_destroy(vm_b);
+}
 
 start_spec(vm_spec)
 	example(loads_a_number_into_a_register)
@@ -809,8 +1889,16 @@ start_spec(vm_spec)
 	example(subtracts_two_numbers)
 	example(multiplies_two_numbers)
 	example(divides_two_numbers)
+	example(subtracts_to_a_negative_number)
+	example(computes_numbers_larger_than_an_immediate_value)
+	example(stops_with_an_error_when_a_number_overflows)
+	example(stops_with_an_error_when_a_product_overflows)
   example(moves_a_register)
   example(directly_calls_a_function)
+  example(calls_a_function_with_a_small_frame_recursively)
+  example(spills_values_in_a_recursive_function)
+  example(spills_values_in_the_top_level_code)
+  example(tail_calls_a_function_with_more_arguments_than_the_callers_frame)
   example(calls_a_closure_downwards)
   example(calls_a_closure_upwards)
   example(modifies_a_closure)
@@ -829,6 +1917,14 @@ start_spec(vm_spec)
   example(binds_a_value_in_a_dynamic_symbol_match)
   example(binds_a_value_in_a_nested_dynamic_symbol)
   example(throws_an_error_if_matching_fails)
+  example(jumps_directly_to_the_matching_pattern_with_a_match_switch)
+  example(uses_the_first_pattern_without_key_if_nothing_else_matches)
+  example(adds_and_subtracts_small_constants)
+  example(adds_a_constant_to_its_own_register)
+  example(compares_and_branches_in_a_recursive_function)
+  example(writes_the_result_of_a_comparison_before_branching)
+  example(jumps_to_the_matching_constant)
+  example(returns_a_constant_from_a_function)
   example(creates_an_explicit_partial_application)
   example(creates_a_partial_application_with_a_generic_application)
   example(does_a_generic_application_of_a_function)
@@ -840,6 +1936,27 @@ start_spec(vm_spec)
   example(has_a_less_than_opcode)
   example(has_a_greater_than_opcode)
   example(creates_a_new_string)
+  example(concatenates_two_strings)
+  example(creates_a_rope_when_concatenating_long_strings)
+  example(reads_a_character_from_a_rope)
+  example(builds_a_long_string_by_appending_in_a_loop)
+  example(takes_a_sub_string_and_truncates_the_length)
+  example(compares_strings)
+  example(finds_a_string_in_a_string)
   example(looks_up_a_value_in_a_module)
+  example(looks_up_values_in_a_module_with_many_fields)
+  example(collects_garbage_while_allocating_in_a_loop)
+  example(grows_the_heap_for_large_live_data)
+  example(keeps_young_objects_referenced_by_old_objects)
+  example(grows_the_stack_for_deep_recursion)
+  example(stops_with_an_error_when_the_stack_is_full)
+  example(runs_a_flush_action)
+  example(runs_an_io_action_returned_by_a_bound_function)
+  example(spawns_a_thread_and_waits_for_its_result)
+  example(preempts_a_thread_that_never_finishes)
+  example(stops_with_an_error_when_all_threads_are_blocked)
+  example(calls_a_function_of_a_loaded_program_many_times)
+  example(calls_a_closure_of_a_loaded_program_while_collecting_garbage)
+  example(runs_two_instances_with_separate_heaps)
 end_spec
 
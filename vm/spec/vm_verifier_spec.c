@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include "vm_verifier_spec.h"
+
+#include "../vm_internal.h"
+#include "../opcodes.h"
+#include "../heap.h"
+#include "../encoding.h"
+#include "../defs.h"
+
+#define array_length(x) (sizeof(x) / sizeof(x[0]))
+
+#define bias(n) ((n) + int_bias)
+
+
+static bool is_error(vm_value value) {
+  if(get_tag(value) != vm_tag_dynamic_compound_symbol) {
+    return false;
+  }
+  vm_value *heap_p = vm_get_heap_pointer(get_val(value));
+  return compound_symbol_id(heap_p[0]) == symbol_id_error;
+}
+
+
+it( rejects_a_jump_outside_of_the_program ) {
+  vm_instruction program[] = {
+    op_load_i(0, bias(1)),
+    op_jmp(bias(5)),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(is_error(result), true);
+}
+
+
+it( accepts_a_jump_to_the_end_of_the_program ) {
+  vm_instruction program[] = {
+    op_load_i(0, bias(1)),
+    op_jmp(bias(1)),
+    op_load_i(0, bias(2)),
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_number(1));
+}
+
+
+it( rejects_a_constant_address_outside_of_the_const_table ) {
+  vm_value const_table[] = {
+    compound_symbol_header(1, 1),
+    make_number(3),
+  };
+  vm_instruction program[] = {
+    op_load_cs(0, 2),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(is_error(result), true);
+}
+
+
+it( rejects_a_compound_symbol_with_fields_outside_of_the_const_table ) {
+  vm_value const_table[] = {
+    compound_symbol_header(1, 2),
+    make_number(3),
+  };
+  vm_instruction program[] = {
+    op_load_cs(0, 0),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(is_error(result), true);
+}
+
+
+it( rejects_a_nested_constant_that_is_not_a_symbol ) {
+  vm_value const_table[] = {
+    compound_symbol_header(1, 1),
+    make_tagged_val(2, vm_tag_compound_symbol),
+    make_number(3),
+  };
+  vm_instruction program[] = {
+    op_load_cs(0, 0),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(is_error(result), true);
+}
+
+
+it( rejects_a_function_address_without_a_function_header ) {
+  vm_instruction program[] = {
+    op_load_f(1, 2),
+    op_gen_ap(0, 1, 0),
+    op_ret(0),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(is_error(result), true);
+}
+
+
+it( rejects_a_frame_that_is_smaller_than_the_arity ) {
+  vm_instruction program[] = {
+    op_ret(0),
+    fun_header_with_frame(3, 2),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(is_error(result), true);
+}
+
+
+it( rejects_arguments_outside_of_the_registers ) {
+  vm_instruction reads_too_many[] = {
+    op_set_arg(0, 20, 15),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(reads_too_many, array_length(reads_too_many), 0, 0);
+  is_equal(is_error(result), true);
+
+  vm_instruction writes_too_many[] = {
+    op_set_arg(20, 0, 15),
+    op_ret(0)
+  };
+  result = vm_execute(writes_too_many, array_length(writes_too_many), 0, 0);
+  is_equal(is_error(result), true);
+}
+
+
+it( rejects_a_register_outside_of_the_frame ) {
+  const int fun_address = 4;
+  vm_instruction program[] = {
+    op_load_f(1, fun_address),
+    op_set_arg(0, 0, 0),
+    op_ap(0, 1, 1),
+    op_ret(0),
+    fun_header_with_frame(1, 2),
+    op_add(0, 0, 2),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(is_error(result), true);
+}
+
+
+it( rejects_a_range_of_registers_that_ends_outside_of_the_frame ) {
+  const int fun_address = 4;
+  vm_instruction program[] = {
+    op_load_f(1, fun_address),
+    op_set_arg(0, 0, 0),
+    op_ap(0, 1, 1),
+    op_ret(0),
+    fun_header_with_frame(1, 3),
+    op_map_new(1),
+    op_map_entry(2, 1, 0),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(is_error(result), true);
+}
+
+
+it( accepts_all_registers_in_the_top_level_code ) {
+  vm_instruction program[] = {
+    op_load_i((num_regs - 1), bias(5)),
+    op_move(0, (num_regs - 1)),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(result, make_number(5));
+}
+
+
+it( rejects_a_spill_slot_that_the_function_does_not_have ) {
+  const int fun_address = 4;
+  vm_instruction program[] = {
+    op_load_f(1, fun_address),
+    op_set_arg(0, 0, 0),
+    op_ap(0, 1, 1),
+    op_ret(0),
+    fun_header_with_spill_slots(1, 2),
+    op_spill(0, 2),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(is_error(result), true);
+}
+
+
+it( rejects_invalid_match_data ) {
+  vm_value const_table[] = {
+    match_header(3),
+    make_number(11),
+  };
+  vm_instruction program[] = {
+    op_load_i(1, bias(11)),
+    op_load_i(2, bias(0)),
+    op_match(1, 2, 0),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(is_error(result), true);
+}
+
+
+it( rejects_invalid_match_data_that_is_not_loaded_directly ) {
+  vm_value const_table[] = {
+    make_number(11),
+  };
+  vm_instruction program[] = {
+    op_load_i(1, bias(11)),
+    op_load_i(2, bias(0)),
+    op_move(3, 2),
+    op_match(1, 3, 0),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(is_error(result), true);
+}
+
+
+it( rejects_an_unsorted_match_table ) {
+  vm_value const_table[] = {
+    match_header(2),
+    make_number(22),
+    make_number(11),
+    2,
+    2,
+    make_number(22), 0,
+    make_number(11), 1,
+  };
+  vm_instruction program[] = {
+    op_load_i(1, bias(11)),
+    op_load_i(2, bias(0)),
+    op_match_switch(1, 2, 0),
+    op_jmp(bias(1)),
+    op_jmp(bias(1)),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(is_error(result), true);
+}
+
+
+it( rejects_a_module_with_unsorted_fields ) {
+  vm_value const_table[] = {
+    opaque_symbol_header(10, 4),
+    make_tagged_val(0, vm_tag_plain_symbol),
+    make_tagged_val(7, vm_tag_plain_symbol),
+    make_number(1),
+    make_tagged_val(5, vm_tag_plain_symbol),
+    make_number(2),
+  };
+  vm_instruction program[] = {
+    op_load_os(0, 0),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), const_table, array_length(const_table));
+  is_equal(is_error(result), true);
+}
+
+
+it( rejects_an_unknown_opcode ) {
+  vm_instruction program[] = {
+    instr_ri(62, 0, 0),
+    op_ret(0)
+  };
+  vm_value result = vm_execute(program, array_length(program), 0, 0);
+  is_equal(is_error(result), true);
+}
+
+
+start_spec(vm_verifier_spec)
+  example(rejects_a_jump_outside_of_the_program)
+  example(accepts_a_jump_to_the_end_of_the_program)
+  example(rejects_a_constant_address_outside_of_the_const_table)
+  example(rejects_a_compound_symbol_with_fields_outside_of_the_const_table)
+  example(rejects_a_nested_constant_that_is_not_a_symbol)
+  example(rejects_a_function_address_without_a_function_header)
+  example(rejects_a_frame_that_is_smaller_than_the_arity)
+  example(rejects_arguments_outside_of_the_registers)
+  example(rejects_a_register_outside_of_the_frame)
+  example(rejects_a_range_of_registers_that_ends_outside_of_the_frame)
+  example(accepts_all_registers_in_the_top_level_code)
+  example(rejects_a_spill_slot_that_the_function_does_not_have)
+  example(rejects_invalid_match_data)
+  example(rejects_invalid_match_data_that_is_not_loaded_directly)
+  example(rejects_an_unsorted_match_table)
+  example(rejects_a_module_with_unsorted_fields)
+  example(rejects_an_unknown_opcode)
+end_spec
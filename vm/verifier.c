@@ -0,0 +1,532 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "verifier.h"
+#include "opcodes.h"
+#include "defs.h"
+#include "encoding.h"
+
+/*
+
+Verifier
+~~~~~~~~
+
+Before a program is run, we check everything that can be checked statically:
+
+  - all opcodes are known
+  - jump targets are inside of the program
+  - function addresses point to a FUN_HEADER, and function arities fit into the
+    registers and the function's frame
+  - spill slots exist in the function that uses them
+  - constant table addresses are inside of the constant table and point to the
+    kind of data the instruction expects
+  - the fields of modules are sorted by the symbol ids of their names
+  - all registers an instruction uses are inside of the current function's frame.
+    Every function only gets a window of frame_size registers, the registers above
+    belong to the next frame (or to the spill slots). This includes the ranges of
+    registers some instructions use: sub_str and array_slice also read the register
+    after their last argument, map_entry writes the register after its result, and
+    set_arg copies 1 + r2 registers (into the next frame, which always has num_regs
+    registers for the arguments).
+
+Constants are checked deeply, i.e. all constants that are reachable from a checked
+constant are checked as well. This means that the interpreter can follow references
+between constants without checking them again. Every checked address is marked, so
+that shared constants are only checked once.
+
+Match data is only ever loaded into a register before it's used (the compiler
+always generates `load_i r, addr` followed by `match _, r, _`). The verifier checks
+the match data for this pattern, but since bytecode isn't required to look like
+this, OP_MATCH calls verify_match_data as well. That's why the verifier keeps its
+state (in the vm instance) after verify_program has returned. The superinstruction
+jmp_match has the address in the instruction itself, so it's always checked.
+
+*/
+
+// Flags in verifier_state.verified
+#define verified_constant 1
+#define verified_match_table 2
+
+
+static bool push_work_item(verifier_state *v, vm_value value) {
+  if(v->work_list_size == v->work_list_capacity) {
+    size_t capacity = v->work_list_capacity == 0 ? 64 : v->work_list_capacity * 2;
+    vm_value *resized = realloc(v->work_list, capacity * sizeof(vm_value));
+    if(resized == NULL) {
+      return false;
+    }
+    v->work_list = resized;
+    v->work_list_capacity = capacity;
+  }
+  v->work_list[v->work_list_size++] = value;
+  return true;
+}
+
+
+static bool is_function_address(verifier_state *v, vm_value address) {
+  return address < v->program_length && get_opcode(v->program[address]) == FUN_HEADER;
+}
+
+
+// Checks that an object with `size` words (including its header) at `address` fits
+// into the constant table and has the expected header tag
+static bool is_const_object(verifier_state *v, vm_value address, vm_value header_tag, size_t size) {
+  return address < v->const_table_length
+      && get_tag(v->const_table[address]) == header_tag
+      && address + size <= v->const_table_length;
+}
+
+
+// Modules consist of (name, value) pairs, sorted by the symbol id of the name, so that
+// OP_GET_FIELD can do a binary search
+static bool is_module_layout(vm_value *fields, size_t count) {
+  if(count % 2 != 0) {
+    return false;
+  }
+  for(size_t i = 0; i < count; i += 2) {
+    if(get_tag(fields[i]) != vm_tag_plain_symbol) {
+      return false;
+    }
+    if(i > 0 && fields[i - 2] >= fields[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+static bool push_fields(verifier_state *v, vm_value *fields, size_t count) {
+  for(size_t i = 0; i < count; ++i) {
+    if(!push_work_item(v, fields[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+static bool verify_constant(verifier_state *v, vm_value value) {
+  v->work_list_size = 0;
+  if(!push_work_item(v, value)) {
+    return false;
+  }
+
+  while(v->work_list_size > 0) {
+    vm_value item = v->work_list[--v->work_list_size];
+    vm_value address = get_val(item);
+
+    switch(get_tag(item)) {
+      case vm_tag_number:
+      case vm_tag_plain_symbol:
+      case vm_tag_match_data: // match vars and wildcards in patterns
+        break;
+
+      case vm_tag_function:
+        if(!is_function_address(v, address)) {
+          return false;
+        }
+        break;
+
+      case vm_tag_compound_symbol: {
+        if(address < v->const_table_length && (v->verified[address] & verified_constant)) {
+          break;
+        }
+        vm_value header = address < v->const_table_length ? v->const_table[address] : 0;
+        size_t count = compound_symbol_count(header);
+        if(!is_const_object(v, address, vm_tag_compound_symbol, compound_symbol_header_size + count)) {
+          return false;
+        }
+        v->verified[address] |= verified_constant;
+        if(!push_fields(v, &v->const_table[address + compound_symbol_header_size], count)) {
+          return false;
+        }
+      }
+      break;
+
+      case vm_tag_opaque_symbol: {
+        if(address < v->const_table_length && (v->verified[address] & verified_constant)) {
+          break;
+        }
+        // The header is followed by the owner and the fields
+        vm_value header = address < v->const_table_length ? v->const_table[address] : 0;
+        size_t count = compound_symbol_count(header);
+        if(!is_const_object(v, address, vm_tag_opaque_symbol, 2 + count)) {
+          return false;
+        }
+        if(v->const_table[address + 1] == make_tagged_val(0, vm_tag_plain_symbol)
+           && !is_module_layout(&v->const_table[address + 2], count)) {
+          return false;
+        }
+        v->verified[address] |= verified_constant;
+        if(!push_fields(v, &v->const_table[address + 1], count + 1)) {
+          return false;
+        }
+      }
+      break;
+
+      case vm_tag_string: {
+        vm_value header = address < v->const_table_length ? v->const_table[address] : 0;
+        if(!is_const_object(v, address, vm_tag_string, string_header_size + string_chunk_count(header))) {
+          return false;
+        }
+      }
+      break;
+
+      default:
+        // Dynamic values can't appear in the constant table
+        return false;
+    }
+  }
+
+  return true;
+}
+
+
+bool verify_match_data(verifier_state *v, vm_value address) {
+  if(address >= v->const_table_length) {
+    return false;
+  }
+  if(v->verified[address] & verified_constant) {
+    return true;
+  }
+
+  vm_value header = v->const_table[address];
+  bool is_header = is_match_header(header);
+  size_t number_of_patterns = from_match_value(header);
+  if(!is_header || !is_const_object(v, address, vm_tag_match_data, 1 + number_of_patterns)) {
+    return false;
+  }
+
+  for(size_t i = 0; i < number_of_patterns; ++i) {
+    if(!verify_constant(v, v->const_table[address + 1 + i])) {
+      return false;
+    }
+  }
+
+  v->verified[address] |= verified_constant;
+  return true;
+}
+
+
+bool verify_match_table(verifier_state *v, vm_value address) {
+  if(!verify_match_data(v, address)) {
+    return false;
+  }
+  if(v->verified[address] & verified_match_table) {
+    return true;
+  }
+
+  vm_value number_of_patterns = from_match_value(v->const_table[address]);
+  vm_value table_address = address + 1 + number_of_patterns;
+  if(table_address + 2 > v->const_table_length) {
+    return false;
+  }
+
+  vm_value number_of_keys = v->const_table[table_address];
+  vm_value first_catch_all = v->const_table[table_address + 1];
+  if(first_catch_all > number_of_patterns
+      || number_of_keys > (v->const_table_length - table_address - 2) / 2) {
+    return false;
+  }
+
+  // the keys have to be sorted, because the vm does a binary search on them
+  vm_value *entries = &v->const_table[table_address + 2];
+  for(vm_value i = 0; i < number_of_keys; ++i) {
+    if(i > 0 && entries[2 * i] <= entries[2 * (i - 1)]) {
+      return false;
+    }
+    if(entries[2 * i + 1] > number_of_patterns) {
+      return false;
+    }
+  }
+
+  v->verified[address] |= verified_match_table;
+  return true;
+}
+
+
+static int max3(int a, int b, int c) {
+  int ab = a > b ? a : b;
+  return ab > c ? ab : c;
+}
+
+
+// The highest register that an instruction reads or writes in the current frame, or
+// -1 if it doesn't use any
+static int last_register(vm_instruction instr) {
+  int r0 = get_arg_r0(instr);
+  int r1 = get_arg_r1(instr);
+  int r2 = get_arg_r2(instr);
+
+  switch(get_opcode(instr)) {
+    case OP_LOAD_i:
+    case OP_LOAD_ps:
+    case OP_LOAD_cs:
+    case OP_LOAD_os:
+    case OP_LOAD_f:
+    case OP_LOAD_str:
+    case OP_RET:
+    case OP_RET_i:
+    case OP_RET_ps:
+    case OP_JMP_TRUE:
+    case OP_JMP_MATCH:
+    case OP_SPILL:
+    case OP_RELOAD:
+    case OP_MAP_NEW:
+      return r0;
+
+    // r2 is a number of arguments or an index
+    case OP_MOVE:
+    case OP_NOT:
+    case OP_COPY_SYM:
+    case OP_STR_LEN:
+    case OP_NEW_STR:
+    case OP_MAP_SIZE:
+    case OP_ARRAY_NEW:
+    case OP_ARRAY_LEN:
+    case OP_AP:
+    case OP_GEN_AP:
+    case OP_TAIL_GEN_AP:
+    case OP_PART_AP:
+    case OP_SET_CL_VAL:
+    case OP_SET_SYM_FIELD:
+      return r0 > r1 ? r0 : r1;
+
+    case OP_TAIL_AP:
+      return r1;
+
+    // the arguments are written into the next frame
+    case OP_SET_ARG:
+      return r1 + r2;
+
+    case OP_SUB_STR:
+    case OP_ARRAY_SLICE:
+      return max3(r0, r1, r2 + 1);
+
+    case OP_MAP_ENTRY:
+      return max3(r0 + 1, r1, r2);
+
+    case OP_JMP:
+    case FUN_HEADER:
+      return -1;
+
+    default:
+      return max3(r0, r1, r2);
+  }
+}
+
+
+#define reject(format, ...) { snprintf(error, error_size, format, ## __VA_ARGS__); return false; }
+
+bool verify_program(verifier_state *v, vm_instruction *program_arg, int program_length_arg,
+                    vm_value *const_table_arg, int const_table_length_arg,
+                    char *error, size_t error_size) {
+  v->program = program_arg;
+  v->program_length = program_length_arg;
+  v->const_table = const_table_arg;
+  v->const_table_length = const_table_length_arg;
+
+  if(v->const_table_length > v->verified_capacity) {
+    uint8_t *resized = realloc(v->verified, v->const_table_length);
+    if(resized == NULL) {
+      reject("Out of memory");
+    }
+    v->verified = resized;
+    v->verified_capacity = v->const_table_length;
+  }
+  if(v->const_table_length > 0) {
+    memset(v->verified, 0, v->const_table_length);
+  }
+
+  // the code of a function follows its header, and the top-level code has all
+  // registers and no spill slots unless it starts with a header
+  int spill_slots = 0;
+  int registers = num_regs;
+  for(int pc = 0; pc < v->program_length; ++pc) {
+    vm_instruction instr = v->program[pc];
+    int i = get_arg_i(instr);
+
+    if(last_register(instr) >= registers) {
+      reject("Register %i at %i is outside of the frame (%i registers)", last_register(instr), pc, registers);
+    }
+
+    switch(get_opcode(instr)) {
+      case OP_LOAD_cs:
+        if(!verify_constant(v, make_tagged_val(i, vm_tag_compound_symbol))) {
+          reject("Invalid compound symbol at %i (address %i)", pc, i);
+        }
+        break;
+
+      case OP_LOAD_os:
+        if(!verify_constant(v, make_tagged_val(i, vm_tag_opaque_symbol))) {
+          reject("Invalid opaque symbol at %i (address %i)", pc, i);
+        }
+        break;
+
+      case OP_LOAD_str:
+        if(!verify_constant(v, make_tagged_val(i, vm_tag_string))) {
+          reject("Invalid string at %i (address %i)", pc, i);
+        }
+        break;
+
+      case OP_LOAD_f:
+        if(!is_function_address(v, i)) {
+          reject("Invalid function address at %i: %i", pc, i);
+        }
+        break;
+
+      case OP_JMP:
+      case OP_JMP_TRUE: {
+        int target = pc + 1 + ((int) i - int_bias);
+        if(target < 0 || target > v->program_length) {
+          reject("Invalid jump target at %i: %i", pc, target);
+        }
+      }
+      break;
+
+      case OP_JMP_LT:
+      case OP_JMP_GT:
+      case OP_JMP_EQ: {
+        int target = pc + 1 + ((int) get_arg_small_i(instr) - small_int_bias);
+        if(target < 0 || target > v->program_length) {
+          reject("Invalid jump target at %i: %i", pc, target);
+        }
+      }
+      break;
+
+      case OP_JMP_MATCH: {
+        if(!verify_match_table(v, i)) {
+          reject("Invalid match data at %i (address %i)", pc, i);
+        }
+        // there is no register for captures
+        int number_of_patterns = from_match_value(v->const_table[i]);
+        for(int p = 0; p < number_of_patterns; ++p) {
+          vm_value pattern = v->const_table[i + 1 + p];
+          if(get_tag(pattern) != vm_tag_number && get_tag(pattern) != vm_tag_plain_symbol) {
+            reject("Pattern with captures in jmp_match at %i", pc);
+          }
+        }
+        if(pc + number_of_patterns > v->program_length) {
+          reject("Match jump table at %i is outside of the program", pc);
+        }
+      }
+      break;
+
+      case OP_MATCH:
+      case OP_MATCH_SWITCH: {
+        if(pc == 0) {
+          break;
+        }
+        vm_instruction previous = v->program[pc - 1];
+        if(get_opcode(previous) != OP_LOAD_i || get_arg_r0(previous) != get_arg_r1(instr)) {
+          break;
+        }
+        // like all number immediates, the address is biased
+        vm_value address = (vm_value) ((int64_t) get_arg_i(previous) - int_bias);
+        bool is_valid = get_opcode(instr) == OP_MATCH ? verify_match_data(v, address)
+                                                      : verify_match_table(v, address);
+        if(!is_valid) {
+          reject("Invalid match data at %i (address %lld)", pc, (long long) address);
+        }
+        // The match jumps over one instruction per pattern it didn't match
+        int number_of_patterns = from_match_value(v->const_table[address]);
+        if(pc + number_of_patterns > v->program_length) {
+          reject("Match jump table at %i is outside of the program", pc);
+        }
+      }
+      break;
+
+      case FUN_HEADER:
+        if(get_fun_arity(instr) > num_regs) {
+          reject("Invalid function arity at %i: %i", pc, get_fun_arity(instr));
+        }
+        // the arguments are in the callee's frame
+        if(get_fun_arity(instr) > get_fun_frame_size(instr)) {
+          reject("Frame size at %i is smaller than the arity: %i", pc, get_fun_frame_size(instr));
+        }
+        spill_slots = get_fun_spill_slots(instr);
+        // the spill slots come after the registers
+        registers = get_fun_frame_size(instr) < num_regs ? get_fun_frame_size(instr) : num_regs;
+        break;
+
+      case OP_SPILL:
+      case OP_RELOAD:
+        if(i >= spill_slots) {
+          reject("Invalid spill slot at %i: %i", pc, i);
+        }
+        break;
+
+      case OP_RET:
+      case OP_LOAD_i:
+      case OP_LOAD_ps:
+      case OP_ADD:
+      case OP_SUB:
+      case OP_MUL:
+      case OP_DIV:
+      case OP_MOVE:
+      case OP_AP:
+      case OP_GEN_AP:
+      case OP_TAIL_AP:
+      case OP_TAIL_GEN_AP:
+      case OP_PART_AP:
+      case OP_SET_CL_VAL:
+      case OP_EQ:
+      case OP_COPY_SYM:
+      case OP_SET_SYM_FIELD:
+      case OP_STR_LEN:
+      case OP_NEW_STR:
+      case OP_GET_CHAR:
+      case OP_PUT_CHAR:
+      case OP_LT:
+      case OP_GT:
+      case OP_OR:
+      case OP_AND:
+      case OP_NOT:
+      case OP_GET_FIELD:
+      case OP_CONVERT:
+      case OP_STR_CONCAT:
+      case OP_STR_CMP:
+      case OP_STR_FIND:
+      case OP_ADD_i:
+      case OP_SUB_i:
+      case OP_RET_i:
+      case OP_RET_ps:
+      case OP_MAP_NEW:
+      case OP_MAP_GET:
+      case OP_MAP_PUT:
+      case OP_MAP_DEL:
+      case OP_MAP_SIZE:
+      case OP_ARRAY_NEW:
+      case OP_ARRAY_GET:
+      case OP_ARRAY_SET:
+      case OP_ARRAY_LEN:
+        break;
+
+      case OP_SUB_STR:
+      case OP_ARRAY_SLICE:
+      case OP_MAP_ENTRY:
+        break;
+
+      case OP_SET_ARG:
+        // copies the registers r1 .. r1 + r2 (checked above) to the arguments
+        // r0 .. r0 + r2 of the next frame
+        if(get_arg_r0(instr) + get_arg_r2(instr) >= num_regs) {
+          reject("Invalid registers for the arguments at %i", pc);
+        }
+        break;
+
+      default:
+        reject("Unknown opcode at %i: %i", pc, get_opcode(instr));
+    }
+  }
+
+  return true;
+}
+
+
+void verifier_free(verifier_state *v) {
+  free(v->verified);
+  free(v->work_list);
+  memset(v, 0, sizeof(verifier_state));
+}
@@ -0,0 +1,42 @@
+#ifndef _INCLUDE_VERIFIER_H
+#define _INCLUDE_VERIFIER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "vm.h"
+
+// Every vm instance has its own verifier state, because OP_MATCH keeps using it
+// after the program has been verified
+typedef struct {
+  vm_instruction *program;
+  int program_length;
+  vm_value *const_table;
+  int const_table_length;
+
+  // One entry per constant table address, with flags for what has been verified
+  uint8_t *verified;
+  int verified_capacity;
+
+  vm_value *work_list;
+  size_t work_list_size;
+  size_t work_list_capacity;
+} verifier_state;
+
+// Checks a program and its constant table once before it is run. If the program is
+// malformed, this returns false and writes a description of the problem to `error`.
+bool verify_program(verifier_state *v, vm_instruction *program, int program_length,
+                    vm_value *const_table, int const_table_length,
+                    char *error, size_t error_size);
+
+// Match data is only referenced through registers, so OP_MATCH has to make sure
+// that it has been verified (this is cheap for match data that has already been
+// checked). Can only be used after verify_program.
+bool verify_match_data(verifier_state *v, vm_value address);
+
+// OP_MATCH_SWITCH additionally needs the match table after the patterns
+bool verify_match_table(verifier_state *v, vm_value address);
+
+void verifier_free(verifier_state *v);
+
+#endif
@@ -3,45 +3,168 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <limits.h>
 #include "vm_internal.h"
 #include "opcodes.h"
 #include "heap.h"
 #include "gc.h"
 #include "io.h"
+#include "scheduler.h"
+#include "verifier.h"
+#include "image.h"
+#include "map.h"
+#include "array.h"
+#include "profiler.h"
+#include "jit.h"
 #include "defs.h"
 #include "encoding.h"
 
 /*
 
-TODO use computed Goto
+Dispatch
+~~~~~~~~
 
-*/
+Before a program is run, it is decoded into an array of decoded_instruction, so
+that the interpreter loop doesn't have to mask and shift every instruction to get
+at its arguments. The decoded program has an additional OP_HALT instruction at the
+end, which means we don't have to check the program pointer on every step.
+
+By default we use direct threading with computed gotos (a GCC extension, which
+clang supports too): Every opcode handler jumps directly to the handler of the next
+instruction. With VM_SWITCH_DISPATCH (`make DISPATCH=switch`), or with compilers
+that don't support computed gotos, every handler jumps back to a switch statement
+instead.
+
+A profiling instance (see profiler.c) runs every instruction through
+profile_instruction first. With computed gotos it uses a second dispatch table,
+whose entries all lead there, so the handlers don't have to check whether the
+instance is profiling.
+
+The jit (see jit.c) replaces instructions in the decoded program with two more
+opcodes: OP_COUNT_CALL counts the calls of a function, and OP_ENTER_JIT runs
+compiled code. Both need the original instruction now and then, which is decoded
+again from its `instr` field (see run_original).
 
+*/
 
-//TODO do this once instead of all the time
+#if !defined(__GNUC__) && !defined(VM_SWITCH_DISPATCH)
+#define VM_SWITCH_DISPATCH
+#endif
+
+// Not part of the instruction set, only used to mark the end of the decoded program
+#define OP_HALT 64
+// Only used by the jit, which puts them into the decoded program
+#define OP_COUNT_CALL 65
+#define OP_ENTER_JIT 66
+#define num_dispatch_targets (OP_ENTER_JIT + 1)
+
+typedef struct {
+  uint8_t opcode;
+  uint8_t r0;
+  uint8_t r1;
+  uint8_t r2;
+  vm_value i;
+  vm_instruction instr; // the original instruction, for code that decodes it by itself
+} decoded_instruction;
+
+#define fetch_instruction() \
+  decoded = &decoded_program[state->program_pointer]; \
+  instr = decoded->instr; \
+  ++state->program_pointer;
+
+// Jumps relative to the next instruction
+#ifdef VM_DEBUG_CHECKS
+#define jump_by(offset) { \
+    state->program_pointer += (offset); \
+    if(state->program_pointer < 0 || state->program_pointer > program_length) { \
+      panic_stop_vm_m("Illegal address: %i", state->program_pointer); } }
+#else
+#define jump_by(offset) { state->program_pointer += (offset); }
+#endif
+
+#ifdef VM_SWITCH_DISPATCH
+  #define vm_case(op) case op
+  #define vm_default default
+  #define dispatch() break
+#else
+  #define vm_case(op) case op: label_##op
+  #define vm_default default: label_unknown_opcode
+  #define dispatch() { fetch_instruction(); goto *handlers[decoded->opcode]; }
+#endif
+
+
+// Programs are checked by the verifier before they are run (see verifier.c), so
+// these checks are only needed for debugging the vm itself (`make CHECKS=debug`)
+#ifdef VM_DEBUG_CHECKS
 #define check_ctable_index(x) if( (x) >= state->const_table_length || (x) < 0) { \
-    printf("Ctable index out of bounds: %i at %i\n", (x), __LINE__ ); \
+    printf("Ctable index out of bounds: %lld at %i\n", (long long) (x), __LINE__ ); \
     return false; }
 
 #define check_reg(i) { int r = (i); if(r >= num_regs) { fprintf(stderr, "Illegal register: %i", r); panic_stop_vm(); }}
+#else
+#define check_ctable_index(x)
+#define check_reg(i)
+#endif
 #define get_reg(i) state->stack[state->stack_pointer].reg[(i)]
 
-static int invocation = 0;
+// Arithmetic is done on shifted numbers (see encoding.h), so that a single overflow
+// check on the 64 bit result tells us whether the number fits into 60 bits.
+#if defined(__GNUC__)
+#define shifted_add_overflow(a, b, result) __builtin_add_overflow(a, b, result)
+#define shifted_sub_overflow(a, b, result) __builtin_sub_overflow(a, b, result)
+#define shifted_mul_overflow(a, b, result) __builtin_mul_overflow(a, b, result)
+#else
+static bool shifted_add_overflow(int64_t a, int64_t b, int64_t *result) {
+  if((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b)) {
+    return true;
+  }
+  *result = a + b;
+  return false;
+}
+
+static bool shifted_sub_overflow(int64_t a, int64_t b, int64_t *result) {
+  if((b < 0 && a > INT64_MAX + b) || (b > 0 && a < INT64_MIN + b)) {
+    return true;
+  }
+  *result = a - b;
+  return false;
+}
+
+static bool shifted_mul_overflow(int64_t a, int64_t b, int64_t *result) {
+  int64_t product = (int64_t) ((uint64_t) a * (uint64_t) b);
+  if((a == -1 && b == INT64_MIN) || (b == -1 && a == INT64_MIN) || (b != 0 && product / b != a)) {
+    return true;
+  }
+  *result = product;
+  return false;
+}
+#endif
 
 const int char_per_string_chunk = sizeof(vm_value) / sizeof(char);
 
 const vm_value vm_failure_result = make_tagged_val(symbol_id_false, vm_tag_plain_symbol);
-vm_value make_str_error(const char *format, ...);
+vm_value make_str_error(vm_state *state, const char *format, ...);
 #define panic_stop_vm() { return vm_failure_result; }
-#define panic_stop_vm_m(format, ...) { vm_value e = make_str_error(format, ## __VA_ARGS__); return e; }
+#define panic_stop_vm_m(format, ...) { vm_value e = make_str_error(state, format, ## __VA_ARGS__); return e; }
 
 // TODO we don't know if get_reg(get_arg_r0(instr)) is actually the return address!!!
-#define fail(format, ...) { vm_value e = make_str_error(format, ## __VA_ARGS__); fprintf(stderr, format "\n", ## __VA_ARGS__); get_reg(get_arg_r0(instr)) = e; break; }
+#define fail(format, ...) { vm_value e = make_str_error(state, format, ## __VA_ARGS__); fprintf(stderr, format "\n", ## __VA_ARGS__); get_reg(get_arg_r0(instr)) = e; break; }
+
+#define check_stack_space() if(!has_room_for_frame(state)) { \
+    panic_stop_vm_m("Stack overflow: more than %zu frames", state->max_stack_size); }
 
-#define throw(format, ...) { vm_value e = make_str_error(format, ## __VA_ARGS__); get_reg(get_arg_r0(instr)) = e; goto op_ret; }
+// The verifier checks spill slots against the function they're in, but a jump could
+// still end up in code of a function with fewer spill slots
+#define check_spill_slot(slot) if(num_regs + (int) (slot) >= current_frame.frame_size) { \
+    panic_stop_vm_m("Invalid spill slot: %i", (int) (slot)); }
 
+// Green threads are preempted after a number of calls and returns (see scheduler.c)
+#define count_time_slice() if(--state->scheduler.time_slice <= 0) { scheduler_yield(state); }
 
-char *value_to_type_string(vm_value value) {
+#define throw(format, ...) { vm_value e = make_str_error(state, format, ## __VA_ARGS__); get_reg(get_arg_r0(instr)) = e; goto op_ret; }
+
+
+char *value_to_type_string(vm_state *state, vm_value value) {
 
   switch(get_tag(value)) {
 
@@ -53,7 +176,7 @@ char *value_to_type_string(vm_value value) {
       return "symbol";
 
     case vm_tag_dynamic_compound_symbol: {
-      vm_value *sym_p = heap_get_pointer(get_val(value));
+      vm_value *sym_p = heap_get_pointer(state, get_val(value));
       if(compound_symbol_id(*sym_p) == symbol_id_error) {
         return "error";
       }
@@ -66,8 +189,15 @@ char *value_to_type_string(vm_value value) {
 
     case vm_tag_string:
     case vm_tag_dynamic_string:
+    case vm_tag_rope:
       return "string";
 
+    case vm_tag_map:
+      return "dict";
+
+    case vm_tag_array:
+      return "array";
+
     case vm_tag_match_data:
       return "match pattern";
 
@@ -78,48 +208,191 @@ char *value_to_type_string(vm_value value) {
   return "";
 }
 
-// TODO turn into macro, also use it for new_str opcode
-static heap_address new_empty_string(size_t length) {
-
+static size_t string_chunks_for_length(size_t length) {
   size_t adjusted_length = length + 1; // allow space for trailing '\0'
-  int num_chunks = adjusted_length / char_per_string_chunk;
-  if( (adjusted_length % char_per_string_chunk) != 0 ) {
-    num_chunks += char_per_string_chunk - (adjusted_length % char_per_string_chunk);
-  }
+  return (adjusted_length + char_per_string_chunk - 1) / char_per_string_chunk;
+}
+
+// Allocates a string of the given length, filled with '\0'. Can trigger a garbage
+// collection.
+static heap_address new_empty_string(vm_state *state, size_t length) {
 
+  size_t num_chunks = string_chunks_for_length(length);
   size_t total_size = string_header_size + num_chunks;
-  heap_address string_address = heap_alloc(total_size);
-  vm_value *str_pointer = heap_get_pointer(string_address);
+  heap_address string_address = heap_alloc(state, total_size);
+  vm_value *str_pointer = heap_get_pointer(state, string_address);
 
   memset(str_pointer, 0, total_size * sizeof(vm_value));
-  *str_pointer = string_header(length, num_chunks);
+  *str_pointer = string_header(length, 0);
 
   return string_address;
 }
 
-vm_value new_heap_string(char *content) {
+vm_value new_heap_string(vm_state *state, char *content) {
 
-  heap_address string_address = new_empty_string(strlen(content));
-  vm_value *str_pointer = heap_get_pointer(string_address);
+  heap_address string_address = new_empty_string(state, strlen(content));
+  vm_value *str_pointer = heap_get_pointer(state, string_address);
   char *str_start = (char *)(str_pointer + string_header_size);
   strcpy(str_start, content);
   return make_tagged_val(string_address, vm_tag_dynamic_string);
 
 }
 
+#define is_string(v) (get_tag(v) == vm_tag_string || get_tag(v) == vm_tag_dynamic_string || get_tag(v) == vm_tag_rope)
+#define string_chars(str_pointer) ((char *) ((str_pointer) + string_header_size))
+
+// Returns a pointer to the header of a constant or dynamic string, or of a rope
+static vm_value *get_string_pointer(vm_state *state, vm_value string_value) {
+  heap_address addr = get_val(string_value);
+  if(get_tag(string_value) == vm_tag_string) {
+    return state->const_table + addr;
+  }
+  return heap_get_pointer(state, addr);
+}
+
+
+/*
+
+Ropes
+~~~~~
+
+Concatenating two long strings doesn't copy them, but creates a rope, which only
+points to both parts. This way, building a long string by appending to it is linear
+instead of quadratic. The characters of a rope are only copied into a flat string
+when somebody needs them in one piece (e.g. OP_GET_CHAR or print_ln). The flat string
+is then stored in the rope, so every rope is flattened at most once.
+
+Ropes that are built by appending lean to the left, so they can be very deep.
+Flattening therefore uses an explicit stack instead of recursion.
+
+*/
+
+// Returns the number of words needed to flatten the string, which is 0 for flat strings
+// and for ropes that have been flattened before.
+size_t string_flatten_size(vm_state *state, vm_value string_value) {
+  if(get_tag(string_value) != vm_tag_rope) {
+    return 0;
+  }
+  vm_value *rope_pointer = get_string_pointer(state, string_value);
+  if(rope_is_flat(rope_pointer)) {
+    return 0;
+  }
+  return string_header_size + string_chunks_for_length(string_length(*rope_pointer));
+}
+
+// Returns the flat version of a rope. The caller has to make sure that this doesn't
+// trigger a garbage collection (see string_flatten_size).
+static vm_value flatten_rope(vm_state *state, vm_value rope) {
+  vm_value *rope_pointer = get_string_pointer(state, rope);
+  if(rope_is_flat(rope_pointer)) {
+    return rope_pointer[1];
+  }
+
+  size_t end = string_length(*rope_pointer);
+  heap_address string_address = new_empty_string(state, end);
+  char *chars = string_chars(heap_get_pointer(state, string_address));
+
+  // We copy the parts from right to left, so ropes that lean to the left only need a
+  // small stack
+  size_t capacity = 16;
+  size_t count = 0;
+  vm_value *pending = malloc(capacity * sizeof(vm_value));
+  if(pending == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    exit(-1);
+  }
+  pending[count++] = rope;
+
+  while(count > 0) {
+    vm_value part = pending[--count];
+    vm_value *part_pointer = get_string_pointer(state, part);
+
+    if(get_tag(part) == vm_tag_rope) {
+      if(rope_is_flat(part_pointer)) {
+        part_pointer = get_string_pointer(state, part_pointer[1]);
+      }
+      else {
+        if(count + 2 > capacity) {
+          capacity *= 2;
+          vm_value *resized = realloc(pending, capacity * sizeof(vm_value));
+          if(resized == NULL) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(-1);
+          }
+          pending = resized;
+        }
+        pending[count++] = part_pointer[1];
+        pending[count++] = part_pointer[2];
+        continue;
+      }
+    }
+
+    size_t part_length = string_length(*part_pointer);
+    end -= part_length;
+    memcpy(chars + end, string_chars(part_pointer), part_length);
+  }
+  free(pending);
+
+  vm_value flat = make_tagged_val(string_address, vm_tag_dynamic_string);
+  rope_pointer[1] = flat;
+  rope_pointer[2] = make_tagged_val(symbol_id_nil, vm_tag_plain_symbol);
+  heap_write_barrier(state, get_val(rope), flat);
+  return flat;
+}
+
+// Replaces a rope in a register with a flat string. Can trigger a garbage collection.
+static void flatten_string_reg(vm_state *state, int reg) {
+  if(get_tag(get_reg(reg)) != vm_tag_rope) {
+    return;
+  }
+  heap_reserve(state, string_flatten_size(state, get_reg(reg)));
+  get_reg(reg) = flatten_rope(state, get_reg(reg));
+}
+
+// Returns the index of the first occurrence of `needle` in `haystack`, or -1. memchr
+// and memcmp are vectorized in most C libraries, so we let them do the scanning.
+static int64_t find_in_string(const char *haystack, size_t haystack_length,
+                              const char *needle, size_t needle_length) {
+  if(needle_length == 0) {
+    return 0;
+  }
+  if(needle_length > haystack_length) {
+    return -1;
+  }
+
+  const char *start = haystack;
+  const char *last_start = haystack + (haystack_length - needle_length);
+  while(start <= last_start) {
+    start = memchr(start, needle[0], (size_t) (last_start - start) + 1);
+    if(start == NULL) {
+      return -1;
+    }
+    if(memcmp(start, needle, needle_length) == 0) {
+      return start - haystack;
+    }
+    ++start;
+  }
+  return -1;
+}
+
+// Ropes are flattened, so callers have to reserve string_flatten_size words on the heap
+// before calling this.
 char *read_string(vm_state *state, vm_value string_value) {
 
-  if(get_tag(string_value) != vm_tag_dynamic_string
-      && get_tag(string_value) != vm_tag_string) {
-    fprintf(stderr, "Expected a string, but got %s", value_to_type_string(string_value));
+  if(!is_string(string_value)) {
+    fprintf(stderr, "Expected a string, but got %s", value_to_type_string(state, string_value));
     return NULL;
   }
 
-  int str_addr = get_val(string_value);
+  if(get_tag(string_value) == vm_tag_rope) {
+    string_value = flatten_rope(state, string_value);
+  }
+
+  heap_address str_addr = get_val(string_value);
 
   vm_value *str_p;
   if(get_tag(string_value) ==vm_tag_dynamic_string) {
-    str_p = heap_get_pointer(str_addr);
+    str_p = heap_get_pointer(state, str_addr);
   }
   else {
     str_p = state->const_table + str_addr;
@@ -131,7 +404,7 @@ char *read_string(vm_state *state, vm_value string_value) {
 
 
 
-vm_value make_str_error(const char *format, ...) {
+vm_value make_str_error(vm_state *state, const char *format, ...) {
   const int buffer_size = 512;
   char message[buffer_size];
   va_list argptr;
@@ -139,11 +412,15 @@ vm_value make_str_error(const char *format, ...) {
   vsnprintf(message, buffer_size, format, argptr);
   va_end(argptr);
 
-  vm_value heap_str = new_heap_string(message);
-
+  // The string value is not stored in a register, so we have to make sure that
+  // allocating the symbol can't trigger a garbage collection
   size_t total_size = compound_symbol_header_size + 2;
-  heap_address dyn_sym_address = heap_alloc(total_size);
-  vm_value *sym_pointer = heap_get_pointer(dyn_sym_address);
+  size_t str_size = string_header_size + string_chunks_for_length(strlen(message));
+  heap_reserve(state, str_size + total_size);
+
+  vm_value heap_str = new_heap_string(state, message);
+  heap_address dyn_sym_address = heap_alloc(state, total_size);
+  vm_value *sym_pointer = heap_get_pointer(state, dyn_sym_address);
   sym_pointer[0] = compound_symbol_header(symbol_id_error, 2);
   sym_pointer[1] = make_tagged_val(symbol_id_runtime_error, vm_tag_plain_symbol);
   sym_pointer[2] = heap_str;
@@ -158,23 +435,24 @@ vm_value convert_to_number(vm_state *state, vm_value source) {
   switch(source_tag) {
 
     case vm_tag_string:
-    case vm_tag_dynamic_string: {
+    case vm_tag_dynamic_string:
+    case vm_tag_rope: {
       char *str = read_string(state, source);
-      int num = atoi(str) + int_bias;
-      if(num < min_biased_int) {
-        result = make_str_error("Integer underflow");
+      long long num = strtoll(str, NULL, 10);
+      if(num < min_number) {
+        result = make_str_error(state, "Integer underflow");
       }
-      else if(num > max_biased_int) {
-        result = make_str_error("Integer overflow");
+      else if(num > max_number) {
+        result = make_str_error(state, "Integer overflow");
       }
       else {
-        result = make_tagged_val(num, vm_tag_number);
+        result = make_number(num);
       }
     }
     break;
 
     default:
-      result = make_str_error("Unable to convert %s to number", value_to_type_string(source));
+      result = make_str_error(state, "Unable to convert %s to number", value_to_type_string(state, source));
   }
 
   return result;
@@ -191,19 +469,20 @@ vm_value convert_to_string(vm_state *state, vm_value source) {
   switch(source_tag) {
 
     case vm_tag_number: {
-      int source_int = get_val(source) - int_bias;
-      int status = snprintf(buffer, buffer_size, "%d", source_int);
+      long long source_int = get_number(source);
+      int status = snprintf(buffer, buffer_size, "%lld", source_int);
       if(status < 0) {
-        result = make_str_error("Conversion error");
+        result = make_str_error(state, "Conversion error");
       }
       else {
-        result = new_heap_string(buffer);
+        result = new_heap_string(state, buffer);
       }
     }
     break;
 
     case vm_tag_dynamic_string:
-    case vm_tag_string: {
+    case vm_tag_string:
+    case vm_tag_rope: {
       result = source;
     }
     break;
@@ -214,21 +493,23 @@ vm_value convert_to_string(vm_state *state, vm_value source) {
     case vm_tag_compound_symbol:
     case vm_tag_dynamic_compound_symbol:
     case vm_tag_pap:
-    case vm_tag_function: {
-      char *type = value_to_type_string(source);
+    case vm_tag_function:
+    case vm_tag_map:
+    case vm_tag_array: {
+      char *type = value_to_type_string(state, source);
       int status = snprintf(buffer, buffer_size, "<%s>", type);
       if(status < 0) {
-        result = make_str_error("Conversion error");
+        result = make_str_error(state, "Conversion error");
       }
       else {
-        result = new_heap_string(buffer);
+        result = new_heap_string(state, buffer);
       }
     }
     break;
 
 
     default:
-      result = make_str_error("Unable to convert %s to string", value_to_type_string(source));
+      result = make_str_error(state, "Unable to convert %s to string", value_to_type_string(state, source));
   }
 
 
@@ -237,12 +518,52 @@ vm_value convert_to_string(vm_state *state, vm_value source) {
 
 
 
+// Grows the register file to at least `count` registers. The register file is
+// moved, so the windows of all frames up to `last_frame` are adjusted.
+static bool grow_registers(vm_state *state, size_t count, int last_frame) {
+  size_t capacity = state->registers_capacity * 2 > count ? state->registers_capacity * 2 : count;
+  // the old buffer is invalid after realloc, so we only keep its address
+  uintptr_t old_registers = (uintptr_t) state->registers;
+  vm_value *registers = realloc(state->registers, capacity * sizeof(vm_value));
+  if(registers == NULL) {
+    return false;
+  }
+  memset(registers + state->registers_capacity, 0, (capacity - state->registers_capacity) * sizeof(vm_value));
+  for(int i = 0; i <= last_frame; ++i) {
+    state->stack[i].reg = registers + ((uintptr_t) state->stack[i].reg - old_registers) / sizeof(vm_value);
+  }
+  state->registers = registers;
+  state->registers_capacity = capacity;
+  return true;
+}
+
+
+// Resizes the window of a frame for a new function, and moves the window of the next
+// frame accordingly. Only the registers of the caller and the arguments have to
+// stay where they are, everything else in the window is garbage.
+static void set_frame_size(vm_state *state, stack_frame *frame, int frame_size) {
+  frame->frame_size = frame_size;
+  stack_frame *next = frame + 1;
+  next->reg = frame->reg + frame_size;
+  // OP_SET_ARG can write up to num_regs arguments into the next window
+  size_t used = (next->reg - state->registers) + num_regs;
+  if(used > state->registers_used) {
+    // only frames with spill slots are larger than num_regs
+    if(used > state->registers_capacity && !grow_registers(state, used, (int) (next - state->stack))) {
+      fprintf(stderr, "Out of memory!\n");
+      exit(-1);
+    }
+    state->registers_used = used;
+  }
+}
+
+
 #define do_call(frame, fun_reg, instr)         \
   int return_pointer;                 \
   bool call_failed = false;              \
   {                                   \
     check_reg(fun_reg); \
-    int fun = get_reg(fun_reg);     \
+    vm_value fun = get_reg(fun_reg);     \
     if(get_tag(fun) != vm_tag_function) { \
       fprintf(stderr, "expected a function (do call)\n"); \
       call_failed = true;                \
@@ -250,22 +571,25 @@ vm_value convert_to_string(vm_state *state, vm_value source) {
     else {                            \
       int fun_address = get_val(fun); \
       if(frame != &next_frame) { \
+        /* the windows might overlap if the frame is smaller than the arguments */ \
         int num_args = get_arg_r2(instr); \
-        memcpy(frame->reg, next_frame.reg, num_args * sizeof(vm_value)); \
+        memmove(frame->reg, next_frame.reg, num_args * sizeof(vm_value)); \
       } \
+      set_frame_size(state, frame, get_fun_frame_size(program[fun_address])); \
       return_pointer = state->program_pointer; \
       state->program_pointer = fun_address + fun_header_size; \
     } \
   }
 
 
-// TODO it could be that fun_address is not valid anymore after doing heap_alloc
+// Note: heap_alloc can trigger a garbage collection. fun_address is a code address and
+// stays valid, but callers must not use heap pointers they obtained earlier.
 #define build_pap(num_pap_args, pap_arity, offset, num_args, fun_address) \
 vm_value pap_value; \
 vm_value *pap_pointer; \
 { \
-  heap_address pap_address = heap_alloc(num_pap_args + pap_header_size ); \
-  pap_pointer = heap_get_pointer(pap_address);  \
+  heap_address pap_address = heap_alloc(state, num_pap_args + pap_header_size ); \
+  pap_pointer = heap_get_pointer(state, pap_address);  \
   *pap_pointer = pap_header(pap_arity, num_pap_args); /* write header */ \
   *(pap_pointer + 1) = fun_address; \
   memcpy(pap_pointer + pap_header_size + offset, next_frame.reg, num_args * sizeof(vm_value)); \
@@ -277,8 +601,8 @@ vm_value *pap_pointer; \
 { \
   int num_remaining_args = num_args - arity; \
   /* store remaining args */ \
-  heap_address addr = heap_alloc(num_args + 1); \
-  vm_value *arg_pointer = heap_get_pointer(addr); \
+  heap_address addr = heap_alloc(state, num_remaining_args + 1); \
+  vm_value *arg_pointer = heap_get_pointer(state, addr); \
   /* fake symbol to hold our spilled args */ \
   *arg_pointer = compound_symbol_header(0, num_remaining_args); \
   memcpy(arg_pointer + 1, &(next_frame.reg[arity]), num_remaining_args * sizeof(vm_value)); \
@@ -319,7 +643,7 @@ int do_gen_ap(vm_state *state, stack_frame *frame, vm_value instr, vm_instructio
 
   // Check whether we are currently applying an oversaturated call
   if(current_frame.spilled_arguments != 0) {
-    vm_value *addr = heap_get_pointer(current_frame.spilled_arguments);
+    vm_value *addr = heap_get_pointer(state, current_frame.spilled_arguments);
     num_args = compound_symbol_count(*addr);
     memcpy(next_frame.reg, addr + 1, num_args * sizeof(vm_value));
 
@@ -335,8 +659,8 @@ int do_gen_ap(vm_state *state, stack_frame *frame, vm_value instr, vm_instructio
 
     heap_address cl_address = (heap_address)get_val(lambda);
 
-    vm_value *cl_pointer = heap_get_pointer(cl_address);
-    int header = *cl_pointer;
+    vm_value *cl_pointer = heap_get_pointer(state, cl_address);
+    vm_value header = *cl_pointer;
     int arity = pap_arity(header);
     int num_cl_vars = pap_var_count(header);
 
@@ -347,6 +671,7 @@ int do_gen_ap(vm_state *state, stack_frame *frame, vm_value instr, vm_instructio
 
       // do the call
       vm_value fun_address = *(cl_pointer + 1);
+      set_frame_size(state, frame, get_fun_frame_size(program[fun_address]));
       int return_pointer = state->program_pointer;
       state->program_pointer = fun_address + fun_header_size;
       return return_pointer;
@@ -363,6 +688,8 @@ int do_gen_ap(vm_state *state, stack_frame *frame, vm_value instr, vm_instructio
       int offset = num_cl_vars;
 
       build_pap(num_pap_args, pap_arity, offset, num_args, fun_address)
+      // the old closure might have been moved by the garbage collector
+      cl_pointer = heap_get_pointer(state, get_val(get_reg(lambda_reg)));
       memcpy(pap_pointer + pap_header_size, cl_pointer + pap_header_size, num_cl_vars * sizeof(vm_value));
 
       check_reg(reg0);
@@ -373,6 +700,8 @@ int do_gen_ap(vm_state *state, stack_frame *frame, vm_value instr, vm_instructio
     else { // num_args > arity
 
       prep_oversaturated_call(arity, num_args)
+      // the closure might have been moved by the garbage collector
+      cl_pointer = heap_get_pointer(state, get_val(get_reg(lambda_reg)));
 
       // set arguments
       memmove(&(next_frame.reg[num_cl_vars]), &(next_frame.reg[0]), arity * sizeof(vm_value));
@@ -380,6 +709,7 @@ int do_gen_ap(vm_state *state, stack_frame *frame, vm_value instr, vm_instructio
 
       // do the call
       vm_value fun_address = *(cl_pointer + 1);
+      set_frame_size(state, &next_frame, get_fun_frame_size(program[fun_address]));
       state->program_pointer = fun_address + fun_header_size;
 
       ++state->stack_pointer;
@@ -393,7 +723,7 @@ int do_gen_ap(vm_state *state, stack_frame *frame, vm_value instr, vm_instructio
     int fun_address = get_val(lambda);
     vm_instruction fun_header = program[fun_address];
     //TODO check fun header "opcode"
-    int arity = get_arg_i(fun_header);
+    int arity = get_fun_arity(fun_header);
 
     // saturated function application
     if (num_args == arity) {
@@ -431,7 +761,7 @@ int do_gen_ap(vm_state *state, stack_frame *frame, vm_value instr, vm_instructio
   }
 
   else {
-    fprintf(stderr, "Expected a function, but got %s \n", value_to_type_string(lambda));
+    fprintf(stderr, "Expected a function, but got %s \n", value_to_type_string(state, lambda));
     //exit(-1);
   }
 
@@ -441,97 +771,396 @@ int do_gen_ap(vm_state *state, stack_frame *frame, vm_value instr, vm_instructio
 
 
 // TODO try to do this without recursive function calls, then turn into a macro
-bool is_equal(vm_state *state, vm_value l, vm_value r) {
+/*
 
-  vm_value l_tag = get_tag(l);
+Equality
+~~~~~~~~
 
-  vm_value r_tag = get_tag(r);
+Equality is structural for numbers, symbols, strings and arrays. Functions and opaque
+symbols are never equal.
 
-  if ( (l_tag == vm_tag_compound_symbol) || (l_tag == vm_tag_dynamic_compound_symbol) ) {
+Compound symbols and arrays are compared with an explicit stack of pairs instead of
+recursion, so deeply nested data (like long lists) can't overflow the C stack. Two
+references to the same object are equal without looking at the object, and the
+headers (with the symbol id or array length, and the number of fields) are compared
+before any of the fields.
 
-    if ( (r_tag != vm_tag_compound_symbol) && (r_tag != vm_tag_dynamic_compound_symbol) ) {
-      return false;
-    }
+Strings are compared by length first and then by their hash (see encoding.h), so
+unequal strings usually don't have to be compared character by character. Constant
+strings get their hash from the compiler. The hash of a dynamic string is computed
+the first time it's needed and stored in its header. Ropes are compared part by part,
+so comparing them doesn't allocate anything and can't trigger a garbage collection.
+
+The keys of maps are hashed with value_hash, which gives equal values the same hash.
+Strings use the same hash as above. Compound symbols combine the hashes of their
+symbol id and of their fields, but only down to a fixed depth, so hashing a long list
+doesn't have to look at all of it. Arrays do the same with their first elements.
 
-    int l_addr = get_val(l);
-    int r_addr = get_val(r);
+*/
 
-    vm_value *l_pointer;
-    vm_value *r_pointer;
+// FNV-1a, cut down to the 30 bits of the string header. Has to give the same result
+// as hashString in DataEncoding.hs.
+#define fnv_offset_basis 2166136261u
 
-    if(l_tag == vm_tag_compound_symbol) {
-      l_pointer = state->const_table + l_addr;
-    }
-    else {
-      l_pointer = heap_get_pointer(l_addr);
-    }
+static uint32_t fnv_hash_chars(uint32_t hash, const char *chars, size_t length) {
+  for(size_t i = 0; i < length; ++i) {
+    hash ^= (uint8_t) chars[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
 
-    if(r_tag == vm_tag_compound_symbol) {
-      r_pointer = state->const_table + r_addr;
-    }
-    else {
-      r_pointer = heap_get_pointer(r_addr);
+static vm_value string_hash_from_fnv(uint32_t hash) {
+  hash &= low_30_bits;
+  return hash == 0 ? 1 : hash;
+}
+
+static vm_value string_hash_of(const char *chars, size_t length) {
+  return string_hash_from_fnv(fnv_hash_chars(fnv_offset_basis, chars, length));
+}
+
+// Returns 0 for constant strings without a hash, whose header we can't change
+static vm_value get_string_hash(vm_value string_value, vm_value *str_pointer) {
+  vm_value hash = string_hash(*str_pointer);
+  if(hash == 0 && get_tag(string_value) == vm_tag_dynamic_string) {
+    size_t length = string_length(*str_pointer);
+    hash = string_hash_of(string_chars(str_pointer), length);
+    *str_pointer = string_header(length, hash);
+  }
+  return hash;
+}
+
+// Returns the characters of a string from left to right, one flat part at a time
+typedef struct {
+  vm_value *pending;
+  size_t count;
+  size_t capacity;
+  const char *chars;
+  size_t remaining;
+} string_cursor;
+
+static void string_cursor_init(string_cursor *cursor, vm_value string_value) {
+  cursor->capacity = 16;
+  cursor->pending = malloc(cursor->capacity * sizeof(vm_value));
+  if(cursor->pending == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    exit(-1);
+  }
+  cursor->pending[0] = string_value;
+  cursor->count = 1;
+  cursor->chars = NULL;
+  cursor->remaining = 0;
+}
+
+// Moves the cursor to the next part that isn't empty. Returns false at the end.
+static bool string_cursor_next(vm_state *state, string_cursor *cursor) {
+  while(cursor->count > 0) {
+    vm_value part = cursor->pending[--cursor->count];
+    vm_value *part_pointer = get_string_pointer(state, part);
+
+    if(get_tag(part) == vm_tag_rope) {
+      if(rope_is_flat(part_pointer)) {
+        part_pointer = get_string_pointer(state, part_pointer[1]);
+      }
+      else {
+        if(cursor->count + 2 > cursor->capacity) {
+          cursor->capacity *= 2;
+          vm_value *resized = realloc(cursor->pending, cursor->capacity * sizeof(vm_value));
+          if(resized == NULL) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(-1);
+          }
+          cursor->pending = resized;
+        }
+        // the left part comes first
+        cursor->pending[cursor->count++] = part_pointer[2];
+        cursor->pending[cursor->count++] = part_pointer[1];
+        continue;
+      }
     }
 
-    vm_value l_header = *l_pointer;
-    vm_value r_header = *r_pointer;
+    size_t length = string_length(*part_pointer);
+    if(length > 0) {
+      cursor->chars = string_chars(part_pointer);
+      cursor->remaining = length;
+      return true;
+    }
+  }
+  return false;
+}
 
+static bool is_equal_rope(vm_state *state, vm_value l, vm_value r) {
+  string_cursor l_cursor;
+  string_cursor r_cursor;
+  string_cursor_init(&l_cursor, l);
+  string_cursor_init(&r_cursor, r);
 
-    int count = compound_symbol_count(l_header);
-    if( (compound_symbol_id(l_header) != compound_symbol_id(r_header))
-        || (count != compound_symbol_count(r_header)) ) {
-      return false;
+  // both strings have the same length, so they end at the same time
+  bool equal = true;
+  while(equal) {
+    if(l_cursor.remaining == 0 && !string_cursor_next(state, &l_cursor)) {
+      break;
+    }
+    if(r_cursor.remaining == 0 && !string_cursor_next(state, &r_cursor)) {
+      break;
     }
+    size_t length = l_cursor.remaining < r_cursor.remaining ? l_cursor.remaining : r_cursor.remaining;
+    equal = memcmp(l_cursor.chars, r_cursor.chars, length) == 0;
+    l_cursor.chars += length;
+    l_cursor.remaining -= length;
+    r_cursor.chars += length;
+    r_cursor.remaining -= length;
+  }
 
-    for(int i = compound_symbol_header_size; i < compound_symbol_header_size + count; ++i) {
-      if(! is_equal(state, l_pointer[i], r_pointer[i])) {
-        return false;
-      }
+  free(l_cursor.pending);
+  free(r_cursor.pending);
+  return equal;
+}
+
+// A rope that has been flattened before is compared as its flat string
+static vm_value flat_string_if_possible(vm_state *state, vm_value string_value) {
+  if(get_tag(string_value) == vm_tag_rope) {
+    vm_value *rope_pointer = get_string_pointer(state, string_value);
+    if(rope_is_flat(rope_pointer)) {
+      return rope_pointer[1];
     }
+  }
+  return string_value;
+}
 
+static bool is_equal_string(vm_state *state, vm_value l, vm_value r) {
+  l = flat_string_if_possible(state, l);
+  r = flat_string_if_possible(state, r);
+  if(l == r) {
     return true;
   }
 
-  if(l_tag == vm_tag_string && r_tag == vm_tag_string) {
+  vm_value *l_pointer = get_string_pointer(state, l);
+  vm_value *r_pointer = get_string_pointer(state, r);
+  size_t length = string_length(*l_pointer);
+  if(length != string_length(*r_pointer)) {
+    return false;
+  }
+
+  if(get_tag(l) == vm_tag_rope || get_tag(r) == vm_tag_rope) {
+    return is_equal_rope(state, l, r);
+  }
+
+  vm_value l_hash = get_string_hash(l, l_pointer);
+  vm_value r_hash = get_string_hash(r, r_pointer);
+  if(l_hash != 0 && r_hash != 0 && l_hash != r_hash) {
+    return false;
+  }
+  return memcmp(string_chars(l_pointer), string_chars(r_pointer), length) == 0;
+}
+
+#define is_compound_symbol(v) (get_tag(v) == vm_tag_compound_symbol || get_tag(v) == vm_tag_dynamic_compound_symbol)
+
+static vm_value *get_compound_symbol_pointer(vm_state *state, vm_value symbol) {
+  if(get_tag(symbol) == vm_tag_compound_symbol) {
+    return state->const_table + get_val(symbol);
+  }
+  return heap_get_pointer(state, get_val(symbol));
+}
+
+// Values that are equal to themselves
+static bool is_comparable(vm_value value) {
+  switch(get_tag(value)) {
+    case vm_tag_number:
+    case vm_tag_plain_symbol:
+    case vm_tag_compound_symbol:
+    case vm_tag_dynamic_compound_symbol:
+    case vm_tag_string:
+    case vm_tag_dynamic_string:
+    case vm_tag_rope:
+    case vm_tag_array:
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+// Compound symbols and arrays are equal if their headers and all of their fields are.
+// Returns the pointer to the header, or NULL for other values.
+static vm_value *get_fields_pointer(vm_state *state, vm_value value, size_t *header_size, size_t *count) {
+  if(is_compound_symbol(value)) {
+    vm_value *pointer = get_compound_symbol_pointer(state, value);
+    *header_size = compound_symbol_header_size;
+    *count = compound_symbol_count(*pointer);
+    return pointer;
+  }
+  if(get_tag(value) == vm_tag_array) {
+    vm_value *pointer = heap_get_pointer(state, get_val(value));
+    *header_size = array_header_size;
+    *count = array_count(*pointer);
+    return pointer;
+  }
+  return NULL;
+}
+
+#define has_fields(v) (is_compound_symbol(v) || get_tag(v) == vm_tag_array)
+
+typedef struct {
+  vm_value l;
+  vm_value r;
+} value_pair;
 
-    int l_addr = get_val(l);
-    int r_addr = get_val(r);
+#define equality_stack_size 32
 
-    vm_value *l_pointer = NULL;
-    vm_value *r_pointer = NULL;
+bool is_equal(vm_state *state, vm_value l, vm_value r) {
+  // most comparisons are between numbers and symbols, which don't need the stack
+  if(l == r) {
+    return is_comparable(l);
+  }
+  if(!has_fields(l) || !has_fields(r)) {
+    if(is_string(l) && is_string(r)) {
+      return is_equal_string(state, l, r);
+    }
+    return false;
+  }
+
+  value_pair local_stack[equality_stack_size];
+  value_pair *stack = local_stack;
+  size_t capacity = equality_stack_size;
+  size_t count = 0;
+  stack[count++] = (value_pair) { l, r };
 
-    if(l_tag == vm_tag_string) {
-      l_pointer = state->const_table + l_addr;
+  bool equal = true;
+  while(equal && count > 0) {
+    value_pair pair = stack[--count];
+
+    if(pair.l == pair.r) {
+      equal = is_comparable(pair.l);
+      continue;
     }
-    else {
-      l_pointer = heap_get_pointer(l_addr);
+    if(is_string(pair.l) && is_string(pair.r)) {
+      equal = is_equal_string(state, pair.l, pair.r);
+      continue;
+    }
+    size_t header_size, field_count, r_header_size, r_field_count;
+    vm_value *l_pointer = get_fields_pointer(state, pair.l, &header_size, &field_count);
+    vm_value *r_pointer = get_fields_pointer(state, pair.r, &r_header_size, &r_field_count);
+    // the headers of constant and dynamic compound symbols are the same
+    if(l_pointer == NULL || r_pointer == NULL || *l_pointer != *r_pointer) {
+      equal = false;
+      continue;
     }
 
-    if(r_tag == vm_tag_string) {
-      r_pointer = state->const_table + r_addr;
+    if(count + field_count > capacity) {
+      while(count + field_count > capacity) {
+        capacity *= 2;
+      }
+      value_pair *resized = stack == local_stack ? malloc(capacity * sizeof(value_pair))
+                                                 : realloc(stack, capacity * sizeof(value_pair));
+      if(resized == NULL) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(-1);
+      }
+      if(stack == local_stack) {
+        memcpy(resized, local_stack, count * sizeof(value_pair));
+      }
+      stack = resized;
     }
-    else {
-      r_pointer = heap_get_pointer(r_addr);
+
+    // the fields are pushed in reverse, so that the first field is compared first
+    for(size_t i = field_count; i > 0; --i) {
+      size_t index = header_size + i - 1;
+      stack[count++] = (value_pair) { l_pointer[index], r_pointer[index] };
     }
+  }
+
+  if(stack != local_stack) {
+    free(stack);
+  }
+  return equal;
+}
 
-    char *l_str_start = (char *) (l_pointer + 1);
-    char *r_str_start = (char *) (r_pointer + 1);
 
-    return strcmp(l_str_start, r_str_start) == 0;
+// The hash of a rope is stored in its header, like the hash of a dynamic string
+static vm_value string_value_hash(vm_state *state, vm_value string_value) {
+  string_value = flat_string_if_possible(state, string_value);
+  vm_value *str_pointer = get_string_pointer(state, string_value);
+  if(get_tag(string_value) != vm_tag_rope) {
+    vm_value hash = get_string_hash(string_value, str_pointer);
+    return hash != 0 ? hash : string_hash_of(string_chars(str_pointer), string_length(*str_pointer));
   }
 
-  if(l_tag != r_tag) {
-    return false;
+  if(string_hash(*str_pointer) != 0) {
+    return string_hash(*str_pointer);
+  }
+  string_cursor cursor;
+  string_cursor_init(&cursor, string_value);
+  uint32_t fnv = fnv_offset_basis;
+  while(string_cursor_next(state, &cursor)) {
+    fnv = fnv_hash_chars(fnv, cursor.chars, cursor.remaining);
   }
+  free(cursor.pending);
 
-  if (l_tag == vm_tag_plain_symbol || l_tag == vm_tag_number) {
-    if(l != r) {
-      return false;
+  vm_value hash = string_hash_from_fnv(fnv);
+  *str_pointer = make_tagged_val(get_val(rope_header(string_length(*str_pointer))) | hash, vm_tag_rope);
+  return hash;
+}
+
+static uint64_t mix_hash(uint64_t hash, uint64_t word) {
+  hash ^= word;
+  hash *= 0x100000001B3ULL;
+  return hash ^ (hash >> 29);
+}
+
+// Values deeper than this don't change the hash of a compound symbol
+#define max_hash_depth 3
+// Only the first elements of an array change its hash
+#define max_hashed_elements 16
+
+static uint64_t hash_at_depth(vm_state *state, vm_value value, int depth) {
+  switch(get_tag(value)) {
+    case vm_tag_number:
+    case vm_tag_plain_symbol:
+      return mix_hash(0, value);
+
+    case vm_tag_string:
+    case vm_tag_dynamic_string:
+    case vm_tag_rope:
+      return string_value_hash(state, value);
+
+    case vm_tag_compound_symbol:
+    case vm_tag_dynamic_compound_symbol: {
+      vm_value *symbol_pointer = get_compound_symbol_pointer(state, value);
+      vm_value header = *symbol_pointer;
+      size_t count = compound_symbol_count(header);
+      uint64_t hash = mix_hash(compound_symbol_id(header), count);
+      if(depth < max_hash_depth) {
+        for(size_t i = 0; i < count; ++i) {
+          hash = mix_hash(hash, hash_at_depth(state, symbol_pointer[compound_symbol_header_size + i], depth + 1));
+        }
+      }
+      return hash;
     }
-    return true;
+
+    // equal arrays start with the same elements, so the rest can be left out
+    case vm_tag_array: {
+      vm_value *array_pointer = heap_get_pointer(state, get_val(value));
+      size_t count = array_count(*array_pointer);
+      uint64_t hash = mix_hash(vm_tag_array, count);
+      size_t hashed = count < max_hashed_elements ? count : max_hashed_elements;
+      if(depth < max_hash_depth) {
+        for(size_t i = 0; i < hashed; ++i) {
+          hash = mix_hash(hash, hash_at_depth(state, array_pointer[array_header_size + i], depth + 1));
+        }
+      }
+      return hash;
+    }
+
+    default:
+      // functions and opaque symbols aren't equal to anything, so any hash will do
+      return get_tag(value);
   }
+}
 
-  return false;
+vm_value value_hash(vm_state *state, vm_value value) {
+  uint64_t hash = hash_at_depth(state, value, 0);
+  return (hash ^ (hash >> 30) ^ (hash >> 60)) & low_30_bits;
 }
 
 
@@ -541,14 +1170,20 @@ bool does_value_match(vm_state *state, vm_value pattern, vm_value subject, int s
 
   vm_value pattern_tag = get_tag(pattern);
 
-  //if bit 27 (NUM_REGS - 5) is set, this is a match header, otherwise it is a variable
-  bool is_match_var = !(pattern & 0x8000000);
+  // match data is either a match header or a variable (see encoding.h)
+  bool is_match_var = !is_match_header(pattern);
   if(pattern_tag == vm_tag_match_data && is_match_var) {
     //capturing match
     int relative_reg = from_match_value(pattern);
     if(relative_reg != match_wildcard_value) {
-      check_reg(start_register + relative_reg);
-      get_reg(start_register + relative_reg) = subject;
+      // the capture register depends on the instruction, so we can't verify this in
+      // advance. Registers past the frame belong to the next frame or the spill slots.
+      int capture_reg = start_register + relative_reg;
+      if(capture_reg >= num_regs || capture_reg >= state->stack[state->stack_pointer].frame_size) {
+        fprintf(stderr, "Illegal capture register: %i\n", capture_reg);
+        return false;
+      }
+      get_reg(capture_reg) = subject;
     }
     return true;
   }
@@ -583,7 +1218,7 @@ bool does_value_match(vm_state *state, vm_value pattern, vm_value subject, int s
         subject_pointer = &state->const_table[subject_address];
       }
       else {
-        subject_pointer = heap_get_pointer(subject_address);
+        subject_pointer = heap_get_pointer(state, subject_address);
       }
 
 
@@ -620,321 +1255,1142 @@ bool does_value_match(vm_state *state, vm_value pattern, vm_value subject, int s
   }
 }
 
-void reset(vm_state *state) {
-  // Invariant: spilled_arguments field in all frames must be 0 from the beginning
-  memset(state, 0x0, sizeof(vm_state));
-  gc_set_stack(state->stack, &state->stack_pointer);
-  heap_init();
-}
+// Looks up the subject in the match table that follows the patterns (see matchTable in
+// DataAssembler.hs) and returns the index of the first pattern that could match it.
+// All patterns before that index are guaranteed not to match.
+static int first_possible_match(vm_state *state, int patterns_addr, int number_of_patterns, vm_value subject) {
+  vm_value *table = &state->const_table[patterns_addr + 1 + number_of_patterns];
+  int number_of_keys = table[0];
+  int first_catch_all = table[1];
+  vm_value *entries = table + 2;
+
+  vm_value key;
+  switch(get_tag(subject)) {
+    case vm_tag_number:
+    case vm_tag_plain_symbol:
+      key = subject;
+      break;
 
+    case vm_tag_compound_symbol:
+      key = state->const_table[get_val(subject)];
+      break;
 
-vm_value vm_execute(vm_instruction *program, int program_length, vm_value *ctable, int ctable_length) {
-  ++invocation;
+    case vm_tag_dynamic_compound_symbol:
+      key = *heap_get_pointer(state, get_val(subject));
+      break;
 
-  vm_state state0;
-  vm_state *state = &state0;
-  reset(state);
+    default:
+      return first_catch_all;
+  }
 
-  state->const_table = ctable;
-  state->const_table_length = ctable_length;
+  int low = 0;
+  int high = number_of_keys - 1;
+  while(low <= high) {
+    int mid = low + (high - low) / 2;
+    vm_value mid_key = entries[2 * mid];
+    if(mid_key == key) {
+      return entries[2 * mid + 1];
+    }
+    else if(mid_key < key) {
+      low = mid + 1;
+    }
+    else {
+      high = mid - 1;
+    }
+  }
+  return first_catch_all;
+}
 
+// Module fields are sorted by their name's symbol id (see compileModule in CodeGen.hs),
+// so we can do a binary search. `fields` are (name, value) pairs and `count` is the
+// number of words.
+static vm_value *find_module_field(vm_value *fields, int count, vm_value name) {
+  int low = 0;
+  int high = count / 2 - 1;
+  while(low <= high) {
+    int mid = low + (high - low) / 2;
+    vm_value mid_name = fields[2 * mid];
+    if(mid_name == name) {
+      return &fields[2 * mid + 1];
+    }
+    else if(mid_name < name) {
+      low = mid + 1;
+    }
+    else {
+      high = mid - 1;
+    }
+  }
+  return NULL;
+}
 
-  bool is_running = true;
+// Record fields are in the same order as in record patterns, which is not
+// necessarily the order of their symbol ids. Records are small though.
+static vm_value *find_record_field(vm_value *fields, int count, vm_value name) {
+  for(int i = 0; i < count; i += 2) {
+    if(fields[i] == name) {
+      return &fields[i + 1];
+    }
+  }
+  return NULL;
+}
 
 
-restart:
-  while(is_running && state->program_pointer < program_length) {
+static bool init_state(vm_state *state, const vm_options *options) {
+  memset(state, 0x0, sizeof(vm_state));
 
-    is_running = true;
-    vm_value instr = program[state->program_pointer];
-    vm_opcode opcode = get_opcode(instr);
-    ++state->program_pointer;
+  state->max_stack_size = options->max_stack_size < 1 ? 1 : options->max_stack_size;
+  state->stack_capacity = initial_stack_size < state->max_stack_size ? initial_stack_size : state->max_stack_size;
+  // Invariant: spilled_arguments field in all frames must be 0 from the beginning, and
+  // registers that have never been used must be 0 (see gc.c)
+  state->stack = calloc(state->stack_capacity + 1, sizeof(stack_frame));
+  state->registers_capacity = (state->stack_capacity + 1) * num_regs;
+  state->registers = calloc(state->registers_capacity, sizeof(vm_value));
+  if(state->stack == NULL || state->registers == NULL) {
+    return false;
+  }
 
-    switch (opcode) {
+  // The program itself runs in a frame with all registers
+  state->stack[0].reg = state->registers;
+  set_frame_size(state, &state->stack[0], num_regs);
+  state->result = make_tagged_val(symbol_id_nil, vm_tag_plain_symbol);
+  return true;
+}
 
-      case OP_LOAD_i: {
-        int reg0 = get_arg_r0(instr);
-        int val = get_arg_i(instr);
-        check_reg(reg0);
-        get_reg(reg0) = val;
-      }
-      break;
+// Values from an earlier call must not stay alive, and the garbage collector expects
+// unused registers and spilled_arguments fields to be 0 (see gc.c)
+static void clear_state(vm_state *state) {
+  memset(state->registers, 0, state->registers_used * sizeof(vm_value));
+  for(size_t i = 0; i <= state->stack_capacity; ++i) {
+    state->stack[i].spilled_arguments = 0;
+  }
+  state->registers_used = 0;
+  state->stack_pointer = 0;
+  set_frame_size(state, &state->stack[0], num_regs);
+}
 
 
-      case OP_LOAD_ps: {
-        int reg0 = get_arg_r0(instr);
-        int value = get_arg_i(instr);
-        check_reg(reg0);
-        get_reg(reg0) = make_tagged_val(value, vm_tag_plain_symbol);
+// Doubles the capacity of the stack (up to max_stack_size). The register file is
+// moved, so all register windows are adjusted. Returns false if the stack can't
+// grow any further.
+static bool grow_stack(vm_state *state) {
+  if(state->stack_capacity >= state->max_stack_size) {
+    return false;
+  }
+  size_t old_capacity = state->stack_capacity;
+  size_t capacity = old_capacity > state->max_stack_size / 2 ? state->max_stack_size : old_capacity * 2;
+
+  stack_frame *stack = realloc(state->stack, (capacity + 1) * sizeof(stack_frame));
+  if(stack == NULL) {
+    return false;
+  }
+  state->stack = stack;
+  memset(stack + old_capacity + 1, 0, (capacity - old_capacity) * sizeof(stack_frame));
+
+  // Only the frames up to the next frame have valid windows, the ones above are set
+  // when they're needed
+  size_t registers = (capacity + 1) * num_regs;
+  if(registers > state->registers_capacity && !grow_registers(state, registers, state->stack_pointer + 1)) {
+    return false;
+  }
+
+  state->stack_capacity = capacity;
+  return true;
+}
+
+// Makes sure that we can push another frame
+#define has_room_for_frame(state) \
+  ((size_t) state->stack_pointer + 1 < state->stack_capacity || grow_stack(state))
+
+
+static size_t size_from_env(const char *name, size_t default_value, bool allow_zero) {
+  char *value = getenv(name);
+  if(value == NULL || *value == '\0') {
+    return default_value;
+  }
+
+  char *end = NULL;
+  unsigned long long size = strtoull(value, &end, 10);
+  if(*end != '\0' || (size == 0 && !allow_zero)) {
+    fprintf(stderr, "Ignoring invalid value for %s: %s\n", name, value);
+    return default_value;
+  }
+  return (size_t) size;
+}
+
+static vm_flush_policy flush_policy_from_env(const char *name, vm_flush_policy default_value) {
+  char *value = getenv(name);
+  if(value == NULL || *value == '\0') {
+    return default_value;
+  }
+
+  if(strcmp(value, "auto") == 0) {
+    return vm_flush_auto;
+  }
+  if(strcmp(value, "line") == 0) {
+    return vm_flush_line;
+  }
+  if(strcmp(value, "full") == 0) {
+    return vm_flush_full;
+  }
+  fprintf(stderr, "Ignoring invalid value for %s: %s\n", name, value);
+  return default_value;
+}
+
+vm_options vm_default_options() {
+  vm_options options;
+  options.initial_heap_size = size_from_env("DASH_HEAP_SIZE", default_heap_size, false);
+  options.max_heap_size = size_from_env("DASH_MAX_HEAP_SIZE", heap_address_limit, false);
+  options.nursery_size = size_from_env("DASH_NURSERY_SIZE", default_nursery_size, true);
+  options.max_stack_size = size_from_env("DASH_MAX_STACK_SIZE", default_max_stack_size, false);
+  options.flush_policy = flush_policy_from_env("DASH_FLUSH", vm_flush_auto);
+  options.jit_threshold = size_from_env("DASH_JIT_THRESHOLD", default_jit_threshold, true);
+  return options;
+}
+
+
+vm_value vm_execute(vm_instruction *program, int program_length, vm_value *ctable, int ctable_length) {
+  vm_options options = vm_default_options();
+  return vm_execute_with_options(program, program_length, ctable, ctable_length, &options);
+}
+
+
+/*
+
+Instances
+~~~~~~~~~
+
+A vm instance keeps a loaded program, its stack and the heap between calls, so a
+program can be loaded once and its functions can be called many times. The
+instance has its own copy of the program and the constant table.
+
+vm_load_program runs the top-level code of the program. Its result is a root for
+the garbage collector, which means that closures and modules stay alive (and are
+updated when they move) as long as the program is loaded. vm_call calls a function
+with arguments by running a small trampoline after the end of the program:
+
+  program_length:      OP_HALT
+  program_length + 1:  OP_GEN_AP 0 0 num_args
+  program_length + 2:  OP_RET 0
+
+The function is in register 0 of the top frame and the arguments are in the next
+frame, just like for any other call. This way OP_GEN_AP deals with closures and
+over-saturated calls, and OP_RET runs the io action if the function returns one.
+
+Green threads start in the same way with a second trampoline, which always passes
+one argument. A blocked thread is resumed at its OP_RET, which runs the thread's
+io action again (see scheduler.c):
+
+  program_length + 3:  OP_GEN_AP 0 0 1
+  program_length + 4:  OP_RET 0
+
+*/
+
+#define trampoline_address(vm) ((vm)->program_length + 1)
+#define thread_call_address(vm) ((vm)->program_length + 3)
+#define thread_retry_address(vm) ((vm)->program_length + 4)
+#define decoded_program_length(vm) ((vm)->program_length + 5)
+
+struct vm_instance {
+  vm_state state;
+  vm_options options;
+  vm_instruction *program;
+  int program_length;
+  vm_value *const_table;
+  int const_table_length;
+  decoded_instruction *decoded_program;
+  // the image that the program was loaded from, if any (see vm_load_image)
+  vm_image image;
+  bool is_profiling;
+  vm_profile profile;
+  vm_jit jit;
+};
+
+static vm_value interpret(vm_instance *vm);
+
+// the program can stop in many places, so we flush the output here
+static vm_value run(vm_instance *vm) {
+  io_start(&vm->state, vm->options.flush_policy);
+  vm_value result = interpret(vm);
+  scheduler_reset(&vm->state);
+  io_finish(&vm->state);
+  return result;
+}
+
+static bool decode_program(vm_instance *vm) {
+  vm_instruction *program = vm->program;
+  int program_length = vm->program_length;
+  decoded_instruction *decoded_program = calloc(decoded_program_length(vm), sizeof(decoded_instruction));
+  if(decoded_program == NULL) {
+    return false;
+  }
+
+  for(int i = 0; i < program_length; ++i) {
+    vm_instruction instr = program[i];
+    decoded_instruction *d = &decoded_program[i];
+    d->opcode = get_opcode(instr);
+    d->r0 = get_arg_r0(instr);
+    d->r1 = get_arg_r1(instr);
+    d->r2 = get_arg_r2(instr);
+    d->i = get_arg_i(instr);
+    d->instr = instr;
+
+    switch(d->opcode) {
+      case OP_ADD_i:
+      case OP_SUB_i:
+      case OP_JMP_LT:
+      case OP_JMP_GT:
+      case OP_JMP_EQ:
+        d->i = get_arg_small_i(instr);
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  decoded_program[program_length].opcode = OP_HALT;
+
+  decoded_instruction *ret = &decoded_program[trampoline_address(vm) + 1];
+  ret->opcode = OP_RET;
+  ret->instr = op_ret(0);
+
+  decoded_instruction *thread_call = &decoded_program[thread_call_address(vm)];
+  thread_call->opcode = OP_GEN_AP;
+  thread_call->r2 = 1;
+  thread_call->instr = op_gen_ap(0, 0, 1);
+
+  decoded_instruction *thread_ret = &decoded_program[thread_retry_address(vm)];
+  thread_ret->opcode = OP_RET;
+  thread_ret->instr = op_ret(0);
+
+  vm->decoded_program = decoded_program;
+  return true;
+}
+
+// The profile covers the decoded program, including the instructions after the end
+// of the program
+static bool start_profile(vm_instance *vm) {
+  vm_profile *p = &vm->profile;
+  if(!profile_init(p, vm->program, vm->program_length, decoded_program_length(vm))) {
+    return false;
+  }
+  for(int i = vm->program_length; i < p->length; ++i) {
+    p->opcodes[i] = vm->decoded_program[i].opcode;
+  }
+  vm->state.profile = p;
+  return true;
+}
+
+// The first instruction of every function counts its calls (the top-level code isn't
+// a function, even if it has a header). The jit doesn't run while profiling, because
+// the profile counts every instruction.
+static bool start_jit(vm_instance *vm) {
+  if(vm->is_profiling || vm->options.jit_threshold == 0 || !jit_is_available()) {
+    return true;
+  }
+  unsigned threshold = vm->options.jit_threshold > UINT_MAX ? UINT_MAX : (unsigned) vm->options.jit_threshold;
+  if(!jit_init(&vm->jit, vm->program_length, threshold)) {
+    return false;
+  }
+  for(int i = 1; i + fun_header_size < vm->program_length; ++i) {
+    int body = i + fun_header_size;
+    if(get_opcode(vm->program[i]) == FUN_HEADER && get_opcode(vm->program[body]) != FUN_HEADER) {
+      vm->decoded_program[body].opcode = OP_COUNT_CALL;
+    }
+  }
+  return true;
+}
+
+// Replaces every instruction that the jit compiled with OP_ENTER_JIT. The function's
+// calls aren't counted any more, even if its first instruction is interpreted.
+static void compile_hot_function(vm_instance *vm, int header_address) {
+  decoded_instruction *decoded_program = vm->decoded_program;
+  int body = header_address + fun_header_size;
+  int end = jit_compile(&vm->jit, &vm->state, vm->program, header_address);
+  decoded_program[body].opcode = get_opcode(decoded_program[body].instr);
+  for(int i = body; i < end; ++i) {
+    if(vm->jit.entries[i] != NULL) {
+      decoded_program[i].opcode = OP_ENTER_JIT;
+    }
+  }
+}
+
+static void unload_program(vm_instance *vm) {
+  image_close(&vm->image);
+  profile_free(&vm->profile);
+  jit_free(&vm->jit);
+  vm->state.profile = NULL;
+  free(vm->program);
+  free(vm->const_table);
+  free(vm->decoded_program);
+  vm->program = 0;
+  vm->program_length = 0;
+  vm->const_table = 0;
+  vm->const_table_length = 0;
+  vm->decoded_program = 0;
+}
+
+
+vm_instance *vm_create(const vm_options *options) {
+  vm_instance *vm = calloc(1, sizeof(vm_instance));
+  if(vm == NULL) {
+    return NULL;
+  }
+
+  vm->options = options ? *options : vm_default_options();
+  if(!init_state(&vm->state, &vm->options)
+     || !heap_init(&vm->state, vm->options.initial_heap_size, vm->options.max_heap_size, vm->options.nursery_size)
+     || !scheduler_init(&vm->state)) {
+    vm_destroy(vm);
+    return NULL;
+  }
+  return vm;
+}
+
+
+void vm_destroy(vm_instance *vm) {
+  if(vm == NULL) {
+    return;
+  }
+  unload_program(vm);
+  // this makes the stack of the main thread the current stack again
+  scheduler_destroy(&vm->state);
+  heap_destroy(&vm->state);
+  io_destroy(&vm->state);
+  verifier_free(&vm->state.verifier);
+  free(vm->state.stack);
+  free(vm->state.registers);
+  free(vm);
+}
+
+
+vm_value vm_load_program(vm_instance *vm, vm_instruction *program, int program_length, vm_value *ctable, int ctable_length) {
+  vm_state *state = &vm->state;
+  unload_program(vm);
+  clear_state(state);
+  state->result = make_tagged_val(symbol_id_nil, vm_tag_plain_symbol);
+
+  vm->program = malloc((program_length + 1) * sizeof(vm_instruction));
+  vm->const_table = malloc((ctable_length + 1) * sizeof(vm_value));
+  if(vm->program == NULL || vm->const_table == NULL) {
+    panic_stop_vm_m("Out of memory!");
+  }
+  memcpy(vm->program, program, program_length * sizeof(vm_instruction));
+  if(ctable_length > 0) {
+    memcpy(vm->const_table, ctable, ctable_length * sizeof(vm_value));
+  }
+  vm->program_length = program_length;
+  vm->const_table_length = ctable_length;
+
+  // OP_MATCH keeps using the verifier, so it has to see our copy of the constant table
+  char verifier_error[256];
+  if(!verify_program(&state->verifier, vm->program, program_length, vm->const_table, ctable_length,
+                     verifier_error, sizeof(verifier_error))) {
+    unload_program(vm);
+    panic_stop_vm_m("Invalid program: %s", verifier_error);
+  }
+  state->const_table = vm->const_table;
+  state->const_table_length = ctable_length;
+
+  if(!decode_program(vm) || (vm->is_profiling && !start_profile(vm)) || !start_jit(vm)) {
+    panic_stop_vm_m("Out of memory!");
+  }
+  state->scheduler.call_address = thread_call_address(vm);
+  state->scheduler.retry_address = thread_retry_address(vm);
+
+  // The top-level code only has a header if it needs spill slots
+  state->program_pointer = 0;
+  if(program_length > 0 && get_opcode(vm->program[0]) == FUN_HEADER) {
+    set_frame_size(state, &state->stack[0], get_fun_frame_size(vm->program[0]));
+    state->program_pointer = fun_header_size;
+  }
+  state->result = run(vm);
+  return state->result;
+}
+
+
+vm_value vm_load_image(vm_instance *vm, const char *path) {
+  vm_state *state = &vm->state;
+  vm_image image;
+  char error[256];
+  if(!image_open(&image, path, error, sizeof(error))) {
+    unload_program(vm);
+    clear_state(state);
+    state->result = make_tagged_val(symbol_id_nil, vm_tag_plain_symbol);
+    fprintf(stderr, "Can't load image: %s\n", error);
+    panic_stop_vm_m("Can't load image: %s", error);
+  }
+
+  // vm_load_program copies the program, so the image is only kept for its symbol names
+  vm_value result = vm_load_program(vm, image.program, image.program_length, image.const_table, image.const_table_length);
+  if(vm->decoded_program == NULL) {
+    image_close(&image);
+  }
+  else {
+    vm->image = image;
+  }
+  return result;
+}
+
+
+const char *vm_image_symbol_names(vm_instance *vm, size_t *size) {
+  *size = vm->image.symbol_names_size;
+  return vm->image.mapping != NULL ? vm->image.symbol_names : NULL;
+}
+
+
+const vm_value *vm_instance_const_table(vm_instance *vm, int *length) {
+  *length = vm->const_table_length;
+  return vm->const_table;
+}
+
+
+vm_value vm_program_result(vm_instance *vm) {
+  return vm->state.result;
+}
+
+
+vm_value vm_call(vm_instance *vm, vm_value function, const vm_value *args, int num_args) {
+  vm_state *state = &vm->state;
+  if(vm->decoded_program == NULL) {
+    panic_stop_vm_m("No program loaded");
+  }
+  if(num_args < 0 || num_args > num_regs) {
+    panic_stop_vm_m("Too many arguments: %i", num_args);
+  }
+
+  clear_state(state);
+  current_frame.reg[0] = function;
+  memcpy(next_frame.reg, args, num_args * sizeof(vm_value));
+
+  decoded_instruction *call = &vm->decoded_program[trampoline_address(vm)];
+  call->opcode = OP_GEN_AP;
+  call->r0 = 0;
+  call->r1 = 0;
+  call->r2 = num_args;
+  call->instr = op_gen_ap(0, 0, num_args);
+
+  state->program_pointer = trampoline_address(vm);
+  return run(vm);
+}
+
+
+int vm_jit_function_count(vm_instance *vm) {
+  return vm->jit.function_count;
+}
+
+
+void vm_enable_profiling(vm_instance *vm) {
+  vm->is_profiling = true;
+}
+
+
+void vm_profile_name_function(vm_instance *vm, int address, const char *name) {
+  if(vm->state.profile != NULL) {
+    profile_name_function(vm->state.profile, address, name);
+  }
+}
+
+
+bool vm_write_profile(vm_instance *vm, const char *report_path, const char *folded_path) {
+  if(vm->state.profile == NULL) {
+    return false;
+  }
+  FILE *report = report_path != NULL ? fopen(report_path, "w") : NULL;
+  FILE *folded = folded_path != NULL ? fopen(folded_path, "w") : NULL;
+  bool is_written = (report != NULL || report_path == NULL) && (folded != NULL || folded_path == NULL)
+                    && profile_write(vm->state.profile, report, folded);
+  if(report != NULL && fclose(report) != 0) {
+    is_written = false;
+  }
+  if(folded != NULL && fclose(folded) != 0) {
+    is_written = false;
+  }
+  return is_written;
+}
+
+
+// vm_execute keeps its instance until the next call, because the caller decodes
+// the result from the heap
+static vm_instance *execute_instance = 0;
+
+vm_value vm_execute_with_options(vm_instruction *program, int program_length, vm_value *ctable, int ctable_length, const vm_options *options) {
+  vm_destroy(execute_instance);
+  execute_instance = vm_create(options);
+  if(execute_instance == NULL) {
+    return vm_failure_result;
+  }
+  return vm_load_program(execute_instance, program, program_length, ctable, ctable_length);
+}
+
+
+static vm_value interpret(vm_instance *vm) {
+
+#ifndef VM_SWITCH_DISPATCH
+  static void *dispatch_table[num_dispatch_targets] = {
+    [0 ... num_dispatch_targets - 1] = &&label_unknown_opcode,
+    [OP_RET] = &&label_OP_RET,
+    [OP_LOAD_i] = &&label_OP_LOAD_i,
+    [OP_LOAD_ps] = &&label_OP_LOAD_ps,
+    [OP_LOAD_cs] = &&label_OP_LOAD_cs,
+    [OP_LOAD_os] = &&label_OP_LOAD_os,
+    [OP_LOAD_f] = &&label_OP_LOAD_f,
+    [OP_ADD] = &&label_OP_ADD,
+    [OP_SUB] = &&label_OP_SUB,
+    [OP_MUL] = &&label_OP_MUL,
+    [OP_DIV] = &&label_OP_DIV,
+    [OP_MOVE] = &&label_OP_MOVE,
+    [OP_AP] = &&label_OP_AP,
+    [OP_GEN_AP] = &&label_OP_GEN_AP,
+    [OP_TAIL_AP] = &&label_OP_TAIL_AP,
+    [OP_TAIL_GEN_AP] = &&label_OP_TAIL_GEN_AP,
+    [OP_PART_AP] = &&label_OP_PART_AP,
+    [OP_JMP] = &&label_OP_JMP,
+    [OP_MATCH] = &&label_OP_MATCH,
+    [OP_SET_ARG] = &&label_OP_SET_ARG,
+    [OP_SET_CL_VAL] = &&label_OP_SET_CL_VAL,
+    [OP_EQ] = &&label_OP_EQ,
+    [OP_COPY_SYM] = &&label_OP_COPY_SYM,
+    [OP_SET_SYM_FIELD] = &&label_OP_SET_SYM_FIELD,
+    [OP_LOAD_str] = &&label_OP_LOAD_str,
+    [OP_STR_LEN] = &&label_OP_STR_LEN,
+    [OP_NEW_STR] = &&label_OP_NEW_STR,
+    [OP_GET_CHAR] = &&label_OP_GET_CHAR,
+    [OP_PUT_CHAR] = &&label_OP_PUT_CHAR,
+    [OP_LT] = &&label_OP_LT,
+    [OP_GT] = &&label_OP_GT,
+    [OP_JMP_TRUE] = &&label_OP_JMP_TRUE,
+    [OP_OR] = &&label_OP_OR,
+    [OP_AND] = &&label_OP_AND,
+    [OP_NOT] = &&label_OP_NOT,
+    [OP_GET_FIELD] = &&label_OP_GET_FIELD,
+    [OP_CONVERT] = &&label_OP_CONVERT,
+    [OP_MATCH_SWITCH] = &&label_OP_MATCH_SWITCH,
+    [OP_STR_CONCAT] = &&label_OP_STR_CONCAT,
+    [OP_SUB_STR] = &&label_OP_SUB_STR,
+    [OP_STR_CMP] = &&label_OP_STR_CMP,
+    [OP_STR_FIND] = &&label_OP_STR_FIND,
+    [OP_SPILL] = &&label_OP_SPILL,
+    [OP_RELOAD] = &&label_OP_RELOAD,
+    [OP_ADD_i] = &&label_OP_ADD_i,
+    [OP_SUB_i] = &&label_OP_SUB_i,
+    [OP_JMP_LT] = &&label_OP_JMP_LT,
+    [OP_JMP_GT] = &&label_OP_JMP_GT,
+    [OP_JMP_EQ] = &&label_OP_JMP_EQ,
+    [OP_JMP_MATCH] = &&label_OP_JMP_MATCH,
+    [OP_RET_i] = &&label_OP_RET_i,
+    [OP_RET_ps] = &&label_OP_RET_ps,
+    [OP_MAP_NEW] = &&label_OP_MAP_NEW,
+    [OP_MAP_GET] = &&label_OP_MAP_GET,
+    [OP_MAP_PUT] = &&label_OP_MAP_PUT,
+    [OP_MAP_DEL] = &&label_OP_MAP_DEL,
+    [OP_MAP_SIZE] = &&label_OP_MAP_SIZE,
+    [OP_MAP_ENTRY] = &&label_OP_MAP_ENTRY,
+    [OP_ARRAY_NEW] = &&label_OP_ARRAY_NEW,
+    [OP_ARRAY_GET] = &&label_OP_ARRAY_GET,
+    [OP_ARRAY_SET] = &&label_OP_ARRAY_SET,
+    [OP_ARRAY_LEN] = &&label_OP_ARRAY_LEN,
+    [OP_ARRAY_SLICE] = &&label_OP_ARRAY_SLICE,
+    [OP_HALT] = &&label_OP_HALT,
+    [OP_COUNT_CALL] = &&label_OP_COUNT_CALL,
+    [OP_ENTER_JIT] = &&label_OP_ENTER_JIT,
+  };
+
+  static void *profile_dispatch_table[num_dispatch_targets] = {
+    [0 ... num_dispatch_targets - 1] = &&label_profile_instruction
+  };
+#endif
+
+  vm_state *state = &vm->state;
+#ifndef VM_SWITCH_DISPATCH
+  void **handlers = (state->profile != NULL) ? profile_dispatch_table : dispatch_table;
+#endif
+  vm_instruction *program = vm->program;
+  int program_length = vm->program_length;
+  decoded_instruction *decoded_program = vm->decoded_program;
+
+  bool is_running = true;
+  decoded_instruction *decoded;
+  vm_instruction instr;
+  // an instruction that the jit has replaced (see run_original)
+  decoded_instruction original;
+
+
+  while(is_running) {
+
+    fetch_instruction();
+    if(state->profile != NULL) {
+      profile_instruction(state, state->program_pointer - 1);
+    }
+
+execute_instruction:
+    switch (decoded->opcode) {
+
+      vm_case(OP_HALT): {
+        // we've reached the end of the program
+        is_running = false;
       }
       break;
 
+      vm_case(OP_LOAD_i): {
+        int reg0 = decoded->r0;
+        // immediates are biased, so that they can hold negative numbers
+        int64_t val = (int64_t) decoded->i - int_bias;
+        check_reg(reg0);
+        get_reg(reg0) = make_number(val);
+      }
+      dispatch();
+
+
+      vm_case(OP_LOAD_ps): {
+        int reg0 = decoded->r0;
+        int value = decoded->i;
+        check_reg(reg0);
+        get_reg(reg0) = make_tagged_val(value, vm_tag_plain_symbol);
+      }
+      dispatch();
 
-      case OP_LOAD_cs: {
-        int reg0 = get_arg_r0(instr);
-        int value = get_arg_i(instr);
+
+      vm_case(OP_LOAD_cs): {
+        int reg0 = decoded->r0;
+        int value = decoded->i;
         check_reg(reg0);
         get_reg(reg0) = make_tagged_val(value, vm_tag_compound_symbol);
       }
-      break;
+      dispatch();
 
-      case OP_LOAD_os: {
-        int reg0 = get_arg_r0(instr);
-        int value = get_arg_i(instr);
+      vm_case(OP_LOAD_os): {
+        int reg0 = decoded->r0;
+        int value = decoded->i;
         check_reg(reg0);
         get_reg(reg0) = make_tagged_val(value, vm_tag_opaque_symbol);
       }
-      break;
+      dispatch();
 
-      case OP_LOAD_f: {
-        int reg0 = get_arg_r0(instr);
-        int value = get_arg_i(instr);
+      vm_case(OP_LOAD_f): {
+        int reg0 = decoded->r0;
+        int value = decoded->i;
         check_reg(reg0);
         get_reg(reg0) = make_tagged_val(value, vm_tag_function);
       }
-      break;
+      dispatch();
 
 
-      case OP_LOAD_str: {
-        int reg0 = get_arg_r0(instr);
-        int value = get_arg_i(instr);
+      vm_case(OP_LOAD_str): {
+        int reg0 = decoded->r0;
+        int value = decoded->i;
         check_reg(reg0);
         get_reg(reg0) = make_tagged_val(value, vm_tag_string);
       }
-      break;
+      dispatch();
 
 
-      case OP_ADD: {
-        int reg1 = get_arg_r1(instr);
-        int reg2 = get_arg_r2(instr);
+      vm_case(OP_ADD): {
+        int reg1 = decoded->r1;
+        int reg2 = decoded->r2;
         check_reg(reg1);
-        int arg1 = get_reg(reg1);
+        vm_value arg1 = get_reg(reg1);
         check_reg(reg2);
-        int arg2 = get_reg(reg2);
-        int reg0 = get_arg_r0(instr);
+        vm_value arg2 = get_reg(reg2);
+        int reg0 = decoded->r0;
         if(get_tag(arg1) != vm_tag_number) {
-          fail("Expected a number, but got %s", value_to_type_string(arg1));
+          fail("Expected a number, but got %s", value_to_type_string(state, arg1));
         }
 
         else if(get_tag(arg2) != vm_tag_number) {
-          fail("Expected a number, but got %s", value_to_type_string(arg2));
+          fail("Expected a number, but got %s", value_to_type_string(state, arg2));
         }
 
         check_reg(reg0);
-        int result = ((arg1 - int_bias) + (arg2 - int_bias)) + int_bias;
-        if(result < min_biased_int || result > max_biased_int) {
+        int64_t result;
+        if(shifted_add_overflow(number_to_shifted(arg1), number_to_shifted(arg2), &result)) {
           fail("Int overflow");
         }
-        get_reg(reg0) = result;
+        get_reg(reg0) = shifted_to_number(result);
       }
-      break;
+      dispatch();
 
 
-      case OP_SUB: {
-        int reg1 = get_arg_r1(instr);
-        int reg2 = get_arg_r2(instr);
+      vm_case(OP_SUB): {
+        int reg1 = decoded->r1;
+        int reg2 = decoded->r2;
         check_reg(reg1);
-        int arg1 = get_reg(reg1);
+        vm_value arg1 = get_reg(reg1);
         check_reg(reg2);
-        int arg2 = get_reg(reg2);
-        int reg0 = get_arg_r0(instr);
+        vm_value arg2 = get_reg(reg2);
+        int reg0 = decoded->r0;
         if(get_tag(arg1) != vm_tag_number) {
-          fail("Expected a number, but got %s", value_to_type_string(arg1));
+          fail("Expected a number, but got %s", value_to_type_string(state, arg1));
         }
 
         if(get_tag(arg2) != vm_tag_number) {
-          fail("Expected a number, but got %s ", value_to_type_string(arg2));
+          fail("Expected a number, but got %s ", value_to_type_string(state, arg2));
         }
 
         check_reg(reg0);
-        int result = ((arg1 - int_bias) - (arg2 - int_bias)) + int_bias;
-        if(result < min_biased_int || result > max_biased_int) {
+        int64_t result;
+        if(shifted_sub_overflow(number_to_shifted(arg1), number_to_shifted(arg2), &result)) {
           fail("Int overflow");
         }
-        get_reg(reg0) = result;
+        get_reg(reg0) = shifted_to_number(result);
       }
-      break;
+      dispatch();
 
 
-      case OP_MUL: {
-        int reg1 = get_arg_r1(instr);
-        int reg2 = get_arg_r2(instr);
+      // The constant also goes to its own register, like the load_i that this replaces
+      vm_case(OP_ADD_i): {
+        int64_t constant = (int64_t) decoded->i - small_int_bias;
+        check_reg(decoded->r2);
+        get_reg(decoded->r2) = make_number(constant);
+        check_reg(decoded->r1);
+        vm_value arg1 = get_reg(decoded->r1);
+        int reg0 = decoded->r0;
+        if(get_tag(arg1) != vm_tag_number) {
+          fail("Expected a number, but got %s", value_to_type_string(state, arg1));
+        }
+
+        check_reg(reg0);
+        int64_t result;
+        if(shifted_add_overflow(number_to_shifted(arg1), number_to_shifted(make_number(constant)), &result)) {
+          fail("Int overflow");
+        }
+        get_reg(reg0) = shifted_to_number(result);
+      }
+      dispatch();
+
+
+      vm_case(OP_SUB_i): {
+        int64_t constant = (int64_t) decoded->i - small_int_bias;
+        check_reg(decoded->r2);
+        get_reg(decoded->r2) = make_number(constant);
+        check_reg(decoded->r1);
+        vm_value arg1 = get_reg(decoded->r1);
+        int reg0 = decoded->r0;
+        if(get_tag(arg1) != vm_tag_number) {
+          fail("Expected a number, but got %s", value_to_type_string(state, arg1));
+        }
+
+        check_reg(reg0);
+        int64_t result;
+        if(shifted_sub_overflow(number_to_shifted(arg1), number_to_shifted(make_number(constant)), &result)) {
+          fail("Int overflow");
+        }
+        get_reg(reg0) = shifted_to_number(result);
+      }
+      dispatch();
+
+
+      vm_case(OP_MUL): {
+        int reg1 = decoded->r1;
+        int reg2 = decoded->r2;
         check_reg(reg1);
-        int arg1 = get_reg(reg1);
+        vm_value arg1 = get_reg(reg1);
         check_reg(reg2);
-        int arg2 = get_reg(reg2);
-        int reg0 = get_arg_r0(instr);
+        vm_value arg2 = get_reg(reg2);
+        int reg0 = decoded->r0;
         if(get_tag(arg1) != vm_tag_number) {
-          fail("Expected a number, but got %s ", value_to_type_string(arg1) );
+          fail("Expected a number, but got %s ", value_to_type_string(state, arg1) );
         }
 
         if(get_tag(arg2) != vm_tag_number) {
-          fail("Expected a number, but got %s ", value_to_type_string(arg2) );
+          fail("Expected a number, but got %s ", value_to_type_string(state, arg2) );
         }
 
         check_reg(reg0);
-        int result = ((arg1 - int_bias) * (arg2 - int_bias)) + int_bias;
-        if(result < min_biased_int || result > max_biased_int) {
-          panic_stop_vm_m("Int overflow");
+        // only one of the factors is shifted, so the product is shifted as well
+        int64_t result;
+        if(shifted_mul_overflow(number_to_shifted(arg1), get_number(arg2), &result)) {
+          fail("Int overflow");
         }
-        get_reg(reg0) = result;
+        get_reg(reg0) = shifted_to_number(result);
       }
-      break;
+      dispatch();
 
 
-      case OP_DIV: {
-        int reg1 = get_arg_r1(instr);
-        int reg2 = get_arg_r2(instr);
+      vm_case(OP_DIV): {
+        int reg1 = decoded->r1;
+        int reg2 = decoded->r2;
         check_reg(reg1);
-        int arg1 = get_reg(reg1);
+        vm_value arg1 = get_reg(reg1);
         check_reg(reg2);
-        int arg2 = get_reg(reg2);
+        vm_value arg2 = get_reg(reg2);
         if(arg2 == 0) {
           fail("Division by 0");
         }
 
         if(get_tag(arg1) != vm_tag_number) {
-          fail("Expected a number, but got %s ", value_to_type_string(arg1) );
+          fail("Expected a number, but got %s ", value_to_type_string(state, arg1) );
         }
 
         if(get_tag(arg2) != vm_tag_number) {
-          fail("Expected a number, but got %s", value_to_type_string(arg2) );
+          fail("Expected a number, but got %s", value_to_type_string(state, arg2) );
         }
 
 
-        int reg0 = get_arg_r0(instr);
+        int reg0 = decoded->r0;
         check_reg(reg0);
-        int result = ((arg1 - int_bias) / (arg2 - int_bias)) + int_bias;
-        if(result < min_biased_int || result > max_biased_int) {
+        int64_t result = get_number(arg1) / get_number(arg2);
+        // the only case that can overflow is min_number / -1
+        if(result > max_number) {
           fail("Int overflow");
         }
-        get_reg(reg0) = result;
+        get_reg(reg0) = make_number(result);
       }
-      break;
+      dispatch();
 
 
-      case OP_MOVE: {
-        int reg0 = get_arg_r0(instr);
-        int reg1 = get_arg_r1(instr);
+      vm_case(OP_MOVE): {
+        int reg0 = decoded->r0;
+        int reg1 = decoded->r1;
         check_reg(reg0);
         check_reg(reg1);
         get_reg(reg0) = get_reg(reg1);
       }
-      break;
+      dispatch();
 
 
-      case OP_AP: {
-        if (state->stack_pointer + 1 == stack_size) {
-          fail("(call)!");
-        }
+      vm_case(OP_AP): {
+        check_stack_space();
 
         // this macro will create `return_pointer`
-        do_call((&next_frame), get_arg_r1(instr), instr);
+        do_call((&next_frame), decoded->r1, instr);
         if (call_failed) {
           fail("call failed"); //TODO give a better error description
         }
 
         next_frame.return_address = return_pointer;
-        next_frame.result_register = get_arg_r0(instr);
+        next_frame.result_register = decoded->r0;
         ++state->stack_pointer;
 
       }
-      break;
+      dispatch();
 
 
-      case OP_TAIL_AP: {
-        do_call((&current_frame), get_arg_r1(instr), instr);
+      vm_case(OP_TAIL_AP): {
+        do_call((&current_frame), decoded->r1, instr);
         if (call_failed) {
           fail("call failed"); //TODO give a better error description
         }
-
+        count_time_slice();
       }
-      break;
+      dispatch();
 
 
-      case OP_GEN_AP: {
-        if (state->stack_pointer + 1 == stack_size) {
-          printf("Stack overflow (call cl)!");
-          panic_stop_vm();
-        }
+      vm_case(OP_GEN_AP): {
+        check_stack_space();
 
         int return_pointer = do_gen_ap(state, (&next_frame), instr, program);
 
         if (return_pointer != -1) {
           next_frame.return_address = return_pointer;
-          next_frame.result_register = get_arg_r0(instr);
+          next_frame.result_register = decoded->r0;
           ++state->stack_pointer;
         }
 
       }
-      break;
+      dispatch();
 
 
       // TODO It's not entirely clear yet what happens when this returns a new PAP
-      case OP_TAIL_GEN_AP: {
+      vm_case(OP_TAIL_GEN_AP): {
+        // an oversaturated call pushes a frame
+        check_stack_space();
         do_gen_ap(state, &current_frame, instr, program);
+        count_time_slice();
       }
-      break;
+      dispatch();
+
+
+      vm_case(OP_RET_i): {
+        check_reg(decoded->r0);
+        get_reg(decoded->r0) = make_number((int64_t) decoded->i - int_bias);
+      }
+      goto op_ret;
 
+      vm_case(OP_RET_ps): {
+        check_reg(decoded->r0);
+        get_reg(decoded->r0) = make_tagged_val(decoded->i, vm_tag_plain_symbol);
+      }
+      goto op_ret;
 
 op_ret:
-      case OP_RET: {
-        int return_val_reg = get_arg_r0(instr);
+      vm_case(OP_RET): {
+        int return_val_reg = decoded->r0;
         if (state->stack_pointer == 0) {
           //We simply copy the result value to register 0, so that the runtime can find it
           current_frame.reg[0] = current_frame.reg[return_val_reg];
+
+          vm_value io_result_value = 0;
+          vm_value next_action;
+          // we pass the register instead of the value, because the io action might allocate
+          io_action_result action_result = check_io_action(state, &current_frame.reg[0], program, &io_result_value, &next_action);
+
+          if(action_result == intermediary_io_action) {
+            // Instead of leaving the interpreter loop, we call the bound function
+            // right away. It replaces the top frame, like a tail call.
+            check_stack_space();
+            current_frame.reg[0] = next_action;
+            next_frame.reg[0] = io_result_value; // argument for next_action
+            int return_pointer = do_gen_ap(state, &current_frame, op_gen_ap(0, 0, 1), program);
+            if (return_pointer == -1) {
+              // TODO is this malformed?
+              panic_stop_vm_m("malformed bound lambda in io action");
+            }
+            current_frame.return_address = return_pointer;
+            current_frame.result_register = 0;
+            count_time_slice();
+            dispatch();
+          }
+
+          if(action_result == blocking_io_action) {
+            if(!scheduler_block(state)) {
+              panic_stop_vm_m("Deadlock: all threads are waiting");
+            }
+            dispatch();
+          }
+
+          if(action_result == final_io_action) {
+            current_frame.reg[0] = io_result_value;
+          }
+
+          if(!scheduler_is_main_thread(state)) {
+            if(!scheduler_finish(state, current_frame.reg[0])) {
+              panic_stop_vm_m("Deadlock: all threads are waiting");
+            }
+            dispatch();
+          }
           is_running = false;
           break;
         }
         --state->stack_pointer;
         current_frame.reg[next_frame.result_register] = next_frame.reg[return_val_reg];
         state->program_pointer = next_frame.return_address;
+        count_time_slice();
       }
-      break;
+      dispatch();
 
 
-      case OP_JMP: {
-        int offset = get_arg_i(instr) - int_bias;
-        state->program_pointer += offset;
-        if(state->program_pointer < 0 || state->program_pointer > program_length) {
-          panic_stop_vm_m("Illegal address!");
+      vm_case(OP_JMP): {
+        jump_by((int) decoded->i - int_bias);
+      }
+      dispatch();
+
+      vm_case(OP_JMP_TRUE): {
+        check_reg(decoded->r0);
+        // true is a plain symbol, so it's enough to compare the values
+        if(get_reg(decoded->r0) == make_tagged_val(symbol_id_true, vm_tag_plain_symbol)) {
+          jump_by((int) decoded->i - int_bias);
         }
+        // else: do nothing
+
       }
-      break;
+      dispatch();
 
-      case OP_JMP_TRUE: {
-        check_reg(get_arg_r0(instr));
-        vm_value bool_value = get_reg(get_arg_r0(instr));
+      // The compare-and-branch instructions write their result like lt, gt and eq
+      vm_case(OP_JMP_LT): {
+        check_reg(decoded->r1);
+        check_reg(decoded->r2);
+        vm_value l = get_reg(decoded->r1);
+        vm_value r = get_reg(decoded->r2);
+        check_reg(decoded->r0);
 
-        if( is_equal(state, bool_value, make_tagged_val(symbol_id_true, vm_tag_plain_symbol) )) {
-          int offset = get_arg_i(instr) - int_bias;
-          state->program_pointer += offset;
-          if(state->program_pointer < 0 || state->program_pointer > program_length) {
-            panic_stop_vm_m("Illegal address: %i", state->program_pointer);
-          }
+        if(get_tag(l) != vm_tag_number) {
+          fail("Expected a number, but got %s", value_to_type_string(state, l));
         }
-        // else: do nothing
+        else if(get_tag(r) != vm_tag_number) {
+          fail("Expected a number, but got %s", value_to_type_string(state, r));
+        }
+
+        if(get_number(l) < get_number(r)) {
+          get_reg(decoded->r0) = make_tagged_val(symbol_id_true, vm_tag_plain_symbol);
+          jump_by((int) decoded->i - small_int_bias);
+        }
+        else {
+          get_reg(decoded->r0) = make_tagged_val(symbol_id_false, vm_tag_plain_symbol);
+        }
+      }
+      dispatch();
 
+      vm_case(OP_JMP_GT): {
+        check_reg(decoded->r1);
+        check_reg(decoded->r2);
+        vm_value l = get_reg(decoded->r1);
+        vm_value r = get_reg(decoded->r2);
+        check_reg(decoded->r0);
+
+        if(get_tag(l) != vm_tag_number) {
+          fail("Expected a number, but got %s", value_to_type_string(state, l));
+        }
+        else if(get_tag(r) != vm_tag_number) {
+          fail("Expected a number, but got %s", value_to_type_string(state, r));
+        }
+
+        if(get_number(l) > get_number(r)) {
+          get_reg(decoded->r0) = make_tagged_val(symbol_id_true, vm_tag_plain_symbol);
+          jump_by((int) decoded->i - small_int_bias);
+        }
+        else {
+          get_reg(decoded->r0) = make_tagged_val(symbol_id_false, vm_tag_plain_symbol);
+        }
       }
-      break;
+      dispatch();
 
-      case OP_MATCH: {
-        check_reg(get_arg_r0(instr));
-        int subject = get_reg(get_arg_r0(instr));
-        check_reg(get_arg_r1(instr));
-        int patterns_addr = get_reg(get_arg_r1(instr));
-        int capture_reg = get_arg_r2(instr);
-        check_reg(capture_reg);
+      vm_case(OP_JMP_EQ): {
+        check_reg(decoded->r1);
+        check_reg(decoded->r2);
+        vm_value l = get_reg(decoded->r1);
+        vm_value r = get_reg(decoded->r2);
+        check_reg(decoded->r0);
 
-        check_ctable_index(patterns_addr)
+        if(is_equal(state, l, r)) {
+          get_reg(decoded->r0) = make_tagged_val(symbol_id_true, vm_tag_plain_symbol);
+          jump_by((int) decoded->i - small_int_bias);
+        }
+        else {
+          get_reg(decoded->r0) = make_tagged_val(symbol_id_false, vm_tag_plain_symbol);
+        }
+      }
+      dispatch();
+
+      vm_case(OP_JMP_MATCH):
+      vm_case(OP_MATCH_SWITCH):
+      vm_case(OP_MATCH): {
+        check_reg(decoded->r0);
+        vm_value subject = get_reg(decoded->r0);
+        int patterns_addr;
+        int capture_reg;
+        if(decoded->opcode == OP_JMP_MATCH) {
+          // the patterns don't capture anything
+          patterns_addr = decoded->i;
+          capture_reg = 0;
+        }
+        else {
+          check_reg(decoded->r1);
+          patterns_addr = get_number(get_reg(decoded->r1));
+          capture_reg = decoded->r2;
+          check_reg(capture_reg);
+        }
+
+        bool is_switch = (decoded->opcode != OP_MATCH);
+        if(!(is_switch ? verify_match_table(&state->verifier, patterns_addr) : verify_match_data(&state->verifier, patterns_addr))) {
+          panic_stop_vm_m("Invalid match data: %i", patterns_addr);
+        }
         vm_value match_header = state->const_table[patterns_addr];
         int number_of_patterns = from_match_value(match_header);
+        if(state->profile != NULL) {
+          state->profile->match_patterns[state->program_pointer - 1] = number_of_patterns;
+        }
+        if(state->program_pointer + number_of_patterns > program_length + 1) {
+          panic_stop_vm_m("Illegal address: %i", state->program_pointer + number_of_patterns - 1);
+        }
         int i = 0;
+        if(is_switch) {
+          i = first_possible_match(state, patterns_addr, number_of_patterns, subject);
+        }
 
-        for(i=0; i<number_of_patterns; ++i) {
+        for(; i<number_of_patterns; ++i) {
           int rel_pat_addr = patterns_addr + 1 + i;
 
-          check_ctable_index(rel_pat_addr)
           vm_value pat = state->const_table[rel_pat_addr];
           if(does_value_match(state, pat, subject, capture_reg)) {
             break;
@@ -950,60 +2406,61 @@ op_ret:
 
         state->program_pointer += i;
       }
-      break;
+      dispatch();
 
 
-      case OP_SET_ARG: {
-        int target_arg = get_arg_r0(instr);
-        int source_reg = get_arg_r1(instr);
-        int extra_amount = get_arg_r2(instr);
+      vm_case(OP_SET_ARG): {
+        int target_arg = decoded->r0;
+        int source_reg = decoded->r1;
+        int extra_amount = decoded->r2;
         memcpy(&next_frame.reg[target_arg], &current_frame.reg[source_reg], (1 + extra_amount) * sizeof(vm_value));
       }
-      break;
+      dispatch();
 
 
-      case OP_SET_CL_VAL: {
-        int cl_reg = get_arg_r0(instr);
+      vm_case(OP_SET_CL_VAL): {
+        int cl_reg = decoded->r0;
         check_reg(cl_reg);
         vm_value closure = get_reg(cl_reg);
 
         if( get_tag(closure) != vm_tag_pap ) {
-          fail("Expected a closure, but got %s", value_to_type_string(closure));
+          fail("Expected a closure, but got %s", value_to_type_string(state, closure));
         }
 
         heap_address cl_address = get_val(closure);
-        check_reg(get_arg_r1(instr));
-        vm_value new_value = get_reg(get_arg_r1(instr));
-        int arg_index = get_arg_r2(instr);
+        check_reg(decoded->r1);
+        vm_value new_value = get_reg(decoded->r1);
+        int arg_index = decoded->r2;
 
-        vm_value *cl_pointer = heap_get_pointer(cl_address);
-        int header = *cl_pointer;
+        vm_value *cl_pointer = heap_get_pointer(state, cl_address);
+        vm_value header = *cl_pointer;
         int num_env_args = pap_var_count(header);
         if(arg_index >= num_env_args) {
           panic_stop_vm_m("Illegal closure modification (index: %i, num env vars: %i)", arg_index, num_env_args);
         }
         cl_pointer[pap_header_size + arg_index] = new_value;
+        heap_write_barrier(state, cl_address, new_value);
 
       }
-      break;
+      dispatch();
 
 
-      case OP_PART_AP: {
-        int reg0 = get_arg_r0(instr);
-        int fun_reg = get_arg_r1(instr);
+      vm_case(OP_PART_AP): {
+        int reg0 = decoded->r0;
+        int fun_reg = decoded->r1;
         check_reg(fun_reg);
-        int func = get_reg(fun_reg);
+        vm_value func = get_reg(fun_reg);
 
         if( get_tag(func) != vm_tag_function ) {
-          fail("Expected a function, but got %s", value_to_type_string(func));
+          fail("Expected a function, but got %s", value_to_type_string(state, func));
         }
 
         int fun_address = get_val(func);
-        int num_args = get_arg_r2(instr);
+        int num_args = decoded->r2;
 
         vm_value fun_header = program[fun_address];
         //TODO check that it's actually a function
-        int arity = get_arg_i(fun_header);
+        int arity = get_fun_arity(fun_header);
 
         // TODO this was >= earlier, which apparently gave false positives. Find out why, and find out if > is the correct choice
         if(num_args > arity) {
@@ -1016,15 +2473,15 @@ op_ret:
         check_reg(reg0);
         get_reg(reg0) = pap_value;
       }
-      break;
+      dispatch();
 
 
-      case OP_EQ: {
-        check_reg(get_arg_r1(instr));
-        check_reg(get_arg_r2(instr));
-        vm_value l = get_reg(get_arg_r1(instr));
-        vm_value r = get_reg(get_arg_r2(instr));
-        int result_reg = get_arg_r0(instr);
+      vm_case(OP_EQ): {
+        check_reg(decoded->r1);
+        check_reg(decoded->r2);
+        vm_value l = get_reg(decoded->r1);
+        vm_value r = get_reg(decoded->r2);
+        int result_reg = decoded->r0;
         check_reg(result_reg);
 
         if( is_equal(state, l, r)) {
@@ -1034,64 +2491,64 @@ op_ret:
           get_reg(result_reg) = make_tagged_val(symbol_id_false, vm_tag_plain_symbol);
         }
       }
-      break;
-
-      case OP_LT: {
-        check_reg(get_arg_r1(instr));
-        check_reg(get_arg_r2(instr));
-        vm_value l = get_reg(get_arg_r1(instr));
-        vm_value r = get_reg(get_arg_r2(instr));
-        int result_reg = get_arg_r0(instr);
+      dispatch();
+
+      vm_case(OP_LT): {
+        check_reg(decoded->r1);
+        check_reg(decoded->r2);
+        vm_value l = get_reg(decoded->r1);
+        vm_value r = get_reg(decoded->r2);
+        int result_reg = decoded->r0;
         check_reg(result_reg);
 
         if(get_tag(l) != vm_tag_number) {
-          fail("Expected a number, but got %s", value_to_type_string(l));
+          fail("Expected a number, but got %s", value_to_type_string(state, l));
         }
         else if(get_tag(r) != vm_tag_number) {
-          fail("Expected a number, but got %s", value_to_type_string(r));
+          fail("Expected a number, but got %s", value_to_type_string(state, r));
         }
 
-        if( l < r) {
+        if(get_number(l) < get_number(r)) {
           get_reg(result_reg) = make_tagged_val(symbol_id_true, vm_tag_plain_symbol);
         }
         else {
           get_reg(result_reg) = make_tagged_val(symbol_id_false, vm_tag_plain_symbol);
         }
       }
-      break;
-
-      case OP_GT: {
-        check_reg(get_arg_r1(instr));
-        check_reg(get_arg_r2(instr));
-        vm_value l = get_reg(get_arg_r1(instr));
-        vm_value r = get_reg(get_arg_r2(instr));
-        int result_reg = get_arg_r0(instr);
+      dispatch();
+
+      vm_case(OP_GT): {
+        check_reg(decoded->r1);
+        check_reg(decoded->r2);
+        vm_value l = get_reg(decoded->r1);
+        vm_value r = get_reg(decoded->r2);
+        int result_reg = decoded->r0;
         check_reg(result_reg);
 
         if(get_tag(l) != vm_tag_number) {
-          fail("Expected a number, but got %s", value_to_type_string(l));
+          fail("Expected a number, but got %s", value_to_type_string(state, l));
         }
         else if(get_tag(r) != vm_tag_number) {
-          fail("Expected a number, but got %s", value_to_type_string(r));
+          fail("Expected a number, but got %s", value_to_type_string(state, r));
         }
 
-        if( l > r) {
+        if(get_number(l) > get_number(r)) {
           get_reg(result_reg) = make_tagged_val(symbol_id_true, vm_tag_plain_symbol);
         }
         else {
           get_reg(result_reg) = make_tagged_val(symbol_id_false, vm_tag_plain_symbol);
         }
       }
-      break;
+      dispatch();
 
 
-      case OP_COPY_SYM: {
-        check_reg(get_arg_r0(instr));
-        check_reg(get_arg_r1(instr));
-        vm_value const_symbol = get_reg(get_arg_r1(instr));
+      vm_case(OP_COPY_SYM): {
+        check_reg(decoded->r0);
+        check_reg(decoded->r1);
+        vm_value const_symbol = get_reg(decoded->r1);
 
         if ( get_tag(const_symbol) != vm_tag_compound_symbol ) {
-          panic_stop_vm_m("Expected a const symbol, but got %s", value_to_type_string(const_symbol));
+          panic_stop_vm_m("Expected a const symbol, but got %s", value_to_type_string(state, const_symbol));
         }
 
         int c_addr = get_val(const_symbol);
@@ -1100,182 +2557,544 @@ op_ret:
         int count = compound_symbol_count(c_sym_header);
 
         size_t total_size = compound_symbol_header_size + count;
-        heap_address dyn_sym_address = heap_alloc(total_size);
-        vm_value *sym_pointer = heap_get_pointer(dyn_sym_address);  \
+        heap_address dyn_sym_address = heap_alloc(state, total_size);
+        // only fetch the pointer after allocating, a collection might have moved the heap
+        vm_value *sym_pointer = heap_get_pointer(state, dyn_sym_address);
         memcpy(sym_pointer, &(state->const_table[c_addr]), total_size * sizeof(vm_value));
 
-        get_reg(get_arg_r0(instr)) = make_tagged_val(dyn_sym_address, vm_tag_dynamic_compound_symbol);
+        get_reg(decoded->r0) = make_tagged_val(dyn_sym_address, vm_tag_dynamic_compound_symbol);
 
       }
-      break;
+      dispatch();
 
-      case OP_SET_SYM_FIELD: {
-        check_reg(get_arg_r0(instr));
-        check_reg(get_arg_r1(instr));
-        vm_value heap_symbol = get_reg(get_arg_r0(instr));
+      vm_case(OP_SET_SYM_FIELD): {
+        check_reg(decoded->r0);
+        check_reg(decoded->r1);
+        vm_value heap_symbol = get_reg(decoded->r0);
 
         if ( get_tag(heap_symbol) != vm_tag_dynamic_compound_symbol ) {
-          panic_stop_vm_m("Expected a dynamic symbol, but got %s", value_to_type_string(heap_symbol));
+          panic_stop_vm_m("Expected a dynamic symbol, but got %s", value_to_type_string(state, heap_symbol));
         }
 
-        int h_addr = get_val(heap_symbol);
-        vm_value *p = heap_get_pointer(h_addr);
+        heap_address h_addr = get_val(heap_symbol);
+        vm_value *p = heap_get_pointer(state, h_addr);
         vm_value h_sym_header = *p;
 
         int count = compound_symbol_count(h_sym_header);
 
-        int index = get_arg_r2(instr);
+        int index = decoded->r2;
         if(index < 0 || index >= count) {
           panic_stop_vm_m("Illegal index while setting symbol field: %d", index);
         }
 
-        p[compound_symbol_header_size + index] = get_reg(get_arg_r1(instr));
+        vm_value new_value = get_reg(decoded->r1);
+        p[compound_symbol_header_size + index] = new_value;
+        heap_write_barrier(state, h_addr, new_value);
       }
-      break;
+      dispatch();
 
 
-      case OP_STR_LEN: {
-        check_reg(get_arg_r0(instr));
-        check_reg(get_arg_r1(instr));
+      vm_case(OP_STR_LEN): {
+        check_reg(decoded->r0);
+        check_reg(decoded->r1);
 
-        vm_value str = get_reg(get_arg_r1(instr));
-        int tag = get_tag(str);
-        if (tag != vm_tag_string && tag != vm_tag_dynamic_string ) {
-          fail("Expected a string, but got %s", value_to_type_string(str));
+        vm_value str = get_reg(decoded->r1);
+        if (!is_string(str)) {
+          fail("Expected a string, but got %s", value_to_type_string(state, str));
         }
 
-        int str_addr = get_val(str);
-        vm_value *str_pointer;
-
-        if(tag == vm_tag_string) {
-          str_pointer = state->const_table + str_addr;
-        }
-        else {
-          str_pointer = heap_get_pointer(str_addr);
-        }
-
-        vm_value str_header = *str_pointer;
+        // ropes store their length in the header as well
+        vm_value str_header = *get_string_pointer(state, str);
 
         int count = string_length(str_header);
-        get_reg(get_arg_r0(instr)) = make_tagged_val(count + int_bias, vm_tag_number);
+        get_reg(decoded->r0) = make_number(count);
       }
-      break;
+      dispatch();
 
 
-      case OP_NEW_STR: {
-        int result_reg = get_arg_r0(instr);
+      vm_case(OP_NEW_STR): {
+        int result_reg = decoded->r0;
         check_reg(result_reg);
-        check_reg(get_arg_r1(instr));
+        check_reg(decoded->r1);
 
-        vm_value length_value = get_reg(get_arg_r1(instr));
+        vm_value length_value = get_reg(decoded->r1);
         if(get_tag(length_value) != vm_tag_number) {
-          panic_stop_vm_m("Expected a number, but got %s", value_to_type_string(length_value));
+          panic_stop_vm_m("Expected a number, but got %s", value_to_type_string(state, length_value));
         }
 
-        int length = length_value - int_bias;
+        int64_t length = get_number(length_value);
         if(length < 0) {
-          panic_stop_vm_m("Negative length for new string, got: %d", length);
+          panic_stop_vm_m("Negative length for new string, got: %lld", (long long) length);
         }
-
-        int adjusted_length = length + 1; // allow space for trailing '\0'
-        int num_chunks = adjusted_length / char_per_string_chunk;
-        if( (adjusted_length % char_per_string_chunk) != 0 ) {
-          num_chunks += char_per_string_chunk - (adjusted_length % char_per_string_chunk);
+        if(length > max_string_length) {
+          panic_stop_vm_m("String too long: %lld", (long long) length);
         }
 
-        size_t total_size = string_header_size + num_chunks;
-        heap_address string_address = heap_alloc(total_size);
-        vm_value *str_pointer = heap_get_pointer(string_address);
-
-        memset(str_pointer, 0, total_size * sizeof(vm_value));
-        *str_pointer = string_header(length, num_chunks);
-
+        heap_address string_address = new_empty_string(state, (size_t) length);
         get_reg(result_reg) = make_tagged_val(string_address, vm_tag_dynamic_string);
 
       }
-      break;
+      dispatch();
 
 
-      case OP_GET_CHAR: {
-        int result_reg = get_arg_r0(instr);
+      vm_case(OP_GET_CHAR): {
+        int result_reg = decoded->r0;
         check_reg(result_reg);
-        check_reg(get_arg_r1(instr));
-        check_reg(get_arg_r2(instr));
-
-        vm_value str = get_reg(get_arg_r1(instr));
-        vm_value str_tag = get_tag(str);
-        if(str_tag != vm_tag_string && str_tag != vm_tag_dynamic_string) {
-          panic_stop_vm_m("Expected a string, but got %s", value_to_type_string(str));
-        }
+        check_reg(decoded->r1);
+        check_reg(decoded->r2);
 
-        int str_addr = get_val(str);
-        vm_value *str_pointer;
-
-        if(str_tag == vm_tag_string) {
-          str_pointer = state->const_table + str_addr;
-        }
-        else {
-          str_pointer = heap_get_pointer(str_addr);
+        vm_value str = get_reg(decoded->r1);
+        if(!is_string(str)) {
+          panic_stop_vm_m("Expected a string, but got %s", value_to_type_string(state, str));
         }
 
+        flatten_string_reg(state, decoded->r1);
+        vm_value *str_pointer = get_string_pointer(state, get_reg(decoded->r1));
         vm_value str_header = *str_pointer;
 
-        int index = get_reg(get_arg_r2(instr)) - int_bias;
+        int64_t index = get_number(get_reg(decoded->r2));
         int str_length = string_length(str_header);
         if(index < 0 || index > str_length) {
-          panic_stop_vm_m("Illegal string index: %d", index);
+          panic_stop_vm_m("Illegal string index: %lld", (long long) index);
         }
 
         char *char_pointer = (char *) (str_pointer + string_header_size);
         int character = char_pointer[index];
 
-        get_reg(result_reg) = make_tagged_val(character, vm_tag_number);
+        get_reg(result_reg) = make_number(character);
 
       }
-      break;
+      dispatch();
 
 
-      case OP_PUT_CHAR: {
-        check_reg(get_arg_r0(instr));
-        check_reg(get_arg_r1(instr));
-        check_reg(get_arg_r2(instr));
+      vm_case(OP_PUT_CHAR): {
+        check_reg(decoded->r0);
+        check_reg(decoded->r1);
+        check_reg(decoded->r2);
 
-        vm_value str = get_reg(get_arg_r1(instr));
+        vm_value str = get_reg(decoded->r1);
         vm_value str_tag = get_tag(str);
         if(str_tag != vm_tag_dynamic_string) {
-          panic_stop_vm_m("Expected a dynamic string, but got %s", value_to_type_string(str));
+          panic_stop_vm_m("Expected a dynamic string, but got %s", value_to_type_string(state, str));
         }
 
-        int character = get_reg(get_arg_r0(instr));
+        vm_value character = get_reg(decoded->r0);
         if(get_tag(character) != vm_tag_number) {
-          panic_stop_vm_m("Expected a number, but got %s", value_to_type_string(character));
+          panic_stop_vm_m("Expected a number, but got %s", value_to_type_string(state, character));
         }
 
-        int str_addr = get_val(str);
-        vm_value *str_pointer = heap_get_pointer(str_addr);
+        heap_address str_addr = get_val(str);
+        vm_value *str_pointer = heap_get_pointer(state, str_addr);
 
         vm_value str_header = *str_pointer;
 
-        int index = get_reg(get_arg_r2(instr)) - int_bias;
+        int64_t index = get_number(get_reg(decoded->r2));
         int str_length = string_length(str_header);
         if(index < 0 || index > str_length) {
-          panic_stop_vm_m("Illegal string index: %d", index);
+          panic_stop_vm_m("Illegal string index: %lld", (long long) index);
         }
 
         char *char_pointer = (char *) (str_pointer + string_header_size);
-        char_pointer[index] = (char) character;
+        char_pointer[index] = (char) get_number(character);
+        // the hash has to be computed again
+        *str_pointer = string_header(str_length, 0);
       }
-      break;
+      dispatch();
+
+
+      vm_case(OP_STR_CONCAT): {
+        int result_reg = decoded->r0;
+        int l_reg = decoded->r1;
+        int r_reg = decoded->r2;
+        check_reg(result_reg);
+        check_reg(l_reg);
+        check_reg(r_reg);
+
+        vm_value l = get_reg(l_reg);
+        vm_value r = get_reg(r_reg);
+        if(!is_string(l)) {
+          fail("Expected a string, but got %s", value_to_type_string(state, l));
+        }
+        if(!is_string(r)) {
+          fail("Expected a string, but got %s", value_to_type_string(state, r));
+        }
+
+        size_t l_length = string_length(*get_string_pointer(state, l));
+        size_t r_length = string_length(*get_string_pointer(state, r));
+        if(l_length + r_length > max_string_length) {
+          fail("String too long: %zu", l_length + r_length);
+        }
+
+        if(l_length == 0 || r_length == 0) {
+          get_reg(result_reg) = (l_length == 0) ? r : l;
+          dispatch();
+        }
+
+        if(l_length + r_length >= min_rope_length) {
+          heap_address rope_address = heap_alloc(state, rope_size);
+          vm_value *rope_pointer = heap_get_pointer(state, rope_address);
+          rope_pointer[0] = rope_header(l_length + r_length);
+          rope_pointer[1] = get_reg(l_reg);
+          rope_pointer[2] = get_reg(r_reg);
+          get_reg(result_reg) = make_tagged_val(rope_address, vm_tag_rope);
+          dispatch();
+        }
+
+        // Short strings are cheaper to copy than to keep around as ropes. Both operands
+        // are flat, because ropes are never shorter than min_rope_length.
+        heap_address string_address = new_empty_string(state, l_length + r_length);
+        // the allocation might have moved both strings, so we read them from the registers again
+        char *chars = string_chars(heap_get_pointer(state, string_address));
+        memcpy(chars, string_chars(get_string_pointer(state, get_reg(l_reg))), l_length);
+        memcpy(chars + l_length, string_chars(get_string_pointer(state, get_reg(r_reg))), r_length);
+
+        get_reg(result_reg) = make_tagged_val(string_address, vm_tag_dynamic_string);
+      }
+      dispatch();
+
+
+      // Start index and length are clamped to the string, so this never fails
+      // for a valid string
+      vm_case(OP_SUB_STR): {
+        int result_reg = decoded->r0;
+        int str_reg = decoded->r1;
+        int start_reg = decoded->r2;
+        check_reg(result_reg);
+        check_reg(str_reg);
+        check_reg(start_reg + 1);
+
+        vm_value str = get_reg(str_reg);
+        vm_value start_value = get_reg(start_reg);
+        vm_value length_value = get_reg(start_reg + 1);
+        if(!is_string(str)) {
+          fail("Expected a string, but got %s", value_to_type_string(state, str));
+        }
+        if(get_tag(start_value) != vm_tag_number) {
+          fail("Expected a number, but got %s", value_to_type_string(state, start_value));
+        }
+        if(get_tag(length_value) != vm_tag_number) {
+          fail("Expected a number, but got %s", value_to_type_string(state, length_value));
+        }
+
+        flatten_string_reg(state, str_reg);
+        int64_t str_length = string_length(*get_string_pointer(state, get_reg(str_reg)));
+        int64_t start = get_number(start_value);
+        int64_t length = get_number(length_value);
+        start = start < 0 ? 0 : (start > str_length ? str_length : start);
+        length = length < 0 ? 0 : (length > str_length - start ? str_length - start : length);
+
+        heap_address string_address = new_empty_string(state, (size_t) length);
+        char *chars = string_chars(heap_get_pointer(state, string_address));
+        memcpy(chars, string_chars(get_string_pointer(state, get_reg(str_reg))) + start, (size_t) length);
+
+        get_reg(result_reg) = make_tagged_val(string_address, vm_tag_dynamic_string);
+      }
+      dispatch();
+
+
+      vm_case(OP_STR_CMP): {
+        int result_reg = decoded->r0;
+        check_reg(result_reg);
+        check_reg(decoded->r1);
+        check_reg(decoded->r2);
+
+        vm_value l = get_reg(decoded->r1);
+        vm_value r = get_reg(decoded->r2);
+        if(!is_string(l)) {
+          fail("Expected a string, but got %s", value_to_type_string(state, l));
+        }
+        if(!is_string(r)) {
+          fail("Expected a string, but got %s", value_to_type_string(state, r));
+        }
+
+        flatten_string_reg(state, decoded->r1);
+        flatten_string_reg(state, decoded->r2);
+        vm_value *l_pointer = get_string_pointer(state, get_reg(decoded->r1));
+        vm_value *r_pointer = get_string_pointer(state, get_reg(decoded->r2));
+        size_t l_length = string_length(*l_pointer);
+        size_t r_length = string_length(*r_pointer);
+
+        int order = memcmp(string_chars(l_pointer), string_chars(r_pointer), l_length < r_length ? l_length : r_length);
+        if(order == 0) {
+          order = (l_length > r_length) - (l_length < r_length);
+        }
+        get_reg(result_reg) = make_number(order < 0 ? -1 : (order > 0 ? 1 : 0));
+      }
+      dispatch();
+
+
+      vm_case(OP_STR_FIND): {
+        int result_reg = decoded->r0;
+        check_reg(result_reg);
+        check_reg(decoded->r1);
+        check_reg(decoded->r2);
+
+        vm_value str = get_reg(decoded->r1);
+        vm_value needle = get_reg(decoded->r2);
+        if(!is_string(str)) {
+          fail("Expected a string, but got %s", value_to_type_string(state, str));
+        }
+        if(!is_string(needle)) {
+          fail("Expected a string, but got %s", value_to_type_string(state, needle));
+        }
+
+        flatten_string_reg(state, decoded->r1);
+        flatten_string_reg(state, decoded->r2);
+        vm_value *str_pointer = get_string_pointer(state, get_reg(decoded->r1));
+        vm_value *needle_pointer = get_string_pointer(state, get_reg(decoded->r2));
+        int64_t index = find_in_string(string_chars(str_pointer), string_length(*str_pointer),
+                                       string_chars(needle_pointer), string_length(*needle_pointer));
+        get_reg(result_reg) = make_number(index);
+      }
+      dispatch();
+
+
+      vm_case(OP_MAP_NEW): {
+        check_reg(decoded->r0);
+        get_reg(decoded->r0) = map_new(state);
+      }
+      dispatch();
+
+
+      // The result register holds the value for keys that aren't in the map
+      vm_case(OP_MAP_GET): {
+        int result_reg = decoded->r0;
+        check_reg(result_reg);
+        check_reg(decoded->r1);
+        check_reg(decoded->r2);
+
+        vm_value map = get_reg(decoded->r1);
+        if(get_tag(map) != vm_tag_map) {
+          fail("Expected a dict, but got %s", value_to_type_string(state, map));
+        }
+        vm_value key = get_reg(decoded->r2);
+        vm_value value;
+        if(map_lookup(state, map, value_hash(state, key), key, &value)) {
+          get_reg(result_reg) = value;
+        }
+      }
+      dispatch();
+
+
+      // The result register holds the value to insert
+      vm_case(OP_MAP_PUT): {
+        int result_reg = decoded->r0;
+        int map_reg = decoded->r1;
+        int key_reg = decoded->r2;
+        check_reg(result_reg);
+        check_reg(map_reg);
+        check_reg(key_reg);
+
+        vm_value map = get_reg(map_reg);
+        if(get_tag(map) != vm_tag_map) {
+          fail("Expected a dict, but got %s", value_to_type_string(state, map));
+        }
+        vm_value hash = value_hash(state, get_reg(key_reg));
+        heap_reserve(state, map_update_size(state, map, hash));
+        // the reservation might have moved the map, the key and the value
+        vm_value result = map_insert(state, get_reg(map_reg), hash, get_reg(key_reg), get_reg(result_reg));
+        get_reg(result_reg) = result;
+      }
+      dispatch();
+
+
+      vm_case(OP_MAP_DEL): {
+        int result_reg = decoded->r0;
+        int map_reg = decoded->r1;
+        int key_reg = decoded->r2;
+        check_reg(result_reg);
+        check_reg(map_reg);
+        check_reg(key_reg);
+
+        vm_value map = get_reg(map_reg);
+        if(get_tag(map) != vm_tag_map) {
+          fail("Expected a dict, but got %s", value_to_type_string(state, map));
+        }
+        vm_value hash = value_hash(state, get_reg(key_reg));
+        heap_reserve(state, map_update_size(state, map, hash));
+        vm_value result = map_remove(state, get_reg(map_reg), hash, get_reg(key_reg));
+        get_reg(result_reg) = result;
+      }
+      dispatch();
+
+
+      vm_case(OP_MAP_SIZE): {
+        check_reg(decoded->r0);
+        check_reg(decoded->r1);
+
+        vm_value map = get_reg(decoded->r1);
+        if(get_tag(map) != vm_tag_map) {
+          fail("Expected a dict, but got %s", value_to_type_string(state, map));
+        }
+        get_reg(decoded->r0) = make_number(map_size(state, map));
+      }
+      dispatch();
+
+
+      // Together with OP_MAP_SIZE, this lets built-in functions go through all entries
+      // of a map without allocating anything
+      vm_case(OP_MAP_ENTRY): {
+        int key_reg = decoded->r0;
+        check_reg(key_reg + 1);
+        check_reg(decoded->r1);
+        check_reg(decoded->r2);
+
+        vm_value map = get_reg(decoded->r1);
+        vm_value index = get_reg(decoded->r2);
+        if(get_tag(map) != vm_tag_map) {
+          fail("Expected a dict, but got %s", value_to_type_string(state, map));
+        }
+        if(get_tag(index) != vm_tag_number) {
+          fail("Expected a number, but got %s", value_to_type_string(state, index));
+        }
+        int64_t i = get_number(index);
+        if(i < 0 || (size_t) i >= map_size(state, map)) {
+          fail("Index out of range: %lld", (long long) i);
+        }
+        map_entry(state, map, i, &get_reg(key_reg), &get_reg(key_reg + 1));
+      }
+      dispatch();
+
+
+      // The result register holds the value for all elements
+      vm_case(OP_ARRAY_NEW): {
+        int result_reg = decoded->r0;
+        check_reg(result_reg);
+        check_reg(decoded->r1);
+
+        vm_value length = get_reg(decoded->r1);
+        if(get_tag(length) != vm_tag_number) {
+          fail("Expected a number, but got %s", value_to_type_string(state, length));
+        }
+        int64_t n = get_number(length);
+        if(n < 0 || n > max_array_length) {
+          fail("Invalid array length: %lld", (long long) n);
+        }
+        heap_reserve(state, array_alloc_size(n));
+        get_reg(result_reg) = array_new(state, n, get_reg(result_reg));
+      }
+      dispatch();
+
+
+      vm_case(OP_ARRAY_GET): {
+        check_reg(decoded->r0);
+        check_reg(decoded->r1);
+        check_reg(decoded->r2);
+
+        vm_value array = get_reg(decoded->r1);
+        vm_value index = get_reg(decoded->r2);
+        if(get_tag(array) != vm_tag_array) {
+          fail("Expected an array, but got %s", value_to_type_string(state, array));
+        }
+        if(get_tag(index) != vm_tag_number) {
+          fail("Expected a number, but got %s", value_to_type_string(state, index));
+        }
+        int64_t i = get_number(index);
+        if(i < 0 || (size_t) i >= array_size(state, array)) {
+          fail("Index out of range: %lld", (long long) i);
+        }
+        get_reg(decoded->r0) = array_get(state, array, i);
+      }
+      dispatch();
+
+
+      // Changes the array in place, so it must only be used for new arrays
+      vm_case(OP_ARRAY_SET): {
+        check_reg(decoded->r0);
+        check_reg(decoded->r1);
+        check_reg(decoded->r2);
+
+        vm_value array = get_reg(decoded->r0);
+        vm_value index = get_reg(decoded->r1);
+        if(get_tag(array) != vm_tag_array) {
+          fail("Expected an array, but got %s", value_to_type_string(state, array));
+        }
+        if(get_tag(index) != vm_tag_number) {
+          fail("Expected a number, but got %s", value_to_type_string(state, index));
+        }
+        int64_t i = get_number(index);
+        if(i < 0 || (size_t) i >= array_size(state, array)) {
+          fail("Index out of range: %lld", (long long) i);
+        }
+        array_set(state, array, i, get_reg(decoded->r2));
+      }
+      dispatch();
+
+
+      vm_case(OP_ARRAY_LEN): {
+        check_reg(decoded->r0);
+        check_reg(decoded->r1);
+
+        vm_value array = get_reg(decoded->r1);
+        if(get_tag(array) != vm_tag_array) {
+          fail("Expected an array, but got %s", value_to_type_string(state, array));
+        }
+        get_reg(decoded->r0) = make_number(array_size(state, array));
+      }
+      dispatch();
+
+
+      // Start and length are clamped to the array, like in OP_SUB_STR
+      vm_case(OP_ARRAY_SLICE): {
+        int result_reg = decoded->r0;
+        int array_reg = decoded->r1;
+        int start_reg = decoded->r2;
+        check_reg(result_reg);
+        check_reg(array_reg);
+        check_reg(start_reg + 1);
+
+        vm_value array = get_reg(array_reg);
+        vm_value start_value = get_reg(start_reg);
+        vm_value length_value = get_reg(start_reg + 1);
+        if(get_tag(array) != vm_tag_array) {
+          fail("Expected an array, but got %s", value_to_type_string(state, array));
+        }
+        if(get_tag(start_value) != vm_tag_number) {
+          fail("Expected a number, but got %s", value_to_type_string(state, start_value));
+        }
+        if(get_tag(length_value) != vm_tag_number) {
+          fail("Expected a number, but got %s", value_to_type_string(state, length_value));
+        }
 
+        int64_t count = array_size(state, array);
+        int64_t start = get_number(start_value);
+        int64_t length = get_number(length_value);
+        start = start < 0 ? 0 : (start > count ? count : start);
+        length = length < 0 ? 0 : (length > count - start ? count - start : length);
 
-      case OP_OR: {
-        int reg1 = get_arg_r1(instr);
-        int reg2 = get_arg_r2(instr);
+        heap_reserve(state, array_alloc_size(length));
+        get_reg(result_reg) = array_slice(state, get_reg(array_reg), start, length);
+      }
+      dispatch();
+
+
+      // Spill slots are behind the registers of the frame (see FUN_HEADER in opcodes.h)
+      vm_case(OP_SPILL): {
+        int reg0 = decoded->r0;
+        check_reg(reg0);
+        check_spill_slot(decoded->i);
+        current_frame.reg[num_regs + decoded->i] = get_reg(reg0);
+      }
+      dispatch();
+
+
+      vm_case(OP_RELOAD): {
+        int reg0 = decoded->r0;
+        check_reg(reg0);
+        check_spill_slot(decoded->i);
+        get_reg(reg0) = current_frame.reg[num_regs + decoded->i];
+      }
+      dispatch();
+
+
+      vm_case(OP_OR): {
+        int reg1 = decoded->r1;
+        int reg2 = decoded->r2;
         check_reg(reg1);
-        int arg1 = get_reg(reg1);
+        vm_value arg1 = get_reg(reg1);
         check_reg(reg2);
-        int arg2 = get_reg(reg2);
-        int reg0 = get_arg_r0(instr);
+        vm_value arg2 = get_reg(reg2);
+        int reg0 = decoded->r0;
         check_reg(reg0);
 
         vm_value result = make_tagged_val(symbol_id_false, vm_tag_plain_symbol);
@@ -1285,17 +3104,17 @@ op_ret:
         }
         get_reg(reg0) = result;
       }
-      break;
+      dispatch();
 
 
-      case OP_AND: {
-        int reg1 = get_arg_r1(instr);
-        int reg2 = get_arg_r2(instr);
+      vm_case(OP_AND): {
+        int reg1 = decoded->r1;
+        int reg2 = decoded->r2;
         check_reg(reg1);
-        int arg1 = get_reg(reg1);
+        vm_value arg1 = get_reg(reg1);
         check_reg(reg2);
-        int arg2 = get_reg(reg2);
-        int reg0 = get_arg_r0(instr);
+        vm_value arg2 = get_reg(reg2);
+        int reg0 = decoded->r0;
         check_reg(reg0);
 
         vm_value result = make_tagged_val(symbol_id_false, vm_tag_plain_symbol);
@@ -1305,14 +3124,14 @@ op_ret:
         }
         get_reg(reg0) = result;
       }
-      break;
+      dispatch();
 
 
-      case OP_NOT: {
-        int reg1 = get_arg_r1(instr);
+      vm_case(OP_NOT): {
+        int reg1 = decoded->r1;
         check_reg(reg1);
-        int arg1 = get_reg(reg1);
-        int reg0 = get_arg_r0(instr);
+        vm_value arg1 = get_reg(reg1);
+        int reg0 = decoded->r0;
         check_reg(reg0);
 
         vm_value result = make_tagged_val(symbol_id_false, vm_tag_plain_symbol);
@@ -1323,13 +3142,13 @@ op_ret:
         //else: result is already set to false
         get_reg(reg0) = result;
       }
-      break;
+      dispatch();
 
 
-      case OP_GET_FIELD: {
-        int result_reg = get_arg_r0(instr);
-        int obj_reg = get_arg_r1(instr);
-        int sym_reg = get_arg_r2(instr);
+      vm_case(OP_GET_FIELD): {
+        int result_reg = decoded->r0;
+        int obj_reg = decoded->r1;
+        int sym_reg = decoded->r2;
         check_reg(result_reg);
         check_reg(obj_reg);
         check_reg(sym_reg);
@@ -1367,7 +3186,7 @@ op_ret:
 
           obj_header = obj_pointer[0];
           if(compound_symbol_id(obj_header) != symbol_id_record) {
-            fail("Expected a module or record, got %s", value_to_type_string(obj_ref));
+            fail("Expected a module or record, got %s", value_to_type_string(state, obj_ref));
           }
 
           obj_fields = obj_pointer + 1;
@@ -1376,8 +3195,8 @@ op_ret:
         else if(get_tag(obj_ref) == vm_tag_dynamic_compound_symbol) {
 
 
-          int obj_addr = get_val(obj_ref);
-          vm_value *obj_pointer = heap_get_pointer(obj_addr);
+          heap_address obj_addr = get_val(obj_ref);
+          vm_value *obj_pointer = heap_get_pointer(state, obj_addr);
 
           //vm_value *obj_pointer = state->const_table + obj_addr;
 
@@ -1385,7 +3204,7 @@ op_ret:
           obj_fields = obj_pointer + 1;
 
           if(compound_symbol_id(obj_header) != symbol_id_record) {
-            fail("Expected a module or record, got %s", value_to_type_string(obj_ref));
+            fail("Expected a module or record, got %s", value_to_type_string(state, obj_ref));
           }
 
 
@@ -1393,36 +3212,31 @@ op_ret:
 
         else {
           // exits subroutine here
-          fail("Expected a module or record, got %s", value_to_type_string(obj_ref));
+          fail("Expected a module or record, got %s", value_to_type_string(state, obj_ref));
         }
 
 
         int num_symbol_fields = compound_symbol_count(obj_header);
+        vm_value *field = (get_tag(obj_ref) == vm_tag_opaque_symbol)
+                            ? find_module_field(obj_fields, num_symbol_fields, requested_name)
+                            : find_record_field(obj_fields, num_symbol_fields, requested_name);
 
-        bool found = false;
-        for(int i=0; i < num_symbol_fields; i += 2) {
-          vm_value name = obj_fields[i];
-
-          if(name == requested_name) {
-            get_reg(result_reg) = obj_fields[i+1];
-            found = true;
-            break;
-          }
+        if(field != NULL) {
+          get_reg(result_reg) = *field;
         }
-
-        if(found == false) {
+        else {
           //TODO change this to built-in nil type
           get_reg(result_reg) = make_tagged_val(symbol_id_nil, vm_tag_plain_symbol);
         }
 
       }
-      break;
+      dispatch();
 
 
-      case OP_CONVERT: {
-        int result_reg = get_arg_r0(instr);
-        int source_reg = get_arg_r1(instr);
-        int type_reg = get_arg_r2(instr);
+      vm_case(OP_CONVERT): {
+        int result_reg = decoded->r0;
+        int source_reg = decoded->r1;
+        int type_reg = decoded->r2;
         check_reg(result_reg);
         check_reg(source_reg);
         check_reg(type_reg);
@@ -1430,7 +3244,7 @@ op_ret:
         vm_value source = get_reg(source_reg);
         vm_value target_type = get_reg(type_reg);
         if(get_tag(target_type) != vm_tag_plain_symbol) {
-          fail("Expected a symbol, got %s", value_to_type_string(target_type));
+          fail("Expected a symbol, got %s", value_to_type_string(state, target_type));
         }
         vm_value target_type_id = get_val(target_type);
         vm_value result;
@@ -1438,78 +3252,117 @@ op_ret:
         switch(target_type_id) {
 
           case symbol_id_number:
-            result = convert_to_number(state, source);
+            flatten_string_reg(state, source_reg);
+            result = convert_to_number(state, get_reg(source_reg));
             break;
 
           case symbol_id_string:
             result = convert_to_string(state, source);
             break;
 
+          case symbol_id_array: {
+            size_t length;
+            if(get_tag(source) == vm_tag_array) {
+              result = source;
+            }
+            else if(list_length(state, source, &length) && length <= max_array_length) {
+              heap_reserve(state, array_alloc_size(length));
+              result = array_from_list(state, get_reg(source_reg), length);
+            }
+            else {
+              result = make_str_error(state, "Unable to convert %s to array", value_to_type_string(state, source));
+            }
+          }
+          break;
+
+          case symbol_id_list: {
+            size_t length;
+            if(get_tag(source) == vm_tag_array) {
+              heap_reserve(state, list_alloc_size(array_size(state, source)));
+              result = array_to_list(state, get_reg(source_reg));
+            }
+            else if(list_length(state, source, &length)) {
+              result = source;
+            }
+            else {
+              result = make_str_error(state, "Unable to convert %s to list", value_to_type_string(state, source));
+            }
+          }
+          break;
+
           default:
-            result = make_str_error("Unable to convert value");
+            result = make_str_error(state, "Unable to convert value");
 
         }
 
         get_reg(result_reg) = result;
       }
-      break;
+      dispatch();
+
+      vm_case(OP_COUNT_CALL): {
+        int address = state->program_pointer - 1;
+        if(jit_count_call(&vm->jit, address - fun_header_size)) {
+          compile_hot_function(vm, address - fun_header_size);
+          if(decoded_program[address].opcode == OP_ENTER_JIT) {
+            state->program_pointer = address;
+            dispatch();
+          }
+        }
+        state->program_pointer = address;
+      }
+      goto run_original;
 
-      default:
-        panic_stop_vm_m("UNKNOWN OPCODE: %04x", opcode);
+      // Compiled code runs until it reaches an instruction that it can't do by itself
+      vm_case(OP_ENTER_JIT): {
+        jit_code code = vm->jit.entries[state->program_pointer - 1];
+        int exit_code = code(current_frame.reg, &state->scheduler.time_slice);
+        state->program_pointer = jit_exit_address(exit_code);
+        if(!jit_exit_runs_original(exit_code)) {
+          dispatch();
+        }
+      }
+      // Runs the instruction at the program pointer as it was before the jit replaced it
+run_original: {
+        original = decoded_program[state->program_pointer];
+        original.opcode = get_opcode(original.instr);
+        decoded = &original;
+        instr = decoded->instr;
+        ++state->program_pointer;
+        goto execute_instruction;
+      }
+
+      vm_default: {
+        panic_stop_vm_m("UNKNOWN OPCODE: %04x", decoded->opcode);
+      }
+
+#ifndef VM_SWITCH_DISPATCH
+      label_profile_instruction: {
+        profile_instruction(state, state->program_pointer - 1);
+        goto *dispatch_table[decoded->opcode];
+      }
+#endif
     }
 
 
   }
 
 
+  // io actions have already been run by OP_RET
   vm_value result = state->stack[state->stack_pointer].reg[0];
 
+  return result;
+}
 
-  vm_value io_result_value = 0;
-  vm_value next_action;
-  io_action_result action_result = check_io_action(state, result, program, &io_result_value, &next_action);
-
-  switch(action_result) {
-    case no_io_action:
-      // do nothing
-      break;
-
-    case intermediary_io_action: {
-        state->stack_pointer = 0;
-
-        current_frame.reg[0] = next_action;
-        next_frame.reg[0] = io_result_value; // argument for next_action
-        vm_instruction instr = op_gen_ap(0, 0, 1);
-        int return_pointer = do_gen_ap(state, &current_frame, instr, program);
-        if (return_pointer != -1) {
-          current_frame.return_address = return_pointer;
-          current_frame.result_register = 0;
-        }
-        else {
-          // TODO is this malformed?
-          panic_stop_vm_m("malformed bound lambda in io action");
-        }
-        is_running = true;
-      }
-      goto restart;
-
-    case final_io_action:
-      result = io_result_value;
-      break;
 
-    default:
-      panic_stop_vm_m("Unknown result of io action: %d", action_result);
-  }
 
 
-  return result;
+vm_value *vm_instance_heap_pointer(vm_instance *vm, vm_value addr) {
+  return heap_get_pointer(&vm->state, addr);
 }
 
 
-
-
 vm_value *vm_get_heap_pointer(vm_value addr) {
-  return heap_get_pointer(addr);
+  return vm_instance_heap_pointer(execute_instance, addr);
 }
 
 
@@ -2,13 +2,82 @@
 #define _INCLUDE_VM_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 
 typedef uint32_t vm_instruction;
-typedef uint32_t vm_value;
+typedef uint64_t vm_value;
 
+// When buffered output is written to stdout (see io.c). The buffer is always flushed
+// at the end of the program and by io.flush.
+typedef enum {
+  vm_flush_auto = 0, // vm_flush_line if stdout is a terminal, otherwise vm_flush_full
+  vm_flush_line,     // after every line
+  vm_flush_full      // only when the buffer is full
+} vm_flush_policy;
+
+// Heap sizes are in words (vm_value) per semispace
+typedef struct {
+  size_t initial_heap_size;
+  size_t max_heap_size;
+  size_t nursery_size; // 0 disables generational collection
+  size_t max_stack_size; // maximum number of stack frames
+  vm_flush_policy flush_policy;
+  size_t jit_threshold; // calls before a function is compiled to native code, 0 disables the jit
+} vm_options;
+
+// The default options can be changed with the environment variables
+// DASH_HEAP_SIZE, DASH_MAX_HEAP_SIZE, DASH_NURSERY_SIZE, DASH_MAX_STACK_SIZE,
+// DASH_FLUSH (auto, line or full) and DASH_JIT_THRESHOLD
+vm_options vm_default_options(void);
+
+// A loaded program together with its stack and heap (see vm.c). Instances don't share
+// any state, so several of them can run at the same time on different threads. A
+// single instance must only be used by one thread at a time.
+typedef struct vm_instance vm_instance;
+
+// If options is NULL, the default options are used
+vm_instance *vm_create(const vm_options *options);
+void vm_destroy(vm_instance *vm);
+// Runs the top-level code of the program and returns its result. The instance keeps a
+// copy of the program and the constant table.
+vm_value vm_load_program(vm_instance *vm, vm_instruction *program, int program_length, vm_value *const_table, int const_table_length);
+// Like vm_load_program, but with a compiled program from a file (see image.c). The
+// file is mapped into memory, not read.
+vm_value vm_load_image(vm_instance *vm, const char *path);
+// The symbol names of the loaded image, each terminated by a NUL character. Returns
+// NULL if the instance hasn't loaded an image (or loading it failed).
+const char *vm_image_symbol_names(vm_instance *vm, size_t *size);
+const vm_value *vm_instance_const_table(vm_instance *vm, int *length);
+// The result of the loaded program. The garbage collector moves heap values, so this
+// has to be asked for again after every call.
+vm_value vm_program_result(vm_instance *vm);
+// Calls a function or closure. Closures have to be reachable from the program result.
+// The result is valid until the next call.
+vm_value vm_call(vm_instance *vm, vm_value function, const vm_value *args, int num_args);
+// Heap values are offsets into the instance's heap
+vm_value *vm_instance_heap_pointer(vm_instance *vm, vm_value addr);
+
+// The number of functions that the jit has compiled since the program was loaded
+// (see jit.c). It is always 0 on platforms without a jit.
+int vm_jit_function_count(vm_instance *vm);
+
+// Profiling counts instructions, calls, allocations and match arms (see profiler.c).
+// It has to be enabled before the program is loaded, and the profile covers the
+// top-level code and all calls until the next program is loaded.
+void vm_enable_profiling(vm_instance *vm);
+// Names the function whose FUN_HEADER is at the given address in the loaded program
+void vm_profile_name_function(vm_instance *vm, int address, const char *name);
+// Writes a report and the sampled call stacks in the folded format of flamegraph.pl.
+// Either path can be NULL. Returns false if the instance isn't profiling or a file
+// can't be written.
+bool vm_write_profile(vm_instance *vm, const char *report_path, const char *folded_path);
+
+// Runs a program in a fresh instance, which is kept until the next call of vm_execute.
+// This uses a global instance, so it isn't thread-safe.
 // TODO find a way to get errors back into the calling code. also stop on error (i.e. pattern match fail) as long as we don't have exception handling
 vm_value vm_execute(vm_instruction *program, int program_length, vm_value *const_table, int const_table_length);
+vm_value vm_execute_with_options(vm_instruction *program, int program_length, vm_value *const_table, int const_table_length, const vm_options *options);
 vm_value *vm_get_heap_pointer(vm_value addr);
 
 #endif
-
@@ -4,10 +4,22 @@
 #include "vm.h"
 #include "defs.h"
 #include "heap.h"
+#include "io.h"
+#include "verifier.h"
 
 
+/*
+  The registers of all frames are in one register file. Every frame has a window
+  into it, which is as large as the function needs (see FUN_HEADER). The window of
+  the next frame starts right after the window of the current frame, so OP_SET_ARG
+  puts the arguments of a call exactly where the callee expects them.
+
+  The stack and the register file are on the heap and grow together (see
+  grow_stack in vm.c), which moves the register windows.
+*/
 typedef struct {
-  vm_value reg[num_regs];
+  vm_value *reg;
+  int frame_size;
   int return_address;
   int result_register;
 
@@ -17,22 +29,112 @@ typedef struct {
 
 
 
+/*
+  Green threads (see scheduler.c). The running thread uses the stack and the
+  registers in vm_state, every other thread keeps them in its vm_thread.
+*/
+typedef enum {
+  thread_running,
+  thread_runnable,
+  thread_blocked,
+  thread_finished
+} thread_status;
+
+typedef enum {
+  wait_for_thread,
+  wait_for_channel,
+  wait_for_input
+} wait_reason;
+
+typedef struct {
+  thread_status status;
+  wait_reason waiting_for;
+  int wait_id;
+  // the result of a finished thread
+  vm_value result;
+
+  stack_frame *stack;
+  size_t stack_capacity;
+  vm_value *registers;
+  size_t registers_capacity;
+  size_t registers_used;
+  int stack_pointer;
+  int program_pointer;
+} vm_thread;
+
+// An unbounded queue of messages
+typedef struct {
+  vm_value *messages;
+  size_t first;
+  size_t count;
+  size_t capacity;
+} vm_channel;
+
 typedef struct {
-  stack_frame stack[stack_size];
+  vm_thread *threads;
+  int thread_count;
+  int thread_capacity;
+  int current_thread;
+
+  int *run_queue;
+  int run_queue_first;
+  int run_queue_count;
+  int run_queue_capacity;
+
+  vm_channel *channels;
+  int channel_count;
+  int channel_capacity;
+
+  // Counts down on every call and return, the running thread is preempted at 0
+  int time_slice;
+  // A new thread starts here if it calls a function, and a blocked thread is resumed
+  // by running its io action again at the retry address (see vm_instance in vm.c)
+  int call_address;
+  int retry_address;
+} vm_scheduler;
+
+
+typedef struct vm_profile vm_profile;
+
+
+// All mutable state of a vm instance. Nothing in the vm is global, so instances
+// can run on different threads at the same time.
+struct vm_state {
+  // There is one more frame than stack_capacity, which only holds the arguments
+  // for the next call of the topmost frame. Most frames have at most num_regs
+  // registers, so the register file has room for at least (stack_capacity + 1) *
+  // num_regs. It grows further when frames with spill slots need more.
+  stack_frame *stack;
+  size_t stack_capacity;
+  size_t max_stack_size;
+  vm_value *registers;
+  size_t registers_capacity;
+  // Registers above this have never been used
+  size_t registers_used;
   int stack_pointer;
   int program_pointer;
   vm_value *const_table;
   int const_table_length;
-} vm_state;
+  // The result of the program's top-level code, which stays alive between calls
+  vm_value result;
+
+  vm_heap heap;
+  vm_io io;
+  verifier_state verifier;
+  vm_scheduler scheduler;
+  // NULL unless the instance is profiling (see profiler.c)
+  vm_profile *profile;
+};
 
 
 #define current_frame (state->stack[state->stack_pointer])
 #define next_frame (state->stack[state->stack_pointer + 1])
 
-vm_value new_heap_string(char *content);
+vm_value new_heap_string(vm_state *state, char *content);
 
 char *read_string(vm_state *state, vm_value string_value);
-char *value_to_type_string(vm_value value);
+size_t string_flatten_size(vm_state *state, vm_value string_value);
+char *value_to_type_string(vm_state *state, vm_value value);
 
 
 #endif